@@ -25,6 +25,10 @@
 
 #include <linux/fs.h>
 #include <linux/bitops.h>
+#include <linux/genhd.h>
+#include <linux/memory_hotplug.h>
+#include <linux/topology.h>
+#include <linux/rbtree_augmented.h>
 #include "nova.h"
 
 int nova_alloc_block_free_lists(struct super_block *sb)
@@ -52,9 +56,129 @@ void nova_delete_free_lists(struct super_block *sb)
 {
 	struct nova_sb_info *sbi = NOVA_SB(sb);
 
-	/* Each tree is freed in save_blocknode_mappings */
+	/* Each tree is freed in nova_destroy_range_trees */
 	kfree(sbi->free_lists);
 	sbi->free_lists = NULL;
+
+	kfree(sbi->numa_nodes);
+	kfree(sbi->node_lists);
+	kfree(sbi->interleave_lists);
+	sbi->numa_nodes = NULL;
+	sbi->node_lists = NULL;
+	sbi->interleave_lists = NULL;
+}
+
+/* Find the NUMA node whose memory backs this block */
+static int nova_block_to_nid(struct super_block *sb, unsigned long blocknr)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	int nid = NUMA_NO_NODE;
+
+#if defined(CONFIG_NUMA) && defined(CONFIG_MEMORY_HOTPLUG)
+	nid = memory_add_physaddr_to_nid(sbi->phys_addr +
+					((u64)blocknr << PAGE_SHIFT));
+#endif
+	if (nid == NUMA_NO_NODE)
+		nid = dev_to_node(disk_to_dev(sbi->s_bdev->bd_disk));
+	if (nid < 0 || nid >= nr_node_ids)
+		nid = first_online_node;
+
+	return nid;
+}
+
+/*
+ * Map each free list to the node backing the middle of its range, and
+ * group the lists by node. On failure the allocator keeps using the
+ * list of the current CPU, as it did before NUMA placement.
+ */
+static void nova_init_numa_lists(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_numa_node *numa_nodes;
+	struct free_list *free_list;
+	unsigned long middle;
+	int *node_lists, *interleave_lists;
+	int i, nid, best, next, round;
+
+	kfree(sbi->numa_nodes);
+	kfree(sbi->node_lists);
+	kfree(sbi->interleave_lists);
+	sbi->numa_nodes = NULL;
+	sbi->node_lists = NULL;
+	sbi->interleave_lists = NULL;
+
+	numa_nodes = kcalloc(nr_node_ids, sizeof(struct nova_numa_node),
+							GFP_KERNEL);
+	node_lists = kcalloc(sbi->cpus, sizeof(int), GFP_KERNEL);
+	interleave_lists = kcalloc(sbi->cpus, sizeof(int), GFP_KERNEL);
+	if (!numa_nodes || !node_lists || !interleave_lists) {
+		nova_dbg("%s: no memory, NUMA placement disabled\n", __func__);
+		kfree(numa_nodes);
+		kfree(node_lists);
+		kfree(interleave_lists);
+		return;
+	}
+
+	for (i = 0; i < sbi->cpus; i++) {
+		free_list = nova_get_free_list(sb, i);
+		middle = sbi->per_list_blocks * i + sbi->per_list_blocks / 2;
+		free_list->nid = nova_block_to_nid(sb, middle);
+		numa_nodes[free_list->nid].nr_lists++;
+	}
+
+	free_list = nova_get_free_list(sb, SHARED_CPU);
+	free_list->nid = nova_block_to_nid(sb, free_list->block_start);
+
+	/* Counting sort of the lists by node */
+	next = 0;
+	for (nid = 0; nid < nr_node_ids; nid++) {
+		numa_nodes[nid].first = next;
+		next += numa_nodes[nid].nr_lists;
+		numa_nodes[nid].nr_lists = 0;
+	}
+
+	for (i = 0; i < sbi->cpus; i++) {
+		nid = nova_get_free_list(sb, i)->nid;
+		node_lists[numa_nodes[nid].first +
+				numa_nodes[nid].nr_lists++] = i;
+	}
+
+	/* Nodes without NVMM allocate from the nearest node with some */
+	for (nid = 0; nid < nr_node_ids; nid++) {
+		numa_nodes[nid].fallback = nid;
+		if (numa_nodes[nid].nr_lists)
+			continue;
+
+		best = -1;
+		for (i = 0; i < nr_node_ids; i++) {
+			if (numa_nodes[i].nr_lists == 0)
+				continue;
+			if (best < 0 ||
+			    node_distance(nid, i) < node_distance(nid, best))
+				best = i;
+		}
+		numa_nodes[nid].fallback = best;
+	}
+
+	/* Interleave order takes one list from each node in turn */
+	for (i = 0, round = 0; i < sbi->cpus; round++) {
+		for (nid = 0; nid < nr_node_ids; nid++) {
+			if (round < numa_nodes[nid].nr_lists)
+				interleave_lists[i++] =
+					node_lists[numa_nodes[nid].first + round];
+		}
+	}
+
+	for (nid = 0; nid < nr_node_ids; nid++) {
+		if (numa_nodes[nid].nr_lists)
+			nova_dbg("%s: node %d has %d free lists\n", __func__,
+					nid, numa_nodes[nid].nr_lists);
+	}
+
+	atomic_set(&sbi->interleave_cursor, 0);
+	sbi->node_lists = node_lists;
+	sbi->interleave_lists = interleave_lists;
+	sbi->numa_nodes = numa_nodes;
 }
 
 void nova_init_blockmap(struct super_block *sb, int recovery)
@@ -110,6 +234,8 @@ void nova_init_blockmap(struct super_block *sb, int recovery)
 		sbi->shared_free_list.block_start = free_list->block_end + 1;
 		sbi->shared_free_list.block_end = sbi->num_blocks - 1;
 	}
+
+	nova_init_numa_lists(sb);
 }
 
 static inline int nova_rbtree_compare_rangenode(struct nova_range_node *curr,
@@ -202,6 +328,41 @@ static int nova_insert_range_node(struct nova_sb_info *sbi,
 	return 0;
 }
 
+static struct rb_node *nova_build_range_subtree(
+	struct nova_range_node **nodes, unsigned long num,
+	struct rb_node *parent, int depth, int red_depth)
+{
+	unsigned long mid = num / 2;
+	struct rb_node *node;
+
+	if (num == 0)
+		return NULL;
+
+	node = &nodes[mid]->node;
+	rb_set_parent_color(node, parent,
+				depth == red_depth ? RB_RED : RB_BLACK);
+	node->rb_left = nova_build_range_subtree(nodes, mid, node,
+						depth + 1, red_depth);
+	node->rb_right = nova_build_range_subtree(nodes + mid + 1,
+				num - mid - 1, node, depth + 1, red_depth);
+	return node;
+}
+
+/*
+ * Link num nodes, sorted and disjoint, into the empty tree in linear
+ * time. Halving keeps every NULL link on the last two levels, so the
+ * tree is a valid red-black tree with all nodes black except those on
+ * an incomplete last level.
+ */
+void nova_build_range_tree(struct rb_root *tree,
+	struct nova_range_node **nodes, unsigned long num)
+{
+	int red_depth = is_power_of_2(num + 1) ? -1 : fls_long(num) - 1;
+
+	tree->rb_node = nova_build_range_subtree(nodes, num, NULL, 0,
+							red_depth);
+}
+
 inline int nova_insert_blocktree(struct nova_sb_info *sbi,
 	struct rb_root *tree, struct nova_range_node *new_node)
 {
@@ -272,7 +433,61 @@ int nova_find_free_slot(struct nova_sb_info *sbi,
 	return 0;
 }
 
-static int nova_free_blocks(struct super_block *sb, unsigned long blocknr,
+/*
+ * While background recovery runs, freed blocks are parked in
+ * bg_deferred_tree instead of the free lists. They are not reused until
+ * the crawl is done, so it never reads a page that was recycled under it.
+ * Returns 0 once the range is parked, 1 if recovery has already finished.
+ */
+static int nova_defer_free_blocks(struct super_block *sb,
+	unsigned long low, unsigned long high)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct rb_root *tree = &sbi->bg_deferred_tree;
+	struct nova_range_node *prev = NULL, *next = NULL;
+	struct nova_range_node *curr_node;
+	int ret;
+
+	curr_node = nova_alloc_blocknode(sb);
+	if (curr_node == NULL)
+		return -ENOMEM;
+
+	spin_lock(&sbi->bg_lock);
+	if (!sbi->bg_recovery) {
+		ret = 1;
+		goto out;
+	}
+
+	ret = nova_find_free_slot(sbi, tree, low, high, &prev, &next);
+	if (ret)
+		goto out;
+
+	if (prev && next && (low == prev->range_high + 1) &&
+			(high + 1 == next->range_low)) {
+		rb_erase(&next->node, tree);
+		prev->range_high = next->range_high;
+		nova_free_blocknode(sb, next);
+	} else if (prev && (low == prev->range_high + 1)) {
+		prev->range_high = high;
+	} else if (next && (high + 1 == next->range_low)) {
+		next->range_low = low;
+	} else {
+		curr_node->range_low = low;
+		curr_node->range_high = high;
+		ret = nova_insert_blocktree(sbi, tree, curr_node);
+		if (ret == 0)
+			curr_node = NULL;
+	}
+
+out:
+	spin_unlock(&sbi->bg_lock);
+	if (curr_node)
+		nova_free_blocknode(sb, curr_node);
+	return ret;
+}
+
+/* log_page: 1 for log pages, 0 for data, -1 to leave the stats alone */
+static int __nova_free_blocks(struct super_block *sb, unsigned long blocknr,
 	int num, unsigned short btype, int log_page)
 {
 	struct nova_sb_info *sbi = NOVA_SB(sb);
@@ -294,6 +509,14 @@ static int nova_free_blocks(struct super_block *sb, unsigned long blocknr,
 		return -EINVAL;
 	}
 
+	num_blocks = nova_get_numblocks(btype) * num;
+	if (unlikely(sbi->bg_recovery)) {
+		ret = nova_defer_free_blocks(sb, blocknr,
+						blocknr + num_blocks - 1);
+		if (ret <= 0)
+			return ret;
+	}
+
 	cpuid = blocknr / sbi->per_list_blocks;
 	if (cpuid >= sbi->cpus)
 		cpuid = SHARED_CPU;
@@ -310,7 +533,6 @@ static int nova_free_blocks(struct super_block *sb, unsigned long blocknr,
 
 	tree = &(free_list->block_free_tree);
 
-	num_blocks = nova_get_numblocks(btype) * num;
 	block_low = blocknr;
 	block_high = blocknr + num_blocks - 1;
 
@@ -361,11 +583,13 @@ static int nova_free_blocks(struct super_block *sb, unsigned long blocknr,
 
 block_found:
 	free_list->num_free_blocks += num_blocks;
+	nova_redo_log_blocks(sb, cpuid, NOVA_REDO_FREE_BLOCKS,
+					block_low, block_high);
 
-	if (log_page) {
+	if (log_page > 0) {
 		free_list->free_log_count++;
 		free_list->freed_log_pages += num_blocks;
-	} else {
+	} else if (log_page == 0) {
 		free_list->free_data_count++;
 		free_list->freed_data_pages += num_blocks;
 	}
@@ -374,7 +598,42 @@ out:
 	spin_unlock(&free_list->s_lock);
 	if (new_node_used == 0)
 		nova_free_blocknode(sb, curr_node);
-	free_steps += step;
+	NOVA_STATS_ADD(free_steps, step);
+
+	return ret;
+}
+
+static int nova_free_blocks(struct super_block *sb, unsigned long blocknr,
+	int num, unsigned short btype, int log_page)
+{
+	u64 trace_start = NOVA_TRACE_START(nova_free_blocks_exit);
+	int ret;
+
+	trace_nova_free_blocks_enter(sb, blocknr, num, btype);
+	ret = __nova_free_blocks(sb, blocknr, num, btype, log_page);
+	trace_nova_free_blocks_exit(sb, blocknr, ret, trace_start);
+
+	return ret;
+}
+
+/* Drop a reference to shared blocks and free the others, see reflink.c */
+static int nova_free_shared_data_blocks(struct super_block *sb,
+	struct nova_inode *pi, unsigned long blocknr, int num)
+{
+	unsigned long run;
+	int shared;
+	int ret = 0;
+
+	while (num > 0) {
+		shared = nova_refcount_put(sb, blocknr, num, &run);
+		if (shared == 0)
+			shared = nova_free_blocks(sb, blocknr, run,
+						pi->i_blk_type, 0);
+		if (shared < 0)
+			ret = shared;
+		blocknr += run;
+		num -= run;
+	}
 
 	return ret;
 }
@@ -392,7 +651,11 @@ int nova_free_data_blocks(struct super_block *sb, struct nova_inode *pi,
 		return -EINVAL;
 	}
 	NOVA_START_TIMING(free_data_t, free_time);
-	ret = nova_free_blocks(sb, blocknr, num, pi->i_blk_type, 0);
+	/* See nova_refcount_shared() for why no lock is needed */
+	if (likely(!nova_refcount_shared(sb)))
+		ret = nova_free_blocks(sb, blocknr, num, pi->i_blk_type, 0);
+	else
+		ret = nova_free_shared_data_blocks(sb, pi, blocknr, num);
 	if (ret)
 		nova_err(sb, "Inode %llu: free %d data block from %lu to %lu "
 				"failed!\n", pi->nova_ino, num, blocknr,
@@ -479,7 +742,7 @@ static unsigned long nova_alloc_blocks_in_free_list(struct super_block *sb,
 
 	free_list->num_free_blocks -= num_blocks;
 
-	alloc_steps += step;
+	NOVA_STATS_ADD(alloc_steps, step);
 
 	if (found == 0)
 		return -ENOSPC;
@@ -487,15 +750,34 @@ static unsigned long nova_alloc_blocks_in_free_list(struct super_block *sb,
 	return num_blocks;
 }
 
-/* Find out the free list with most free blocks */
-static int nova_get_candidate_free_list(struct super_block *sb)
+/*
+ * Find out the free list with most free blocks, preferring the lists
+ * on node nid when one of them can satisfy the request.
+ */
+static int nova_get_candidate_free_list(struct super_block *sb, int nid,
+	unsigned long num_blocks)
 {
 	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_numa_node *node;
 	struct free_list *free_list;
 	int cpuid = 0;
-	int num_free_blocks = 0;
+	unsigned long num_free_blocks = 0;
 	int i;
 
+	if (sbi->numa_nodes) {
+		node = &sbi->numa_nodes[sbi->numa_nodes[nid].fallback];
+		for (i = node->first; i < node->first + node->nr_lists; i++) {
+			free_list = nova_get_free_list(sb, sbi->node_lists[i]);
+			if (free_list->num_free_blocks > num_free_blocks) {
+				cpuid = sbi->node_lists[i];
+				num_free_blocks = free_list->num_free_blocks;
+			}
+		}
+
+		if (num_free_blocks >= num_blocks)
+			return cpuid;
+	}
+
 	for (i = 0; i < sbi->cpus; i++) {
 		free_list = nova_get_free_list(sb, i);
 		if (free_list->num_free_blocks > num_free_blocks) {
@@ -507,10 +789,121 @@ static int nova_get_candidate_free_list(struct super_block *sb)
 	return cpuid;
 }
 
-/* Return how many blocks allocated */
-static int nova_new_blocks(struct super_block *sb, unsigned long *blocknr,
+/* Pick the free list a new allocation on cpuid starts from */
+static int nova_get_placement_free_list(struct super_block *sb, int cpuid,
+	int policy)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_numa_node *node;
+	unsigned int cursor;
+	int nid;
+
+	if (!sbi->numa_nodes)
+		return cpuid % sbi->cpus;
+
+	if (policy == NOVA_ALLOC_INTERLEAVE) {
+		cursor = atomic_inc_return(&sbi->interleave_cursor);
+		return sbi->interleave_lists[cursor % sbi->cpus];
+	}
+
+	/* The CPU's own list, if it sits on the CPU's node */
+	nid = cpu_to_node(cpuid);
+	if (cpuid < sbi->cpus && sbi->free_lists[cpuid].nid == nid)
+		return cpuid;
+
+	node = &sbi->numa_nodes[sbi->numa_nodes[nid].fallback];
+	return sbi->node_lists[node->first + cpuid % node->nr_lists];
+}
+
+static inline int nova_alloc_policy(struct super_block *sb,
+	struct nova_inode *pi)
+{
+	/* Inode tables, journals and the like stay node-local */
+	if (pi->nova_ino != NOVA_ROOT_INO &&
+			pi->nova_ino < NOVA_NORMAL_INODE_START)
+		return NOVA_ALLOC_LOCAL;
+
+	if (test_opt(sb, INTERLEAVE))
+		return NOVA_ALLOC_INTERLEAVE;
+
+	return pi->i_alloc_policy;
+}
+
+/*
+ * Every block of a per-CPU list at or above the high-water mark persisted
+ * in its inode_table slot is free, so a bgrecovery mount can hand those
+ * out before the crawl is done. The mark moves up in NOVA_HWM_STEP
+ * strides, most allocations never write it. Caller holds s_lock.
+ */
+#define	NOVA_HWM_STEP	32768
+
+static void nova_update_alloc_hwm(struct super_block *sb,
+	struct free_list *free_list, int cpuid, unsigned long end)
+{
+	struct inode_table *inode_table;
+	unsigned long hwm;
+
+	/* Unknown, see nova_reset_alloc_hwm */
+	if (free_list->alloc_hwm == 0 || end <= free_list->alloc_hwm)
+		return;
+
+	inode_table = nova_get_inode_table(sb, cpuid);
+	if (!inode_table)
+		return;
+
+	hwm = min(end + NOVA_HWM_STEP, free_list->block_end + 1);
+	inode_table->alloc_hwm = cpu_to_le64(hwm);
+	nova_flush_buffer(&inode_table->alloc_hwm, 8, 1);
+	free_list->alloc_hwm = hwm;
+}
+
+/*
+ * Set each high-water mark to the start of the free run that ends its
+ * range. A block missing from the lists only makes the mark higher. If
+ * the lists cannot be trusted at all, clear the marks, so the next
+ * bgrecovery mount falls back to a full crawl.
+ */
+void nova_reset_alloc_hwm(struct super_block *sb, bool valid)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct inode_table *inode_table;
+	struct free_list *free_list;
+	struct nova_range_node *last;
+	struct rb_node *temp;
+	unsigned long hwm;
+	int i;
+
+	for (i = 0; i < sbi->cpus; i++) {
+		inode_table = nova_get_inode_table(sb, i);
+		if (!inode_table)
+			return;
+
+		free_list = nova_get_free_list(sb, i);
+		spin_lock(&free_list->s_lock);
+		hwm = free_list->block_end + 1;
+		temp = rb_last(&free_list->block_free_tree);
+		if (!valid) {
+			hwm = 0;
+		} else if (temp) {
+			last = container_of(temp, struct nova_range_node, node);
+			if (last->range_high == free_list->block_end)
+				hwm = last->range_low;
+		}
+		/* Nothing is allocated read-only, the old mark still holds */
+		if (!(sb->s_flags & MS_RDONLY)) {
+			inode_table->alloc_hwm = cpu_to_le64(hwm);
+			nova_flush_buffer(&inode_table->alloc_hwm, 8, 0);
+		}
+		free_list->alloc_hwm = hwm;
+		spin_unlock(&free_list->s_lock);
+	}
+
+	PERSISTENT_BARRIER();
+}
+
+static int __nova_new_blocks(struct super_block *sb, unsigned long *blocknr,
 	unsigned int num, unsigned short btype, int zero,
-	enum alloc_type atype)
+	enum alloc_type atype, int policy)
 {
 	struct free_list *free_list;
 	void *bp;
@@ -520,13 +913,17 @@ static int nova_new_blocks(struct super_block *sb, unsigned long *blocknr,
 	struct rb_node *temp;
 	struct nova_range_node *first;
 	int cpuid;
+	int nid;
 	int retried = 0;
 
 	num_blocks = num * nova_get_numblocks(btype);
 	if (num_blocks == 0)
 		return -EINVAL;
 
-	cpuid = smp_processor_id();
+	cpuid = get_cpu();
+	nid = cpu_to_node(cpuid);
+	cpuid = nova_get_placement_free_list(sb, cpuid, policy);
+	put_cpu();
 
 retry:
 	free_list = nova_get_free_list(sb, cpuid);
@@ -547,7 +944,8 @@ retry:
 			spin_unlock(&free_list->s_lock);
 			if (retried >= 3)
 				return -ENOMEM;
-			cpuid = nova_get_candidate_free_list(sb);
+			cpuid = nova_get_candidate_free_list(sb, nid,
+							num_blocks);
 			retried++;
 			goto retry;
 		}
@@ -564,6 +962,19 @@ retry:
 		free_list->alloc_data_pages += ret_blocks;
 	}
 
+	if (new_blocknr && free_list->nid == nid)
+		free_list->alloc_local_pages += ret_blocks;
+	else if (new_blocknr)
+		free_list->alloc_remote_pages += ret_blocks;
+
+	if (new_blocknr && cpuid != SHARED_CPU)
+		nova_update_alloc_hwm(sb, free_list, cpuid,
+					new_blocknr + ret_blocks);
+
+	if (new_blocknr)
+		nova_redo_log_blocks(sb, cpuid, NOVA_REDO_ALLOC_BLOCKS,
+				new_blocknr, new_blocknr + ret_blocks - 1);
+
 	spin_unlock(&free_list->s_lock);
 
 	if (ret_blocks <= 0 || new_blocknr == 0)
@@ -581,6 +992,7 @@ retry:
 		else
 			size = 0x1 << 30;
 		memset_nt(bp, 0, PAGE_SIZE * ret_blocks);
+		NOVA_WA_ADD(wa_zero, PAGE_SIZE * ret_blocks);
 		nova_memlock_block(sb, bp);
 	}
 	*blocknr = new_blocknr;
@@ -589,6 +1001,22 @@ retry:
 	return ret_blocks / nova_get_numblocks(btype);
 }
 
+/* Return how many blocks allocated */
+static int nova_new_blocks(struct super_block *sb, unsigned long *blocknr,
+	unsigned int num, unsigned short btype, int zero,
+	enum alloc_type atype, int policy)
+{
+	u64 trace_start = NOVA_TRACE_START(nova_new_blocks_exit);
+	int ret;
+
+	trace_nova_new_blocks_enter(sb, 0, num, btype);
+	ret = __nova_new_blocks(sb, blocknr, num, btype, zero, atype, policy);
+	trace_nova_new_blocks_exit(sb, ret > 0 ? *blocknr : 0, ret,
+					trace_start);
+
+	return ret;
+}
+
 inline int nova_new_data_blocks(struct super_block *sb, struct nova_inode *pi,
 	unsigned long *blocknr,	unsigned int num, unsigned long start_blk,
 	int zero, int cow)
@@ -597,7 +1025,7 @@ inline int nova_new_data_blocks(struct super_block *sb, struct nova_inode *pi,
 	timing_t alloc_time;
 	NOVA_START_TIMING(new_data_blocks_t, alloc_time);
 	allocated = nova_new_blocks(sb, blocknr, num,
-					pi->i_blk_type, zero, DATA);
+			pi->i_blk_type, zero, DATA, nova_alloc_policy(sb, pi));
 	NOVA_END_TIMING(new_data_blocks_t, alloc_time);
 	nova_dbgv("Inode %llu, start blk %lu, cow %d, "
 			"alloc %d data blocks from %lu to %lu\n",
@@ -613,7 +1041,7 @@ inline int nova_new_log_blocks(struct super_block *sb, struct nova_inode *pi,
 	timing_t alloc_time;
 	NOVA_START_TIMING(new_log_blocks_t, alloc_time);
 	allocated = nova_new_blocks(sb, blocknr, num,
-					pi->i_blk_type, zero, LOG);
+			pi->i_blk_type, zero, LOG, nova_alloc_policy(sb, pi));
 	NOVA_END_TIMING(new_log_blocks_t, alloc_time);
 	nova_dbgv("Inode %llu, alloc %d log blocks from %lu to %lu\n",
 			pi->nova_ino, allocated, *blocknr,
@@ -621,6 +1049,104 @@ inline int nova_new_log_blocks(struct super_block *sb, struct nova_inode *pi,
 	return allocated;
 }
 
+/* Take low - high out of its free list, see nova_redo_block_range */
+static int nova_remove_free_range(struct super_block *sb,
+	unsigned long low, unsigned long high)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct free_list *free_list;
+	struct nova_range_node *curr, *new_node;
+	struct rb_root *tree;
+	struct rb_node *temp;
+	int cpuid;
+	int ret = 0;
+
+	cpuid = low / sbi->per_list_blocks;
+	if (cpuid >= sbi->cpus)
+		cpuid = SHARED_CPU;
+
+	free_list = nova_get_free_list(sb, cpuid);
+	tree = &free_list->block_free_tree;
+
+	if (!nova_find_range_node(sbi, tree, low, &curr) ||
+			high > curr->range_high)
+		return -EINVAL;
+
+	if (low == curr->range_low && high == curr->range_high) {
+		rb_erase(&curr->node, tree);
+		free_list->num_blocknode--;
+		nova_free_blocknode(sb, curr);
+	} else if (low == curr->range_low) {
+		curr->range_low = high + 1;
+	} else if (high == curr->range_high) {
+		curr->range_high = low - 1;
+	} else {
+		new_node = nova_alloc_blocknode(sb);
+		if (new_node == NULL)
+			return -ENOMEM;
+		new_node->range_low = high + 1;
+		new_node->range_high = curr->range_high;
+		curr->range_high = low - 1;
+		ret = nova_insert_blocktree(sbi, tree, new_node);
+		if (ret) {
+			nova_free_blocknode(sb, new_node);
+			return ret;
+		}
+		free_list->num_blocknode++;
+	}
+
+	free_list->num_free_blocks -= high - low + 1;
+	temp = rb_first(tree);
+	free_list->first_node = temp ?
+		container_of(temp, struct nova_range_node, node) : NULL;
+
+	return ret;
+}
+
+/*
+ * Checkpoint recovery: apply a logged allocation or free of blocks
+ * low - high to the free lists. Nothing is logged while recovering.
+ */
+int nova_redo_block_range(struct super_block *sb, unsigned long low,
+	unsigned long high, int alloc)
+{
+	if (low > high)
+		return -EINVAL;
+
+	if (alloc)
+		return nova_remove_free_range(sb, low, high);
+
+	return nova_free_blocks(sb, low, high - low + 1,
+					NOVA_BLOCK_TYPE_4K, -1);
+}
+
+/*
+ * Background recovery: hand blocks low - high to the live free lists.
+ * The range may span several lists and be larger than one free call.
+ */
+int nova_free_recovered_blocks(struct super_block *sb, unsigned long low,
+	unsigned long high)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	unsigned long end, num;
+	int ret;
+
+	while (low <= high) {
+		end = high;
+		if (low / sbi->per_list_blocks < sbi->cpus)
+			end = min(high, (low / sbi->per_list_blocks + 1) *
+					sbi->per_list_blocks - 1);
+		num = min(end - low + 1, (unsigned long)INT_MAX);
+		ret = nova_free_blocks(sb, low, (int)num,
+					NOVA_BLOCK_TYPE_4K, -1);
+		if (ret)
+			return ret;
+		low += num;
+	}
+
+	return 0;
+}
+
 unsigned long nova_count_free_blocks(struct super_block *sb)
 {
 	struct nova_sb_info *sbi = NOVA_SB(sb);
@@ -66,43 +66,23 @@ static int get_cpuid(struct nova_sb_info *sbi, unsigned long blocknr)
 	return cpuid;
 }
 
-static int nova_failure_insert_inodetree(struct super_block *sb,
-	unsigned long ino_low, unsigned long ino_high)
+/* Mark internal inos low - high of cpu in use. Caller holds the map mutex */
+static int __nova_insert_inode_range(struct super_block *sb, int cpu,
+	struct rb_root *tree, unsigned long internal_low,
+	unsigned long internal_high)
 {
 	struct nova_sb_info *sbi = NOVA_SB(sb);
-	struct inode_map *inode_map;
+	struct inode_map *inode_map = &sbi->inode_maps[cpu];
 	struct nova_range_node *prev = NULL, *next = NULL;
 	struct nova_range_node *new_node;
-	unsigned long internal_low, internal_high;
-	int cpu;
-	struct rb_root *tree;
 	int ret;
 
-	if (ino_low > ino_high) {
-		nova_err(sb, "%s: ino low %lu, ino high %lu\n",
-				__func__, ino_low, ino_high);
-		BUG();
-	}
-
-	cpu = ino_low % sbi->cpus;
-	if (ino_high % sbi->cpus != cpu) {
-		nova_err(sb, "%s: ino low %lu, ino high %lu\n",
-				__func__, ino_low, ino_high);
-		BUG();
-	}
-
-	internal_low = ino_low / sbi->cpus;
-	internal_high = ino_high / sbi->cpus;
-	inode_map = &sbi->inode_maps[cpu];
-	tree = &inode_map->inode_inuse_tree;
-	mutex_lock(&inode_map->inode_table_mutex);
-
 	ret = nova_find_free_slot(sbi, tree, internal_low, internal_high,
 					&prev, &next);
 	if (ret) {
 		nova_dbg("%s: ino %lu - %lu already exists!: %d\n",
-					__func__, ino_low, ino_high, ret);
-		mutex_unlock(&inode_map->inode_table_mutex);
+			__func__, internal_low * sbi->cpus + cpu,
+			internal_high * sbi->cpus + cpu, ret);
 		return ret;
 	}
 
@@ -113,17 +93,17 @@ static int nova_failure_insert_inodetree(struct super_block *sb,
 		inode_map->num_range_node_inode--;
 		prev->range_high = next->range_high;
 		nova_free_inode_node(sb, next);
-		goto finish;
+		return 0;
 	}
 	if (prev && (internal_low == prev->range_high + 1)) {
 		/* Aligns left */
 		prev->range_high += internal_high - internal_low + 1;
-		goto finish;
+		return 0;
 	}
 	if (next && (internal_high + 1 == next->range_low)) {
 		/* Aligns right */
 		next->range_low -= internal_high - internal_low + 1;
-		goto finish;
+		return 0;
 	}
 
 	/* Aligns somewhere in the middle */
@@ -131,15 +111,51 @@ static int nova_failure_insert_inodetree(struct super_block *sb,
 	NOVA_ASSERT(new_node);
 	new_node->range_low = internal_low;
 	new_node->range_high = internal_high;
-	ret = nova_insert_inodetree(sbi, new_node, cpu);
+	ret = nova_insert_blocktree(sbi, tree, new_node);
 	if (ret) {
 		nova_err(sb, "%s failed\n", __func__);
 		nova_free_inode_node(sb, new_node);
-		goto finish;
+		return ret;
 	}
 	inode_map->num_range_node_inode++;
 
-finish:
+	return 0;
+}
+
+int nova_failure_insert_inodetree(struct super_block *sb,
+	unsigned long ino_low, unsigned long ino_high)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct inode_map *inode_map;
+	int cpu;
+	struct rb_root *tree;
+	int ret;
+
+	if (ino_low > ino_high) {
+		nova_err(sb, "%s: ino low %lu, ino high %lu\n",
+				__func__, ino_low, ino_high);
+		BUG();
+	}
+
+	cpu = ino_low % sbi->cpus;
+	if (ino_high % sbi->cpus != cpu) {
+		nova_err(sb, "%s: ino low %lu, ino high %lu\n",
+				__func__, ino_low, ino_high);
+		BUG();
+	}
+
+	inode_map = &sbi->inode_maps[cpu];
+	tree = &inode_map->inode_inuse_tree;
+	/*
+	 * The background crawl fills a tree of its own, the live one holds
+	 * a placeholder until it is done. Node counts are redone then.
+	 */
+	if (sbi->bg_recovery)
+		tree = &inode_map->bg_inuse_tree;
+
+	mutex_lock(&inode_map->inode_table_mutex);
+	ret = __nova_insert_inode_range(sb, cpu, tree, ino_low / sbi->cpus,
+					ino_high / sbi->cpus);
 	mutex_unlock(&inode_map->inode_table_mutex);
 	return ret;
 }
@@ -179,68 +195,6 @@ static void nova_destroy_blocknode_trees(struct super_block *sb)
 	nova_destroy_blocknode_tree(sb, SHARED_CPU);
 }
 
-static int nova_init_blockmap_from_inode(struct super_block *sb)
-{
-	struct nova_sb_info *sbi = NOVA_SB(sb);
-	struct nova_inode *pi = nova_get_inode_by_ino(sb, NOVA_BLOCKNODE_INO);
-	struct free_list *free_list;
-	struct nova_range_node_lowhigh *entry;
-	struct nova_range_node *blknode;
-	size_t size = sizeof(struct nova_range_node_lowhigh);
-	u64 curr_p;
-	u64 cpuid;
-	int ret = 0;
-
-	curr_p = pi->log_head;
-	if (curr_p == 0) {
-		nova_dbg("%s: pi head is 0!\n", __func__);
-		return -EINVAL;
-	}
-
-	while (curr_p != pi->log_tail) {
-		if (is_last_entry(curr_p, size)) {
-			curr_p = next_log_page(sb, curr_p);
-		}
-
-		if (curr_p == 0) {
-			nova_dbg("%s: curr_p is NULL!\n", __func__);
-			NOVA_ASSERT(0);
-			ret = -EINVAL;
-			break;
-		}
-
-		entry = (struct nova_range_node_lowhigh *)nova_get_block(sb,
-							curr_p);
-		blknode = nova_alloc_blocknode(sb);
-		if (blknode == NULL)
-			NOVA_ASSERT(0);
-		blknode->range_low = le64_to_cpu(entry->range_low);
-		blknode->range_high = le64_to_cpu(entry->range_high);
-		cpuid = get_cpuid(sbi, blknode->range_low);
-
-		/* FIXME: Assume NR_CPUS not change */
-		free_list = nova_get_free_list(sb, cpuid);
-		ret = nova_insert_blocktree(sbi,
-				&free_list->block_free_tree, blknode);
-		if (ret) {
-			nova_err(sb, "%s failed\n", __func__);
-			nova_free_blocknode(sb, blknode);
-			NOVA_ASSERT(0);
-			nova_destroy_blocknode_trees(sb);
-			goto out;
-		}
-		free_list->num_blocknode++;
-		if (free_list->num_blocknode == 1)
-			free_list->first_node = blknode;
-		free_list->num_free_blocks +=
-			blknode->range_high - blknode->range_low + 1;
-		curr_p += sizeof(struct nova_range_node_lowhigh);
-	}
-out:
-	nova_free_inode_log(sb, pi);
-	return ret;
-}
-
 static void nova_destroy_inode_trees(struct super_block *sb)
 {
 	struct nova_sb_info *sbi = NOVA_SB(sb);
@@ -251,113 +205,71 @@ static void nova_destroy_inode_trees(struct super_block *sb)
 		inode_map = &sbi->inode_maps[i];
 		nova_destroy_range_node_tree(sb,
 					&inode_map->inode_inuse_tree);
+		nova_destroy_range_node_tree(sb,
+					&inode_map->bg_inuse_tree);
 	}
 }
 
-#define CPUID_MASK 0xff00000000000000
-
-static int nova_init_inode_list_from_inode(struct super_block *sb)
+/* Free lists and inode maps, at unmount */
+void nova_destroy_range_trees(struct super_block *sb)
 {
-	struct nova_sb_info *sbi = NOVA_SB(sb);
-	struct nova_inode *pi = nova_get_inode_by_ino(sb, NOVA_INODELIST1_INO);
-	struct nova_range_node_lowhigh *entry;
-	struct nova_range_node *range_node;
-	struct inode_map *inode_map;
-	size_t size = sizeof(struct nova_range_node_lowhigh);
-	unsigned long num_inode_node = 0;
-	u64 curr_p;
-	unsigned long cpuid;
-	int ret;
-
-	sbi->s_inodes_used_count = 0;
-	curr_p = pi->log_head;
-	if (curr_p == 0) {
-		nova_dbg("%s: pi head is 0!\n", __func__);
-		return -EINVAL;
-	}
-
-	while (curr_p != pi->log_tail) {
-		if (is_last_entry(curr_p, size)) {
-			curr_p = next_log_page(sb, curr_p);
-		}
-
-		if (curr_p == 0) {
-			nova_dbg("%s: curr_p is NULL!\n", __func__);
-			NOVA_ASSERT(0);
-		}
-
-		entry = (struct nova_range_node_lowhigh *)nova_get_block(sb,
-							curr_p);
-		range_node = nova_alloc_inode_node(sb);
-		if (range_node == NULL)
-			NOVA_ASSERT(0);
-
-		cpuid = (entry->range_low & CPUID_MASK) >> 56;
-		if (cpuid >= sbi->cpus) {
-			nova_err(sb, "Invalid cpuid %lu\n", cpuid);
-			nova_free_inode_node(sb, range_node);
-			NOVA_ASSERT(0);
-			nova_destroy_inode_trees(sb);
-			goto out;
-		}
-
-		range_node->range_low = entry->range_low & ~CPUID_MASK;
-		range_node->range_high = entry->range_high;
-		ret = nova_insert_inodetree(sbi, range_node, cpuid);
-		if (ret) {
-			nova_err(sb, "%s failed, %d\n", __func__, cpuid);
-			nova_free_inode_node(sb, range_node);
-			NOVA_ASSERT(0);
-			nova_destroy_inode_trees(sb);
-			goto out;
-		}
-
-		sbi->s_inodes_used_count +=
-			range_node->range_high - range_node->range_low + 1;
-		num_inode_node++;
-
-		inode_map = &sbi->inode_maps[cpuid];
-		inode_map->num_range_node_inode++;
-		if (!inode_map->first_inode_range)
-			inode_map->first_inode_range = range_node;
-
-		curr_p += sizeof(struct nova_range_node_lowhigh);
-	}
-
-	nova_dbg("%s: %lu inode nodes\n", __func__, num_inode_node);
-out:
-	nova_free_inode_log(sb, pi);
-	return ret;
+	nova_destroy_blocknode_trees(sb);
+	nova_destroy_inode_trees(sb);
 }
 
-static bool nova_can_skip_full_scan(struct super_block *sb)
+/* Drop partially built free lists and inode trees */
+static void nova_reset_recovery_state(struct super_block *sb)
 {
-	struct nova_inode *pi =  nova_get_inode_by_ino(sb, NOVA_BLOCKNODE_INO);
-	int ret;
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct free_list *free_list;
+	struct inode_map *inode_map;
+	int i;
 
-	if (pi->log_head == 0 || pi->log_tail == 0)
-		return false;
+	nova_destroy_blocknode_trees(sb);
+	nova_destroy_inode_trees(sb);
 
-	ret = nova_init_blockmap_from_inode(sb);
-	if (ret) {
-		nova_err(sb, "init blockmap failed, "
-				"fall back to failure recovery\n");
-		return false;
+	for (i = 0; i <= sbi->cpus; i++) {
+		free_list = nova_get_free_list(sb, i < sbi->cpus ?
+							i : SHARED_CPU);
+		free_list->first_node = NULL;
+		free_list->num_blocknode = 0;
+		free_list->num_free_blocks = 0;
 	}
 
-	ret = nova_init_inode_list_from_inode(sb);
-	if (ret) {
-		nova_err(sb, "init inode list failed, "
-				"fall back to failure recovery\n");
-		nova_destroy_blocknode_trees(sb);
-		return false;
+	for (i = 0; i < sbi->cpus; i++) {
+		inode_map = &sbi->inode_maps[i];
+		inode_map->first_inode_range = NULL;
+		inode_map->num_range_node_inode = 0;
 	}
-
-	return true;
 }
 
+/*
+ * Unmount saves each free list and each inode map into its own region of
+ * the log of NOVA_BLOCKNODE_INO or NOVA_INODELIST1_INO, one thread per
+ * CPU. The log starts with { NOVA_RANGE_MAGIC, nr regions }, followed by
+ * one { first page, nr nodes } record per region; the log tail ends
+ * there. A region is written a page at a time with non-temporal stores
+ * and fenced once. Mount loads the regions in parallel the same way.
+ * Logs that do not start with the magic were saved as one sorted list
+ * and are loaded serially.
+ */
+#define	NOVA_RANGE_MAGIC	0x4e4f564152414e47ULL	/* "NOVARANG" */
+
+struct range_node_region {
+	struct super_block *sb;
+	int		cpuid;		/* Free list or inode map */
+	int		inode;		/* Inode map region */
+	u64		first_page;
+	unsigned long	max_nodes;	/* Pages reserved, in nodes */
+	unsigned long	num_nodes;
+	unsigned long	count;		/* Blocks or inodes loaded */
+	struct nova_range_node_lowhigh *buf;
+	int		ret;
+	struct completion done;
+};
+
 static u64 nova_append_range_node_entry(struct super_block *sb,
-	struct nova_range_node *curr, u64 tail, unsigned long cpuid)
+	struct nova_range_node *curr, u64 tail)
 {
 	u64 curr_p;
 	size_t size = sizeof(struct nova_range_node_lowhigh);
@@ -376,8 +288,6 @@ static u64 nova_append_range_node_entry(struct super_block *sb,
 
 	entry = (struct nova_range_node_lowhigh *)nova_get_block(sb, curr_p);
 	entry->range_low = cpu_to_le64(curr->range_low);
-	if (cpuid)
-		entry->range_low |= cpu_to_le64(cpuid << 56);
 	entry->range_high = cpu_to_le64(curr->range_high);
 	nova_dbgv("append entry block low 0x%lx, high 0x%lx\n",
 			curr->range_low, curr->range_high);
@@ -387,121 +297,632 @@ out:
 	return curr_p;
 }
 
-static u64 nova_save_range_nodes_to_log(struct super_block *sb,
-	struct rb_root *tree, u64 temp_tail, unsigned long cpuid)
+static inline int nova_range_regions(struct nova_sb_info *sbi, int inode)
+{
+	return inode ? sbi->cpus : sbi->cpus + 1;
+}
+
+static inline int nova_region_cpuid(struct nova_sb_info *sbi, int i)
+{
+	return i < sbi->cpus ? i : SHARED_CPU;
+}
+
+static struct rb_root *nova_region_tree(struct range_node_region *region)
+{
+	struct nova_sb_info *sbi = NOVA_SB(region->sb);
+
+	if (region->inode)
+		return &sbi->inode_maps[region->cpuid].inode_inuse_tree;
+
+	return &nova_get_free_list(region->sb,
+				region->cpuid)->block_free_tree;
+}
+
+/*
+ * Leaves the tree alone: a failed save keeps the lists usable, and a
+ * read-only remount goes on with them. Unmount frees them afterwards.
+ */
+static int nova_save_range_region(struct range_node_region *region)
 {
+	struct super_block *sb = region->sb;
+	struct rb_root *tree = nova_region_tree(region);
+	size_t size = sizeof(struct nova_range_node_lowhigh);
 	struct nova_range_node *curr;
 	struct rb_node *temp;
-	size_t size = sizeof(struct nova_range_node_lowhigh);
-	u64 curr_entry = 0;
+	u64 curr_page = region->first_page;
+	int n = 0;
 
-	/* Save in increasing order */
 	temp = rb_first(tree);
 	while (temp) {
 		curr = container_of(temp, struct nova_range_node, node);
-		curr_entry = nova_append_range_node_entry(sb, curr,
-						temp_tail, cpuid);
-		temp_tail = curr_entry + size;
 		temp = rb_next(temp);
-		rb_erase(&curr->node, tree);
-		nova_free_range_node(curr);
+		if (region->num_nodes == region->max_nodes)
+			return -ENOSPC;
+
+		region->buf[n].range_low = cpu_to_le64(curr->range_low);
+		region->buf[n].range_high = cpu_to_le64(curr->range_high);
+		region->num_nodes++;
+		n++;
+
+		if (n == RANGENODE_PER_PAGE || (n && !temp)) {
+			memcpy_to_pmem_nocache(nova_get_block(sb, curr_page),
+						region->buf, n * size);
+			curr_page = next_log_page(sb, curr_page);
+			n = 0;
+		}
 	}
 
-	return temp_tail;
-}
-
-static u64 nova_save_free_list_blocknodes(struct super_block *sb, int cpu,
-	u64 temp_tail)
-{
-	struct free_list *free_list;
-
-	free_list = nova_get_free_list(sb, cpu);
-	temp_tail = nova_save_range_nodes_to_log(sb, &free_list->block_free_tree,
-								temp_tail, 0);
-	return temp_tail;
+	PERSISTENT_BARRIER();
+	return 0;
 }
 
-void nova_save_inode_list_to_log(struct super_block *sb)
+/*
+ * Regions are saved in increasing order, so the nodes are allocated in
+ * bulk, checked to be sorted and disjoint, and linked into a balanced
+ * tree in one pass instead of being inserted one at a time.
+ */
+static int nova_load_range_region(struct range_node_region *region)
 {
-	struct nova_inode *pi = nova_get_inode_by_ino(sb, NOVA_INODELIST1_INO);
+	struct super_block *sb = region->sb;
 	struct nova_sb_info *sbi = NOVA_SB(sb);
-	unsigned long num_blocks;
-	unsigned long num_nodes = 0;
+	struct nova_range_node_lowhigh *entry;
+	struct nova_range_node **nodes;
+	struct nova_range_node *node;
+	struct free_list *free_list;
 	struct inode_map *inode_map;
+	struct rb_root *tree = nova_region_tree(region);
+	size_t size = sizeof(struct nova_range_node_lowhigh);
+	unsigned long num = region->num_nodes;
+	u64 curr_p = region->first_page;
 	unsigned long i;
-	u64 temp_tail;
-	u64 new_block;
-	int allocated;
+	int ret = 0;
 
-	for (i = 0; i < sbi->cpus; i++) {
-		inode_map = &sbi->inode_maps[i];
-		num_nodes += inode_map->num_range_node_inode;
-	}
+	if (num == 0)
+		return 0;
 
-	num_blocks = num_nodes / RANGENODE_PER_PAGE;
-	if (num_nodes % RANGENODE_PER_PAGE)
-		num_blocks++;
+	if (!RB_EMPTY_ROOT(tree))
+		return -EINVAL;
 
-	allocated = nova_allocate_inode_log_pages(sb, pi, num_blocks,
-						&new_block);
-	if (allocated != num_blocks) {
-		nova_dbg("Error saving inode list: %d\n", allocated);
-		return;
+	nodes = vmalloc(num * sizeof(struct nova_range_node *));
+	if (!nodes)
+		return -ENOMEM;
+
+	ret = nova_alloc_range_nodes(sb, nodes, num);
+	if (ret)
+		goto out;
+
+	for (i = 0; i < num; i++) {
+		if (i && i % RANGENODE_PER_PAGE == 0)
+			curr_p = next_log_page(sb, curr_p);
+		if (curr_p == 0) {
+			ret = -EINVAL;
+			break;
+		}
+
+		entry = (struct nova_range_node_lowhigh *)nova_get_block(sb,
+							curr_p);
+		node = nodes[i];
+		node->range_low = le64_to_cpu(entry->range_low);
+		node->range_high = le64_to_cpu(entry->range_high);
+		if (node->range_high < node->range_low ||
+				(i && node->range_low <=
+					nodes[i - 1]->range_high) ||
+				(!region->inode &&
+				 get_cpuid(sbi, node->range_low) !=
+							region->cpuid)) {
+			ret = -EINVAL;
+			break;
+		}
+
+		region->count += node->range_high - node->range_low + 1;
+		curr_p += size;
 	}
 
-	pi->log_head = new_block;
-	nova_flush_buffer(&pi->log_head, CACHELINE_SIZE, 0);
+	if (ret) {
+		nova_free_range_nodes(nodes, num);
+		goto out;
+	}
 
-	temp_tail = new_block;
-	for (i = 0; i < sbi->cpus; i++) {
-		inode_map = &sbi->inode_maps[i];
-		temp_tail = nova_save_range_nodes_to_log(sb,
-				&inode_map->inode_inuse_tree, temp_tail, i);
+	nova_build_range_tree(tree, nodes, num);
+	if (region->inode) {
+		inode_map = &sbi->inode_maps[region->cpuid];
+		inode_map->num_range_node_inode = num;
+		inode_map->first_inode_range = nodes[0];
+	} else {
+		free_list = nova_get_free_list(sb, region->cpuid);
+		free_list->num_blocknode = num;
+		free_list->first_node = nodes[0];
+		free_list->num_free_blocks = region->count;
 	}
+out:
+	vfree(nodes);
+	return ret;
+}
 
-	nova_update_tail(pi, temp_tail);
+static int nova_save_range_region_func(void *data)
+{
+	struct range_node_region *region = data;
 
-	nova_dbg("%s: %lu inode nodes, pi head 0x%llx, tail 0x%llx\n",
-		__func__, num_nodes, pi->log_head, pi->log_tail);
+	region->ret = nova_save_range_region(region);
+	complete(&region->done);
+	return 0;
 }
 
-void nova_save_blocknode_mappings_to_log(struct super_block *sb)
+static int nova_load_range_region_func(void *data)
+{
+	struct range_node_region *region = data;
+
+	region->ret = nova_load_range_region(region);
+	complete(&region->done);
+	return 0;
+}
+
+/* One thread per CPU region, the shared free list on the caller */
+static int nova_run_range_regions(struct super_block *sb,
+	struct range_node_region *regions, int nr, int (*func)(void *))
 {
-	struct nova_inode *pi =  nova_get_inode_by_ino(sb, NOVA_BLOCKNODE_INO);
 	struct nova_sb_info *sbi = NOVA_SB(sb);
-	struct nova_super_block *super;
-	struct free_list *free_list;
-	unsigned long num_blocknode = 0;
-	unsigned long num_pages;
-	int allocated;
-	u64 new_block = 0;
-	u64 temp_tail;
+	struct task_struct *thread;
+	int ret = 0;
 	int i;
 
-	/* Allocate log pages before save blocknode mappings */
-	for (i = 0; i < sbi->cpus; i++) {
-		free_list = nova_get_free_list(sb, i);
-		num_blocknode += free_list->num_blocknode;
-		nova_dbgv("%s: free list %d: %lu nodes\n", __func__,
-				i, free_list->num_blocknode);
+	for (i = 0; i < nr; i++) {
+		init_completion(&regions[i].done);
+		if (i >= sbi->cpus) {
+			func(&regions[i]);
+			continue;
+		}
+
+		thread = kthread_create(func, &regions[i], "nova range %d", i);
+		if (IS_ERR(thread)) {
+			/* Do it here instead */
+			func(&regions[i]);
+			continue;
+		}
+		if (cpu_online(i))
+			kthread_bind(thread, i);
+		wake_up_process(thread);
 	}
 
-	free_list = nova_get_free_list(sb, SHARED_CPU);
-	num_blocknode += free_list->num_blocknode;
-	nova_dbgv("%s: shared list: %lu nodes\n", __func__,
-				free_list->num_blocknode);
+	for (i = 0; i < nr; i++) {
+		wait_for_completion(&regions[i].done);
+		if (regions[i].ret && !ret)
+			ret = regions[i].ret;
+	}
 
-	num_pages = num_blocknode / RANGENODE_PER_PAGE;
-	if (num_blocknode % RANGENODE_PER_PAGE)
-		num_pages++;
+	return ret;
+}
+
+static int nova_save_range_nodes(struct super_block *sb,
+	struct nova_inode *pi, int inode)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct range_node_region *regions, *region;
+	struct nova_range_node header;
+	unsigned long num_pages, region_pages;
+	unsigned long num_nodes = 0;
+	int nr = nova_range_regions(sbi, inode);
+	u64 new_block, curr_page, temp_tail;
+	size_t size = sizeof(struct nova_range_node_lowhigh);
+	int allocated;
+	int ret = 0;
+	int i;
+
+	regions = kcalloc(nr, sizeof(struct range_node_region), GFP_KERNEL);
+	if (!regions)
+		return -ENOMEM;
+
+	/* Allocating the log never adds free list nodes */
+	num_pages = DIV_ROUND_UP(nr + 1, RANGENODE_PER_PAGE);
+	for (i = 0; i < nr; i++) {
+		region = &regions[i];
+		region->sb = sb;
+		region->inode = inode;
+		region->cpuid = nova_region_cpuid(sbi, i);
+		if (inode)
+			region->max_nodes =
+				sbi->inode_maps[i].num_range_node_inode;
+		else
+			region->max_nodes = nova_get_free_list(sb,
+					region->cpuid)->num_blocknode;
+		num_nodes += region->max_nodes;
+		num_pages += DIV_ROUND_UP(region->max_nodes,
+						RANGENODE_PER_PAGE);
+		region->buf = kmalloc(RANGENODE_PER_PAGE * size, GFP_KERNEL);
+		if (!region->buf) {
+			ret = -ENOMEM;
+			goto out;
+		}
+	}
 
 	allocated = nova_allocate_inode_log_pages(sb, pi, num_pages,
 						&new_block);
 	if (allocated != num_pages) {
-		nova_dbg("Error saving blocknode mappings: %d\n", allocated);
+		ret = allocated < 0 ? allocated : -ENOSPC;
+		goto out;
+	}
+
+	/* Header pages first, then each region on its own pages */
+	curr_page = new_block;
+	for (i = 0; i < DIV_ROUND_UP(nr + 1, RANGENODE_PER_PAGE); i++)
+		curr_page = next_log_page(sb, curr_page);
+	for (i = 0; i < nr; i++) {
+		region = &regions[i];
+		region->first_page = curr_page;
+		region_pages = DIV_ROUND_UP(region->max_nodes,
+						RANGENODE_PER_PAGE);
+		while (region_pages--)
+			curr_page = next_log_page(sb, curr_page);
+	}
+
+	ret = nova_run_range_regions(sb, regions, nr,
+					nova_save_range_region_func);
+	if (ret) {
+		nova_free_contiguous_log_blocks(sb, pi, new_block);
+		goto out;
+	}
+
+	header.range_low = NOVA_RANGE_MAGIC;
+	header.range_high = nr;
+	temp_tail = nova_append_range_node_entry(sb, &header,
+						new_block) + size;
+	for (i = 0; i < nr; i++) {
+		header.range_low = regions[i].first_page;
+		header.range_high = regions[i].num_nodes;
+		temp_tail = nova_append_range_node_entry(sb, &header,
+						temp_tail) + size;
+	}
+
+	pi->log_head = new_block;
+	nova_flush_buffer(&pi->log_head, CACHELINE_SIZE, 0);
+	nova_update_tail(pi, temp_tail);
+
+	nova_dbg("%s: %lu %s nodes, %lu log pages, pi head 0x%llx, "
+		"tail 0x%llx\n", __func__, num_nodes,
+		inode ? "inode" : "block", num_pages,
+		pi->log_head, pi->log_tail);
+out:
+	for (i = 0; i < nr; i++)
+		kfree(regions[i].buf);
+	kfree(regions);
+	return ret;
+}
+
+/* Returns -EAGAIN if the log was not saved in regions */
+static int nova_load_range_nodes(struct super_block *sb,
+	struct nova_inode *pi, int inode)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct range_node_region *regions, *region;
+	struct nova_range_node_lowhigh *entry;
+	size_t size = sizeof(struct nova_range_node_lowhigh);
+	int nr = nova_range_regions(sbi, inode);
+	u64 curr_p = pi->log_head;
+	int ret;
+	int i;
+
+	entry = (struct nova_range_node_lowhigh *)nova_get_block(sb, curr_p);
+	if (le64_to_cpu(entry->range_low) != NOVA_RANGE_MAGIC)
+		return -EAGAIN;
+
+	/*
+	 * Regions map to the CPUs of the saving mount. If that number
+	 * changed, refuse the log; the caller falls back to failure
+	 * recovery, which rebuilds the lists from the inode logs.
+	 */
+	if (le64_to_cpu(entry->range_high) != nr) {
+		nova_info("%s: %llu regions saved, %d expected, "
+				"rebuilding\n", __func__,
+				le64_to_cpu(entry->range_high), nr);
+		return -EINVAL;
+	}
+
+	regions = kcalloc(nr, sizeof(struct range_node_region), GFP_KERNEL);
+	if (!regions)
+		return -ENOMEM;
+
+	for (i = 0; i < nr; i++) {
+		curr_p += size;
+		if (is_last_entry(curr_p, size))
+			curr_p = next_log_page(sb, curr_p);
+		entry = (struct nova_range_node_lowhigh *)nova_get_block(sb,
+							curr_p);
+		region = &regions[i];
+		region->sb = sb;
+		region->inode = inode;
+		region->cpuid = nova_region_cpuid(sbi, i);
+		region->first_page = le64_to_cpu(entry->range_low);
+		region->num_nodes = le64_to_cpu(entry->range_high);
+	}
+
+	ret = nova_run_range_regions(sb, regions, nr,
+					nova_load_range_region_func);
+	if (ret == 0 && inode) {
+		sbi->s_inodes_used_count = 0;
+		for (i = 0; i < nr; i++)
+			sbi->s_inodes_used_count += regions[i].count;
+	}
+
+	kfree(regions);
+	return ret;
+}
+
+/*
+ * The saved lists are only valid until the first write, so a writable
+ * mount frees them once loaded. A read-only mount leaves them on media;
+ * nova_drop_saved_lists() frees them if it is remounted writable.
+ */
+static void nova_put_saved_list(struct super_block *sb,
+	struct nova_inode *pi, int ret)
+{
+	if (ret == 0 && (sb->s_flags & MS_RDONLY))
 		return;
+
+	nova_free_inode_log(sb, pi);
+}
+
+void nova_drop_saved_lists(struct super_block *sb)
+{
+	nova_free_inode_log(sb, nova_get_inode_by_ino(sb, NOVA_INODELIST1_INO));
+	nova_free_inode_log(sb, nova_get_inode_by_ino(sb, NOVA_BLOCKNODE_INO));
+}
+
+static int nova_init_blockmap_from_inode(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_inode *pi = nova_get_inode_by_ino(sb, NOVA_BLOCKNODE_INO);
+	struct free_list *free_list;
+	struct nova_range_node_lowhigh *entry;
+	struct nova_range_node *blknode;
+	size_t size = sizeof(struct nova_range_node_lowhigh);
+	u64 curr_p;
+	u64 cpuid;
+	int ret = 0;
+
+	curr_p = pi->log_head;
+	if (curr_p == 0) {
+		nova_dbg("%s: pi head is 0!\n", __func__);
+		return -EINVAL;
+	}
+
+	ret = nova_load_range_nodes(sb, pi, 0);
+	if (ret != -EAGAIN) {
+		if (ret)
+			nova_reset_recovery_state(sb);
+		goto out;
+	}
+	ret = 0;
+
+	while (curr_p != pi->log_tail) {
+		if (is_last_entry(curr_p, size)) {
+			curr_p = next_log_page(sb, curr_p);
+		}
+
+		if (curr_p == 0) {
+			nova_dbg("%s: curr_p is NULL!\n", __func__);
+			NOVA_ASSERT(0);
+			ret = -EINVAL;
+			break;
+		}
+
+		entry = (struct nova_range_node_lowhigh *)nova_get_block(sb,
+							curr_p);
+		blknode = nova_alloc_blocknode(sb);
+		if (blknode == NULL)
+			NOVA_ASSERT(0);
+		blknode->range_low = le64_to_cpu(entry->range_low);
+		blknode->range_high = le64_to_cpu(entry->range_high);
+		cpuid = get_cpuid(sbi, blknode->range_low);
+
+		/* FIXME: Assume NR_CPUS not change */
+		free_list = nova_get_free_list(sb, cpuid);
+		ret = nova_insert_blocktree(sbi,
+				&free_list->block_free_tree, blknode);
+		if (ret) {
+			nova_err(sb, "%s failed\n", __func__);
+			nova_free_blocknode(sb, blknode);
+			NOVA_ASSERT(0);
+			nova_destroy_blocknode_trees(sb);
+			goto out;
+		}
+		free_list->num_blocknode++;
+		if (free_list->num_blocknode == 1)
+			free_list->first_node = blknode;
+		free_list->num_free_blocks +=
+			blknode->range_high - blknode->range_low + 1;
+		curr_p += sizeof(struct nova_range_node_lowhigh);
+	}
+out:
+	nova_put_saved_list(sb, pi, ret);
+	return ret;
+}
+
+/*
+ * Inode lists saved as one list carry the cpuid in the unused top bits
+ * of range_low: the low 8 bits at 56, as in the original format, and the
+ * high 8 bits at 48, which stay zero below 256 cpus.
+ */
+#define CPUID_MASK 0xffff000000000000
+
+static inline unsigned long nova_range_low_cpuid(u64 range_low)
+{
+	return ((range_low >> 56) & 0xff) | (((range_low >> 48) & 0xff) << 8);
+}
+
+static int nova_init_inode_list_from_inode(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_inode *pi = nova_get_inode_by_ino(sb, NOVA_INODELIST1_INO);
+	struct nova_range_node_lowhigh *entry;
+	struct nova_range_node *range_node;
+	struct inode_map *inode_map;
+	size_t size = sizeof(struct nova_range_node_lowhigh);
+	unsigned long num_inode_node = 0;
+	u64 curr_p;
+	unsigned long cpuid;
+	int ret;
+
+	sbi->s_inodes_used_count = 0;
+	curr_p = pi->log_head;
+	if (curr_p == 0) {
+		nova_dbg("%s: pi head is 0!\n", __func__);
+		return -EINVAL;
+	}
+
+	ret = nova_load_range_nodes(sb, pi, 1);
+	if (ret != -EAGAIN) {
+		if (ret)
+			nova_reset_recovery_state(sb);
+		goto out;
+	}
+	ret = 0;
+
+	while (curr_p != pi->log_tail) {
+		if (is_last_entry(curr_p, size)) {
+			curr_p = next_log_page(sb, curr_p);
+		}
+
+		if (curr_p == 0) {
+			nova_dbg("%s: curr_p is NULL!\n", __func__);
+			NOVA_ASSERT(0);
+		}
+
+		entry = (struct nova_range_node_lowhigh *)nova_get_block(sb,
+							curr_p);
+		range_node = nova_alloc_inode_node(sb);
+		if (range_node == NULL)
+			NOVA_ASSERT(0);
+
+		cpuid = nova_range_low_cpuid(entry->range_low);
+		if (cpuid >= sbi->cpus) {
+			nova_err(sb, "Invalid cpuid %lu\n", cpuid);
+			nova_free_inode_node(sb, range_node);
+			NOVA_ASSERT(0);
+			nova_destroy_inode_trees(sb);
+			goto out;
+		}
+
+		range_node->range_low = entry->range_low & ~CPUID_MASK;
+		range_node->range_high = entry->range_high;
+		ret = nova_insert_inodetree(sbi, range_node, cpuid);
+		if (ret) {
+			nova_err(sb, "%s failed, %d\n", __func__, cpuid);
+			nova_free_inode_node(sb, range_node);
+			NOVA_ASSERT(0);
+			nova_destroy_inode_trees(sb);
+			goto out;
+		}
+
+		sbi->s_inodes_used_count +=
+			range_node->range_high - range_node->range_low + 1;
+		num_inode_node++;
+
+		inode_map = &sbi->inode_maps[cpuid];
+		inode_map->num_range_node_inode++;
+		if (!inode_map->first_inode_range)
+			inode_map->first_inode_range = range_node;
+
+		curr_p += sizeof(struct nova_range_node_lowhigh);
 	}
 
+	nova_dbg("%s: %lu inode nodes\n", __func__, num_inode_node);
+out:
+	nova_put_saved_list(sb, pi, ret);
+	return ret;
+}
+
+static bool nova_can_skip_full_scan(struct super_block *sb)
+{
+	struct nova_inode *pi =  nova_get_inode_by_ino(sb, NOVA_BLOCKNODE_INO);
+	int ret;
+
+	if (pi->log_head == 0 || pi->log_tail == 0)
+		return false;
+
+	ret = nova_init_blockmap_from_inode(sb);
+	if (ret) {
+		nova_err(sb, "init blockmap failed, "
+				"fall back to failure recovery\n");
+		return false;
+	}
+
+	ret = nova_init_inode_list_from_inode(sb);
+	if (ret) {
+		nova_err(sb, "init inode list failed, "
+				"fall back to failure recovery\n");
+		/* Read-only mounts kept the blocknode log */
+		nova_free_inode_log(sb, pi);
+		nova_destroy_blocknode_trees(sb);
+		return false;
+	}
+
+	return true;
+}
+
+/* Unmounted cleanly: the lists are saved and no transaction is open */
+bool nova_clean_shutdown(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_inode *pi;
+	struct ptr_pair *pair;
+	int i;
+
+	pi = nova_get_inode_by_ino(sb, NOVA_BLOCKNODE_INO);
+	if (pi->log_head == 0 || pi->log_tail == 0)
+		return false;
+
+	pi = nova_get_inode_by_ino(sb, NOVA_INODELIST1_INO);
+	if (pi->log_head == 0 || pi->log_tail == 0)
+		return false;
+
+	for (i = 0; i < sbi->cpus; i++) {
+		pair = nova_get_journal_pointers(sb, i);
+		if (!pair || pair->journal_head != pair->journal_tail)
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * No clean shutdown: try the allocator checkpoint and its redo logs
+ * before crawling every inode log.
+ */
+static bool nova_can_skip_crawl(struct super_block *sb)
+{
+	int ret;
+
+	ret = nova_recover_from_checkpoint(sb);
+	if (ret == 0)
+		return true;
+	if (ret == -ENOENT)
+		return false;
+
+	nova_err(sb, "load checkpoint failed %d, "
+			"fall back to failure recovery\n", ret);
+	nova_reset_recovery_state(sb);
+	return false;
+}
+
+void nova_save_inode_list_to_log(struct super_block *sb)
+{
+	struct nova_inode *pi = nova_get_inode_by_ino(sb, NOVA_INODELIST1_INO);
+	int ret;
+
+	/* Reserved inode numbers are free on media */
+	nova_drain_inode_magazines(sb);
+
+	ret = nova_save_range_nodes(sb, pi, 1);
+	if (ret)
+		nova_dbg("Error saving inode list: %d\n", ret);
+}
+
+void nova_save_blocknode_mappings_to_log(struct super_block *sb)
+{
+	struct nova_inode *pi =  nova_get_inode_by_ino(sb, NOVA_BLOCKNODE_INO);
+	struct nova_super_block *super;
+	int ret;
+
 	/*
 	 * save the total allocated blocknode mappings
 	 * in super block
@@ -517,24 +938,12 @@ void nova_save_blocknode_mappings_to_log(struct super_block *sb)
 	nova_memlock_range(sb, &super->s_wtime, NOVA_FAST_MOUNT_FIELD_SIZE);
 	nova_flush_buffer(super, NOVA_SB_SIZE, 0);
 
-	/* Finally update log head and tail */
-	pi->log_head = new_block;
-	nova_flush_buffer(&pi->log_head, CACHELINE_SIZE, 0);
-
-	temp_tail = new_block;
-	for (i = 0; i < sbi->cpus; i++) {
-		temp_tail = nova_save_free_list_blocknodes(sb, i, temp_tail);
-	}
-
-	temp_tail = nova_save_free_list_blocknodes(sb, SHARED_CPU, temp_tail);
-	nova_update_tail(pi, temp_tail);
-
-	nova_dbg("%s: %lu blocknodes, %lu log pages, pi head 0x%llx, "
-		"tail 0x%llx\n", __func__, num_blocknode, num_pages,
-		pi->log_head, pi->log_tail);
+	ret = nova_save_range_nodes(sb, pi, 0);
+	if (ret)
+		nova_dbg("Error saving blocknode mappings: %d\n", ret);
 }
 
-static int nova_insert_blocknode_map(struct super_block *sb,
+int nova_insert_blocknode_map(struct super_block *sb,
 	int cpuid, unsigned long low, unsigned long high)
 {
 	struct nova_sb_info *sbi = NOVA_SB(sb);
@@ -569,57 +978,112 @@ out:
 	return ret;
 }
 
-static int __nova_build_blocknode_map(struct super_block *sb,
-	unsigned long *bitmap, unsigned long bsize, unsigned long scale)
+/*
+ * Turn the zero runs of bitmap within cpuid's range into free list
+ * nodes. find_next_zero_bit/find_next_bit skip a whole word of used or
+ * free blocks per step, so this runs at word speed.
+ */
+static int nova_build_free_list(struct super_block *sb,
+	unsigned long *bitmap, int cpuid)
 {
-	struct nova_sb_info *sbi = NOVA_SB(sb);
 	struct free_list *free_list;
-	unsigned long next = 0;
-	unsigned long low = 0;
+	unsigned long low, next;
 	unsigned long start, end;
-	int cpuid = 0;
+	int ret;
 
 	free_list = nova_get_free_list(sb, cpuid);
 	start = free_list->block_start;
 	end = free_list->block_end + 1;
-	while (1) {
-		next = find_next_zero_bit(bitmap, end, start);
-		if (next == bsize)
+
+	while (start < end) {
+		low = find_next_zero_bit(bitmap, end, start);
+		if (low == end)
 			break;
-		if (next == end) {
-			if (cpuid == sbi->cpus - 1)
-				cpuid = SHARED_CPU;
-			else
-				cpuid++;
-			free_list = nova_get_free_list(sb, cpuid);
-			start = free_list->block_start;
-			end = free_list->block_end + 1;
-			continue;
-		}
 
-		low = next;
-		next = find_next_bit(bitmap, end, next);
-		if (nova_insert_blocknode_map(sb, cpuid,
-				low << scale , (next << scale) - 1)) {
+		next = find_next_bit(bitmap, end, low);
+		ret = nova_insert_blocknode_map(sb, cpuid, low, next - 1);
+		if (ret) {
 			nova_dbg("Error: could not insert %lu - %lu\n",
-				low << scale, ((next << scale) - 1));
+				low, next - 1);
+			return ret;
 		}
 		start = next;
-		if (next == bsize)
-			break;
-		if (next == end) {
-			if (cpuid == sbi->cpus - 1)
-				cpuid = SHARED_CPU;
-			else
-				cpuid++;
-			free_list = nova_get_free_list(sb, cpuid);
-			start = free_list->block_start;
-			end = free_list->block_end + 1;
-		}
 	}
+
 	return 0;
 }
 
+struct free_list_builder {
+	struct super_block *sb;
+	unsigned long *bitmap;
+	int cpuid;
+	int ret;
+	struct completion done;
+};
+
+static int nova_build_free_list_func(void *data)
+{
+	struct free_list_builder *builder = data;
+
+	builder->ret = nova_build_free_list(builder->sb, builder->bitmap,
+						builder->cpuid);
+	complete(&builder->done);
+	return 0;
+}
+
+/*
+ * Every CPU builds its own free list over its own range of the shared
+ * bitmap. The lists cover disjoint ranges, so no locking is needed.
+ */
+static int __nova_build_blocknode_map(struct super_block *sb,
+	unsigned long *bitmap)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct free_list_builder *builders;
+	struct free_list_builder *builder;
+	struct task_struct *thread;
+	int ret = 0;
+	int i;
+
+	builders = kcalloc(sbi->cpus, sizeof(struct free_list_builder),
+							GFP_KERNEL);
+	if (!builders)
+		return -ENOMEM;
+
+	for (i = 0; i < sbi->cpus; i++) {
+		builder = &builders[i];
+		builder->sb = sb;
+		builder->bitmap = bitmap;
+		builder->cpuid = i;
+		init_completion(&builder->done);
+
+		thread = kthread_create(nova_build_free_list_func, builder,
+						"nova free list");
+		if (IS_ERR(thread)) {
+			/* Build it here instead */
+			nova_build_free_list_func(builder);
+			continue;
+		}
+		if (cpu_online(i))
+			kthread_bind(thread, i);
+		wake_up_process(thread);
+	}
+
+	/* Shared free list gets any remaining blocks */
+	if (sbi->shared_free_list.block_start)
+		ret = nova_build_free_list(sb, bitmap, SHARED_CPU);
+
+	for (i = 0; i < sbi->cpus; i++) {
+		builder = &builders[i];
+		wait_for_completion(&builder->done);
+		if (builder->ret && !ret)
+			ret = builder->ret;
+	}
+
+	kfree(builders);
+	return ret;
+}
+
 static void nova_update_4K_map(struct super_block *sb,
 	struct scan_bitmap *bm,	unsigned long *bitmap,
 	unsigned long bsize, unsigned long scale)
@@ -641,144 +1105,153 @@ static void nova_update_4K_map(struct super_block *sb,
 	}
 }
 
-struct scan_bitmap *global_bm[64];
+/*
+ * One failure recovery of one superblock, hung off sbi->recovery from
+ * alloc_bm() to free_bm(). Recovery workers mark used blocks in one
+ * shared bitmap with atomic set_bit, so there is nothing to merge once
+ * they are done.
+ */
+struct nova_recovery {
+	struct scan_bitmap *bm;
+	struct recovery_worker *workers;
+	int num_workers;
+	atomic_t pending_work;		/* Queued or running work */
+	atomic_t running_workers;
+	wait_queue_head_t work_wq;
+	struct completion workers_done;
+};
 
-static int nova_build_blocknode_map(struct super_block *sb,
-	unsigned long initsize)
+/* Fold the 2M and 1G maps and the reserved blocks into the 4K map */
+static unsigned long *nova_fill_4K_map(struct super_block *sb)
 {
 	struct nova_sb_info *sbi = NOVA_SB(sb);
-	struct scan_bitmap *bm;
-	struct scan_bitmap *final_bm;
+	struct scan_bitmap *bm = sbi->recovery->bm;
 	unsigned long num_used_block;
-	unsigned long *src, *dst;
-	int i, j;
-	int num;
-	int ret;
-
-	final_bm = kzalloc(sizeof(struct scan_bitmap), GFP_KERNEL);
-	if (!final_bm)
-		return -ENOMEM;
-
-	final_bm->scan_bm_4K.bitmap_size =
-				(initsize >> (PAGE_SHIFT + 0x3));
-
-	/* Alloc memory to hold the block alloc bitmap */
-	final_bm->scan_bm_4K.bitmap = kzalloc(final_bm->scan_bm_4K.bitmap_size,
-							GFP_KERNEL);
-
-	if (!final_bm->scan_bm_4K.bitmap) {
-		kfree(final_bm);
-		return -ENOMEM;
-	}
+	int i;
 
 	/*
 	 * We are using free lists. Set 2M and 1G blocks in 4K map,
 	 * and use 4K map to rebuild block map.
 	 */
-	for (i = 0; i < sbi->cpus; i++) {
-		bm = global_bm[i];
-		nova_update_4K_map(sb, bm, bm->scan_bm_2M.bitmap,
-			bm->scan_bm_2M.bitmap_size * 8, PAGE_SHIFT_2M - 12);
-		nova_update_4K_map(sb, bm, bm->scan_bm_1G.bitmap,
-			bm->scan_bm_1G.bitmap_size * 8, PAGE_SHIFT_1G - 12);
-	}
-
-	/* Merge per-CPU bms to the final single bm */
-	num = final_bm->scan_bm_4K.bitmap_size / sizeof(unsigned long);
-	if (final_bm->scan_bm_4K.bitmap_size % sizeof(unsigned long))
-		num++;
-
-	for (i = 0; i < sbi->cpus; i++) {
-		bm = global_bm[i];
-		src = (unsigned long *)bm->scan_bm_4K.bitmap;
-		dst = (unsigned long *)final_bm->scan_bm_4K.bitmap;
-
-		for (j = 0; j < num; j++)
-			dst[j] |= src[j];
-	}
+	nova_update_4K_map(sb, bm, bm->scan_bm_2M.bitmap,
+		bm->scan_bm_2M.bitmap_size * 8, PAGE_SHIFT_2M - 12);
+	nova_update_4K_map(sb, bm, bm->scan_bm_1G.bitmap,
+		bm->scan_bm_1G.bitmap_size * 8, PAGE_SHIFT_1G - 12);
 
 	/* Set initial used pages */
 	num_used_block = sbi->reserved_blocks;
 	for (i = 0; i < num_used_block; i++)
-		set_bm(i, final_bm, BM_4K);
+		set_bm(i, bm, BM_4K);
 
-	ret = __nova_build_blocknode_map(sb, final_bm->scan_bm_4K.bitmap,
-			final_bm->scan_bm_4K.bitmap_size * 8, PAGE_SHIFT - 12);
-
-	kfree(final_bm->scan_bm_4K.bitmap);
-	kfree(final_bm);
+	return bm->scan_bm_4K.bitmap;
+}
 
-	return ret;
+static int nova_build_blocknode_map(struct super_block *sb,
+	unsigned long initsize)
+{
+	return __nova_build_blocknode_map(sb, nova_fill_4K_map(sb));
 }
 
 static void free_bm(struct super_block *sb)
 {
 	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_recovery *rc = sbi->recovery;
 	struct scan_bitmap *bm;
-	int i;
 
-	for (i = 0; i < sbi->cpus; i++) {
-		bm = global_bm[i];
-		if (bm) {
-			kfree(bm->scan_bm_4K.bitmap);
-			kfree(bm->scan_bm_2M.bitmap);
-			kfree(bm->scan_bm_1G.bitmap);
-			kfree(bm);
-		}
+	if (!rc)
+		return;
+
+	bm = rc->bm;
+	if (bm) {
+		vfree(bm->scan_bm_4K.bitmap);
+		kfree(bm->scan_bm_2M.bitmap);
+		kfree(bm->scan_bm_1G.bitmap);
+		kfree(bm);
 	}
+	kfree(rc);
+	sbi->recovery = NULL;
 }
 
+/* Set up the recovery context of sb and its scan bitmap */
 static int alloc_bm(struct super_block *sb, unsigned long initsize)
 {
 	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_recovery *rc;
 	struct scan_bitmap *bm;
-	int i;
 
-	for (i = 0; i < sbi->cpus; i++) {
-		bm = kzalloc(sizeof(struct scan_bitmap), GFP_KERNEL);
-		if (!bm)
-			return -ENOMEM;
+	rc = kzalloc(sizeof(struct nova_recovery), GFP_KERNEL);
+	if (!rc)
+		return -ENOMEM;
+
+	init_waitqueue_head(&rc->work_wq);
+	sbi->recovery = rc;
 
-		global_bm[i] = bm;
+	bm = kzalloc(sizeof(struct scan_bitmap), GFP_KERNEL);
+	if (!bm)
+		return -ENOMEM;
 
-		bm->scan_bm_4K.bitmap_size =
-				(initsize >> (PAGE_SHIFT + 0x3));
-		bm->scan_bm_2M.bitmap_size =
-				(initsize >> (PAGE_SHIFT_2M + 0x3));
-		bm->scan_bm_1G.bitmap_size =
-				(initsize >> (PAGE_SHIFT_1G + 0x3));
+	rc->bm = bm;
 
-		/* Alloc memory to hold the block alloc bitmap */
-		bm->scan_bm_4K.bitmap = kzalloc(bm->scan_bm_4K.bitmap_size,
-							GFP_KERNEL);
-		bm->scan_bm_2M.bitmap = kzalloc(bm->scan_bm_2M.bitmap_size,
+	/* Round up to whole longs for the bitops */
+	bm->scan_bm_4K.bitmap_size = BITS_TO_LONGS(initsize >> PAGE_SHIFT) *
+						sizeof(unsigned long);
+	bm->scan_bm_2M.bitmap_size =
+			(initsize >> (PAGE_SHIFT_2M + 0x3));
+	bm->scan_bm_1G.bitmap_size =
+			(initsize >> (PAGE_SHIFT_1G + 0x3));
+
+	/* Alloc memory to hold the block alloc bitmap */
+	bm->scan_bm_4K.bitmap = vzalloc(bm->scan_bm_4K.bitmap_size);
+	bm->scan_bm_2M.bitmap = kzalloc(bm->scan_bm_2M.bitmap_size,
 							GFP_KERNEL);
-		bm->scan_bm_1G.bitmap = kzalloc(bm->scan_bm_1G.bitmap_size,
+	bm->scan_bm_1G.bitmap = kzalloc(bm->scan_bm_1G.bitmap_size,
 							GFP_KERNEL);
 
-		if (!bm->scan_bm_4K.bitmap || !bm->scan_bm_2M.bitmap ||
-				!bm->scan_bm_1G.bitmap)
-			return -ENOMEM;
-	}
+	if (!bm->scan_bm_4K.bitmap || !bm->scan_bm_2M.bitmap ||
+			!bm->scan_bm_1G.bitmap)
+		return -ENOMEM;
 
 	return 0;
 }
 
 /************************** NOVA recovery ****************************/
 
-#define MAX_PGOFF	262144
+/* Pages of a file resolved per log pass, 1GB of 4K data */
+#define RECOVERY_WINDOW	262144
 
-struct task_ring {
-	u64 addr[512];
-	int num;
-	int inodes_used_count;
-	u64 *array;
+enum recovery_work_type {
+	RECOVER_INODE_TABLE,	/* A 2MB inode table superpage */
+	RECOVER_INODE,		/* A single inode */
+	RECOVER_FILE_WINDOW,	/* One window of a large file */
+};
+
+struct recovery_work {
+	struct list_head list;
+	enum recovery_work_type type;
+	u64 addr;		/* Superpage or inode address */
+	unsigned long base;	/* First pgoff of the window */
 };
 
-static struct task_ring *task_rings;
-static struct task_struct **threads;
-wait_queue_head_t finish_wq;
-int *finished;
+/*
+ * Each worker pops its own queue from the head and, once that is empty,
+ * steals from the tail of the others. Windows of large files are pushed
+ * back as separate work, so one huge file does not hold up a CPU.
+ */
+struct recovery_worker {
+	spinlock_t lock;
+	struct list_head queue;
+	struct nova_recovery *rc;
+	struct super_block *sb;
+	struct task_struct *thread;
+	struct scan_bitmap *bm;
+	struct nova_inode_info_header sih;
+	u64 *array;			/* pgoff - base -> blocknr */
+	unsigned long array_size;
+	unsigned long array_used;
+	unsigned long inodes_used_count;
+	int id;
+	int error;
+};
 
 void nova_init_header(struct super_block *sb,
 	struct nova_inode_info_header *sih, u16 i_mode)
@@ -789,19 +1262,24 @@ void nova_init_header(struct super_block *sb,
 	sih->high_dirty = 0;
 	sih->i_size = 0;
 	sih->pi_addr = 0;
+	sih->dir_version = 0;
+	sih->batch = NULL;
+	sih->fast_gcs = 0;
+	sih->thorough_gcs = 0;
+	sih->gc_freed_pages = 0;
+	sih->snapshot_dead = 0;
 	INIT_RADIX_TREE(&sih->tree, GFP_ATOMIC);
 	INIT_RADIX_TREE(&sih->cache_tree, GFP_ATOMIC);
 	sih->i_mode = i_mode;
 }
 
+/* pi is the inode at pi_addr, or a copy of it for a snapshot mount */
 int nova_rebuild_inode(struct super_block *sb, struct nova_inode_info *si,
-	u64 pi_addr)
+	struct nova_inode *pi, u64 pi_addr)
 {
 	struct nova_inode_info_header *sih = &si->header;
-	struct nova_inode *pi;
 	unsigned long nova_ino;
 
-	pi = (struct nova_inode *)nova_get_block(sb, pi_addr);
 	if (!pi)
 		NOVA_ASSERT(0);
 
@@ -857,21 +1335,103 @@ static int nova_traverse_dir_inode_log(struct super_block *sb,
 	BUG_ON(curr_p & (PAGE_SIZE - 1));
 	set_bm(curr_p >> PAGE_SHIFT, bm, BM_4K);
 
-	curr_page = (struct nova_inode_log_page *)nova_get_block(sb, curr_p);
-	while ((next = curr_page->page_tail.next_page) != 0) {
-		curr_p = next;
-		BUG_ON(curr_p & (PAGE_SIZE - 1));
-		set_bm(curr_p >> PAGE_SHIFT, bm, BM_4K);
-		curr_page = (struct nova_inode_log_page *)
-			nova_get_block(sb, curr_p);
+	curr_page = (struct nova_inode_log_page *)nova_get_block(sb, curr_p);
+	while ((next = curr_page->page_tail.next_page) != 0) {
+		curr_p = next;
+		BUG_ON(curr_p & (PAGE_SIZE - 1));
+		set_bm(curr_p >> PAGE_SHIFT, bm, BM_4K);
+		curr_page = (struct nova_inode_log_page *)
+			nova_get_block(sb, curr_p);
+	}
+
+	return 0;
+}
+
+static int nova_queue_recovery_work(struct recovery_worker *worker,
+	enum recovery_work_type type, u64 addr, unsigned long base)
+{
+	struct nova_recovery *rc = worker->rc;
+	struct recovery_work *work;
+
+	work = kmalloc(sizeof(struct recovery_work), GFP_KERNEL);
+	if (!work)
+		return -ENOMEM;
+
+	work->type = type;
+	work->addr = addr;
+	work->base = base;
+
+	atomic_inc(&rc->pending_work);
+	spin_lock(&worker->lock);
+	list_add_tail(&work->list, &worker->queue);
+	spin_unlock(&worker->lock);
+	wake_up_interruptible(&rc->work_wq);
+
+	return 0;
+}
+
+static struct recovery_work *nova_get_recovery_work(
+	struct recovery_worker *worker)
+{
+	struct nova_recovery *rc = worker->rc;
+	struct recovery_worker *victim;
+	struct recovery_work *work = NULL;
+	int i;
+
+	for (i = 0; i < rc->num_workers && !work; i++) {
+		victim = &rc->workers[(worker->id + i) % rc->num_workers];
+		spin_lock(&victim->lock);
+		if (!list_empty(&victim->queue)) {
+			if (victim == worker)
+				work = list_first_entry(&victim->queue,
+						struct recovery_work, list);
+			else
+				work = list_last_entry(&victim->queue,
+						struct recovery_work, list);
+			list_del(&work->list);
+		}
+		spin_unlock(&victim->lock);
+	}
+
+	return work;
+}
+
+static void nova_finish_recovery_work(struct nova_recovery *rc,
+	struct recovery_work *work)
+{
+	kfree(work);
+	if (atomic_dec_and_test(&rc->pending_work))
+		wake_up_interruptible(&rc->work_wq);
+}
+
+/* Window arrays start small and grow up to RECOVERY_WINDOW entries */
+static int nova_grow_ring_array(struct recovery_worker *worker,
+	unsigned long size)
+{
+	unsigned long new_size = max(worker->array_size, 512UL);
+	u64 *array;
+
+	while (new_size < size)
+		new_size <<= 1;
+
+	array = vzalloc(sizeof(u64) * new_size);
+	if (!array)
+		return -ENOMEM;
+
+	if (worker->array) {
+		memcpy(array, worker->array,
+				sizeof(u64) * worker->array_used);
+		vfree(worker->array);
 	}
 
+	worker->array = array;
+	worker->array_size = new_size;
 	return 0;
 }
 
 static int nova_set_ring_array(struct super_block *sb,
-	struct nova_inode_info_header *sih, struct nova_file_write_entry *entry,
-	struct task_ring *ring, unsigned long base)
+	struct nova_file_write_entry *entry,
+	struct recovery_worker *worker, unsigned long base)
 {
 	unsigned long start, end;
 	unsigned long pgoff;
@@ -881,45 +1441,65 @@ static int nova_set_ring_array(struct super_block *sb,
 		start = base;
 
 	end = entry->pgoff + entry->num_pages;
-	if (end > base + MAX_PGOFF)
-		end = base + MAX_PGOFF;
+	if (end > base + RECOVERY_WINDOW)
+		end = base + RECOVERY_WINDOW;
+
+	if (end - base > worker->array_size &&
+			nova_grow_ring_array(worker, end - base)) {
+		worker->error = -ENOMEM;
+		return -ENOMEM;
+	}
+
+	for (pgoff = start; pgoff < end; pgoff++) {
+		/* A hole entry drops what older entries mapped */
+		if (nova_entry_hole(entry))
+			worker->array[pgoff - base] = 0;
+		else
+			worker->array[pgoff - base] =
+				(u64)(entry->block >> PAGE_SHIFT) + pgoff -
+				entry->pgoff;
+	}
 
-	for (pgoff = start; pgoff < end; pgoff++)
-		ring->array[pgoff - base] = (u64)(entry->block >> PAGE_SHIFT)
-						+ pgoff - entry->pgoff;
+	if (end - base > worker->array_used)
+		worker->array_used = end - base;
 
 	return 0;
 }
 
+static void nova_reset_ring_array(struct recovery_worker *worker)
+{
+	if (worker->array_used)
+		memset(worker->array, 0, sizeof(u64) * worker->array_used);
+	worker->array_used = 0;
+}
+
 static int nova_set_file_bm(struct super_block *sb,
-	struct nova_inode_info_header *sih, struct task_ring *ring,
-	struct scan_bitmap *bm, unsigned long base, unsigned long last_blocknr)
+	struct recovery_worker *worker, unsigned long base,
+	unsigned long last_blocknr)
 {
-	unsigned long nvmm, pgoff;
+	unsigned long nvmm, pgoff, end = 0;
 
-	if (last_blocknr >= base + MAX_PGOFF)
-		last_blocknr = MAX_PGOFF - 1;
-	else
-		last_blocknr -= base;
+	if (last_blocknr >= base)
+		end = min(last_blocknr - base + 1, worker->array_used);
 
-	for (pgoff = 0; pgoff <= last_blocknr; pgoff++) {
-		nvmm = ring->array[pgoff];
-		if (nvmm) {
-			set_bm(nvmm, bm, BM_4K);
-			ring->array[pgoff] = 0;
-		}
+	for (pgoff = 0; pgoff < end; pgoff++) {
+		nvmm = worker->array[pgoff];
+		if (nvmm)
+			set_bm(nvmm, worker->bm, BM_4K);
 	}
 
+	/* Also drops blocks past EOF, so the next file starts clean */
+	nova_reset_ring_array(worker);
 	return 0;
 }
 
 static void nova_ring_setattr_entry(struct super_block *sb,
-	struct nova_inode_info_header *sih,
-	struct nova_setattr_logentry *entry, struct task_ring *ring,
+	struct nova_setattr_logentry *entry, struct recovery_worker *worker,
 	unsigned long base, unsigned int data_bits)
 {
+	struct nova_inode_info_header *sih = &worker->sih;
 	unsigned long first_blocknr, last_blocknr;
-	unsigned long pgoff;
+	unsigned long pgoff, end_blocknr;
 	loff_t start, end;
 
 	if (sih->i_size > entry->size) {
@@ -939,24 +1519,38 @@ static void nova_ring_setattr_entry(struct super_block *sb,
 		if (first_blocknr < base)
 			first_blocknr = base;
 
-		if (last_blocknr > base + MAX_PGOFF - 1)
-			last_blocknr = base + MAX_PGOFF - 1;
-
-		for (pgoff = first_blocknr; pgoff <= last_blocknr; pgoff++)
-			ring->array[pgoff - base] = 0;
+		/* Nothing is set past array_used */
+		end_blocknr = min(last_blocknr + 1, base + worker->array_used);
+		for (pgoff = first_blocknr; pgoff < end_blocknr; pgoff++)
+			worker->array[pgoff - base] = 0;
 	}
 out:
 	sih->i_size = entry->size;
 }
 
+static void nova_mark_entry_blocks(struct super_block *sb,
+	struct nova_file_write_entry *entry, struct scan_bitmap *bm)
+{
+	unsigned long blocknr = entry->block >> PAGE_SHIFT;
+	unsigned long i;
+
+	for (i = 0; i < entry->num_pages; i++)
+		set_bm(blocknr + i, bm, BM_4K);
+}
+
+/*
+ * Resolve the pages of one RECOVERY_WINDOW of a file. The base 0 pass also
+ * marks the log pages and queues the remaining windows.
+ */
 static int nova_traverse_file_inode_log(struct super_block *sb,
-	struct nova_inode *pi, struct nova_inode_info_header *sih,
-	struct task_ring *ring, struct scan_bitmap *bm)
+	u64 pi_addr, struct recovery_worker *worker, unsigned long base)
 {
+	struct nova_inode *pi = nova_get_block(sb, pi_addr);
+	struct nova_inode_info_header *sih = &worker->sih;
+	struct scan_bitmap *bm = worker->bm;
 	struct nova_file_write_entry *entry = NULL;
 	struct nova_setattr_logentry *attr_entry = NULL;
 	struct nova_inode_log_page *curr_page;
-	unsigned long base = 0;
 	unsigned long last_blocknr;
 	u64 ino = pi->nova_ino;
 	void *addr;
@@ -969,7 +1563,6 @@ static int nova_traverse_file_inode_log(struct super_block *sb,
 	btype = pi->i_blk_type;
 	data_bits = blk_type_to_shift[btype];
 
-again:
 	sih->i_size = 0;
 	curr_p = pi->log_head;
 	nova_dbg_verbose("Log head 0x%llx, tail 0x%llx\n",
@@ -1003,8 +1596,8 @@ again:
 			case SET_ATTR:
 				attr_entry =
 					(struct nova_setattr_logentry *)addr;
-				nova_ring_setattr_entry(sb, sih, attr_entry,
-							ring, base, data_bits);
+				nova_ring_setattr_entry(sb, attr_entry,
+						worker, base, data_bits);
 				curr_p += sizeof(struct nova_setattr_logentry);
 				continue;
 			case LINK_CHANGE:
@@ -1021,10 +1614,18 @@ again:
 		entry = (struct nova_file_write_entry *)addr;
 		sih->i_size = entry->size;
 
+		/*
+		 * A snapshot may map pages whose record the crash lost,
+		 * keep them all rather than free one it reads.
+		 */
+		if (base == 0 && !nova_entry_hole(entry) &&
+				nova_log_page_frozen(sb, curr_p))
+			nova_mark_entry_blocks(sb, entry, bm);
+
 		if (entry->num_pages != entry->invalid_pages) {
-			if (entry->pgoff < base + MAX_PGOFF &&
+			if (entry->pgoff < base + RECOVERY_WINDOW &&
 					entry->pgoff + entry->num_pages > base)
-				nova_set_ring_array(sb, sih, entry, ring, base);
+				nova_set_ring_array(sb, entry, worker, base);
 		}
 
 		curr_p += sizeof(struct nova_file_write_entry);
@@ -1043,321 +1644,919 @@ again:
 		}
 	}
 
-	if (sih->i_size == 0)
+	if (sih->i_size == 0) {
+		nova_reset_ring_array(worker);
 		return 0;
+	}
 
 	last_blocknr = (sih->i_size - 1) >> data_bits;
-	nova_set_file_bm(sb, sih, ring, bm, base, last_blocknr);
-	if (last_blocknr >= base + MAX_PGOFF) {
-		base += MAX_PGOFF;
-		goto again;
+	nova_set_file_bm(sb, worker, base, last_blocknr);
+
+	if (base != 0)
+		return 0;
+
+	/* Let idle workers pick up the rest of a large file */
+	for (base = RECOVERY_WINDOW; base <= last_blocknr;
+					base += RECOVERY_WINDOW) {
+		if (nova_queue_recovery_work(worker, RECOVER_FILE_WINDOW,
+						pi_addr, base)) {
+			worker->error = -ENOMEM;
+			break;
+		}
 	}
 
 	return 0;
 }
 
+/*
+ * Background recovery: a worker claims an inode before walking its log
+ * and leaves it alone if the inode is pinned. nova_bg_pin_inode waits
+ * for the claim to go away, so no log is walked while it changes.
+ * Pinned inodes are walked again under i_mutex when the crawl is done.
+ */
+static bool nova_bg_claim_inode(struct super_block *sb,
+	struct recovery_worker *worker, unsigned long ino)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	bool claimed = true;
+
+	if (!sbi->bg_recovery)
+		return true;
+
+	spin_lock(&sbi->bg_lock);
+	if (radix_tree_lookup(&sbi->bg_pinned, ino))
+		claimed = false;
+	else
+		sbi->bg_claimed[worker->id] = ino;
+	spin_unlock(&sbi->bg_lock);
+
+	return claimed;
+}
+
+static void nova_bg_release_inode(struct super_block *sb,
+	struct recovery_worker *worker)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+
+	if (!sbi->bg_recovery)
+		return;
+
+	spin_lock(&sbi->bg_lock);
+	sbi->bg_claimed[worker->id] = 0;
+	spin_unlock(&sbi->bg_lock);
+	wake_up_all(&sbi->bg_wait);
+}
+
+/* Index snapshot pages hang off pi->i_index, not the log */
+static void nova_mark_index_pages(struct super_block *sb,
+	struct nova_inode *pi, struct scan_bitmap *bm)
+{
+	struct nova_inode_log_page *curr_page;
+	u64 curr_p = nova_get_index_head(sb, pi);
+
+	while (curr_p) {
+		set_bm(curr_p >> PAGE_SHIFT, bm, BM_4K);
+		curr_page = (struct nova_inode_log_page *)
+			nova_get_block(sb, curr_p);
+		curr_p = curr_page->page_tail.next_page;
+	}
+}
+
 static int nova_recover_inode_pages(struct super_block *sb,
-	struct nova_inode_info_header *sih, struct task_ring *ring,
-	u64 pi_addr, struct scan_bitmap *bm)
+	struct recovery_worker *worker, u64 pi_addr)
 {
+	struct nova_inode_info_header *sih = &worker->sih;
 	struct nova_inode *pi;
 	unsigned long nova_ino;
 
-	pi = (struct nova_inode *)nova_get_block(sb, pi_addr);
-	if (!pi)
-		NOVA_ASSERT(0);
+	pi = (struct nova_inode *)nova_get_block(sb, pi_addr);
+	if (!pi)
+		NOVA_ASSERT(0);
+
+	if (pi->valid == 0)
+		return 0;
+
+	nova_ino = pi->nova_ino;
+	worker->inodes_used_count++;
+
+	if (!nova_bg_claim_inode(sb, worker, nova_ino))
+		return 0;
+
+	sih->i_mode = __le16_to_cpu(pi->i_mode);
+	sih->ino = nova_ino;
+
+	nova_dbgv("%s: inode %lu, addr 0x%llx, head 0x%llx, tail 0x%llx\n",
+			__func__, nova_ino, pi_addr, pi->log_head,
+			pi->log_tail);
+
+	switch (__le16_to_cpu(pi->i_mode) & S_IFMT) {
+	case S_IFDIR:
+		nova_traverse_dir_inode_log(sb, pi, worker->bm);
+		break;
+	case S_IFLNK:
+		/* Treat symlink files as normal files */
+		/* Fall through */
+	case S_IFREG:
+		/* Fall through */
+	default:
+		/* In case of special inode, walk the log */
+		nova_traverse_file_inode_log(sb, pi_addr, worker, 0);
+		break;
+	}
+
+	nova_mark_index_pages(sb, pi, worker->bm);
+	nova_bg_release_inode(sb, worker);
+	return 0;
+}
+
+static void free_resources(struct super_block *sb)
+{
+	struct nova_recovery *rc = NOVA_SB(sb)->recovery;
+	struct recovery_worker *worker;
+	struct recovery_work *work, *next;
+	int i;
+
+	if (!rc->workers)
+		return;
+
+	for (i = 0; i < rc->num_workers; i++) {
+		worker = &rc->workers[i];
+		list_for_each_entry_safe(work, next, &worker->queue, list) {
+			list_del(&work->list);
+			kfree(work);
+		}
+		vfree(worker->array);
+		worker->array = NULL;
+	}
+
+	kfree(rc->workers);
+	rc->workers = NULL;
+}
+
+static int failure_thread_func(void *data);
+
+static int allocate_resources(struct super_block *sb, int cpus)
+{
+	struct nova_recovery *rc = NOVA_SB(sb)->recovery;
+	struct recovery_worker *worker;
+	int i;
+
+	rc->workers = kcalloc(cpus, sizeof(struct recovery_worker),
+							GFP_KERNEL);
+	if (!rc->workers)
+		return -ENOMEM;
+
+	rc->num_workers = cpus;
+	atomic_set(&rc->running_workers, cpus);
+	init_completion(&rc->workers_done);
+
+	/* Held by the crawler until all inode table pages are queued */
+	atomic_set(&rc->pending_work, 1);
+
+	for (i = 0; i < cpus; i++) {
+		worker = &rc->workers[i];
+		spin_lock_init(&worker->lock);
+		INIT_LIST_HEAD(&worker->queue);
+		worker->rc = rc;
+		worker->sb = sb;
+		worker->bm = rc->bm;
+		worker->id = i;
+		nova_init_header(sb, &worker->sih, 0);
+	}
+
+	for (i = 0; i < cpus; i++) {
+		worker = &rc->workers[i];
+		worker->thread = kthread_create(failure_thread_func,
+						worker, "recovery thread");
+		if (IS_ERR(worker->thread))
+			goto fail;
+		if (cpu_online(i))
+			kthread_bind(worker->thread, i);
+	}
+
+	return 0;
+
+fail:
+	/* Threads that never ran exit without calling the thread function */
+	while (--i >= 0)
+		kthread_stop(rc->workers[i].thread);
+	free_resources(sb);
+	return -ENOMEM;
+}
+
+/*********************** Failure recovery *************************/
+
+static inline int nova_failure_update_inodetree(struct super_block *sb,
+	struct nova_inode *pi, unsigned long *ino_low, unsigned long *ino_high)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+
+	if (*ino_low == 0) {
+		*ino_low = *ino_high = pi->nova_ino;
+	} else {
+		if (pi->nova_ino == *ino_high + sbi->cpus) {
+			*ino_high = pi->nova_ino;
+		} else {
+			/* A new start */
+			nova_failure_insert_inodetree(sb, *ino_low, *ino_high);
+			*ino_low = *ino_high = pi->nova_ino;
+		}
+	}
+
+	return 0;
+}
+
+static void nova_recover_inode_table_page(struct super_block *sb,
+	struct recovery_worker *worker, u64 curr)
+{
+	struct nova_inode *pi;
+	unsigned long num_inodes_per_page;
+	unsigned long ino_low, ino_high;
+	unsigned int data_bits;
+	unsigned long i;
+	u64 pi_addr;
+
+	pi = nova_get_inode_by_ino(sb, NOVA_INODETABLE_INO);
+	data_bits = blk_type_to_shift[pi->i_blk_type];
+	num_inodes_per_page = 1 << (data_bits - NOVA_INODE_BITS);
+
+	ino_low = ino_high = 0;
+
+	/*
+	 * Note: The inode log page is allocated in 2MB
+	 * granularity, but not aligned on 2MB boundary.
+	 */
+	for (i = 0; i < 512; i++)
+		set_bm((curr >> PAGE_SHIFT) + i, worker->bm, BM_4K);
+
+	for (i = 0; i < num_inodes_per_page; i++) {
+		pi_addr = curr + i * NOVA_INODE_SIZE;
+		pi = nova_get_block(sb, pi_addr);
+		if (pi->valid) {
+			nova_recover_inode_pages(sb, worker, pi_addr);
+			nova_failure_update_inodetree(sb, pi,
+					&ino_low, &ino_high);
+		}
+	}
+
+	if (ino_low && ino_high)
+		nova_failure_insert_inodetree(sb, ino_low, ino_high);
+}
+
+static int failure_thread_func(void *data)
+{
+	struct recovery_worker *worker = data;
+	struct nova_recovery *rc = worker->rc;
+	struct super_block *sb = worker->sb;
+	struct recovery_work *work;
+	struct nova_inode *pi;
+	int ret = 0;
+
+	while (1) {
+		work = NULL;
+		wait_event_interruptible(rc->work_wq,
+			(work = nova_get_recovery_work(worker)) != NULL ||
+			atomic_read(&rc->pending_work) == 0);
+		if (!work) {
+			if (atomic_read(&rc->pending_work) == 0)
+				break;
+			continue;
+		}
+
+		switch (work->type) {
+		case RECOVER_INODE_TABLE:
+			nova_recover_inode_table_page(sb, worker, work->addr);
+			break;
+		case RECOVER_INODE:
+			nova_recover_inode_pages(sb, worker, work->addr);
+			break;
+		case RECOVER_FILE_WINDOW:
+			pi = nova_get_block(sb, work->addr);
+			if (!nova_bg_claim_inode(sb, worker, pi->nova_ino))
+				break;
+			nova_traverse_file_inode_log(sb, work->addr, worker,
+							work->base);
+			nova_bg_release_inode(sb, worker);
+			break;
+		}
+
+		nova_finish_recovery_work(rc, work);
+	}
+
+	if (atomic_dec_and_test(&rc->running_workers))
+		complete(&rc->workers_done);
+	do_exit(ret);
+	return ret;
+}
+
+static int nova_failure_recovery_crawl(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_recovery *rc = sbi->recovery;
+	struct inode_table *inode_table;
+	unsigned long curr_addr;
+	u64 root_addr = NOVA_ROOT_INO_START;
+	u64 curr;
+	int ret = 0;
+	int cpuid;
+	int worker_id;
+
+	/* Workers start on pages as soon as they are queued */
+	for (worker_id = 0; worker_id < rc->num_workers; worker_id++)
+		wake_up_process(rc->workers[worker_id].thread);
+
+	/* Recover the root iode */
+	ret = nova_queue_recovery_work(&rc->workers[0], RECOVER_INODE,
+					root_addr, 0);
+	if (ret)
+		return ret;
+
+	worker_id = 0;
+	for (cpuid = 0; cpuid < sbi->cpus; cpuid++) {
+		inode_table = nova_get_inode_table(sb, cpuid);
+		if (!inode_table)
+			return -EINVAL;
+
+		curr = inode_table->log_head;
+		while (curr) {
+			ret = nova_queue_recovery_work(&rc->workers[worker_id],
+					RECOVER_INODE_TABLE, curr, 0);
+			if (ret)
+				return ret;
+
+			worker_id = (worker_id + 1) % rc->num_workers;
+
+			curr_addr = (unsigned long)nova_get_block(sb, curr);
+			/* Next page resides at the last 8 bytes */
+			curr_addr += 2097152 - 8;
+			curr = *(u64 *)(curr_addr);
+		}
+	}
+
+	return ret;
+}
+
+int nova_failure_recovery(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_recovery *rc = sbi->recovery;
+	struct recovery_worker *worker;
+	struct nova_inode *pi;
+	struct ptr_pair *pair;
+	unsigned long range_high;
+	u64 curr_p;
+	int ret;
+	int i;
+
+	if (sbi->bg_recovery) {
+		/* Reserved inodes, as nova_init_inode_inuse_list does */
+		range_high = (NOVA_NORMAL_INODE_START - 1) / sbi->cpus;
+		if (NOVA_NORMAL_INODE_START % sbi->cpus)
+			range_high++;
+		for (i = 0; i < sbi->cpus; i++)
+			nova_failure_insert_inodetree(sb, i,
+					range_high * sbi->cpus + i);
+	} else {
+		sbi->s_inodes_used_count = 0;
+
+		/* Initialize inuse inode list */
+		if (nova_init_inode_inuse_list(sb) < 0)
+			return -EINVAL;
+	}
+
+	/* Handle special inodes */
+	pi = nova_get_inode_by_ino(sb, NOVA_BLOCKNODE_INO);
+	pi->log_head = pi->log_tail = 0;
+	nova_flush_buffer(&pi->log_head, CACHELINE_SIZE, 0);
+
+	/* The crawl does not see checkpoint pages, they become free */
+	pi = nova_get_inode_by_ino(sb, NOVA_CHECKPOINT_INO);
+	pi->log_head = pi->log_tail = 0;
+	nova_flush_buffer(&pi->log_head, CACHELINE_SIZE, 0);
+
+	for (i = 0; i < sbi->cpus; i++) {
+		pair = nova_get_journal_pointers(sb, i);
+		if (!pair)
+			return -EINVAL;
 
-	if (pi->valid == 0)
-		return 0;
+		set_bm(pair->journal_head >> PAGE_SHIFT, rc->bm, BM_4K);
+	}
 
-	nova_ino = pi->nova_ino;
-	ring->inodes_used_count++;
+	/* Shared block counts outlive the crash, keep their log */
+	mutex_lock(&sbi->refcount_mutex);
+	pi = nova_get_inode_by_ino(sb, NOVA_REFCOUNT_INO);
+	for (curr_p = pi->log_head; curr_p; curr_p = next_log_page(sb, curr_p))
+		set_bm(curr_p >> PAGE_SHIFT, rc->bm, BM_4K);
+	mutex_unlock(&sbi->refcount_mutex);
 
-	sih->i_mode = __le16_to_cpu(pi->i_mode);
-	sih->ino = nova_ino;
+	/* So do snapshots, and the blocks only they map */
+	nova_snapshot_mark_blocks(sb, rc->bm);
+	PERSISTENT_BARRIER();
 
-	nova_dbgv("%s: inode %lu, addr 0x%llx, head 0x%llx, tail 0x%llx\n",
-			__func__, nova_ino, pi_addr, pi->log_head,
-			pi->log_tail);
+	ret = allocate_resources(sb, sbi->cpus);
+	if (ret)
+		return ret;
 
-	switch (__le16_to_cpu(pi->i_mode) & S_IFMT) {
-	case S_IFDIR:
-		nova_traverse_dir_inode_log(sb, pi, bm);
-		break;
-	case S_IFLNK:
-		/* Treat symlink files as normal files */
-		/* Fall through */
-	case S_IFREG:
-		/* Fall through */
-	default:
-		/* In case of special inode, walk the log */
-		nova_traverse_file_inode_log(sb, pi, sih, ring, bm);
-		break;
+	ret = nova_failure_recovery_crawl(sb);
+
+	/* Drop the crawler's reference, then sleep until workers exit */
+	if (atomic_dec_and_test(&rc->pending_work))
+		wake_up_interruptible(&rc->work_wq);
+	wait_for_completion(&rc->workers_done);
+
+	for (i = 0; i < rc->num_workers; i++) {
+		worker = &rc->workers[i];
+		/* Redone from the merged trees after a background crawl */
+		if (!sbi->bg_recovery)
+			sbi->s_inodes_used_count += worker->inodes_used_count;
+		if (worker->error && !ret)
+			ret = worker->error;
 	}
 
-	return 0;
+	free_resources(sb);
+
+	nova_dbg("Failure recovery total recovered %lu\n",
+				sbi->s_inodes_used_count);
+	return ret;
 }
 
-static void free_resources(struct super_block *sb)
+/*********************** Background recovery *************************/
+
+/*
+ * With -o bgrecovery, a mount that needs failure recovery returns before
+ * the crawl. At first each per-CPU free list only holds the blocks above
+ * its persisted high-water mark, which were free at the crash, and each
+ * inode map treats every slot of its inode table as in use, so new inodes
+ * extend the table. A kthread then runs the usual crawl and hands the
+ * rest over. Until it is done:
+ *
+ * - freed blocks are parked, see nova_defer_free_blocks, so the crawl
+ *   never reads a page that was reused under it;
+ * - every inode that gets a VFS inode is pinned, see nova_bg_pin_inode,
+ *   so it cannot be evicted, and its blocks are marked again under
+ *   i_mutex once the crawl is done;
+ * - allocations can fail with -ENOSPC although the fs is not full.
+ */
+
+static bool nova_bg_inode_claimed(struct nova_sb_info *sbi, unsigned long ino)
 {
-	struct nova_sb_info *sbi = NOVA_SB(sb);
-	struct task_ring *ring;
+	bool claimed = false;
 	int i;
 
-	if (task_rings) {
-		for (i = 0; i < sbi->cpus; i++) {
-			ring = &task_rings[i];
-			vfree(ring->array);
-			ring->array = NULL;
+	spin_lock(&sbi->bg_lock);
+	for (i = 0; sbi->bg_claimed && i < sbi->cpus; i++) {
+		if (sbi->bg_claimed[i] == ino) {
+			claimed = true;
+			break;
 		}
 	}
+	spin_unlock(&sbi->bg_lock);
 
-	kfree(task_rings);
-	kfree(threads);
-	kfree(finished);
+	return claimed;
 }
 
-static int failure_thread_func(void *data);
-
-static int allocate_resources(struct super_block *sb, int cpus)
+/* Hold inode until background recovery is done */
+int nova_bg_pin_inode(struct inode *inode)
 {
-	struct task_ring *ring;
-	int i;
+	struct nova_sb_info *sbi = NOVA_SB(inode->i_sb);
+	unsigned long ino = inode->i_ino;
+	int ret = 0;
 
-	task_rings = kzalloc(cpus * sizeof(struct task_ring), GFP_KERNEL);
-	if (!task_rings)
-		goto fail;
+	if (likely(!sbi->bg_recovery))
+		return 0;
 
-	for (i = 0; i < cpus; i++) {
-		ring = &task_rings[i];
-		ring->array = vzalloc(sizeof(u64) * MAX_PGOFF);
-		if (!ring->array)
-			goto fail;
+	if (radix_tree_preload(GFP_NOFS))
+		return -ENOMEM;
+
+	spin_lock(&sbi->bg_lock);
+	if (sbi->bg_recovery && !radix_tree_lookup(&sbi->bg_pinned, ino)) {
+		ret = radix_tree_insert(&sbi->bg_pinned, ino, inode);
+		if (ret == 0)
+			ihold(inode);
 	}
+	spin_unlock(&sbi->bg_lock);
+	radix_tree_preload_end();
+
+	if (ret)
+		return ret;
 
-	threads = kzalloc(cpus * sizeof(struct task_struct *), GFP_KERNEL);
-	if (!threads)
-		goto fail;
+	/* A worker may be half way through the log */
+	wait_event(sbi->bg_wait, !nova_bg_inode_claimed(sbi, ino));
+	return 0;
+}
 
-	finished = kzalloc(cpus * sizeof(int), GFP_KERNEL);
-	if (!finished)
-		goto fail;
+/* Mark the log pages and live data blocks of a pinned inode */
+static void nova_bg_remark_inode(struct super_block *sb, struct inode *inode,
+	struct scan_bitmap *bm)
+{
+	struct nova_inode_info_header *sih = &NOVA_I(inode)->header;
+	struct nova_file_write_entry *entries[1];
+	struct nova_file_write_entry *entry;
+	struct nova_inode_log_page *curr_page;
+	struct nova_inode *pi;
+	unsigned long pgoff = 0;
+	u64 curr_p;
 
-	init_waitqueue_head(&finish_wq);
+	mutex_lock(&inode->i_mutex);
+	if (sih->pi_addr == 0)
+		goto out;
 
-	for (i = 0; i < cpus; i++) {
-		threads[i] = kthread_create(failure_thread_func,
-						sb, "recovery thread");
-		kthread_bind(threads[i], i);
+	pi = (struct nova_inode *)nova_get_block(sb, sih->pi_addr);
+	curr_p = pi->log_head;
+	while (curr_p) {
+		set_bm(curr_p >> PAGE_SHIFT, bm, BM_4K);
+		curr_page = (struct nova_inode_log_page *)
+			nova_get_block(sb, curr_p);
+		curr_p = curr_page->page_tail.next_page;
 	}
+	nova_mark_index_pages(sb, pi, bm);
 
-	return 0;
+	if (S_ISDIR(inode->i_mode))
+		goto out;
 
-fail:
-	free_resources(sb);
-	return -ENOMEM;
+	while (radix_tree_gang_lookup(&sih->tree, (void **)entries,
+						pgoff, 1) == 1) {
+		entry = entries[0];
+		if (pgoff < entry->pgoff)
+			pgoff = entry->pgoff;
+		if (radix_tree_lookup(&sih->tree, pgoff) == entry)
+			set_bm((entry->block >> PAGE_SHIFT) + pgoff -
+					entry->pgoff, bm, BM_4K);
+		pgoff++;
+	}
+out:
+	mutex_unlock(&inode->i_mutex);
 }
 
-static void wait_to_finish(int cpus)
-{
-	int i;
+#define	BG_PIN_BATCH	16
 
-	for (i = 0; i < cpus; i++) {
-		while (finished[i] == 0) {
-			wait_event_interruptible_timeout(finish_wq, false,
-							msecs_to_jiffies(1));
+/*
+ * Inodes pinned after this pass were crawled before they were pinned,
+ * whatever they free from then on is parked.
+ */
+static void nova_bg_remark_pinned(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct inode *inodes[BG_PIN_BATCH];
+	unsigned long index = 0;
+	int nr, i;
+
+	do {
+		spin_lock(&sbi->bg_lock);
+		nr = radix_tree_gang_lookup(&sbi->bg_pinned, (void **)inodes,
+						index, BG_PIN_BATCH);
+		spin_unlock(&sbi->bg_lock);
+
+		for (i = 0; i < nr; i++) {
+			nova_bg_remark_inode(sb, inodes[i],
+						sbi->recovery->bm);
+			index = inodes[i]->i_ino + 1;
 		}
-	}
+	} while (nr == BG_PIN_BATCH);
 }
 
-/*********************** Failure recovery *************************/
+static void nova_bg_unpin_inodes(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct inode *inodes[BG_PIN_BATCH];
+	int nr, i;
+
+	do {
+		spin_lock(&sbi->bg_lock);
+		nr = radix_tree_gang_lookup(&sbi->bg_pinned, (void **)inodes,
+						0, BG_PIN_BATCH);
+		for (i = 0; i < nr; i++)
+			radix_tree_delete(&sbi->bg_pinned, inodes[i]->i_ino);
+		spin_unlock(&sbi->bg_lock);
+
+		for (i = 0; i < nr; i++)
+			iput(inodes[i]);
+	} while (nr);
+}
 
-static inline int nova_failure_update_inodetree(struct super_block *sb,
-	struct nova_inode *pi, unsigned long *ino_low, unsigned long *ino_high)
+/* Free the zero runs of bitmap below each list's bg_limit */
+static int nova_bg_merge_free_space(struct super_block *sb,
+	unsigned long *bitmap)
 {
 	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct free_list *free_list;
+	unsigned long start, end;
+	unsigned long low, next;
+	int ret;
+	int i;
 
-	if (*ino_low == 0) {
-		*ino_low = *ino_high = pi->nova_ino;
-	} else {
-		if (pi->nova_ino == *ino_high + sbi->cpus) {
-			*ino_high = pi->nova_ino;
-		} else {
-			/* A new start */
-			nova_failure_insert_inodetree(sb, *ino_low, *ino_high);
-			*ino_low = *ino_high = pi->nova_ino;
+	for (i = 0; i <= sbi->cpus; i++) {
+		free_list = nova_get_free_list(sb, i < sbi->cpus ?
+							i : SHARED_CPU);
+		if (i == sbi->cpus && free_list->block_start == 0)
+			break;
+
+		start = free_list->block_start;
+		end = free_list->bg_limit;
+		while (start < end) {
+			low = find_next_zero_bit(bitmap, end, start);
+			if (low == end)
+				break;
+
+			next = find_next_bit(bitmap, end, low);
+			ret = nova_free_recovered_blocks(sb, low, next - 1);
+			if (ret)
+				return ret;
+			start = next;
 		}
 	}
 
 	return 0;
 }
 
-static int failure_thread_func(void *data)
+/*
+ * Free a parked range. Blocks at or above bg_limit were handed out after
+ * mount. Below it, the crawl has already freed what it found unused, so
+ * only its used blocks are left, or all of them if there is no bitmap.
+ */
+static int nova_bg_free_deferred(struct super_block *sb,
+	unsigned long *bitmap, unsigned long low, unsigned long high)
 {
-	struct super_block *sb = data;
-	struct nova_inode_info_header sih;
-	struct task_ring *ring;
-	struct nova_inode *pi;
-	unsigned long num_inodes_per_page;
-	unsigned long ino_low, ino_high;
-	unsigned long last_blocknr;
-	unsigned int data_bits;
-	u64 curr;
-	int cpuid = smp_processor_id();
-	unsigned long i;
-	unsigned long max_size = 0;
-	u64 pi_addr = 0;
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct free_list *free_list;
+	unsigned long end, stop, next;
 	int ret = 0;
-	int count;
 
-	pi = nova_get_inode_by_ino(sb, NOVA_INODETABLE_INO);
-	data_bits = blk_type_to_shift[pi->i_blk_type];
-	num_inodes_per_page = 1 << (data_bits - NOVA_INODE_BITS);
+	while (low <= high && ret == 0) {
+		free_list = nova_get_free_list(sb, get_cpuid(sbi, low));
+		end = min(high, free_list->block_end);
+
+		if (bitmap && low < free_list->bg_limit) {
+			stop = min(end + 1, free_list->bg_limit);
+			while (ret == 0) {
+				low = find_next_bit(bitmap, stop, low);
+				if (low == stop)
+					break;
+				next = find_next_zero_bit(bitmap, stop, low);
+				ret = nova_free_recovered_blocks(sb, low,
+								next - 1);
+				low = next;
+			}
+		}
 
-	ring = &task_rings[cpuid];
-	nova_init_header(sb, &sih, 0);
+		if (low <= end && ret == 0)
+			ret = nova_free_recovered_blocks(sb, low, end);
+		low = end + 1;
+	}
 
-	for (count = 0; count < ring->num; count++) {
-		curr = ring->addr[count];
-		ino_low = ino_high = 0;
+	return ret;
+}
 
-		/*
-		 * Note: The inode log page is allocated in 2MB
-		 * granularity, but not aligned on 2MB boundary.
-		 */
-		for (i = 0; i < 512; i++)
-			set_bm((curr >> PAGE_SHIFT) + i, global_bm[cpuid],
-					BM_4K);
-
-		for (i = 0; i < num_inodes_per_page; i++) {
-			pi_addr = curr + i * NOVA_INODE_SIZE;
-			pi = nova_get_block(sb, pi_addr);
-			if (pi->valid) {
-				nova_recover_inode_pages(sb, &sih, ring,
-						pi_addr, global_bm[cpuid]);
-				nova_failure_update_inodetree(sb, pi,
-						&ino_low, &ino_high);
-				if (sih.i_size > max_size)
-					max_size = sih.i_size;
-			}
+/*
+ * Replace the placeholder of cpu's inode map with what the crawl found
+ * below bg_limit. Returns the number of inodes in use.
+ */
+static unsigned long nova_bg_merge_inode_tree(struct super_block *sb,
+	int cpu, bool crawled)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct inode_map *inode_map = &sbi->inode_maps[cpu];
+	struct rb_root *tree = &inode_map->inode_inuse_tree;
+	struct nova_range_node *curr;
+	struct rb_root found;
+	struct rb_node *temp;
+	unsigned long high;
+	unsigned long used = 0;
+
+	mutex_lock(&inode_map->inode_table_mutex);
+	found = inode_map->bg_inuse_tree;
+	inode_map->bg_inuse_tree = RB_ROOT;
+
+	if (crawled) {
+		/* Allocations only ever grow the placeholder upwards */
+		curr = container_of(rb_first(tree), struct nova_range_node,
+						node);
+		if (curr->range_high >= inode_map->bg_limit) {
+			curr->range_low = inode_map->bg_limit;
+		} else {
+			rb_erase(&curr->node, tree);
+			nova_free_inode_node(sb, curr);
 		}
 
-		if (ino_low && ino_high)
-			nova_failure_insert_inodetree(sb, ino_low, ino_high);
+		for (temp = rb_first(&found); temp; temp = rb_next(temp)) {
+			curr = container_of(temp, struct nova_range_node, node);
+			if (curr->range_low >= inode_map->bg_limit)
+				break;
+			high = min(curr->range_high, inode_map->bg_limit - 1);
+			__nova_insert_inode_range(sb, cpu, tree,
+						curr->range_low, high);
+		}
 	}
+	nova_destroy_range_node_tree(sb, &found);
 
-	/* Free radix tree */
-	if (max_size) {
-		last_blocknr = (max_size - 1) >> PAGE_SHIFT;
-		nova_delete_file_tree(sb, &sih, 0, last_blocknr, false, false);
+	inode_map->num_range_node_inode = 0;
+	for (temp = rb_first(tree); temp; temp = rb_next(temp)) {
+		curr = container_of(temp, struct nova_range_node, node);
+		used += curr->range_high - curr->range_low + 1;
+		inode_map->num_range_node_inode++;
 	}
+	inode_map->first_inode_range = container_of(rb_first(tree),
+					struct nova_range_node, node);
+	mutex_unlock(&inode_map->inode_table_mutex);
 
-	finished[cpuid] = 1;
-	wake_up_interruptible(&finish_wq);
-	do_exit(ret);
-	return ret;
+	return used;
 }
 
-static int nova_failure_recovery_crawl(struct super_block *sb)
+static void nova_finish_bg_recovery(struct super_block *sb, int crawl_ret)
 {
 	struct nova_sb_info *sbi = NOVA_SB(sb);
-	struct nova_inode_info_header sih;
-	struct inode_table *inode_table;
-	struct task_ring *ring;
-	unsigned long curr_addr;
-	u64 root_addr = NOVA_ROOT_INO_START;
-	u64 curr;
-	int ret = 0;
-	int cpuid;
-	int ring_id;
+	unsigned long *bitmap = NULL;
+	struct nova_range_node *curr;
+	struct rb_root deferred;
+	struct rb_node *temp;
+	unsigned long used = 0;
+	int ret;
+	int i;
 
-	ring_id = 0;
-	for (cpuid = 0; cpuid < sbi->cpus; cpuid++) {
-		inode_table = nova_get_inode_table(sb, cpuid);
-		if (!inode_table)
-			return -EINVAL;
+	if (crawl_ret == 0) {
+		bitmap = nova_fill_4K_map(sb);
+		nova_bg_remark_pinned(sb);
+	}
 
-		curr = inode_table->log_head;
-		while (curr) {
-			ring = &task_rings[ring_id];
-			if (ring->num >= 512) {
-				nova_err(sb, "%s: ring size too small\n",
-						__func__);
-				return -EINVAL;
-			}
+	/* From here on frees go straight to the free lists */
+	spin_lock(&sbi->bg_lock);
+	sbi->bg_recovery = 0;
+	deferred = sbi->bg_deferred_tree;
+	sbi->bg_deferred_tree = RB_ROOT;
+	kfree(sbi->bg_claimed);
+	sbi->bg_claimed = NULL;
+	spin_unlock(&sbi->bg_lock);
+
+	if (bitmap) {
+		ret = nova_bg_merge_free_space(sb, bitmap);
+		if (ret)
+			nova_err(sb, "%s: merge free space failed %d\n",
+					__func__, ret);
+	}
+
+	temp = rb_first(&deferred);
+	while (temp) {
+		curr = container_of(temp, struct nova_range_node, node);
+		temp = rb_next(temp);
+		ret = nova_bg_free_deferred(sb, bitmap, curr->range_low,
+						curr->range_high);
+		if (ret)
+			nova_err(sb, "%s: free %lu - %lu failed %d\n",
+					__func__, curr->range_low,
+					curr->range_high, ret);
+		rb_erase(&curr->node, &deferred);
+		nova_free_blocknode(sb, curr);
+	}
 
-			ring->addr[ring->num] = curr;
-			ring->num++;
+	for (i = 0; i < sbi->cpus; i++)
+		used += nova_bg_merge_inode_tree(sb, i, bitmap != NULL);
+	sbi->s_inodes_used_count = used;
 
-			ring_id = (ring_id + 1) % sbi->cpus;
+	nova_reset_alloc_hwm(sb, true);
+	nova_bg_unpin_inodes(sb);
+	free_bm(sb);
 
-			curr_addr = (unsigned long)nova_get_block(sb, curr);
-			/* Next page resides at the last 8 bytes */
-			curr_addr += 2097152 - 8;
-			curr = *(u64 *)(curr_addr);
-		}
+	if (sbi->ckpt_interval && !(sb->s_flags & MS_RDONLY)) {
+		ret = nova_start_checkpointer(sb);
+		if (ret)
+			nova_err(sb, "Start checkpointer failed %d, "
+					"checkpoints disabled\n", ret);
 	}
 
-	for (cpuid = 0; cpuid < sbi->cpus; cpuid++)
-		wake_up_process(threads[cpuid]);
+	nova_dbg("NOVA: Background recovery done, %lu inodes in use\n", used);
+	complete_all(&sbi->bg_done);
+}
 
-	nova_init_header(sb, &sih, 0);
-	/* Recover the root iode */
-	nova_recover_inode_pages(sb, &sih, &task_rings[0],
-					root_addr, global_bm[1]);
+static int nova_bg_recovery_func(void *data)
+{
+	struct super_block *sb = data;
+	int ret;
 
-	return ret;
+	ret = nova_failure_recovery(sb);
+	if (ret)
+		nova_err(sb, "Background recovery failed %d, blocks below "
+				"the high-water marks stay in use\n", ret);
+
+	nova_finish_bg_recovery(sb, ret);
+	return 0;
 }
 
-int nova_failure_recovery(struct super_block *sb)
+static int nova_start_bg_recovery(struct super_block *sb,
+	unsigned long initsize)
 {
 	struct nova_sb_info *sbi = NOVA_SB(sb);
-	struct task_ring *ring;
+	struct inode_table *inode_table;
+	struct free_list *free_list;
+	struct inode_map *inode_map;
+	struct nova_range_node *range_node;
+	struct task_struct *thread;
 	struct nova_inode *pi;
-	struct ptr_pair *pair;
+	unsigned long per_superpage;
+	unsigned long limit;
 	int ret;
 	int i;
 
-	sbi->s_inodes_used_count = 0;
+	/* Images written before the marks existed have zeroes here */
+	for (i = 0; i < sbi->cpus; i++) {
+		inode_table = nova_get_inode_table(sb, i);
+		if (!inode_table || le64_to_cpu(inode_table->alloc_hwm) == 0)
+			return -EINVAL;
+	}
 
-	/* Initialize inuse inode list */
-	if (nova_init_inode_inuse_list(sb) < 0)
-		return -EINVAL;
+	sbi->bg_claimed = kcalloc(sbi->cpus, sizeof(unsigned long),
+							GFP_KERNEL);
+	if (!sbi->bg_claimed)
+		return -ENOMEM;
 
-	/* Handle special inodes */
-	pi = nova_get_inode_by_ino(sb, NOVA_BLOCKNODE_INO);
-	pi->log_head = pi->log_tail = 0;
-	nova_flush_buffer(&pi->log_head, CACHELINE_SIZE, 0);
+	ret = alloc_bm(sb, initsize);
+	if (ret)
+		goto out;
 
 	for (i = 0; i < sbi->cpus; i++) {
-		pair = nova_get_journal_pointers(sb, i);
-		if (!pair)
-			return -EINVAL;
+		inode_table = nova_get_inode_table(sb, i);
+		free_list = nova_get_free_list(sb, i);
+		free_list->alloc_hwm = le64_to_cpu(inode_table->alloc_hwm);
 
-		set_bm(pair->journal_head >> PAGE_SHIFT, global_bm[i], BM_4K);
-	}
-	PERSISTENT_BARRIER();
+		limit = max(free_list->alloc_hwm, free_list->block_start);
+		if (i == 0)
+			limit = max(limit, sbi->reserved_blocks);
+		limit = min(limit, free_list->block_end + 1);
+		free_list->bg_limit = limit;
 
-	ret = allocate_resources(sb, sbi->cpus);
-	if (ret)
-		return ret;
+		if (limit > free_list->block_end)
+			continue;
+		ret = nova_insert_blocknode_map(sb, i, limit,
+						free_list->block_end);
+		if (ret)
+			goto out;
+	}
 
-	ret = nova_failure_recovery_crawl(sb);
+	/* Nothing in the shared list is known to be free yet */
+	free_list = nova_get_free_list(sb, SHARED_CPU);
+	free_list->bg_limit = free_list->block_end + 1;
 
-	wait_to_finish(sbi->cpus);
+	pi = nova_get_inode_by_ino(sb, NOVA_INODETABLE_INO);
+	per_superpage = 1UL << (blk_type_to_shift[pi->i_blk_type] -
+					NOVA_INODE_BITS);
 
+	sbi->s_inodes_used_count = 0;
 	for (i = 0; i < sbi->cpus; i++) {
-		ring = &task_rings[i];
-		sbi->s_inodes_used_count += ring->inodes_used_count;
+		inode_map = &sbi->inode_maps[i];
+		inode_map->bg_inuse_tree = RB_ROOT;
+		inode_map->bg_limit = inode_map->num_table_blocks *
+					per_superpage;
+
+		range_node = nova_alloc_inode_node(sb);
+		if (range_node == NULL) {
+			ret = -ENOMEM;
+			goto out;
+		}
+
+		range_node->range_low = 0;
+		range_node->range_high = inode_map->bg_limit - 1;
+		ret = nova_insert_inodetree(sbi, range_node, i);
+		if (ret) {
+			nova_free_inode_node(sb, range_node);
+			goto out;
+		}
+		inode_map->num_range_node_inode = 1;
+		inode_map->first_inode_range = range_node;
+		sbi->s_inodes_used_count += inode_map->bg_limit;
 	}
 
-	free_resources(sb);
+	sbi->bg_deferred_tree = RB_ROOT;
+	INIT_RADIX_TREE(&sbi->bg_pinned, GFP_ATOMIC);
+	init_completion(&sbi->bg_done);
+	sbi->bg_recovery = 1;
 
-	nova_dbg("Failure recovery total recovered %lu\n",
-				sbi->s_inodes_used_count);
+	thread = kthread_run(nova_bg_recovery_func, sb, "nova_bgrecovery");
+	if (IS_ERR(thread)) {
+		sbi->bg_recovery = 0;
+		ret = PTR_ERR(thread);
+		goto out;
+	}
+	sbi->bg_thread = thread;
+
+	return 0;
+
+out:
+	nova_reset_recovery_state(sb);
+	free_bm(sb);
+	kfree(sbi->bg_claimed);
+	sbi->bg_claimed = NULL;
 	return ret;
 }
 
+void nova_wait_bg_recovery(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+
+	if (sbi->bg_thread) {
+		wait_for_completion(&sbi->bg_done);
+		sbi->bg_thread = NULL;
+	}
+}
+
 /*********************** Recovery entrance *************************/
 
 int nova_recovery(struct super_block *sb)
@@ -1366,6 +2565,7 @@ int nova_recovery(struct super_block *sb)
 	struct nova_super_block *super = nova_get_super(sb);
 	unsigned long initsize = le64_to_cpu(super->s_size);
 	bool value = false;
+	bool background = false;
 	int ret = 0;
 	timing_t start, end;
 
@@ -1384,6 +2584,15 @@ int nova_recovery(struct super_block *sb)
 	value = nova_can_skip_full_scan(sb);
 	if (value) {
 		nova_dbg("NOVA: Normal shutdown\n");
+	} else if (nova_can_skip_crawl(sb)) {
+		nova_dbg("NOVA: Recovered from checkpoint\n");
+		value = true;
+	} else if (test_opt(sb, BGRECOVERY) && !(sb->s_flags & MS_RDONLY) &&
+			nova_start_bg_recovery(sb, initsize) == 0) {
+		nova_dbg("NOVA: Failure recovery in the background\n");
+		/* The recovery thread frees the bitmap */
+		value = true;
+		background = true;
 	} else {
 		nova_dbg("NOVA: Failure recovery\n");
 		ret = alloc_bm(sb, initsize);
@@ -1402,12 +2611,14 @@ out:
 	NOVA_END_TIMING(recovery_t, start);
 	if (measure_timing == 0) {
 		getrawmonotonic(&end);
-		Timingstats[recovery_t] +=
+		NOVA_ADD_TIMING(recovery_t,
 			(end.tv_sec - start.tv_sec) * 1000000000 +
-			(end.tv_nsec - start.tv_nsec);
+			(end.tv_nsec - start.tv_nsec));
 	}
 
 	if (!value)
 		free_bm(sb);
+	if (!background)
+		nova_reset_alloc_hwm(sb, ret == 0);
 	return ret;
 }
@@ -0,0 +1,805 @@
+/*
+ * NOVA allocator checkpoints
+ *
+ * Copyright 2015-2016 Regents of the University of California,
+ * UCSD Non-Volatile Systems Lab, Andiry Xu <jix024@cs.ucsd.edu>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * With the checkpoint=<seconds> mount option, a kernel thread saves the
+ * free lists and the inode maps to the log of NOVA_CHECKPOINT_INO every
+ * few seconds. Every allocation and free after that is appended to a
+ * redo log, one per free list and per inode map, under the lock that
+ * already orders it. After a crash, recovery loads the checkpoint and
+ * replays the redo logs instead of crawling every inode log, so mount
+ * time depends on allocator activity since the last checkpoint, not on
+ * the size of the file system.
+ *
+ * The checkpoint log is a list of nova_range_node_lowhigh records:
+ *
+ *	{ NOVA_CKPT_MAGIC, seq }, { gen, cpus }
+ *	per free list, then per inode map:
+ *		{ start lsn, nr ranges | nr magazine inos << 32 }
+ *		redo log page addresses, two per record
+ *		ranges
+ *		magazine inos, two per record
+ *
+ * Redo entries are made persistent before the allocator returns, so a
+ * valid prefix of each ring holds every operation since the checkpoint.
+ * Blocks or inodes allocated by operations that never committed stay
+ * allocated after such a recovery; they are in-flight operations only.
+ * If a ring is about to overwrite entries the checkpoint still needs,
+ * the checkpoint is invalidated first and a new one is requested. Without
+ * a valid checkpoint, recovery falls back to the full scan.
+ */
+
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/kthread.h>
+#include <linux/jhash.h>
+#include <linux/random.h>
+#include "nova.h"
+
+#define	NOVA_CKPT_MAGIC		0x4e4f5641434b5054ULL	/* "NOVACKPT" */
+#define	NOVA_REDO_TYPE_SHIFT	56
+#define	NOVA_REDO_LOW_MASK	((1ULL << NOVA_REDO_TYPE_SHIFT) - 1)
+
+struct nova_ckpt_snapshot {
+	u64		lsn;
+	unsigned long	nr_ranges;
+	struct nova_range_node_lowhigh *ranges;
+	int		nr_inos;
+	unsigned long	inos[INODE_MAGAZINE_SIZE];
+};
+
+/* Free lists first, the shared one last, then the inode maps */
+static inline int nova_redo_nr_logs(struct nova_sb_info *sbi)
+{
+	return sbi->cpus * 2 + 1;
+}
+
+static inline int nova_block_redo_log(struct nova_sb_info *sbi, int cpuid)
+{
+	return cpuid == SHARED_CPU ? sbi->cpus : cpuid;
+}
+
+static inline int nova_inode_redo_log(struct nova_sb_info *sbi, int map_id)
+{
+	return sbi->cpus + 1 + map_id;
+}
+
+static inline u64 nova_redo_csum(u32 gen, int id, u64 lsn, u64 type_low,
+	u64 high)
+{
+	u64 words[3] = { lsn, type_low, high };
+
+	return jhash2((u32 *)words, 6, gen ^ id);
+}
+
+static inline struct nova_redo_entry *nova_redo_slot(struct super_block *sb,
+	struct nova_redo_log *log, u64 lsn)
+{
+	unsigned long index = lsn % NOVA_REDO_ENTRIES;
+	struct nova_redo_entry *entry;
+
+	entry = nova_get_block(sb, log->pages[index / NOVA_REDO_PER_PAGE]);
+	return entry + index % NOVA_REDO_PER_PAGE;
+}
+
+/* Zero the checkpoint log head, recovery does a full scan until the next */
+void nova_invalidate_checkpoint(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_inode *pi = nova_get_inode_by_ino(sb, NOVA_CHECKPOINT_INO);
+
+	spin_lock(&sbi->ckpt_lock);
+	if (pi->log_head) {
+		pi->log_head = 0;
+		nova_flush_buffer(&pi->log_head, CACHELINE_SIZE, 1);
+	}
+	sbi->ckpt_valid = 0;
+	spin_unlock(&sbi->ckpt_lock);
+}
+
+/* Caller holds the lock that orders the operation on its list or map */
+static void nova_redo_append(struct super_block *sb, int id, int type,
+	unsigned long low, unsigned long high)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_redo_entry entry, *slot;
+	struct nova_redo_log *log;
+	u64 type_low;
+
+	log = &sbi->redo_logs[id];
+	type_low = ((u64)type << NOVA_REDO_TYPE_SHIFT) | low;
+
+	spin_lock(&log->lock);
+	if (!log->overflowed &&
+			log->next_lsn - log->retain_lsn >= NOVA_REDO_ENTRIES) {
+		/* This entry overwrites one the checkpoint needs */
+		log->overflowed = 1;
+		nova_invalidate_checkpoint(sb);
+		sbi->ckpt_requested = 1;
+		wake_up_interruptible(&sbi->ckpt_wait);
+	}
+
+	entry.lsn = cpu_to_le64(log->next_lsn);
+	entry.type_low = cpu_to_le64(type_low);
+	entry.range_high = cpu_to_le64(high);
+	entry.csum = cpu_to_le64(nova_redo_csum(sbi->ckpt_gen, id,
+					log->next_lsn, type_low, high));
+
+	slot = nova_redo_slot(sb, log, log->next_lsn);
+	memcpy(slot, &entry, sizeof(entry));
+	nova_flush_buffer(slot, sizeof(entry), 1);
+	NOVA_WA_ADD(wa_journal, sizeof(entry));
+	log->next_lsn++;
+	NOVA_STATS_ADD(redo_entries, 1);
+	spin_unlock(&log->lock);
+}
+
+void nova_redo_log_blocks(struct super_block *sb, int cpuid, int type,
+	unsigned long low, unsigned long high)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+
+	if (!sbi->redo_logs)
+		return;
+
+	nova_redo_append(sb, nova_block_redo_log(sbi, cpuid), type, low, high);
+}
+
+void nova_redo_log_inode(struct super_block *sb, int type, unsigned long ino)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+
+	if (!sbi->redo_logs)
+		return;
+
+	nova_redo_append(sb, nova_inode_redo_log(sbi, ino % sbi->cpus),
+				type, ino, ino);
+}
+
+/******************** Taking a checkpoint ********************/
+
+/* Called with the list or map locked, so lsn matches the snapshot */
+static void nova_snapshot_lsn(struct nova_sb_info *sbi,
+	struct nova_redo_log *log, struct nova_ckpt_snapshot *snap)
+{
+	spin_lock(&log->lock);
+	snap->lsn = log->next_lsn;
+	/* With no valid checkpoint only this snapshot needs the ring */
+	if (!sbi->ckpt_valid) {
+		log->retain_lsn = snap->lsn;
+		log->overflowed = 0;
+	}
+	spin_unlock(&log->lock);
+}
+
+static int nova_snapshot_free_list(struct super_block *sb, int cpuid,
+	struct nova_ckpt_snapshot *snap)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct free_list *free_list = nova_get_free_list(sb, cpuid);
+	struct nova_redo_log *log;
+	struct nova_range_node *curr;
+	struct rb_node *temp;
+	unsigned long max, n;
+
+	log = &sbi->redo_logs[nova_block_redo_log(sbi, cpuid)];
+	max = free_list->num_blocknode + 16;
+retry:
+	snap->ranges = vmalloc(max * sizeof(struct nova_range_node_lowhigh));
+	if (!snap->ranges)
+		return -ENOMEM;
+
+	spin_lock(&free_list->s_lock);
+	n = 0;
+	temp = rb_first(&free_list->block_free_tree);
+	while (temp && n < max) {
+		curr = container_of(temp, struct nova_range_node, node);
+		snap->ranges[n].range_low = cpu_to_le64(curr->range_low);
+		snap->ranges[n].range_high = cpu_to_le64(curr->range_high);
+		n++;
+		temp = rb_next(temp);
+	}
+
+	if (temp) {
+		/* The list grew since we sized the buffer */
+		max *= 2;
+		spin_unlock(&free_list->s_lock);
+		vfree(snap->ranges);
+		goto retry;
+	}
+
+	nova_snapshot_lsn(sbi, log, snap);
+	spin_unlock(&free_list->s_lock);
+
+	snap->nr_ranges = n;
+	snap->nr_inos = 0;
+	return 0;
+}
+
+/*
+ * Every logged inode operation holds either inode_table_mutex or
+ * magazine_lock. Holding the mutex keeps the tree still, and the
+ * magazine and lsn are read together under magazine_lock.
+ */
+static int nova_snapshot_inode_map(struct super_block *sb, int map_id,
+	struct nova_ckpt_snapshot *snap)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct inode_map *inode_map = &sbi->inode_maps[map_id];
+	struct nova_redo_log *log;
+	struct nova_range_node *curr;
+	struct rb_node *temp;
+	unsigned long max, n = 0;
+	int ret = 0;
+
+	log = &sbi->redo_logs[nova_inode_redo_log(sbi, map_id)];
+
+	mutex_lock(&inode_map->inode_table_mutex);
+	max = inode_map->num_range_node_inode + 16;
+	snap->ranges = vmalloc(max * sizeof(struct nova_range_node_lowhigh));
+	if (!snap->ranges) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	temp = rb_first(&inode_map->inode_inuse_tree);
+	while (temp) {
+		if (n == max) {
+			nova_err(sb, "%s: map %d has more than %lu ranges\n",
+					__func__, map_id, max);
+			ret = -EINVAL;
+			goto out;
+		}
+		curr = container_of(temp, struct nova_range_node, node);
+		snap->ranges[n].range_low = cpu_to_le64(curr->range_low);
+		snap->ranges[n].range_high = cpu_to_le64(curr->range_high);
+		n++;
+		temp = rb_next(temp);
+	}
+	snap->nr_ranges = n;
+
+	spin_lock(&inode_map->magazine_lock);
+	snap->nr_inos = inode_map->magazine_count;
+	memcpy(snap->inos, inode_map->magazine,
+			snap->nr_inos * sizeof(unsigned long));
+	nova_snapshot_lsn(sbi, log, snap);
+	spin_unlock(&inode_map->magazine_lock);
+
+out:
+	mutex_unlock(&inode_map->inode_table_mutex);
+	return ret;
+}
+
+static u64 nova_ckpt_append(struct super_block *sb, u64 tail, u64 a, u64 b)
+{
+	struct nova_range_node_lowhigh *entry;
+	size_t size = sizeof(struct nova_range_node_lowhigh);
+
+	if (is_last_entry(tail, size))
+		tail = next_log_page(sb, tail);
+
+	entry = (struct nova_range_node_lowhigh *)nova_get_block(sb, tail);
+	entry->range_low = cpu_to_le64(a);
+	entry->range_high = cpu_to_le64(b);
+	nova_flush_buffer(entry, size, 0);
+
+	return tail + size;
+}
+
+static u64 nova_ckpt_write_log(struct super_block *sb, u64 tail,
+	struct nova_redo_log *log, struct nova_ckpt_snapshot *snap)
+{
+	unsigned long i;
+
+	tail = nova_ckpt_append(sb, tail, snap->lsn,
+			snap->nr_ranges | ((u64)snap->nr_inos << 32));
+
+	for (i = 0; i < NOVA_REDO_PAGES; i += 2)
+		tail = nova_ckpt_append(sb, tail, log->pages[i],
+						log->pages[i + 1]);
+
+	for (i = 0; i < snap->nr_ranges; i++)
+		tail = nova_ckpt_append(sb, tail,
+				le64_to_cpu(snap->ranges[i].range_low),
+				le64_to_cpu(snap->ranges[i].range_high));
+
+	for (i = 0; i < snap->nr_inos; i += 2)
+		tail = nova_ckpt_append(sb, tail, snap->inos[i],
+				i + 1 < snap->nr_inos ? snap->inos[i + 1] : 0);
+
+	return tail;
+}
+
+static int nova_write_checkpoint(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_inode *pi = nova_get_inode_by_ino(sb, NOVA_CHECKPOINT_INO);
+	struct nova_ckpt_snapshot *snaps;
+	struct nova_redo_log *log;
+	unsigned long records = 2;
+	unsigned long num_pages;
+	u64 new_head = 0, old_head, tail;
+	int nr_logs = nova_redo_nr_logs(sbi);
+	int allocated;
+	int i;
+	int ret = 0;
+	timing_t ckpt_time;
+
+	snaps = vzalloc(nr_logs * sizeof(struct nova_ckpt_snapshot));
+	if (!snaps)
+		return -ENOMEM;
+
+	NOVA_START_TIMING(checkpoint_t, ckpt_time);
+
+	for (i = 0; i < sbi->cpus && ret == 0; i++)
+		ret = nova_snapshot_free_list(sb, i, &snaps[i]);
+	if (ret == 0)
+		ret = nova_snapshot_free_list(sb, SHARED_CPU,
+					&snaps[sbi->cpus]);
+	for (i = 0; i < sbi->cpus && ret == 0; i++)
+		ret = nova_snapshot_inode_map(sb, i,
+				&snaps[nova_inode_redo_log(sbi, i)]);
+	if (ret)
+		goto out;
+
+	for (i = 0; i < nr_logs; i++)
+		records += 1 + NOVA_REDO_PAGES / 2 + snaps[i].nr_ranges +
+				DIV_ROUND_UP(snaps[i].nr_inos, 2);
+
+	num_pages = DIV_ROUND_UP(records, RANGENODE_PER_PAGE);
+	allocated = nova_allocate_inode_log_pages(sb, pi, num_pages,
+						&new_head);
+	if (allocated != num_pages) {
+		nova_dbg("Error saving checkpoint: %d\n", allocated);
+		ret = -ENOSPC;
+		goto out;
+	}
+
+	tail = nova_ckpt_append(sb, new_head, NOVA_CKPT_MAGIC, sbi->ckpt_seq);
+	tail = nova_ckpt_append(sb, tail, sbi->ckpt_gen, sbi->cpus);
+	for (i = 0; i < nr_logs; i++)
+		tail = nova_ckpt_write_log(sb, tail, &sbi->redo_logs[i],
+						&snaps[i]);
+
+	/*
+	 * Commit. A ring that overflowed since the snapshots may have
+	 * lost entries this checkpoint needs. Appenders mark the ring
+	 * before they take ckpt_lock to invalidate, so either we see the
+	 * mark here or they invalidate after us.
+	 */
+	spin_lock(&sbi->ckpt_lock);
+	for (i = 0; i < nr_logs; i++) {
+		if (READ_ONCE(sbi->redo_logs[i].overflowed))
+			break;
+	}
+
+	if (i < nr_logs) {
+		spin_unlock(&sbi->ckpt_lock);
+		nova_dbg("%s: redo log %d overflowed, retry\n", __func__, i);
+		nova_free_contiguous_log_blocks(sb, pi, new_head);
+		sbi->ckpt_requested = 1;
+		ret = -EAGAIN;
+		goto out;
+	}
+
+	PERSISTENT_BARRIER();
+	pi->log_head = 0;
+	nova_flush_buffer(&pi->log_head, CACHELINE_SIZE, 1);
+	pi->log_tail = tail;
+	nova_flush_buffer(&pi->log_tail, CACHELINE_SIZE, 1);
+	pi->log_head = new_head;
+	nova_flush_buffer(&pi->log_head, CACHELINE_SIZE, 1);
+	sbi->ckpt_valid = 1;
+	old_head = sbi->ckpt_head;
+	sbi->ckpt_head = new_head;
+	spin_unlock(&sbi->ckpt_lock);
+
+	for (i = 0; i < nr_logs; i++) {
+		log = &sbi->redo_logs[i];
+		spin_lock(&log->lock);
+		log->retain_lsn = snaps[i].lsn;
+		log->overflowed = 0;
+		spin_unlock(&log->lock);
+	}
+
+	if (old_head)
+		nova_free_contiguous_log_blocks(sb, pi, old_head);
+
+	nova_dbgv("%s: checkpoint %llu, %lu records, head 0x%llx\n",
+			__func__, sbi->ckpt_seq, records, new_head);
+	sbi->ckpt_seq++;
+
+out:
+	NOVA_END_TIMING(checkpoint_t, ckpt_time);
+	for (i = 0; i < nr_logs; i++)
+		vfree(snaps[i].ranges);
+	vfree(snaps);
+	return ret;
+}
+
+static int nova_checkpoint_thread(void *data)
+{
+	struct super_block *sb = data;
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+
+	while (!kthread_should_stop()) {
+		wait_event_interruptible_timeout(sbi->ckpt_wait,
+				sbi->ckpt_requested || kthread_should_stop(),
+				sbi->ckpt_interval * HZ);
+		if (kthread_should_stop())
+			break;
+
+		sbi->ckpt_requested = 0;
+		nova_write_checkpoint(sb);
+	}
+
+	return 0;
+}
+
+static void nova_free_redo_pages(struct super_block *sb,
+	struct nova_redo_log *log)
+{
+	struct nova_inode *pi = nova_get_inode_by_ino(sb, NOVA_CHECKPOINT_INO);
+	int i;
+
+	for (i = 0; i < NOVA_REDO_PAGES; i++) {
+		if (log->pages[i] == 0)
+			continue;
+		nova_free_log_blocks(sb, pi, nova_get_blocknr(sb,
+				log->pages[i], NOVA_BLOCK_TYPE_4K), 1);
+		log->pages[i] = 0;
+	}
+}
+
+static int nova_alloc_redo_pages(struct super_block *sb,
+	struct nova_redo_log *log)
+{
+	struct nova_inode *pi = nova_get_inode_by_ino(sb, NOVA_CHECKPOINT_INO);
+	unsigned long blocknr;
+	int allocated;
+	int i, j;
+
+	for (i = 0; i < NOVA_REDO_PAGES; i += allocated) {
+		allocated = nova_new_log_blocks(sb, pi, &blocknr,
+					NOVA_REDO_PAGES - i, 1);
+		if (allocated <= 0)
+			return -ENOSPC;
+
+		for (j = 0; j < allocated; j++)
+			log->pages[i + j] = nova_get_block_off(sb,
+					blocknr + j, NOVA_BLOCK_TYPE_4K);
+	}
+
+	return 0;
+}
+
+/*
+ * Redo pages are allocated before logging starts, so the first
+ * checkpoint, taken right away, already counts them as in use.
+ */
+int nova_start_checkpointer(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_redo_log *logs;
+	struct task_struct *thread;
+	int nr_logs = nova_redo_nr_logs(sbi);
+	int ret = 0;
+	int i;
+
+	logs = kcalloc(nr_logs, sizeof(struct nova_redo_log), GFP_KERNEL);
+	if (!logs)
+		return -ENOMEM;
+
+	for (i = 0; i < nr_logs && ret == 0; i++) {
+		spin_lock_init(&logs[i].lock);
+		ret = nova_alloc_redo_pages(sb, &logs[i]);
+	}
+	if (ret)
+		goto fail;
+
+	get_random_bytes(&sbi->ckpt_gen, sizeof(u32));
+	sbi->ckpt_valid = 0;
+	sbi->ckpt_head = 0;
+	sbi->ckpt_requested = 1;
+	sbi->redo_logs = logs;
+
+	thread = kthread_run(nova_checkpoint_thread, sb, "nova_ckpt");
+	if (IS_ERR(thread)) {
+		ret = PTR_ERR(thread);
+		sbi->redo_logs = NULL;
+		goto fail;
+	}
+
+	sbi->ckpt_thread = thread;
+	nova_info("NOVA: checkpoint every %u seconds\n", sbi->ckpt_interval);
+	return 0;
+
+fail:
+	for (i = 0; i < nr_logs; i++)
+		nova_free_redo_pages(sb, &logs[i]);
+	kfree(logs);
+	return ret;
+}
+
+/* A clean unmount saves the allocator state itself */
+void nova_stop_checkpointer(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_inode *pi = nova_get_inode_by_ino(sb, NOVA_CHECKPOINT_INO);
+	struct nova_redo_log *logs = sbi->redo_logs;
+	int i;
+
+	if (!logs)
+		return;
+
+	kthread_stop(sbi->ckpt_thread);
+	sbi->ckpt_thread = NULL;
+
+	nova_invalidate_checkpoint(sb);
+	pi->log_tail = 0;
+	nova_flush_buffer(&pi->log_tail, CACHELINE_SIZE, 1);
+
+	sbi->redo_logs = NULL;
+	if (sbi->ckpt_head)
+		nova_free_contiguous_log_blocks(sb, pi, sbi->ckpt_head);
+	sbi->ckpt_head = 0;
+
+	for (i = 0; i < nova_redo_nr_logs(sbi); i++)
+		nova_free_redo_pages(sb, &logs[i]);
+	kfree(logs);
+}
+
+/******************** Recovery ********************/
+
+static u64 nova_ckpt_read(struct super_block *sb, u64 curr_p, u64 tail,
+	u64 *a, u64 *b)
+{
+	struct nova_range_node_lowhigh *entry;
+	size_t size = sizeof(struct nova_range_node_lowhigh);
+
+	if (curr_p == 0 || curr_p == tail)
+		return 0;
+
+	if (is_last_entry(curr_p, size))
+		curr_p = next_log_page(sb, curr_p);
+	if (curr_p == 0)
+		return 0;
+
+	entry = (struct nova_range_node_lowhigh *)nova_get_block(sb, curr_p);
+	*a = le64_to_cpu(entry->range_low);
+	*b = le64_to_cpu(entry->range_high);
+
+	return curr_p + size;
+}
+
+static int nova_ckpt_insert_inode_range(struct super_block *sb, int map_id,
+	unsigned long low, unsigned long high)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct inode_map *inode_map = &sbi->inode_maps[map_id];
+	struct nova_range_node *range_node;
+	int ret;
+
+	range_node = nova_alloc_inode_node(sb);
+	if (range_node == NULL)
+		return -ENOMEM;
+
+	range_node->range_low = low;
+	range_node->range_high = high;
+	ret = nova_insert_inodetree(sbi, range_node, map_id);
+	if (ret) {
+		nova_free_inode_node(sb, range_node);
+		return ret;
+	}
+
+	inode_map->num_range_node_inode++;
+	sbi->s_inodes_used_count += high - low + 1;
+	return 0;
+}
+
+/* Load one list or map from the checkpoint into the DRAM structures */
+static u64 nova_ckpt_load_log(struct super_block *sb, u64 curr_p, u64 tail,
+	int id, struct nova_redo_log *log)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	unsigned long nr_ranges, nr_inos;
+	unsigned long i;
+	u64 counts, a, b;
+	int map_id = id - sbi->cpus - 1;
+	int ret;
+
+	curr_p = nova_ckpt_read(sb, curr_p, tail, &log->next_lsn, &counts);
+	if (curr_p == 0)
+		return 0;
+
+	nr_ranges = counts & 0xffffffff;
+	nr_inos = counts >> 32;
+	if (nr_inos > INODE_MAGAZINE_SIZE)
+		return 0;
+
+	for (i = 0; i < NOVA_REDO_PAGES && curr_p; i += 2)
+		curr_p = nova_ckpt_read(sb, curr_p, tail, &log->pages[i],
+					&log->pages[i + 1]);
+
+	for (i = 0; i < nr_ranges && curr_p; i++) {
+		curr_p = nova_ckpt_read(sb, curr_p, tail, &a, &b);
+		if (curr_p == 0)
+			break;
+
+		if (id < sbi->cpus)
+			ret = nova_insert_blocknode_map(sb, id, a, b);
+		else if (id == sbi->cpus)
+			ret = nova_insert_blocknode_map(sb, SHARED_CPU, a, b);
+		else
+			ret = nova_ckpt_insert_inode_range(sb, map_id, a, b);
+		if (ret)
+			return 0;
+	}
+
+	/* Magazine inodes are free, though in use in the saved tree */
+	for (i = 0; i < nr_inos && curr_p; i += 2) {
+		curr_p = nova_ckpt_read(sb, curr_p, tail, &a, &b);
+		if (curr_p == 0)
+			break;
+
+		if (nova_redo_free_inode(sb, a))
+			return 0;
+		if (i + 1 < nr_inos && nova_redo_free_inode(sb, b))
+			return 0;
+	}
+
+	return curr_p;
+}
+
+/* Apply the valid prefix of one redo ring, return entries replayed */
+static unsigned long nova_replay_redo_log(struct super_block *sb, int id,
+	struct nova_redo_log *log, u32 gen)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_redo_entry *entry;
+	unsigned long count;
+	unsigned long low, high;
+	u64 lsn = log->next_lsn;
+	u64 type_low;
+	int type;
+	int ret;
+
+	for (count = 0; count < NOVA_REDO_ENTRIES; count++, lsn++) {
+		entry = nova_redo_slot(sb, log, lsn);
+		type_low = le64_to_cpu(entry->type_low);
+		high = le64_to_cpu(entry->range_high);
+		if (le64_to_cpu(entry->lsn) != lsn ||
+				le64_to_cpu(entry->csum) !=
+				nova_redo_csum(gen, id, lsn, type_low, high))
+			break;
+
+		type = type_low >> NOVA_REDO_TYPE_SHIFT;
+		low = type_low & NOVA_REDO_LOW_MASK;
+
+		switch (type) {
+		case NOVA_REDO_ALLOC_BLOCKS:
+			ret = nova_redo_block_range(sb, low, high, 1);
+			break;
+		case NOVA_REDO_FREE_BLOCKS:
+			ret = nova_redo_block_range(sb, low, high, 0);
+			break;
+		case NOVA_REDO_ALLOC_INODE:
+			ret = nova_failure_insert_inodetree(sb, low, low);
+			if (ret == 0)
+				sbi->s_inodes_used_count++;
+			break;
+		case NOVA_REDO_FREE_INODE:
+			ret = nova_redo_free_inode(sb, low);
+			break;
+		default:
+			ret = -EINVAL;
+			break;
+		}
+
+		/* Entries only order ops, a lost free just leaks the range */
+		if (ret)
+			nova_dbg("%s: log %d lsn %llu type %d %lu - %lu: %d\n",
+				__func__, id, lsn, type, low, high, ret);
+	}
+
+	return count;
+}
+
+/*
+ * Rebuild the free lists and inode maps from the checkpoint and the redo
+ * logs. Returns -ENOENT if there is no checkpoint. On other errors the
+ * caller throws away what was loaded and does a full scan.
+ */
+int nova_recover_from_checkpoint(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_inode *pi = nova_get_inode_by_ino(sb, NOVA_CHECKPOINT_INO);
+	struct nova_redo_log *logs;
+	struct free_list *free_list;
+	struct inode_map *inode_map;
+	struct rb_node *temp;
+	unsigned long replayed = 0;
+	int nr_logs = nova_redo_nr_logs(sbi);
+	u64 curr_p, tail;
+	u64 magic, seq, gen, cpus;
+	int ret = 0;
+	int i;
+
+	curr_p = pi->log_head;
+	tail = pi->log_tail;
+	if (curr_p == 0 || tail == 0)
+		return -ENOENT;
+
+	logs = kcalloc(nr_logs, sizeof(struct nova_redo_log), GFP_KERNEL);
+	if (!logs)
+		return -ENOMEM;
+
+	sbi->s_inodes_used_count = 0;
+
+	curr_p = nova_ckpt_read(sb, curr_p, tail, &magic, &seq);
+	curr_p = nova_ckpt_read(sb, curr_p, tail, &gen, &cpus);
+	if (curr_p == 0 || magic != NOVA_CKPT_MAGIC || cpus != sbi->cpus) {
+		nova_err(sb, "%s: bad checkpoint header\n", __func__);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	for (i = 0; i < nr_logs; i++) {
+		curr_p = nova_ckpt_load_log(sb, curr_p, tail, i, &logs[i]);
+		if (curr_p == 0) {
+			nova_err(sb, "%s: bad checkpoint log %d\n",
+					__func__, i);
+			ret = -EINVAL;
+			goto out;
+		}
+	}
+
+	for (i = 0; i < nr_logs; i++)
+		replayed += nova_replay_redo_log(sb, i, &logs[i], gen);
+
+	for (i = 0; i <= sbi->cpus; i++) {
+		free_list = nova_get_free_list(sb, i < sbi->cpus ?
+							i : SHARED_CPU);
+		temp = rb_first(&free_list->block_free_tree);
+		free_list->first_node = temp ?
+			container_of(temp, struct nova_range_node, node) : NULL;
+	}
+
+	for (i = 0; i < sbi->cpus; i++) {
+		inode_map = &sbi->inode_maps[i];
+		temp = rb_first(&inode_map->inode_inuse_tree);
+		inode_map->first_inode_range = temp ?
+			container_of(temp, struct nova_range_node, node) : NULL;
+	}
+
+	/* The checkpoint and its rings are done, a new mount makes new ones */
+	nova_free_inode_log(sb, pi);
+	for (i = 0; i < nr_logs; i++)
+		nova_free_redo_pages(sb, &logs[i]);
+	sbi->ckpt_seq = seq + 1;
+
+	nova_dbg("%s: checkpoint %llu, replayed %lu redo entries, "
+		"%lu inodes in use\n", __func__, seq, replayed,
+		sbi->s_inodes_used_count);
+out:
+	kfree(logs);
+	return ret;
+}
@@ -97,6 +97,11 @@ do_dax_mapping_read(struct file *filp, char __user *buf,
 			nr = PAGE_SIZE;
 		}
 
+		if (nova_entry_unwritten(entry)) {
+			zero = 1;
+			goto memcpy;
+		}
+
 		nvmm = get_nvmm(sb, sih, entry, index);
 		dax_mem = nova_get_block(sb, (nvmm << PAGE_SHIFT));
 
@@ -133,7 +138,7 @@ out:
 	if (filp)
 		file_accessed(filp);
 
-	read_bytes += copied;
+	NOVA_STATS_ADD(read_bytes, copied);
 	nova_dbgv("%s returned %zu\n", __func__, copied);
 	return (copied ? copied : error);
 }
@@ -147,13 +152,18 @@ ssize_t nova_dax_file_read(struct file *filp, char __user *buf,
 			    size_t len, loff_t *ppos)
 {
 	ssize_t res;
+	struct inode *inode = filp->f_mapping->host;
+	loff_t pos = *ppos;
+	u64 trace_start = NOVA_TRACE_START(nova_read_exit);
 	timing_t dax_read_time;
 
+	trace_nova_read_enter(inode, pos, len);
 	NOVA_START_TIMING(dax_read_t, dax_read_time);
 //	rcu_read_lock();
 	res = do_dax_mapping_read(filp, buf, len, ppos);
 //	rcu_read_unlock();
 	NOVA_END_TIMING(dax_read_t, dax_read_time);
+	trace_nova_read_exit(inode, pos, res, 0, trace_start);
 	return res;
 }
 
@@ -209,7 +219,7 @@ static void nova_handle_head_tail_blocks(struct super_block *sb,
 				offset, start_blk, kmem);
 	if (offset != 0) {
 		entry = nova_get_write_entry(sb, si, start_blk);
-		if (entry == NULL) {
+		if (entry == NULL || nova_entry_unwritten(entry)) {
 			/* Fill zero */
 		    	memset(kmem, 0, offset);
 		} else {
@@ -218,6 +228,7 @@ static void nova_handle_head_tail_blocks(struct super_block *sb,
 					offset, kmem, false);
 		}
 		nova_flush_buffer(kmem, offset, 0);
+		NOVA_WA_ADD(wa_data, offset);
 	}
 
 	kmem = (void *)((char *)kmem +
@@ -227,7 +238,7 @@ static void nova_handle_head_tail_blocks(struct super_block *sb,
 				eblk_offset, end_blk, kmem);
 	if (eblk_offset != 0) {
 		entry = nova_get_write_entry(sb, si, end_blk);
-		if (entry == NULL) {
+		if (entry == NULL || nova_entry_unwritten(entry)) {
 			/* Fill zero */
 		    	memset(kmem + eblk_offset, 0,
 					sb->s_blocksize - eblk_offset);
@@ -238,6 +249,7 @@ static void nova_handle_head_tail_blocks(struct super_block *sb,
 		}
 		nova_flush_buffer(kmem + eblk_offset,
 					sb->s_blocksize - eblk_offset, 0);
+		NOVA_WA_ADD(wa_data, sb->s_blocksize - eblk_offset);
 	}
 
 	NOVA_END_TIMING(partial_block_t, partial_time);
@@ -250,6 +262,7 @@ int nova_reassign_file_tree(struct super_block *sb,
 	struct nova_file_write_entry *entry_data;
 	u64 curr_p = begin_tail;
 	size_t entry_size = sizeof(struct nova_file_write_entry);
+	int freed;
 
 	while (curr_p != pi->log_tail) {
 		if (is_last_entry(curr_p, entry_size))
@@ -271,6 +284,15 @@ int nova_reassign_file_tree(struct super_block *sb,
 			continue;
 		}
 
+		if (nova_entry_hole(entry_data)) {
+			freed = nova_delete_file_tree(sb, sih,
+					entry_data->pgoff, entry_data->pgoff +
+					entry_data->num_pages - 1, true, false);
+			pi->i_blocks -= freed;
+			curr_p += entry_size;
+			continue;
+		}
+
 		nova_assign_write_entry(sb, pi, sih, entry_data, true);
 		curr_p += entry_size;
 	}
@@ -292,7 +314,7 @@ ssize_t nova_cow_file_write(struct file *filp,
 	loff_t pos;
 	size_t count, offset, copied, ret;
 	unsigned long start_blk, num_blocks;
-	unsigned long total_blocks;
+	unsigned long total_blocks = 0;
 	unsigned long blocknr = 0;
 	unsigned int data_bits;
 	int allocated;
@@ -303,12 +325,18 @@ ssize_t nova_cow_file_write(struct file *filp,
 	timing_t cow_write_time, memcpy_time;
 	unsigned long step = 0;
 	u64 temp_tail, begin_tail = 0;
+	u64 trace_start;
+	loff_t trace_pos;
 	u32 time;
 
 	if (len == 0)
 		return 0;
 
+	trace_start = NOVA_TRACE_START(nova_write_exit);
+	trace_pos = *ppos;
+	trace_nova_write_enter(inode, trace_pos, len);
 	NOVA_START_TIMING(cow_write_t, cow_write_time);
+	NOVA_WA_BEGIN(wa_write);
 
 	sb_start_write(inode->i_sb);
 	if (need_mutex)
@@ -322,6 +350,7 @@ ssize_t nova_cow_file_write(struct file *filp,
 
 	if (filp->f_flags & O_APPEND)
 		pos = i_size_read(inode);
+	trace_pos = pos;
 
 	count = len;
 
@@ -378,6 +407,8 @@ ssize_t nova_cow_file_write(struct file *filp,
 		copied = bytes - memcpy_to_pmem_nocache(kmem + offset,
 						buf, bytes);
 		NOVA_END_TIMING(memcpy_w_nvmm_t, memcpy_time);
+		NOVA_WA_ADD(wa_user, copied);
+		NOVA_WA_ADD(wa_data, copied);
 
 		entry_data.pgoff = cpu_to_le64(start_blk);
 		entry_data.num_pages = cpu_to_le32(allocated);
@@ -440,7 +471,7 @@ ssize_t nova_cow_file_write(struct file *filp,
 	inode->i_blocks = le64_to_cpu(pi->i_blocks);
 
 	ret = written;
-	write_breaks += step;
+	NOVA_STATS_ADD(write_breaks, step);
 	nova_dbgv("blocks: %lu, %llu\n", inode->i_blocks, pi->i_blocks);
 
 	*ppos = pos;
@@ -453,8 +484,203 @@ out:
 	if (need_mutex)
 		mutex_unlock(&inode->i_mutex);
 	sb_end_write(inode->i_sb);
+	NOVA_WA_END(wa_write);
 	NOVA_END_TIMING(cow_write_t, cow_write_time);
-	cow_write_bytes += written;
+	NOVA_STATS_ADD(cow_write_bytes, written);
+	trace_nova_write_exit(inode, trace_pos, ret, total_blocks,
+				trace_start);
+	return ret;
+}
+
+/* Pages of a single extent move */
+#define	NOVA_DEFRAG_CHUNK		512
+
+/* Physical runs in [pgoff, pgoff + num), all of which are mapped */
+static unsigned long nova_defrag_count_runs(struct super_block *sb,
+	struct nova_inode_info_header *sih, unsigned long pgoff,
+	unsigned long num)
+{
+	struct nova_file_write_entry *entry;
+	unsigned long nvmm, last_nvmm = 0;
+	unsigned long i, runs = 0;
+
+	for (i = 0; i < num; i++) {
+		entry = radix_tree_lookup(&sih->tree, pgoff + i);
+		nvmm = get_nvmm(sb, sih, entry, pgoff + i);
+		if (i == 0 || nvmm != last_nvmm + 1)
+			runs++;
+		last_nvmm = nvmm;
+	}
+
+	return runs;
+}
+
+/*
+ * Preallocated pages have no data to move, and moving a shared page
+ * would unshare it.
+ */
+static inline bool nova_defrag_movable(struct super_block *sb,
+	struct nova_inode_info_header *sih, unsigned long pgoff)
+{
+	struct nova_file_write_entry *entry;
+
+	entry = radix_tree_lookup(&sih->tree, pgoff);
+	return entry && !nova_entry_unwritten(entry) &&
+		!nova_block_shared(sb, get_nvmm(sb, sih, entry, pgoff));
+}
+
+/*
+ * Copy [pgoff, pgoff + num) to new contiguous blocks and commit them
+ * with a write entry, like a COW write of the same data. The old blocks
+ * are freed once the new entry is in the log. Returns the pages looked
+ * at, which may be fewer than num if the allocation came up short.
+ */
+static int nova_defrag_move(struct super_block *sb, struct inode *inode,
+	struct nova_inode *pi, struct nova_inode_info_header *sih,
+	unsigned long pgoff, unsigned long num, unsigned long *moved)
+{
+	struct nova_file_write_entry entry_data;
+	struct nova_file_write_entry *entry;
+	unsigned long blocknr = 0;
+	unsigned long nvmm;
+	unsigned int data_bits;
+	u64 curr_entry;
+	void *kmem;
+	int allocated;
+	int i, ret;
+
+	allocated = nova_new_data_blocks(sb, pi, &blocknr, num, pgoff, 0, 1);
+	if (allocated <= 0)
+		return allocated ? allocated : -ENOSPC;
+
+	/* A short allocation may not improve on what is there */
+	if (allocated < 2 ||
+			nova_defrag_count_runs(sb, sih, pgoff, allocated) < 2) {
+		nova_free_data_blocks(sb, pi, blocknr, allocated);
+		return allocated;
+	}
+
+	kmem = nova_get_block(sb, nova_get_block_off(sb, blocknr,
+						pi->i_blk_type));
+	for (i = 0; i < allocated; i++) {
+		entry = radix_tree_lookup(&sih->tree, pgoff + i);
+		nvmm = get_nvmm(sb, sih, entry, pgoff + i);
+		memcpy_to_pmem_nocache(kmem + ((unsigned long)i << PAGE_SHIFT),
+				nova_get_block(sb, nvmm << PAGE_SHIFT),
+				PAGE_SIZE);
+	}
+	NOVA_WA_ADD(wa_data, (unsigned long)allocated << PAGE_SHIFT);
+
+	entry_data.pgoff = cpu_to_le64(pgoff);
+	entry_data.num_pages = cpu_to_le32(allocated);
+	entry_data.invalid_pages = 0;
+	entry_data.block = cpu_to_le64(nova_get_block_off(sb, blocknr,
+							pi->i_blk_type));
+	/* Moving data is not a modification */
+	entry_data.mtime = cpu_to_le32(inode->i_mtime.tv_sec);
+	nova_set_entry_type((void *)&entry_data, FILE_WRITE);
+	entry_data.size = cpu_to_le64(inode->i_size);
+
+	curr_entry = nova_append_file_write_entry(sb, pi, inode,
+						&entry_data, pi->log_tail);
+	if (curr_entry == 0) {
+		nova_free_data_blocks(sb, pi, blocknr, allocated);
+		return -ENOSPC;
+	}
+
+	nova_memunlock_inode(sb, pi);
+	data_bits = blk_type_to_shift[pi->i_blk_type];
+	le64_add_cpu(&pi->i_blocks,
+			(allocated << (data_bits - sb->s_blocksize_bits)));
+	nova_memlock_inode(sb, pi);
+
+	nova_update_tail(pi, curr_entry + sizeof(struct nova_file_write_entry));
+
+	ret = nova_reassign_file_tree(sb, pi, sih, curr_entry);
+	if (ret)
+		return ret;
+
+	inode->i_blocks = le64_to_cpu(pi->i_blocks);
+	*moved += allocated;
+	return allocated;
+}
+
+/* Caller holds i_mutex */
+int nova_defrag_file(struct super_block *sb, struct inode *inode,
+	struct nova_defrag *defrag)
+{
+	struct nova_inode_info *si = NOVA_I(inode);
+	struct nova_inode_info_header *sih = &si->header;
+	struct nova_file_write_entry *entries[1];
+	struct nova_file_write_entry *entry;
+	struct nova_inode *pi;
+	unsigned long pgoff, end_pgoff, num, budget;
+	unsigned long moved = 0;
+	int nr_entries;
+	int ret = 0;
+	timing_t defrag_time;
+
+	pi = nova_get_inode(sb, inode);
+	if (!pi)
+		return -EACCES;
+
+	if (mapping_mapped(inode->i_mapping) || sih->mmap_pages)
+		return -EBUSY;
+
+	if (get_seconds() < inode->i_mtime.tv_sec + NOVA_DEFRAG_IDLE)
+		return -EBUSY;
+
+	budget = defrag->max_blocks;
+	if (budget == 0 || budget > NOVA_DEFRAG_MAX_BLOCKS)
+		budget = NOVA_DEFRAG_MAX_BLOCKS;
+
+	NOVA_START_TIMING(defrag_t, defrag_time);
+	pgoff = defrag->start;
+	end_pgoff = (i_size_read(inode) + PAGE_SIZE - 1) >> PAGE_SHIFT;
+	while (pgoff < end_pgoff && moved < budget) {
+		entry = radix_tree_lookup(&sih->tree, pgoff);
+		if (!entry) {
+			/* Skip the hole */
+			nr_entries = radix_tree_gang_lookup(&sih->tree,
+						(void **)entries, pgoff, 1);
+			if (nr_entries == 0) {
+				pgoff = end_pgoff;
+				break;
+			}
+			pgoff = max_t(unsigned long, pgoff + 1,
+					entries[0]->pgoff);
+			continue;
+		}
+
+		if (!nova_defrag_movable(sb, sih, pgoff)) {
+			pgoff++;
+			continue;
+		}
+
+		/* Logically contiguous pages from pgoff */
+		num = 1;
+		while (num < NOVA_DEFRAG_CHUNK && num < budget - moved &&
+				pgoff + num < end_pgoff &&
+				nova_defrag_movable(sb, sih, pgoff + num))
+			num++;
+
+		if (num < 2 || nova_defrag_count_runs(sb, sih, pgoff, num) < 2) {
+			pgoff += num;
+			continue;
+		}
+
+		ret = nova_defrag_move(sb, inode, pi, sih, pgoff, num, &moved);
+		if (ret < 0)
+			break;
+
+		pgoff += ret;
+		ret = 0;
+		cond_resched();
+	}
+	NOVA_END_TIMING(defrag_t, defrag_time);
+
+	defrag->start = pgoff;
+	defrag->moved = moved;
 	return ret;
 }
 
@@ -494,6 +720,8 @@ static ssize_t nova_flush_mmap_to_nvmm(struct super_block *sb,
 		nvmm_addr = nova_get_block(sb, nvmm_block);
 		copied = bytes - memcpy_to_pmem_nocache(kmem + offset,
 				nvmm_addr + offset, bytes);
+		NOVA_WA_ADD(wa_user, copied);
+		NOVA_WA_ADD(wa_data, copied);
 
 		if (copied > 0) {
 			status = copied;
@@ -639,7 +867,7 @@ ssize_t nova_copy_to_nvmm(struct super_block *sb, struct inode *inode,
 out:
 	sb_end_write(inode->i_sb);
 	NOVA_END_TIMING(copy_to_nvmm_t, copy_to_nvmm_time);
-	fsync_bytes += written;
+	NOVA_STATS_ADD(fsync_bytes, written);
 	return ret;
 }
 
@@ -801,14 +1029,19 @@ static int __nova_dax_file_fault(struct vm_area_struct *vma,
 
 static int nova_dax_file_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
 {
+	struct inode *inode = vma->vm_file->f_mapping->host;
+	loff_t pos = (loff_t)vmf->pgoff << PAGE_SHIFT;
+	u64 trace_start = NOVA_TRACE_START(nova_fault_exit);
 	int ret = 0;
 	timing_t fault_time;
 
+	trace_nova_fault_enter(inode, pos, PAGE_SIZE);
 	NOVA_START_TIMING(mmap_fault_t, fault_time);
 	rcu_read_lock();
 	ret = __nova_dax_file_fault(vma, vmf);
 	rcu_read_unlock();
 	NOVA_END_TIMING(mmap_fault_t, fault_time);
+	trace_nova_fault_exit(inode, pos, ret, 1, trace_start);
 	return ret;
 }
 
@@ -51,6 +51,8 @@ static int nova_insert_dir_radix_tree(struct super_block *sb,
 	ret = radix_tree_insert(&sih->tree, hash, direntry);
 	if (ret)
 		nova_dbg("%s ERROR %d: %s\n", __func__, ret, name);
+	else
+		sih->dir_version++;
 
 	return ret;
 }
@@ -73,6 +75,7 @@ static int nova_remove_dir_radix_tree(struct super_block *sb,
 
 	hash = BKDRHash(name, namelen);
 	entry = radix_tree_delete(&sih->tree, hash);
+	sih->dir_version++;
 
 	if (replay == 0) {
 		if (!entry) {
@@ -97,6 +100,7 @@ static int nova_remove_dir_radix_tree(struct super_block *sb,
 
 		/* No need to flush */
 		entry->invalid = 1;
+		nova_snapshot_keep_dentry(sb, sih, entry);
 	}
 
 	return 0;
@@ -150,8 +154,8 @@ void nova_delete_dir_tree(struct super_block *sb,
  */
 static u64 nova_append_dir_inode_entry(struct super_block *sb,
 	struct nova_inode *pidir, struct inode *dir,
-	u64 ino, struct dentry *dentry, unsigned short de_len, u64 tail,
-	int link_change, u64 *curr_tail)
+	u64 ino, umode_t mode, struct dentry *dentry, unsigned short de_len,
+	u64 tail, int link_change, u64 *curr_tail)
 {
 	struct nova_inode_info *si = NOVA_I(dir);
 	struct nova_inode_info_header *sih = &si->header;
@@ -175,7 +179,7 @@ static u64 nova_append_dir_inode_entry(struct super_block *sb,
 	memcpy_to_pmem_nocache(entry->name, dentry->d_name.name,
 				dentry->d_name.len);
 	entry->name[dentry->d_name.len] = '\0';
-	entry->file_type = 0;
+	entry->file_type = IF2DT(mode);
 	entry->invalid = 0;
 	entry->mtime = cpu_to_le32(dir->i_mtime.tv_sec);
 	entry->size = cpu_to_le64(dir->i_size);
@@ -195,6 +199,7 @@ static u64 nova_append_dir_inode_entry(struct super_block *sb,
 			entry->name_len, entry->file_type);
 
 	nova_flush_buffer(entry, de_len, 0);
+	NOVA_WA_ADD(wa_log, de_len);
 
 	*curr_tail = curr_p + de_len;
 
@@ -231,6 +236,7 @@ int nova_append_dir_init_entries(struct super_block *sb,
 	de_entry->entry_type = DIR_LOG;
 	de_entry->ino = cpu_to_le64(self_ino);
 	de_entry->name_len = 1;
+	de_entry->file_type = DT_DIR;
 	de_entry->de_len = cpu_to_le16(NOVA_DIR_LOG_REC_LEN(1));
 	de_entry->mtime = CURRENT_TIME_SEC.tv_sec;
 	de_entry->size = sb->s_blocksize;
@@ -245,6 +251,7 @@ int nova_append_dir_init_entries(struct super_block *sb,
 	de_entry->entry_type = DIR_LOG;
 	de_entry->ino = cpu_to_le64(parent_ino);
 	de_entry->name_len = 2;
+	de_entry->file_type = DT_DIR;
 	de_entry->de_len = cpu_to_le16(NOVA_DIR_LOG_REC_LEN(2));
 	de_entry->mtime = CURRENT_TIME_SEC.tv_sec;
 	de_entry->size = sb->s_blocksize;
@@ -253,6 +260,7 @@ int nova_append_dir_init_entries(struct super_block *sb,
 	nova_flush_buffer(de_entry, NOVA_DIR_LOG_REC_LEN(2), 0);
 
 	curr_p += NOVA_DIR_LOG_REC_LEN(2);
+	NOVA_WA_ADD(wa_log, curr_p - new_block);
 	nova_update_tail(pi, curr_p);
 
 	return 0;
@@ -261,8 +269,8 @@ int nova_append_dir_init_entries(struct super_block *sb,
 /* adds a directory entry pointing to the inode. assumes the inode has
  * already been logged for consistency
  */
-int nova_add_dentry(struct dentry *dentry, u64 ino, int inc_link,
-	u64 tail, u64 *new_tail)
+int nova_add_dentry(struct dentry *dentry, u64 ino, umode_t mode,
+	int inc_link, u64 tail, u64 *new_tail)
 {
 	struct inode *dir = dentry->d_parent->d_inode;
 	struct super_block *sb = dir->i_sb;
@@ -294,7 +302,7 @@ int nova_add_dentry(struct dentry *dentry, u64 ino, int inc_link,
 	dir->i_mtime = dir->i_ctime = CURRENT_TIME_SEC;
 
 	loglen = NOVA_DIR_LOG_REC_LEN(namelen);
-	curr_entry = nova_append_dir_inode_entry(sb, pidir, dir, ino,
+	curr_entry = nova_append_dir_inode_entry(sb, pidir, dir, ino, mode,
 				dentry,	loglen, tail, inc_link,
 				&curr_tail);
 
@@ -331,7 +339,7 @@ int nova_remove_dentry(struct dentry *dentry, int dec_link, u64 tail,
 	dir->i_mtime = dir->i_ctime = CURRENT_TIME_SEC;
 
 	loglen = NOVA_DIR_LOG_REC_LEN(entry->len);
-	curr_entry = nova_append_dir_inode_entry(sb, pidir, dir, 0,
+	curr_entry = nova_append_dir_inode_entry(sb, pidir, dir, 0, 0,
 				dentry, loglen, tail, dec_link, &curr_tail);
 	*new_tail = curr_tail;
 
@@ -405,6 +413,9 @@ int nova_rebuild_dir_inode_tree(struct super_block *sb,
 				curr_p, pi->log_tail);
 
 	sih->log_pages = 1;
+	/* Only replay what the index snapshot does not cover */
+	nova_load_index(sb, pi, sih, &curr_p);
+
 	while (curr_p != pi->log_tail) {
 		if (goto_next_page(sb, curr_p)) {
 			sih->log_pages++;
@@ -416,6 +427,10 @@ int nova_rebuild_dir_inode_tree(struct super_block *sb,
 			BUG();
 		}
 
+		/* A snapshot mount stops at the pages of later epochs */
+		if (nova_snapshot_log_end(sb, curr_p))
+			break;
+
 		addr = (void *)nova_get_block(sb, curr_p);
 		type = nova_get_entry_type(addr);
 		switch (type) {
@@ -471,6 +486,7 @@ int nova_rebuild_dir_inode_tree(struct super_block *sb,
 		curr_p += de_len;
 	}
 
+	nova_snapshot_rebuild_tree(sb, sih);
 	sih->i_size = le64_to_cpu(pi->i_size);
 	sih->i_mode = le64_to_cpu(pi->i_mode);
 	nova_flush_buffer(pi, sizeof(struct nova_inode), 0);
@@ -492,6 +508,68 @@ int nova_rebuild_dir_inode_tree(struct super_block *sb,
 	return 0;
 }
 
+/*
+ * Readdir cursor, cached in file->private_data so that a getdents() call
+ * picking up where the previous one stopped does not repeat the radix tree
+ * lookup. The cached batch points into the directory log, so it is dropped
+ * whenever the tree changes (dir_version) or the file is seeked (pos).
+ */
+struct nova_readdir_cursor {
+	loff_t pos;			/* ctx->pos the cursor resumes at */
+	u64 version;			/* sih->dir_version of the batch */
+	unsigned long next_index;	/* Radix tree index after the batch */
+	int nr_entries;
+	int next;
+	int end;
+	struct nova_dentry *entries[READDIR_BATCH];
+};
+
+static struct nova_readdir_cursor *nova_get_readdir_cursor(struct file *file,
+	struct nova_inode_info_header *sih, loff_t pos)
+{
+	struct nova_readdir_cursor *cursor = file->private_data;
+
+	if (!cursor) {
+		cursor = kmalloc(sizeof(struct nova_readdir_cursor),
+					GFP_KERNEL);
+		if (!cursor)
+			return NULL;
+		file->private_data = cursor;
+	} else if (cursor->pos == pos && cursor->version == sih->dir_version) {
+		return cursor;
+	}
+
+	cursor->pos = pos;
+	cursor->version = sih->dir_version;
+	cursor->next_index = pos;
+	cursor->nr_entries = 0;
+	cursor->next = 0;
+	cursor->end = 0;
+	return cursor;
+}
+
+/* Only for dentries written before file_type was recorded */
+static unsigned char nova_dentry_file_type(struct super_block *sb,
+	struct nova_dentry *entry)
+{
+	struct nova_inode *child_pi;
+	u64 pi_addr;
+	int ret;
+
+	if (entry->file_type)
+		return entry->file_type;
+
+	ret = nova_get_inode_address(sb, le64_to_cpu(entry->ino), &pi_addr, 0);
+	if (ret) {
+		nova_dbg("%s: get child inode %llu address failed %d\n",
+				__func__, le64_to_cpu(entry->ino), ret);
+		return DT_UNKNOWN;
+	}
+
+	child_pi = nova_get_block(sb, pi_addr);
+	return IF2DT(le16_to_cpu(child_pi->i_mode));
+}
+
 static int nova_readdir(struct file *file, struct dir_context *ctx)
 {
 	struct inode *inode = file_inode(file);
@@ -499,15 +577,10 @@ static int nova_readdir(struct file *file, struct dir_context *ctx)
 	struct nova_inode *pidir;
 	struct nova_inode_info *si = NOVA_I(inode);
 	struct nova_inode_info_header *sih = &si->header;
-	struct nova_inode *child_pi;
+	struct nova_readdir_cursor *cursor;
 	struct nova_dentry *entry;
-	struct nova_dentry *entries[FREE_BATCH];
-	int nr_entries;
-	u64 pi_addr;
-	unsigned long pos = 0;
+	unsigned long pos;
 	ino_t ino;
-	int i;
-	int ret;
 	timing_t readdir_time;
 
 	NOVA_START_TIMING(readdir_t, readdir_time);
@@ -523,52 +596,69 @@ static int nova_readdir(struct file *file, struct dir_context *ctx)
 		return 0;
 	}
 
-	pos = ctx->pos;
-	if (pos == READDIR_END)
+	if (ctx->pos == READDIR_END)
 		goto out;
 
-	do {
-		nr_entries = radix_tree_gang_lookup(&sih->tree,
-					(void **)entries, pos, FREE_BATCH);
-		for (i = 0; i < nr_entries; i++) {
-			entry = entries[i];
-			pos = BKDRHash(entry->name, entry->name_len);
-			ino = __le64_to_cpu(entry->ino);
-			if (ino == 0)
-				continue;
+	cursor = nova_get_readdir_cursor(file, sih, ctx->pos);
+	if (!cursor) {
+		NOVA_END_TIMING(readdir_t, readdir_time);
+		return -ENOMEM;
+	}
 
-			ret = nova_get_inode_address(sb, ino, &pi_addr, 0);
-			if (ret) {
-				nova_dbg("%s: get child inode %lu address "
-					"failed %d\n", __func__, ino, ret);
-				ctx->pos = READDIR_END;
-				return ret;
+	while (!cursor->end) {
+		if (cursor->next == cursor->nr_entries) {
+			cursor->nr_entries = radix_tree_gang_lookup(&sih->tree,
+					(void **)cursor->entries,
+					cursor->next_index, READDIR_BATCH);
+			cursor->next = 0;
+			if (cursor->nr_entries == 0) {
+				cursor->end = 1;
+				break;
 			}
+			entry = cursor->entries[cursor->nr_entries - 1];
+			cursor->next_index =
+				BKDRHash(entry->name, entry->name_len) + 1;
+		}
 
-			child_pi = nova_get_block(sb, pi_addr);
-			nova_dbgv("ctx: ino %llu, name %s, "
-				"name_len %u, de_len %u\n",
-				(u64)ino, entry->name, entry->name_len,
-				entry->de_len);
-			if (!dir_emit(ctx, entry->name, entry->name_len,
-				ino, IF2DT(le16_to_cpu(child_pi->i_mode)))) {
-				nova_dbgv("Here: pos %llu\n", ctx->pos);
-				return 0;
-			}
-			ctx->pos = pos + 1;
+		entry = cursor->entries[cursor->next];
+		pos = BKDRHash(entry->name, entry->name_len);
+		ino = __le64_to_cpu(entry->ino);
+		if (ino == 0) {
+			cursor->next++;
+			continue;
 		}
-		pos++;
-	} while (nr_entries == FREE_BATCH);
 
+		nova_dbgv("ctx: ino %llu, name %s, "
+			"name_len %u, de_len %u\n",
+			(u64)ino, entry->name, entry->name_len,
+			entry->de_len);
+		if (!dir_emit(ctx, entry->name, entry->name_len,
+				ino, nova_dentry_file_type(sb, entry))) {
+			nova_dbgv("Here: pos %llu\n", ctx->pos);
+			break;
+		}
+		cursor->next++;
+		ctx->pos = pos + 1;
+	}
+
+	cursor->pos = ctx->pos;
 out:
 	NOVA_END_TIMING(readdir_t, readdir_time);
 	return 0;
 }
 
+static int nova_dir_release(struct inode *inode, struct file *file)
+{
+	kfree(file->private_data);
+	file->private_data = NULL;
+	return 0;
+}
+
 const struct file_operations nova_dir_operations = {
 	.llseek		= generic_file_llseek,
 	.read		= generic_read_dir,
 	.iterate	= nova_readdir,
+	.release	= nova_dir_release,
 	.fsync		= noop_fsync,
 	.unlocked_ioctl = nova_ioctl,
 #ifdef CONFIG_COMPAT
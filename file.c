@@ -142,7 +142,7 @@ static unsigned long nova_get_dirty_range(struct super_block *sb,
 			if (flush_bytes == 0)
 				dirty_start = temp;
 			flush_bytes += bytes;
-			fsync_pages++;
+			NOVA_STATS_ADD(fsync_pages, 1);
 		} else {
 			if (flush_bytes)
 				break;
@@ -195,9 +195,14 @@ int nova_fsync(struct file *file, loff_t start, loff_t end, int datasync)
 	int ret = 0;
 	loff_t sync_start, sync_end;
 	loff_t isize;
+	u64 trace_start = NOVA_TRACE_START(nova_fsync_exit);
+	loff_t trace_pos = start;
+	unsigned long flushed = 0;
 	timing_t fsync_time;
 
+	trace_nova_fsync_enter(inode, start, end - start + 1);
 	NOVA_START_TIMING(fsync_t, fsync_time);
+	NOVA_WA_BEGIN(wa_msync);
 	if (!mapping_mapped(mapping))
 		goto out;
 
@@ -216,9 +221,8 @@ int nova_fsync(struct file *file, loff_t start, loff_t end, int datasync)
 	{
 		nova_dbg_verbose("[%s:%d] : (ERR) isize(%llx), start(%llx),"
 			" end(%llx)\n", __func__, __LINE__, isize, start, end);
-		NOVA_END_TIMING(fsync_t, fsync_time);
 		mutex_unlock(&inode->i_mutex);
-		return 0;
+		goto out;
 	}
 
 	nova_get_sync_range(sih, &start, &end);
@@ -249,6 +253,7 @@ int nova_fsync(struct file *file, loff_t start, loff_t end, int datasync)
 		}
 
 		start += nr_flush_bytes;
+		flushed += nr_flush_bytes;
 	} while (start < end);
 
 	end_tail = end_temp;
@@ -264,7 +269,10 @@ int nova_fsync(struct file *file, loff_t start, loff_t end, int datasync)
 	mutex_unlock(&inode->i_mutex);
 
 out:
+	NOVA_WA_END(wa_msync);
 	NOVA_END_TIMING(fsync_t, fsync_time);
+	trace_nova_fsync_exit(inode, trace_pos, ret,
+			DIV_ROUND_UP(flushed, PAGE_SIZE), trace_start);
 
 	return ret;
 }
@@ -287,6 +295,534 @@ static int nova_open(struct inode *inode, struct file *filp)
 	return generic_file_open(inode, filp);
 }
 
+/*
+ * fallocate. NOVA never writes data in place, so preallocated pages are
+ * recorded as unwritten extents: the blocks come off the free lists and
+ * the pages read as zeros until a write replaces them. A punched range
+ * is recorded with a hole entry, which replay applies by dropping the
+ * older mappings of the range. Hole entries are never invalidated, GC
+ * keeps them.
+ */
+#define	NOVA_FALLOC_BATCH	65536
+
+u64 nova_append_range_entry(struct super_block *sb,
+	struct nova_inode *pi, struct inode *inode, unsigned long pgoff,
+	unsigned long num, u64 block, loff_t size, u64 tail)
+{
+	struct nova_file_write_entry entry_data;
+
+	entry_data.pgoff = cpu_to_le64(pgoff);
+	entry_data.num_pages = cpu_to_le32(num);
+	entry_data.invalid_pages = 0;
+	entry_data.block = cpu_to_le64(block);
+	entry_data.mtime = cpu_to_le32(inode->i_mtime.tv_sec);
+	/* Set entry type after set block */
+	nova_set_entry_type((void *)&entry_data, FILE_WRITE);
+	entry_data.size = cpu_to_le64(size);
+
+	return nova_append_file_write_entry(sb, pi, inode, &entry_data, tail);
+}
+
+/* Whether any page in [pgoff, last] is mapped */
+bool nova_range_mapped(struct nova_inode_info_header *sih,
+	unsigned long pgoff, unsigned long last)
+{
+	struct radix_tree_iter iter;
+	void **slot;
+
+	radix_tree_for_each_slot(slot, &sih->tree, &iter, pgoff) {
+		if (iter.index > last)
+			break;
+		if (radix_tree_deref_slot(slot))
+			return true;
+	}
+
+	return false;
+}
+
+/* Free the blocks of entries appended but not committed */
+void nova_fallocate_abort(struct super_block *sb,
+	struct nova_inode *pi, u64 begin, u64 tail)
+{
+	struct nova_file_write_entry *entry;
+	size_t entry_size = sizeof(struct nova_file_write_entry);
+	u64 curr_p = begin;
+
+	while (curr_p && curr_p != tail) {
+		if (is_last_entry(curr_p, entry_size))
+			curr_p = next_log_page(sb, curr_p);
+		if (curr_p == 0)
+			break;
+
+		entry = (struct nova_file_write_entry *)
+					nova_get_block(sb, curr_p);
+		if (!nova_entry_hole(entry))
+			nova_free_data_blocks(sb, pi,
+					entry->block >> PAGE_SHIFT,
+					entry->num_pages);
+		curr_p += entry_size;
+	}
+}
+
+/*
+ * Commit the new entries and apply them to the tree, like a COW write.
+ * Blocks is the number of new blocks in the entries.
+ */
+int nova_fallocate_commit(struct super_block *sb,
+	struct nova_inode *pi, struct inode *inode, u64 begin, u64 tail,
+	unsigned long blocks, loff_t new_size)
+{
+	struct nova_inode_info *si = NOVA_I(inode);
+	struct nova_inode_info_header *sih = &si->header;
+	unsigned int data_bits;
+	int ret = 0;
+
+	if (tail == pi->log_tail)
+		return 0;
+
+	nova_memunlock_inode(sb, pi);
+	data_bits = blk_type_to_shift[pi->i_blk_type];
+	le64_add_cpu(&pi->i_blocks,
+			(blocks << (data_bits - sb->s_blocksize_bits)));
+	nova_memlock_inode(sb, pi);
+
+	nova_update_tail(pi, tail);
+
+	/* Free the overlap blocks after the entries are committed */
+	if (begin)
+		ret = nova_reassign_file_tree(sb, pi, sih, begin);
+
+	inode->i_blocks = le64_to_cpu(pi->i_blocks);
+	if (new_size != inode->i_size) {
+		i_size_write(inode, new_size);
+		sih->i_size = new_size;
+	}
+
+	return ret;
+}
+
+/*
+ * Append a COW copy of the page at pgoff with [from, to) zeroed.
+ * Returns the blocks allocated, 0 if the page already reads as zeros.
+ */
+static int nova_zero_partial_page(struct super_block *sb,
+	struct nova_inode *pi, struct inode *inode, unsigned long pgoff,
+	size_t from, size_t to, loff_t size, u64 *begin, u64 *tail)
+{
+	struct nova_inode_info *si = NOVA_I(inode);
+	struct nova_inode_info_header *sih = &si->header;
+	struct nova_file_write_entry *entry;
+	unsigned long blocknr = 0;
+	void *kmem, *src;
+	u64 block, curr_entry;
+	int allocated;
+
+	entry = nova_get_write_entry(sb, si, pgoff);
+	if (!entry || nova_entry_unwritten(entry))
+		return 0;
+
+	allocated = nova_new_data_blocks(sb, pi, &blocknr, 1, pgoff, 0, 1);
+	if (allocated <= 0)
+		return allocated ? allocated : -ENOSPC;
+
+	block = nova_get_block_off(sb, blocknr, pi->i_blk_type);
+	kmem = nova_get_block(sb, block);
+	src = nova_get_block(sb, get_nvmm(sb, sih, entry, pgoff) << PAGE_SHIFT);
+
+	memcpy_to_pmem_nocache(kmem, src, from);
+	memset(kmem + from, 0, to - from);
+	nova_flush_buffer(kmem + from, to - from, 0);
+	memcpy_to_pmem_nocache(kmem + to, src + to, sb->s_blocksize - to);
+	NOVA_WA_ADD(wa_data, sb->s_blocksize);
+
+	curr_entry = nova_append_range_entry(sb, pi, inode, pgoff, 1, block,
+						size, *tail);
+	if (curr_entry == 0) {
+		nova_free_data_blocks(sb, pi, blocknr, 1);
+		return -ENOSPC;
+	}
+
+	if (*begin == 0)
+		*begin = curr_entry;
+	*tail = curr_entry + sizeof(struct nova_file_write_entry);
+	return 1;
+}
+
+/*
+ * Append unwritten extents for the pages in [pgoff, end_pgoff). Mapped
+ * pages are left alone unless replace is set. Returns the blocks
+ * allocated.
+ */
+static int nova_prealloc_pages(struct super_block *sb,
+	struct nova_inode *pi, struct inode *inode, unsigned long pgoff,
+	unsigned long end_pgoff, bool replace, loff_t size, u64 *begin,
+	u64 *tail)
+{
+	struct nova_inode_info *si = NOVA_I(inode);
+	struct nova_inode_info_header *sih = &si->header;
+	unsigned long blocknr = 0;
+	unsigned long num;
+	u64 curr_entry;
+	int allocated;
+	int blocks = 0;
+
+	while (pgoff < end_pgoff) {
+		if (!replace && radix_tree_lookup(&sih->tree, pgoff)) {
+			pgoff++;
+			continue;
+		}
+
+		num = 1;
+		while (pgoff + num < end_pgoff && num < NOVA_FALLOC_BATCH &&
+				(replace ||
+				 !radix_tree_lookup(&sih->tree, pgoff + num)))
+			num++;
+
+		allocated = nova_new_data_blocks(sb, pi, &blocknr, num,
+						pgoff, 0, 1);
+		if (allocated <= 0)
+			return allocated ? allocated : -ENOSPC;
+
+		curr_entry = nova_append_range_entry(sb, pi, inode, pgoff,
+				allocated, nova_get_block_off(sb, blocknr,
+				pi->i_blk_type) | FILE_UNWRITTEN, size, *tail);
+		if (curr_entry == 0) {
+			nova_free_data_blocks(sb, pi, blocknr, allocated);
+			return -ENOSPC;
+		}
+
+		if (*begin == 0)
+			*begin = curr_entry;
+		*tail = curr_entry + sizeof(struct nova_file_write_entry);
+		blocks += allocated;
+		pgoff += allocated;
+		cond_resched();
+	}
+
+	return blocks;
+}
+
+/*
+ * Mode 0 and ZERO_RANGE. With KEEP_SIZE nothing is allocated past EOF:
+ * truncate and recovery expect no blocks there.
+ */
+static int nova_prealloc_range(struct super_block *sb, struct nova_inode *pi,
+	struct inode *inode, loff_t offset, loff_t len, loff_t new_size,
+	bool zero)
+{
+	struct nova_inode_info *si = NOVA_I(inode);
+	struct nova_inode_info_header *sih = &si->header;
+	unsigned long mask = sb->s_blocksize - 1;
+	unsigned int bits = sb->s_blocksize_bits;
+	unsigned long pgoff, end_pgoff;
+	unsigned long blocks = 0;
+	u64 begin = 0, tail = pi->log_tail;
+	struct iattr attr;
+	loff_t end;
+	int ret;
+
+	end = min(offset + len, new_size);
+	if (offset >= end)
+		return 0;
+
+	if (zero || new_size != inode->i_size)
+		inode->i_ctime = inode->i_mtime = CURRENT_TIME_SEC;
+
+	pgoff = offset >> bits;
+	end_pgoff = (end + mask) >> bits;
+
+	if (zero && (offset & mask)) {
+		/* Head page */
+		ret = nova_zero_partial_page(sb, pi, inode, pgoff,
+				offset & mask, (end >> bits) == pgoff ?
+				end & mask : sb->s_blocksize, new_size,
+				&begin, &tail);
+		if (ret < 0)
+			goto fail;
+		blocks += ret;
+		if (ret)
+			pgoff++;
+	}
+
+	if (zero && (end & mask) && ((end >> bits) << bits) >= offset) {
+		/* Tail page */
+		ret = nova_zero_partial_page(sb, pi, inode, end >> bits,
+				0, end & mask, new_size, &begin, &tail);
+		if (ret < 0)
+			goto fail;
+		blocks += ret;
+		if (ret)
+			end_pgoff--;
+	}
+
+	ret = nova_prealloc_pages(sb, pi, inode, pgoff, end_pgoff, zero,
+					new_size, &begin, &tail);
+	if (ret < 0)
+		goto fail;
+	blocks += ret;
+
+	/*
+	 * No entry records the new size. Log it like nova_notify_change:
+	 * the old setattr entry is invalid once sih->last_setattr moves,
+	 * so commit the new one right away.
+	 */
+	if (begin == 0 && new_size != inode->i_size) {
+		attr.ia_valid = ATTR_SIZE | ATTR_MTIME | ATTR_CTIME;
+		attr.ia_size = new_size;
+		tail = nova_append_setattr_entry(sb, pi, inode, &attr, 0);
+		nova_update_tail(pi, tail);
+		i_size_write(inode, new_size);
+		sih->i_size = new_size;
+		return 0;
+	}
+
+	return nova_fallocate_commit(sb, pi, inode, begin, tail, blocks,
+					new_size);
+fail:
+	nova_fallocate_abort(sb, pi, begin, tail);
+	return ret;
+}
+
+static int nova_punch_hole(struct super_block *sb, struct nova_inode *pi,
+	struct inode *inode, loff_t offset, loff_t len)
+{
+	struct nova_inode_info *si = NOVA_I(inode);
+	struct nova_inode_info_header *sih = &si->header;
+	unsigned long mask = sb->s_blocksize - 1;
+	unsigned int bits = sb->s_blocksize_bits;
+	unsigned long pgoff, end_pgoff;
+	unsigned long blocks = 0;
+	u64 begin = 0, tail = pi->log_tail;
+	u64 curr_entry;
+	loff_t end, size = inode->i_size;
+	int ret;
+
+	if (offset >= size)
+		return 0;
+
+	/* Past EOF the last page is zeros already */
+	end = offset + len;
+	if (end >= size)
+		end = (size + mask) & ~mask;
+
+	inode->i_ctime = inode->i_mtime = CURRENT_TIME_SEC;
+	pgoff = (offset + mask) >> bits;
+	end_pgoff = end >> bits;
+
+	if (offset & mask) {
+		/* Head page */
+		ret = nova_zero_partial_page(sb, pi, inode, offset >> bits,
+				offset & mask, (end >> bits) == (offset >> bits) ?
+				end & mask : sb->s_blocksize, size,
+				&begin, &tail);
+		if (ret < 0)
+			goto fail;
+		blocks += ret;
+	}
+
+	if ((end & mask) && end_pgoff >= pgoff) {
+		/* Tail page */
+		ret = nova_zero_partial_page(sb, pi, inode, end_pgoff,
+				0, end & mask, size, &begin, &tail);
+		if (ret < 0)
+			goto fail;
+		blocks += ret;
+	}
+
+	if (pgoff < end_pgoff &&
+			nova_range_mapped(sih, pgoff, end_pgoff - 1)) {
+		curr_entry = nova_append_range_entry(sb, pi, inode, pgoff,
+				end_pgoff - pgoff, FILE_HOLE, size, tail);
+		if (curr_entry == 0) {
+			ret = -ENOSPC;
+			goto fail;
+		}
+		if (begin == 0)
+			begin = curr_entry;
+		tail = curr_entry + sizeof(struct nova_file_write_entry);
+	}
+
+	return nova_fallocate_commit(sb, pi, inode, begin, tail, blocks,
+					size);
+fail:
+	nova_fallocate_abort(sb, pi, begin, tail);
+	return ret;
+}
+
+/*
+ * Drop [pgoff, last] from the tree without freeing the blocks, which
+ * entries appended for the new offsets now own.
+ */
+static void nova_detach_file_pages(struct super_block *sb,
+	struct nova_inode_info_header *sih, unsigned long pgoff,
+	unsigned long last)
+{
+	struct nova_file_write_entry *entry;
+	struct nova_file_write_entry *entries[1];
+
+	while (pgoff <= last) {
+		entry = radix_tree_delete(&sih->tree, pgoff);
+		if (entry) {
+			entry->invalid_pages++;
+			nova_snapshot_keep_pages(sb, sih, entry, pgoff, 1, 0);
+			pgoff++;
+			continue;
+		}
+
+		/* We are finding a hole. Jump to the next entry. */
+		if (radix_tree_gang_lookup(&sih->tree, (void **)entries,
+						pgoff, 1) != 1)
+			break;
+		pgoff = max_t(unsigned long, pgoff + 1, entries[0]->pgoff);
+	}
+}
+
+/*
+ * The pages past the range are mapped at their new offsets by entries
+ * pointing at the same blocks, after a hole entry dropping everything
+ * from offset to EOF. No data is copied.
+ */
+static int nova_collapse_range(struct super_block *sb, struct nova_inode *pi,
+	struct inode *inode, loff_t offset, loff_t len)
+{
+	struct nova_inode_info *si = NOVA_I(inode);
+	struct nova_inode_info_header *sih = &si->header;
+	struct nova_file_write_entry *entries[1];
+	struct nova_file_write_entry *entry;
+	unsigned long mask = sb->s_blocksize - 1;
+	unsigned int bits = sb->s_blocksize_bits;
+	unsigned long pgoff, shift, last, num;
+	u64 begin = 0, tail = pi->log_tail;
+	u64 block, curr_entry;
+	loff_t new_size;
+	int freed;
+	int ret = 0;
+
+	if ((offset | len) & mask)
+		return -EINVAL;
+	if (offset + len >= inode->i_size)
+		return -EINVAL;
+
+	new_size = inode->i_size - len;
+	inode->i_ctime = inode->i_mtime = CURRENT_TIME_SEC;
+
+	pgoff = offset >> bits;
+	shift = len >> bits;
+	last = (inode->i_size - 1) >> bits;
+
+	curr_entry = nova_append_range_entry(sb, pi, inode, pgoff,
+			last - pgoff + 1, FILE_HOLE, new_size, tail);
+	if (curr_entry == 0)
+		return -ENOSPC;
+	tail = curr_entry + sizeof(struct nova_file_write_entry);
+
+	pgoff += shift;
+	while (pgoff <= last) {
+		entry = radix_tree_lookup(&sih->tree, pgoff);
+		if (!entry) {
+			if (radix_tree_gang_lookup(&sih->tree,
+					(void **)entries, pgoff, 1) != 1)
+				break;
+			pgoff = max_t(unsigned long, pgoff + 1,
+					entries[0]->pgoff);
+			continue;
+		}
+
+		num = 1;
+		while (pgoff + num <= last &&
+				radix_tree_lookup(&sih->tree, pgoff + num) == entry)
+			num++;
+
+		block = ((u64)get_nvmm(sb, sih, entry, pgoff) << PAGE_SHIFT) |
+				(entry->block & FILE_UNWRITTEN);
+		curr_entry = nova_append_range_entry(sb, pi, inode,
+				pgoff - shift, num, block, new_size, tail);
+		if (curr_entry == 0)
+			return -ENOSPC;
+
+		if (begin == 0)
+			begin = curr_entry;
+		tail = curr_entry + sizeof(struct nova_file_write_entry);
+		pgoff += num;
+	}
+
+	nova_update_tail(pi, tail);
+
+	pgoff = offset >> bits;
+	freed = nova_delete_file_tree(sb, sih, pgoff, pgoff + shift - 1,
+					true, false);
+	pi->i_blocks -= freed;
+	nova_detach_file_pages(sb, sih, pgoff + shift, last);
+
+	if (begin)
+		ret = nova_reassign_file_tree(sb, pi, sih, begin);
+
+	inode->i_blocks = le64_to_cpu(pi->i_blocks);
+	i_size_write(inode, new_size);
+	sih->i_size = new_size;
+	return ret;
+}
+
+static long nova_fallocate(struct file *file, int mode, loff_t offset,
+	loff_t len)
+{
+	struct address_space *mapping = file->f_mapping;
+	struct inode *inode = mapping->host;
+	struct nova_inode_info *si = NOVA_I(inode);
+	struct nova_inode_info_header *sih = &si->header;
+	struct super_block *sb = inode->i_sb;
+	struct nova_inode *pi;
+	loff_t new_size;
+	int ret;
+	timing_t fallocate_time;
+
+	if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE |
+			FALLOC_FL_ZERO_RANGE | FALLOC_FL_COLLAPSE_RANGE))
+		return -EOPNOTSUPP;
+
+	if (!S_ISREG(inode->i_mode))
+		return -EOPNOTSUPP;
+
+	NOVA_START_TIMING(fallocate_t, fallocate_time);
+	NOVA_WA_BEGIN(wa_fallocate);
+	mutex_lock(&inode->i_mutex);
+
+	pi = nova_get_inode(sb, inode);
+
+	/* mmap pages are not punched or moved */
+	if ((mode & ~FALLOC_FL_KEEP_SIZE) &&
+			(mapping_mapped(mapping) || sih->mmap_pages)) {
+		ret = -EBUSY;
+		goto out;
+	}
+
+	if (mode & FALLOC_FL_PUNCH_HOLE) {
+		ret = nova_punch_hole(sb, pi, inode, offset, len);
+		goto out;
+	}
+
+	if (mode & FALLOC_FL_COLLAPSE_RANGE) {
+		ret = nova_collapse_range(sb, pi, inode, offset, len);
+		goto out;
+	}
+
+	new_size = inode->i_size;
+	if (!(mode & FALLOC_FL_KEEP_SIZE) && offset + len > new_size) {
+		new_size = offset + len;
+		ret = inode_newsize_ok(inode, new_size);
+		if (ret)
+			goto out;
+	}
+
+	ret = nova_prealloc_range(sb, pi, inode, offset, len, new_size,
+					mode & FALLOC_FL_ZERO_RANGE);
+out:
+	mutex_unlock(&inode->i_mutex);
+	NOVA_WA_END(wa_fallocate);
+	NOVA_END_TIMING(fallocate_t, fallocate_time);
+	return ret;
+}
+
 const struct file_operations nova_dax_file_operations = {
 	.llseek			= nova_llseek,
 	.read			= nova_dax_file_read,
@@ -297,6 +833,10 @@ const struct file_operations nova_dax_file_operations = {
 	.open			= nova_open,
 	.fsync			= nova_fsync,
 	.flush			= nova_flush,
+	.fallocate		= nova_fallocate,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 5, 0)
+	.clone_file_range	= nova_clone_file_range,
+#endif
 	.unlocked_ioctl		= nova_ioctl,
 #ifdef CONFIG_COMPAT
 	.compat_ioctl		= nova_compat_ioctl,
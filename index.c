@@ -0,0 +1,385 @@
+/*
+ * NOVA inode index snapshots
+ *
+ * Copyright 2015-2016 Regents of the University of California,
+ * UCSD Non-Volatile Systems Lab, Andiry Xu <jix024@cs.ucsd.edu>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * With the index mount option, evicting a file or directory with a long
+ * log saves its radix tree to a chain of log pages hung off pi->i_index.
+ * File pages mapped to the same write entry are saved as one record.
+ * The snapshot is tagged with the log tail it covers, so the next rebuild
+ * loads it and replays only the entries appended after that tail.
+ *
+ * Records point into the log, so whatever frees log pages drops the
+ * snapshot first: log GC and nova_free_inode_log. Appending to the log
+ * keeps it valid. A snapshot that does not match the inode or fails its
+ * checksum is ignored and the whole log is replayed.
+ */
+
+#include <linux/fs.h>
+#include <linux/jhash.h>
+#include "nova.h"
+
+/* Short logs replay fast enough */
+#define	NOVA_INDEX_MIN_LOG_PAGES	16
+
+#define	NOVA_INDEX_REC_SIZE	sizeof(struct nova_index_record)
+#define	NOVA_INDEX_FIRST_RECORDS	((LAST_ENTRY - \
+		sizeof(struct nova_index_header)) / NOVA_INDEX_REC_SIZE)
+#define	NOVA_INDEX_PAGE_RECORDS	(LAST_ENTRY / NOVA_INDEX_REC_SIZE)
+
+struct nova_index_cursor {
+	struct super_block *sb;
+	u64		curr_p;		/* 0 if only counting records */
+	unsigned long	nr_records;
+	u32		csum;
+};
+
+static inline u32 nova_index_header_csum(struct nova_index_header *hdr)
+{
+	return jhash2((u32 *)hdr, offsetof(struct nova_index_header, csum) / 4,
+			le64_to_cpu(hdr->ino));
+}
+
+static inline u32 nova_index_record_csum(struct nova_index_record *rec,
+	u32 csum)
+{
+	return jhash2((u32 *)rec, NOVA_INDEX_REC_SIZE / 4, csum);
+}
+
+static unsigned long nova_index_pages(unsigned long nr_records)
+{
+	if (nr_records <= NOVA_INDEX_FIRST_RECORDS)
+		return 1;
+
+	return 1 + DIV_ROUND_UP(nr_records - NOVA_INDEX_FIRST_RECORDS,
+					NOVA_INDEX_PAGE_RECORDS);
+}
+
+static inline bool nova_index_off_valid(struct super_block *sb, u64 off)
+{
+	return off && off < NOVA_SB(sb)->initsize;
+}
+
+static struct nova_index_record *nova_index_next_record(
+	struct super_block *sb, u64 *curr_p)
+{
+	struct nova_index_record *rec;
+
+	if (is_last_entry(*curr_p, NOVA_INDEX_REC_SIZE)) {
+		*curr_p = next_log_page(sb, *curr_p);
+		if (!nova_index_off_valid(sb, *curr_p) || ENTRY_LOC(*curr_p))
+			return NULL;
+	}
+
+	rec = (struct nova_index_record *)nova_get_block(sb, *curr_p);
+	*curr_p += NOVA_INDEX_REC_SIZE;
+	return rec;
+}
+
+/* Returns the first index page if pi->i_index points to our header */
+u64 nova_get_index_head(struct super_block *sb, struct nova_inode *pi)
+{
+	struct nova_index_header *hdr;
+	u64 head = le64_to_cpu(pi->i_index);
+
+	if (!nova_index_off_valid(sb, head) || ENTRY_LOC(head))
+		return 0;
+
+	hdr = (struct nova_index_header *)nova_get_block(sb, head);
+	if (le64_to_cpu(hdr->magic) != NOVA_INDEX_MAGIC ||
+			le64_to_cpu(hdr->ino) != pi->nova_ino)
+		return 0;
+
+	return head;
+}
+
+static void nova_set_index(struct super_block *sb, struct nova_inode *pi,
+	u64 head)
+{
+	nova_memunlock_inode(sb, pi);
+	pi->i_index = cpu_to_le64(head);
+	nova_memlock_inode(sb, pi);
+	nova_flush_buffer(&pi->i_index, sizeof(pi->i_index), 1);
+}
+
+/* Called before any log page is freed */
+void nova_drop_index(struct super_block *sb, struct nova_inode *pi)
+{
+	u64 head;
+
+	if (pi->i_index == 0)
+		return;
+
+	head = nova_get_index_head(sb, pi);
+	nova_set_index(sb, pi, 0);
+	if (head)
+		nova_free_contiguous_log_blocks(sb, pi, head);
+}
+
+static void nova_index_emit(struct nova_index_cursor *cur,
+	unsigned long index, unsigned long num, void *entry)
+{
+	struct super_block *sb = cur->sb;
+	struct nova_index_record *rec;
+
+	cur->nr_records++;
+	if (cur->curr_p == 0)
+		return;
+
+	if (is_last_entry(cur->curr_p, NOVA_INDEX_REC_SIZE))
+		nova_flush_buffer(nova_get_block(sb, BLOCK_OFF(cur->curr_p)),
+					LAST_ENTRY, 0);
+
+	rec = nova_index_next_record(sb, &cur->curr_p);
+	rec->index = cpu_to_le64(index);
+	rec->num = cpu_to_le64(num);
+	rec->entry = cpu_to_le64(nova_get_addr_off(NOVA_SB(sb), entry));
+	cur->csum = nova_index_record_csum(rec, cur->csum);
+}
+
+static void nova_index_walk(struct nova_index_cursor *cur,
+	struct nova_inode_info_header *sih)
+{
+	struct radix_tree_iter iter;
+	void **slot;
+	void *entry, *run_entry = NULL;
+	unsigned long run_start = 0, run_num = 0;
+	bool merge = !S_ISDIR(sih->i_mode);
+
+	radix_tree_for_each_slot(slot, &sih->tree, &iter, 0) {
+		entry = radix_tree_deref_slot(slot);
+		if (merge && entry == run_entry &&
+				iter.index == run_start + run_num) {
+			run_num++;
+			continue;
+		}
+
+		if (run_entry)
+			nova_index_emit(cur, run_start, run_num, run_entry);
+		run_entry = entry;
+		run_start = iter.index;
+		run_num = 1;
+	}
+
+	if (run_entry)
+		nova_index_emit(cur, run_start, run_num, run_entry);
+}
+
+/* Log pages from the head to the tail page, as the rebuild counts them */
+static unsigned long nova_index_tail_pages(struct super_block *sb,
+	struct nova_inode *pi)
+{
+	unsigned long pages = 1;
+	u64 curr_p = pi->log_head;
+
+	while (BLOCK_OFF(curr_p) != BLOCK_OFF(pi->log_tail)) {
+		curr_p = next_log_page(sb, curr_p);
+		if (curr_p == 0)
+			return 0;
+		pages++;
+	}
+
+	return pages;
+}
+
+/* Called from evict, nothing else touches the inode */
+int nova_save_index(struct super_block *sb, struct inode *inode)
+{
+	struct nova_inode_info_header *sih = &NOVA_I(inode)->header;
+	struct nova_index_cursor cur = { .sb = sb };
+	struct nova_index_header *hdr;
+	struct nova_inode *pi;
+	unsigned long num_pages, log_pages;
+	u64 head, old_head;
+	timing_t save_time;
+	int allocated;
+	int ret = 0;
+
+	if (!test_opt(sb, INDEX) || (sb->s_flags & MS_RDONLY))
+		return 0;
+
+	if (!S_ISREG(inode->i_mode) && !S_ISDIR(inode->i_mode))
+		return 0;
+
+	if (is_bad_inode(inode) || !inode->i_nlink || sih->pi_addr == 0 ||
+			sih->batch || sih->mmap_pages ||
+			sih->log_pages < NOVA_INDEX_MIN_LOG_PAGES)
+		return 0;
+
+	pi = nova_get_inode(sb, inode);
+	if (pi->log_head == 0 || pi->log_tail == 0)
+		return 0;
+
+	old_head = nova_get_index_head(sb, pi);
+	if (old_head) {
+		hdr = (struct nova_index_header *)nova_get_block(sb, old_head);
+		if (le64_to_cpu(hdr->log_head) == pi->log_head &&
+				le64_to_cpu(hdr->log_tail) == pi->log_tail)
+			return 0;
+	}
+
+	NOVA_START_TIMING(save_index_t, save_time);
+
+	log_pages = nova_index_tail_pages(sb, pi);
+	nova_index_walk(&cur, sih);
+	num_pages = nova_index_pages(cur.nr_records);
+	/* Not worth it if loading is about as slow as replaying */
+	if (log_pages == 0 || num_pages * 2 > sih->log_pages)
+		goto out;
+
+	allocated = nova_allocate_inode_log_pages(sb, pi, num_pages, &head);
+	if (allocated != num_pages) {
+		nova_dbg("%s: inode %lu: allocate %lu index pages failed %d\n",
+				__func__, inode->i_ino, num_pages, allocated);
+		ret = allocated < 0 ? allocated : -ENOSPC;
+		goto out;
+	}
+
+	hdr = (struct nova_index_header *)nova_get_block(sb, head);
+	hdr->magic = cpu_to_le64(NOVA_INDEX_MAGIC);
+	hdr->ino = cpu_to_le64(pi->nova_ino);
+	hdr->log_head = cpu_to_le64(pi->log_head);
+	hdr->log_tail = cpu_to_le64(pi->log_tail);
+	hdr->log_pages = cpu_to_le64(log_pages);
+	hdr->last_setattr = cpu_to_le64(sih->last_setattr);
+	hdr->last_link_change = cpu_to_le64(sih->last_link_change);
+	hdr->nr_records = cpu_to_le64(cur.nr_records);
+	hdr->padding = 0;
+
+	cur.curr_p = head + sizeof(struct nova_index_header);
+	cur.csum = nova_index_header_csum(hdr);
+	cur.nr_records = 0;
+	nova_index_walk(&cur, sih);
+	hdr->csum = cpu_to_le32(cur.csum);
+
+	nova_flush_buffer(nova_get_block(sb, BLOCK_OFF(cur.curr_p)),
+				LAST_ENTRY, 0);
+	nova_flush_buffer(hdr, sizeof(struct nova_index_header), 0);
+
+	/* Persists the snapshot before it is published */
+	nova_set_index(sb, pi, head);
+	if (old_head)
+		nova_free_contiguous_log_blocks(sb, pi, old_head);
+
+	nova_dbgv("%s: inode %lu: %lu records in %lu pages, log %lu pages\n",
+			__func__, inode->i_ino, cur.nr_records, num_pages,
+			sih->log_pages);
+out:
+	NOVA_END_TIMING(save_index_t, save_time);
+	return ret;
+}
+
+static void nova_index_unload(struct super_block *sb,
+	struct nova_inode_info_header *sih, u64 head, unsigned long nr)
+{
+	struct nova_index_record *rec;
+	unsigned long i, j;
+	u64 curr_p = head + sizeof(struct nova_index_header);
+
+	for (i = 0; i < nr; i++) {
+		rec = nova_index_next_record(sb, &curr_p);
+		for (j = 0; j < le64_to_cpu(rec->num); j++)
+			radix_tree_delete(&sih->tree,
+					le64_to_cpu(rec->index) + j);
+	}
+}
+
+/*
+ * Fill the empty tree of sih from the index snapshot. On success, curr_p
+ * is set to the first log entry the snapshot does not cover.
+ */
+int nova_load_index(struct super_block *sb, struct nova_inode *pi,
+	struct nova_inode_info_header *sih, u64 *curr_p)
+{
+	struct nova_index_header *hdr;
+	struct nova_index_record *rec;
+	unsigned long nr, i, j;
+	u8 type = S_ISDIR(sih->i_mode) ? DIR_LOG : FILE_WRITE;
+	u64 head, p, off;
+	timing_t load_time;
+	void *entry;
+	u32 csum;
+	int ret = 0;
+
+	/* The index covers the live log, not the prefix a snapshot sees */
+	if (NOVA_SB(sb)->mount_snapshot)
+		return -ENOENT;
+
+	head = nova_get_index_head(sb, pi);
+	if (head == 0)
+		return -ENOENT;
+
+	hdr = (struct nova_index_header *)nova_get_block(sb, head);
+	if (le64_to_cpu(hdr->log_head) != pi->log_head)
+		return -EINVAL;
+
+	NOVA_START_TIMING(load_index_t, load_time);
+
+	/* Check every record before the tree is touched */
+	nr = le64_to_cpu(hdr->nr_records);
+	csum = nova_index_header_csum(hdr);
+	p = head + sizeof(struct nova_index_header);
+	for (i = 0; i < nr; i++) {
+		rec = nova_index_next_record(sb, &p);
+		if (!rec) {
+			ret = -EINVAL;
+			goto out;
+		}
+
+		off = le64_to_cpu(rec->entry);
+		if (!nova_index_off_valid(sb, off) || rec->num == 0 ||
+				nova_get_entry_type(nova_get_block(sb, off))
+					!= type) {
+			ret = -EINVAL;
+			goto out;
+		}
+		csum = nova_index_record_csum(rec, csum);
+	}
+
+	if (csum != le32_to_cpu(hdr->csum)) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	p = head + sizeof(struct nova_index_header);
+	for (i = 0; i < nr; i++) {
+		rec = nova_index_next_record(sb, &p);
+		entry = nova_get_block(sb, le64_to_cpu(rec->entry));
+		for (j = 0; j < le64_to_cpu(rec->num); j++) {
+			ret = radix_tree_insert(&sih->tree,
+					le64_to_cpu(rec->index) + j, entry);
+			if (ret) {
+				nova_index_unload(sb, sih, head, i + 1);
+				goto out;
+			}
+		}
+	}
+
+	sih->log_pages = le64_to_cpu(hdr->log_pages);
+	sih->last_setattr = le64_to_cpu(hdr->last_setattr);
+	sih->last_link_change = le64_to_cpu(hdr->last_link_change);
+	*curr_p = le64_to_cpu(hdr->log_tail);
+
+out:
+	if (ret)
+		nova_dbg("%s: inode %llu: index snapshot ignored, %d\n",
+				__func__, pi->nova_ino, ret);
+	NOVA_END_TIMING(load_index_t, load_time);
+	return ret;
+}
@@ -65,6 +65,87 @@ int nova_init_inode_inuse_list(struct super_block *sb)
 	return 0;
 }
 
+/*
+ * Each CPU's inode table is a chain of 2MB superpages linked through their
+ * last 8 bytes. inode_table_tree in the inode map caches the chain in DRAM,
+ * indexed by superpage number, so finding an inode never walks NVMM.
+ * Entries are only inserted under inode_table_mutex and only removed at
+ * unmount; lookups rely on RCU.
+ */
+static int nova_insert_inode_table_block(struct inode_map *inode_map,
+	unsigned long index, u64 block)
+{
+	int ret;
+
+	ret = radix_tree_insert(&inode_map->inode_table_tree, index,
+				(void *)block);
+	if (ret)
+		return ret;
+
+	inode_map->num_table_blocks++;
+	return 0;
+}
+
+static inline u64 nova_lookup_inode_table_block(struct inode_map *inode_map,
+	unsigned long index)
+{
+	u64 block;
+
+	rcu_read_lock();
+	block = (u64)radix_tree_lookup(&inode_map->inode_table_tree, index);
+	rcu_read_unlock();
+
+	return block;
+}
+
+int nova_build_inode_table_index(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct inode_table *inode_table;
+	struct inode_map *inode_map;
+	unsigned long curr_addr;
+	u64 curr;
+	int ret;
+	int i;
+
+	for (i = 0; i < sbi->cpus; i++) {
+		inode_map = &sbi->inode_maps[i];
+		inode_table = nova_get_inode_table(sb, i);
+		if (!inode_table)
+			return -EINVAL;
+
+		curr = inode_table->log_head;
+		while (curr) {
+			ret = nova_insert_inode_table_block(inode_map,
+					inode_map->num_table_blocks, curr);
+			if (ret)
+				return ret;
+
+			curr_addr = (unsigned long)nova_get_block(sb, curr);
+			/* Next page pointer in the last 8 bytes of the superpage */
+			curr_addr += 2097152 - 8;
+			curr = *(u64 *)(curr_addr);
+		}
+	}
+
+	return 0;
+}
+
+void nova_delete_inode_table_index(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct inode_map *inode_map;
+	unsigned long index;
+	int i;
+
+	for (i = 0; i < sbi->cpus; i++) {
+		inode_map = &sbi->inode_maps[i];
+		for (index = 0; index < inode_map->num_table_blocks; index++)
+			radix_tree_delete(&inode_map->inode_table_tree, index);
+		inode_map->num_table_blocks = 0;
+	}
+}
+
 int nova_init_inode_table(struct super_block *sb)
 {
 	struct nova_sb_info *sbi = NOVA_SB(sb);
@@ -73,6 +154,7 @@ int nova_init_inode_table(struct super_block *sb)
 	unsigned long blocknr;
 	u64 block;
 	int allocated;
+	int ret;
 	int i;
 
 	pi->i_mode = 0;
@@ -98,18 +180,61 @@ int nova_init_inode_table(struct super_block *sb)
 		block = nova_get_block_off(sb, blocknr, NOVA_BLOCK_TYPE_2M);
 		inode_table->log_head = block;
 		nova_flush_buffer(inode_table, CACHELINE_SIZE, 0);
+
+		ret = nova_insert_inode_table_block(&sbi->inode_maps[i],
+							0, block);
+		if (ret)
+			return ret;
 	}
 
 	PERSISTENT_BARRIER();
 	return 0;
 }
 
+/* Append superpages to cpuid's inode table. Caller holds inode_table_mutex */
+static int nova_extend_inode_table(struct super_block *sb,
+	struct nova_inode *pi, int cpuid, unsigned int superpage_count)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct inode_map *inode_map = &sbi->inode_maps[cpuid];
+	unsigned long blocknr;
+	unsigned long curr_addr;
+	u64 curr, prev;
+	int allocated;
+	int ret;
+
+	while (inode_map->num_table_blocks <= superpage_count) {
+		prev = nova_lookup_inode_table_block(inode_map,
+					inode_map->num_table_blocks - 1);
+		if (prev == 0)
+			return -EINVAL;
+
+		allocated = nova_new_log_blocks(sb, pi, &blocknr, 1, 1);
+		if (allocated != 1)
+			return -EINVAL;
+
+		curr = nova_get_block_off(sb, blocknr, NOVA_BLOCK_TYPE_2M);
+		ret = nova_insert_inode_table_block(inode_map,
+					inode_map->num_table_blocks, curr);
+		if (ret) {
+			nova_free_log_blocks(sb, pi, blocknr, 1);
+			return ret;
+		}
+
+		curr_addr = (unsigned long)nova_get_block(sb, prev);
+		curr_addr += 2097152 - 8;
+		*(u64 *)(curr_addr) = curr;
+		nova_flush_buffer((void *)curr_addr, NOVA_INODE_SIZE, 1);
+	}
+
+	return 0;
+}
+
 int nova_get_inode_address(struct super_block *sb, u64 ino,
 	u64 *pi_addr, int extendable)
 {
 	struct nova_sb_info *sbi = NOVA_SB(sb);
 	struct nova_inode *pi;
-	struct inode_table *inode_table;
 	unsigned int data_bits;
 	unsigned int num_inodes_bits;
 	u64 curr;
@@ -117,10 +242,7 @@ int nova_get_inode_address(struct super_block *sb, u64 ino,
 	u64 internal_ino;
 	int cpuid;
 	unsigned int index;
-	unsigned int i = 0;
-	unsigned long blocknr;
-	unsigned long curr_addr;
-	int allocated;
+	int ret;
 
 	pi = nova_get_inode_by_ino(sb, NOVA_INODETABLE_INO);
 	data_bits = blk_type_to_shift[pi->i_blk_type];
@@ -129,39 +251,21 @@ int nova_get_inode_address(struct super_block *sb, u64 ino,
 	cpuid = ino % sbi->cpus;
 	internal_ino = ino / sbi->cpus;
 
-	inode_table = nova_get_inode_table(sb, cpuid);
 	superpage_count = internal_ino >> num_inodes_bits;
 	index = internal_ino & ((1 << num_inodes_bits) - 1);
 
-	curr = inode_table->log_head;
-	if (curr == 0)
-		return -EINVAL;
-
-	for (i = 0; i < superpage_count; i++) {
-		if (curr == 0)
+	curr = nova_lookup_inode_table_block(&sbi->inode_maps[cpuid],
+						superpage_count);
+	if (curr == 0) {
+		if (extendable == 0)
 			return -EINVAL;
 
-		curr_addr = (unsigned long)nova_get_block(sb, curr);
-		/* Next page pointer in the last 8 bytes of the superpage */
-		curr_addr += 2097152 - 8;
-		curr = *(u64 *)(curr_addr);
-
-		if (curr == 0) {
-			if (extendable == 0)
-				return -EINVAL;
-
-			allocated = nova_new_log_blocks(sb, pi, &blocknr,
-							1, 1);
-
-			if (allocated != 1)
-				return -EINVAL;
+		ret = nova_extend_inode_table(sb, pi, cpuid, superpage_count);
+		if (ret)
+			return ret;
 
-			curr = nova_get_block_off(sb, blocknr,
-						NOVA_BLOCK_TYPE_2M);
-			*(u64 *)(curr_addr) = curr;
-			nova_flush_buffer((void *)curr_addr,
-						NOVA_INODE_SIZE, 1);
-		}
+		curr = nova_lookup_inode_table_block(&sbi->inode_maps[cpuid],
+						superpage_count);
 	}
 
 	*pi_addr = curr + index * NOVA_INODE_SIZE;
@@ -190,6 +294,10 @@ static inline int nova_free_contiguous_data_blocks(struct super_block *sb,
 	entry->invalid_pages += num_pages;
 	nvmm = get_nvmm(sb, sih, entry, pgoff);
 
+	/* Freed with the last snapshot that maps them */
+	if (nova_snapshot_keep_pages(sb, sih, entry, pgoff, num_pages, nvmm))
+		return num_pages;
+
 	if (*start_blocknr == 0) {
 		*start_blocknr = nvmm;
 		*num_free = num_pages;
@@ -209,7 +317,7 @@ static inline int nova_free_contiguous_data_blocks(struct super_block *sb,
 	return freed;
 }
 
-static int nova_free_contiguous_log_blocks(struct super_block *sb,
+int nova_free_contiguous_log_blocks(struct super_block *sb,
 	struct nova_inode *pi, u64 head)
 {
 	struct nova_inode_log_page *curr_page;
@@ -514,7 +622,9 @@ int nova_assign_write_entry(struct super_block *sb,
 			old_nvmm = get_nvmm(sb, sih, old_entry, curr_pgoff);
 			if (free) {
 				old_entry->invalid_pages++;
-				nova_free_data_blocks(sb, pi, old_nvmm, 1);
+				if (!nova_snapshot_keep_pages(sb, sih, old_entry,
+						curr_pgoff, 1, old_nvmm))
+					nova_free_data_blocks(sb, pi, old_nvmm, 1);
 				pi->i_blocks--;
 			}
 			radix_tree_replace_slot(pentry, entry);
@@ -534,15 +644,13 @@ out:
 }
 
 static int nova_read_inode(struct super_block *sb, struct inode *inode,
-	u64 pi_addr)
+	struct nova_inode *pi)
 {
 	struct nova_inode_info *si = NOVA_I(inode);
-	struct nova_inode *pi;
 	struct nova_inode_info_header *sih = &si->header;
 	int ret = -EIO;
 	unsigned long ino;
 
-	pi = (struct nova_inode *)nova_get_block(sb, pi_addr);
 	inode->i_mode = sih->i_mode;
 	i_uid_write(inode, le32_to_cpu(pi->i_uid));
 	i_gid_write(inode, le32_to_cpu(pi->i_gid));
@@ -687,7 +795,8 @@ static int nova_alloc_unused_inode(struct super_block *sb, int cpuid,
 	return 0;
 }
 
-static int nova_free_inuse_inode(struct super_block *sb, unsigned long ino)
+/* Return ino to the in-use range tree. Caller holds inode_table_mutex */
+static int __nova_free_inuse_inode(struct super_block *sb, unsigned long ino)
 {
 	struct nova_sb_info *sbi = NOVA_SB(sb);
 	struct inode_map *inode_map;
@@ -701,11 +810,9 @@ static int nova_free_inuse_inode(struct super_block *sb, unsigned long ino)
 	nova_dbg_verbose("Free inuse ino: %lu\n", ino);
 	inode_map = &sbi->inode_maps[cpuid];
 
-	mutex_lock(&inode_map->inode_table_mutex);
 	found = nova_search_inodetree(sbi, ino, &i);
 	if (!found) {
 		nova_dbg("%s ERROR: ino %lu not found\n", __func__, ino);
-		mutex_unlock(&inode_map->inode_table_mutex);
 		return -EINVAL;
 	}
 
@@ -750,16 +857,147 @@ err:
 	nova_error_mng(sb, "Unable to free inode %lu\n", ino);
 	nova_error_mng(sb, "Found inuse block %lu - %lu\n",
 				 i->range_low, i->range_high);
-	mutex_unlock(&inode_map->inode_table_mutex);
 	return ret;
 
 block_found:
 	sbi->s_inodes_used_count--;
 	inode_map->freed++;
+	return ret;
+}
+
+/*
+ * Inode number magazines.
+ *
+ * Each inode map keeps a small stack of free inode numbers that are still
+ * marked in use in inode_inuse_tree. Creates pop from it and unlinks push
+ * to it under the map's magazine_lock, so the hot path never takes
+ * inode_table_mutex. The magazine is refilled from the range tree in
+ * bulk, and the inode table is extended to cover the whole refill at the
+ * same time, so nova_get_inode_address never has to extend it later.
+ * Magazines are drained back into the tree before the inode list is saved
+ * at unmount, so the on-media format does not change. After a crash,
+ * recovery rebuilds the tree from valid inodes, so cached numbers are
+ * free again. The allocator redo log records pops and pushes, not
+ * refills, and a checkpoint saves the magazine with the tree.
+ */
+static int nova_free_inuse_inode(struct super_block *sb, unsigned long ino)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct inode_map *inode_map = &sbi->inode_maps[ino % sbi->cpus];
+	int ret;
+
+	spin_lock(&inode_map->magazine_lock);
+	if (inode_map->magazine_count < INODE_MAGAZINE_SIZE) {
+		inode_map->magazine[inode_map->magazine_count++] = ino;
+		nova_redo_log_inode(sb, NOVA_REDO_FREE_INODE, ino);
+		spin_unlock(&inode_map->magazine_lock);
+		return 0;
+	}
+	spin_unlock(&inode_map->magazine_lock);
+
+	mutex_lock(&inode_map->inode_table_mutex);
+	ret = __nova_free_inuse_inode(sb, ino);
+	if (ret == 0)
+		nova_redo_log_inode(sb, NOVA_REDO_FREE_INODE, ino);
 	mutex_unlock(&inode_map->inode_table_mutex);
 	return ret;
 }
 
+/* Checkpoint recovery: return ino to the range tree directly */
+int nova_redo_free_inode(struct super_block *sb, unsigned long ino)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct inode_map *inode_map = &sbi->inode_maps[ino % sbi->cpus];
+	int ret;
+
+	mutex_lock(&inode_map->inode_table_mutex);
+	ret = __nova_free_inuse_inode(sb, ino);
+	mutex_unlock(&inode_map->inode_table_mutex);
+	return ret;
+}
+
+static int nova_refill_inode_magazine(struct super_block *sb, int map_id)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct inode_map *inode_map = &sbi->inode_maps[map_id];
+	unsigned long inos[INODE_MAGAZINE_REFILL];
+	unsigned long max_ino = 0;
+	u64 pi_addr;
+	int count = 0;
+	int i = 0;
+	int ret = 0;
+
+	mutex_lock(&inode_map->inode_table_mutex);
+	for (count = 0; count < INODE_MAGAZINE_REFILL; count++) {
+		ret = nova_alloc_unused_inode(sb, map_id, &inos[count]);
+		if (ret)
+			break;
+		if (inos[count] > max_ino)
+			max_ino = inos[count];
+	}
+
+	if (count == 0)
+		goto out;
+
+	/* Make sure every reserved inode has a slot in the inode table */
+	ret = nova_get_inode_address(sb, max_ino, &pi_addr, 1);
+	if (ret) {
+		nova_dbg("%s: get inode address failed %d\n", __func__, ret);
+		goto out;
+	}
+
+	spin_lock(&inode_map->magazine_lock);
+	while (i < count &&
+			inode_map->magazine_count < INODE_MAGAZINE_SIZE)
+		inode_map->magazine[inode_map->magazine_count++] = inos[i++];
+	spin_unlock(&inode_map->magazine_lock);
+
+out:
+	/* Whatever did not make it into the magazine goes back */
+	for (; i < count; i++)
+		__nova_free_inuse_inode(sb, inos[i]);
+	mutex_unlock(&inode_map->inode_table_mutex);
+	return count ? 0 : ret;
+}
+
+void nova_drain_inode_magazines(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct inode_map *inode_map;
+	unsigned long ino;
+	int i;
+
+	for (i = 0; i < sbi->cpus; i++) {
+		inode_map = &sbi->inode_maps[i];
+		mutex_lock(&inode_map->inode_table_mutex);
+		spin_lock(&inode_map->magazine_lock);
+		while (inode_map->magazine_count > 0) {
+			ino = inode_map->magazine[--inode_map->magazine_count];
+			spin_unlock(&inode_map->magazine_lock);
+			__nova_free_inuse_inode(sb, ino);
+			spin_lock(&inode_map->magazine_lock);
+		}
+		spin_unlock(&inode_map->magazine_lock);
+		mutex_unlock(&inode_map->inode_table_mutex);
+	}
+}
+
+/*
+ * Numbers parked in magazines are still in inode_inuse_tree, so they are
+ * in s_inodes_used_count too. statfs takes them out.
+ */
+unsigned long nova_count_magazine_inodes(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	unsigned long count = 0;
+	int i;
+
+	for (i = 0; i < sbi->cpus; i++)
+		count += READ_ONCE(sbi->inode_maps[i].magazine_count);
+
+	return count;
+}
+
 /*
  * NOTE! When we get the inode, we're the only people
  * that have access to it, and as such there are no
@@ -816,6 +1054,8 @@ static int nova_free_inode(struct inode *inode,
 struct inode *nova_iget(struct super_block *sb, unsigned long ino)
 {
 	struct nova_inode_info *si;
+	struct nova_inode *pi;
+	struct nova_inode snapshot_pi;
 	struct inode *inode;
 	u64 pi_addr;
 	int err;
@@ -824,7 +1064,7 @@ struct inode *nova_iget(struct super_block *sb, unsigned long ino)
 	if (unlikely(!inode))
 		return ERR_PTR(-ENOMEM);
 	if (!(inode->i_state & I_NEW))
-		return inode;
+		goto pin;
 
 	si = NOVA_I(inode);
 
@@ -846,16 +1086,32 @@ struct inode *nova_iget(struct super_block *sb, unsigned long ino)
 		goto fail;
 	}
 
-	err = nova_rebuild_inode(sb, si, pi_addr);
+	pi = (struct nova_inode *)nova_get_block(sb, pi_addr);
+	if (NOVA_SB(sb)->mount_snapshot) {
+		/* Replay into a copy, the inode belongs to the live fs */
+		memcpy(&snapshot_pi, pi, sizeof(struct nova_inode));
+		if (S_ISREG(le16_to_cpu(pi->i_mode)))
+			snapshot_pi.i_size = 0;
+		pi = &snapshot_pi;
+	}
+
+	err = nova_rebuild_inode(sb, si, pi, pi_addr);
 	if (err)
 		goto fail;
 
-	err = nova_read_inode(sb, inode, pi_addr);
+	err = nova_read_inode(sb, inode, pi);
 	if (unlikely(err))
 		goto fail;
 	inode->i_ino = ino;
 
 	unlock_new_inode(inode);
+pin:
+	/* Only does anything while background recovery runs */
+	err = nova_bg_pin_inode(inode);
+	if (err) {
+		iput(inode);
+		return ERR_PTR(err);
+	}
 	return inode;
 fail:
 	iget_failed(inode);
@@ -907,7 +1163,12 @@ void nova_evict_inode(struct inode *inode)
 		if (IS_APPEND(inode) || IS_IMMUTABLE(inode))
 			goto out;
 
+		/* Freed once no snapshot sees it */
+		if (nova_snapshot_keep_inode(sb, inode))
+			goto out;
+
 		destroy = 1;
+		sih->snapshot_dead = 1;
 		/* We need the log to free the blocks from the b-tree */
 		switch (inode->i_mode & S_IFMT) {
 		case S_IFREG:
@@ -947,8 +1208,10 @@ void nova_evict_inode(struct inode *inode)
 		inode->i_size = 0;
 	}
 out:
-	if (destroy == 0)
+	if (destroy == 0) {
+		nova_save_index(sb, inode);
 		nova_free_dram_resource(sb, sih);
+	}
 
 	/* TODO: Since we don't use page-cache, do we really need the following
 	 * call? */
@@ -970,28 +1233,38 @@ u64 nova_new_nova_inode(struct super_block *sb, u64 *pi_addr)
 	timing_t new_inode_time;
 
 	NOVA_START_TIMING(new_nova_inode_t, new_inode_time);
-	map_id = sbi->map_id;
-	sbi->map_id = (sbi->map_id + 1) % sbi->cpus;
+	/*
+	 * Use the local CPU's inode map rather than a shared round-robin
+	 * cursor, so concurrent creators do not bounce one counter and pile
+	 * up on the same inode_table_mutex. Only a placement hint.
+	 */
+	map_id = raw_smp_processor_id() % sbi->cpus;
 
 	inode_map = &sbi->inode_maps[map_id];
 
-	mutex_lock(&inode_map->inode_table_mutex);
-	ret = nova_alloc_unused_inode(sb, map_id, &free_ino);
-	if (ret) {
-		nova_dbg("%s: alloc inode number failed %d\n", __func__, ret);
-		mutex_unlock(&inode_map->inode_table_mutex);
-		return 0;
+	spin_lock(&inode_map->magazine_lock);
+	while (inode_map->magazine_count == 0) {
+		spin_unlock(&inode_map->magazine_lock);
+		ret = nova_refill_inode_magazine(sb, map_id);
+		if (ret) {
+			nova_dbg("%s: alloc inode number failed %d\n",
+					__func__, ret);
+			NOVA_END_TIMING(new_nova_inode_t, new_inode_time);
+			return 0;
+		}
+		spin_lock(&inode_map->magazine_lock);
 	}
+	free_ino = inode_map->magazine[--inode_map->magazine_count];
+	nova_redo_log_inode(sb, NOVA_REDO_ALLOC_INODE, free_ino);
+	spin_unlock(&inode_map->magazine_lock);
 
-	ret = nova_get_inode_address(sb, free_ino, pi_addr, 1);
+	ret = nova_get_inode_address(sb, free_ino, pi_addr, 0);
 	if (ret) {
 		nova_dbg("%s: get inode address failed %d\n", __func__, ret);
-		mutex_unlock(&inode_map->inode_table_mutex);
+		NOVA_END_TIMING(new_nova_inode_t, new_inode_time);
 		return 0;
 	}
 
-	mutex_unlock(&inode_map->inode_table_mutex);
-
 	ino = free_ino;
 
 	NOVA_END_TIMING(new_nova_inode_t, new_inode_time);
@@ -1041,6 +1314,10 @@ struct inode *nova_new_vfs_inode(enum nova_new_inode_type type,
 	/* chosen inode is in ino */
 	inode->i_ino = ino;
 
+	errval = nova_bg_pin_inode(inode);
+	if (errval)
+		goto fail1;
+
 	switch (type) {
 		case TYPE_CREATE:
 			inode->i_op = &nova_file_inode_operations;
@@ -1073,8 +1350,11 @@ struct inode *nova_new_vfs_inode(enum nova_new_inode_type type,
 	nova_memunlock_inode(sb, pi);
 	pi->i_blk_type = NOVA_DEFAULT_BLOCK_TYPE;
 	pi->i_flags = nova_mask_flags(mode, diri->i_flags);
+	pi->i_alloc_policy = diri->i_alloc_policy;
 	pi->log_head = 0;
 	pi->log_tail = 0;
+	pi->i_index = 0;
+	pi->i_epoch = cpu_to_le32(sbi->s_epoch);
 	pi->nova_ino = ino;
 	nova_memlock_inode(sb, pi);
 
@@ -1160,6 +1440,7 @@ static void nova_clear_last_page_tail(struct super_block *sb,
 	nvmm_addr = (char *)nova_get_block(sb, nvmm);
 	memset(nvmm_addr + offset, 0, length);
 	nova_flush_buffer(nvmm_addr + offset, length, 0);
+	NOVA_WA_ADD(wa_zero, length);
 
 	/* Clear mmap page */
 	if (sih->mmap_pages && pgoff <= sih->high_dirty &&
@@ -1282,7 +1563,7 @@ out:
 }
 
 /* Returns new tail after append */
-static u64 nova_append_setattr_entry(struct super_block *sb,
+u64 nova_append_setattr_entry(struct super_block *sb,
 	struct nova_inode *pi, struct inode *inode, struct iattr *attr,
 	u64 tail)
 {
@@ -1305,6 +1586,7 @@ static u64 nova_append_setattr_entry(struct super_block *sb,
 	entry = (struct nova_setattr_logentry *)nova_get_block(sb, curr_p);
 	/* inode is already updated with attr */
 	nova_update_setattr_entry(inode, entry, attr);
+	NOVA_WA_ADD(wa_log, size);
 	new_tail = curr_p + size;
 	sih->last_setattr = curr_p;
 
@@ -1347,6 +1629,7 @@ int nova_notify_change(struct dentry *dentry, struct iattr *attr)
 	if (ia_valid == 0)
 		return ret;
 
+	NOVA_WA_BEGIN(wa_setattr);
 	/* We are holding i_mutex so OK to append the log */
 	new_tail = nova_append_setattr_entry(sb, pi, inode, attr, 0);
 
@@ -1361,6 +1644,7 @@ int nova_notify_change(struct dentry *dentry, struct iattr *attr)
 		nova_setsize(inode, oldsize, attr->ia_size);
 	}
 
+	NOVA_WA_END(wa_setattr);
 	NOVA_END_TIMING(setattr_t, setattr_time);
 	return ret;
 }
@@ -1454,12 +1738,14 @@ static int nova_coalesce_log_pages(struct super_block *sb,
 	for (i = 0; i < num_pages - 1; i++) {
 		curr_page->page_tail.next_page = nova_get_block_off(sb,
 				next_blocknr, NOVA_BLOCK_TYPE_4K);
+		nova_set_page_epoch(sb, &curr_page->page_tail);
 		curr_page++;
 		next_blocknr++;
 	}
 
 	/* Last page */
 	curr_page->page_tail.next_page = 0;
+	nova_set_page_epoch(sb, &curr_page->page_tail);
 	return 0;
 }
 
@@ -1664,8 +1950,10 @@ static int nova_gc_assign_dentry(struct super_block *sb,
 	pentry = radix_tree_lookup_slot(&sih->tree, hash);
 	if (pentry) {
 		temp = radix_tree_deref_slot(pentry);
-		if (temp == old_dentry)
+		if (temp == old_dentry) {
 			radix_tree_replace_slot(pentry, new_dentry);
+			sih->dir_version++;
+		}
 	}
 
 	return ret;
@@ -1731,8 +2019,11 @@ static int nova_inode_log_thorough_gc(struct super_block *sb,
 	int allocated;
 	int extended = 0;
 	int ret;
+	unsigned long freed = 0;
+	u64 trace_start = NOVA_TRACE_START(nova_thorough_gc_exit);
 	timing_t gc_time;
 
+	trace_nova_thorough_gc_enter(sb, ino, sih->log_pages);
 	NOVA_START_TIMING(thorough_gc_t, gc_time);
 
 	curr_p = pi->log_head;
@@ -1746,6 +2037,12 @@ static int nova_inode_log_thorough_gc(struct super_block *sb,
 	if (curr_p >> PAGE_SHIFT == pi->log_tail >> PAGE_SHIFT)
 		goto out;
 
+	/* The pages of a snapshot stay where they are */
+	if (nova_log_page_frozen(sb, curr_p))
+		goto out;
+
+	nova_drop_index(sb, pi);
+
 	allocated = nova_allocate_inode_log_pages(sb, pi, blocks,
 					&new_head);
 	if (allocated != blocks) {
@@ -1781,6 +2078,7 @@ static int nova_inode_log_thorough_gc(struct super_block *sb,
 			/* Copy entry to the new log */
 			memcpy_to_pmem_nocache(nova_get_block(sb, new_curr),
 				nova_get_block(sb, curr_p), length);
+			NOVA_WA_ADD(wa_gc, length);
 			nova_gc_assign_new_entry(sb, pi, sih, curr_p, new_curr);
 			new_curr += length;
 		}
@@ -1819,10 +2117,15 @@ static int nova_inode_log_thorough_gc(struct super_block *sb,
 	nova_free_contiguous_log_blocks(sb, pi, old_head);
 
 	sih->log_pages = sih->log_pages + blocks - checked_pages;
-	thorough_gc_pages += checked_pages - blocks;
-	thorough_checked_pages += checked_pages;
+	freed = checked_pages - blocks;
+	sih->thorough_gcs++;
+	sih->gc_freed_pages += freed;
+	NOVA_STATS_ADD(thorough_gc_pages, freed);
+	NOVA_STATS_ADD(thorough_checked_pages, checked_pages);
 out:
 	NOVA_END_TIMING(thorough_gc_t, gc_time);
+	trace_nova_thorough_gc_exit(sb, ino, checked_pages, freed,
+					trace_start);
 	return 0;
 }
 
@@ -1850,8 +2153,10 @@ static int nova_inode_log_fast_gc(struct super_block *sb,
 	unsigned long blocks;
 	unsigned long checked_pages = 0;
 	int freed_pages = 0;
+	u64 trace_start = NOVA_TRACE_START(nova_fast_gc_exit);
 	timing_t gc_time;
 
+	trace_nova_fast_gc_enter(sb, sih->ino, sih->log_pages);
 	NOVA_START_TIMING(fast_gc_t, gc_time);
 	curr = pi->log_head;
 	sih->valid_bytes = 0;
@@ -1870,8 +2175,11 @@ static int nova_inode_log_fast_gc(struct super_block *sb,
 					nova_get_block(sb, curr);
 		next = curr_page->page_tail.next_page;
 		nova_dbg_verbose("curr 0x%llx, next 0x%llx\n", curr, next);
-		if (curr_page_invalid(sb, pi, sih, curr)) {
+		/* A snapshot may still replay it */
+		if (!nova_log_page_frozen(sb, curr) &&
+				curr_page_invalid(sb, pi, sih, curr)) {
 			nova_dbg_verbose("curr page %p invalid\n", curr_page);
+			nova_drop_index(sb, pi);
 			if (curr == pi->log_head) {
 				/* Free first page later */
 				first_need_free = 1;
@@ -1882,7 +2190,7 @@ static int nova_inode_log_fast_gc(struct super_block *sb,
 				free_curr_page(sb, pi, curr_page, last_page,
 						curr);
 			}
-			fast_gc_pages++;
+			NOVA_STATS_ADD(fast_gc_pages, 1);
 			freed_pages++;
 		} else {
 			if (found_head == 0) {
@@ -1898,8 +2206,10 @@ static int nova_inode_log_fast_gc(struct super_block *sb,
 			break;
 	}
 
-	fast_checked_pages += checked_pages;
+	NOVA_STATS_ADD(fast_checked_pages, checked_pages);
 	checked_pages -= freed_pages;
+	sih->fast_gcs++;
+	sih->gc_freed_pages += freed_pages;
 
 	page_tail = PAGE_TAIL(curr_tail);
 	((struct nova_inode_page_tail *)
@@ -1928,6 +2238,8 @@ static int nova_inode_log_fast_gc(struct super_block *sb,
 		blocks++;
 
 	NOVA_END_TIMING(fast_gc_t, gc_time);
+	trace_nova_fast_gc_exit(sb, sih->ino, checked_pages + freed_pages,
+					freed_pages, trace_start);
 
 	if (need_thorough_gc(sb, sih, blocks, checked_pages)) {
 		nova_dbgv("Thorough GC for inode %lu: checked pages %lu, "
@@ -1939,6 +2251,110 @@ static int nova_inode_log_fast_gc(struct super_block *sb,
 	return 0;
 }
 
+static void nova_add_extent_stats(struct nova_log_stats *stats,
+	unsigned long blocks)
+{
+	int class = fls_long(blocks) - 1;
+
+	if (class >= NOVA_EXTENT_CLASSES)
+		class = NOVA_EXTENT_CLASSES - 1;
+	stats->extents++;
+	stats->extent_sizes[class]++;
+}
+
+/* Walk the file tree in pgoff order and count contiguous runs */
+static void nova_get_extent_stats(struct super_block *sb,
+	struct nova_inode_info_header *sih, struct nova_log_stats *stats)
+{
+	struct nova_file_write_entry *entry;
+	struct radix_tree_iter iter;
+	void **slot;
+	unsigned long last_pgoff = 0, last_nvmm = 0, nvmm;
+	unsigned long run = 0;
+
+	radix_tree_for_each_slot(slot, &sih->tree, &iter, 0) {
+		entry = radix_tree_deref_slot(slot);
+		if (!entry)
+			continue;
+
+		nvmm = get_nvmm(sb, sih, entry, iter.index);
+		stats->data_blocks++;
+		if (run && iter.index == last_pgoff + 1 &&
+				nvmm == last_nvmm + 1) {
+			run++;
+		} else {
+			if (run)
+				nova_add_extent_stats(stats, run);
+			run = 1;
+		}
+		last_pgoff = iter.index;
+		last_nvmm = nvmm;
+	}
+
+	if (run)
+		nova_add_extent_stats(stats, run);
+}
+
+/* Caller holds i_mutex so neither the log nor the trees change */
+int nova_get_log_stats(struct super_block *sb, struct inode *inode,
+	struct nova_log_stats *stats)
+{
+	struct nova_inode_info *si = NOVA_I(inode);
+	struct nova_inode_info_header *sih = &si->header;
+	struct nova_inode *pi;
+	size_t length;
+	u64 curr_p;
+
+	pi = nova_get_inode(sb, inode);
+	if (!pi)
+		return -EACCES;
+
+	memset(stats, 0, sizeof(struct nova_log_stats));
+	stats->ino = inode->i_ino;
+	stats->valid_bytes = sih->valid_bytes;
+	stats->fast_gcs = sih->fast_gcs;
+	stats->thorough_gcs = sih->thorough_gcs;
+	stats->gc_freed_pages = sih->gc_freed_pages;
+	stats->mmap_pages = sih->mmap_pages;
+	stats->blk_type = pi->i_blk_type;
+
+	if (pi->log_head == 0 || pi->log_tail == 0)
+		return 0;
+
+	stats->log_pages = nova_get_nova_log_pages(sb, sih, pi);
+
+	curr_p = pi->log_head;
+	while (curr_p != pi->log_tail) {
+		if (goto_next_page(sb, curr_p)) {
+			curr_p = next_log_page(sb, curr_p);
+			if (curr_p == 0) {
+				nova_err(sb, "%s: inode %lu log is broken\n",
+						__func__, inode->i_ino);
+				return -EIO;
+			}
+			cond_resched();
+			continue;
+		}
+
+		length = 0;
+		if (curr_log_entry_invalid(sb, pi, sih, curr_p, &length)) {
+			if (length == 0)
+				return -EIO;
+			stats->dead_entries++;
+			stats->dead_bytes += length;
+		} else {
+			stats->live_entries++;
+			stats->live_bytes += length;
+		}
+		curr_p += length;
+	}
+
+	if (S_ISREG(inode->i_mode))
+		nova_get_extent_stats(sb, sih, stats);
+
+	return 0;
+}
+
 static u64 nova_extend_inode_log(struct super_block *sb, struct nova_inode *pi,
 	struct nova_inode_info_header *sih, u64 curr_p)
 {
@@ -2020,6 +2436,19 @@ static u64 nova_append_one_log_page(struct super_block *sb,
 	return curr_p;
 }
 
+static void nova_stamp_log_page(struct super_block *sb, u64 curr_p)
+{
+	struct nova_inode_page_tail *page_tail;
+
+	if (nova_log_page_epoch(sb, curr_p) == NOVA_SB(sb)->s_epoch)
+		return;
+
+	page_tail = (struct nova_inode_page_tail *)nova_get_block(sb,
+							PAGE_TAIL(curr_p));
+	nova_set_page_epoch(sb, page_tail);
+	nova_flush_buffer(page_tail, sizeof(struct nova_inode_page_tail), 0);
+}
+
 u64 nova_get_append_head(struct super_block *sb, struct nova_inode *pi,
 	struct nova_inode_info_header *sih, u64 tail, size_t size, int *extended)
 {
@@ -2030,6 +2459,13 @@ u64 nova_get_append_head(struct super_block *sb, struct nova_inode *pi,
 	else
 		curr_p = pi->log_tail;
 
+	/* Leave the log pages of a snapshot as they were */
+	if (sih && curr_p && ENTRY_LOC(curr_p) &&
+			nova_log_page_frozen(sb, curr_p)) {
+		nova_set_next_page_flag(sb, curr_p);
+		curr_p = PAGE_TAIL(curr_p);
+	}
+
 	if (curr_p == 0 || (is_last_entry(curr_p, size) &&
 				next_log_page(sb, curr_p) == 0)) {
 		if (is_last_entry(curr_p, size))
@@ -2052,6 +2488,10 @@ u64 nova_get_append_head(struct super_block *sb, struct nova_inode *pi,
 		curr_p = next_log_page(sb, curr_p);
 	}
 
+	/* A page takes the epoch of its first entry */
+	if (ENTRY_LOC(curr_p) == 0)
+		nova_stamp_log_page(sb, curr_p);
+
 	return  curr_p;
 }
 
@@ -2081,6 +2521,7 @@ u64 nova_append_file_write_entry(struct super_block *sb, struct nova_inode *pi,
 	entry = (struct nova_file_write_entry *)nova_get_block(sb, curr_p);
 	memcpy_to_pmem_nocache(entry, data,
 			sizeof(struct nova_file_write_entry));
+	NOVA_WA_ADD(wa_log, size);
 	nova_dbg_verbose("file %lu entry @ 0x%llx: pgoff %llu, num %u, "
 			"block %llu, size %llu\n", inode->i_ino,
 			curr_p, entry->pgoff, entry->num_pages,
@@ -2097,6 +2538,7 @@ void nova_free_inode_log(struct super_block *sb, struct nova_inode *pi)
 	int freed = 0;
 	timing_t free_time;
 
+	nova_drop_index(sb, pi);
 	if (pi->log_head == 0 || pi->log_tail == 0)
 		return;
 
@@ -2152,6 +2594,8 @@ int nova_rebuild_file_inode_tree(struct super_block *sb,
 		return 0;
 
 	sih->log_pages = 1;
+	/* Only replay what the index snapshot does not cover */
+	nova_load_index(sb, pi, sih, &curr_p);
 
 	while (curr_p != pi->log_tail) {
 		if (goto_next_page(sb, curr_p)) {
@@ -2164,6 +2608,10 @@ int nova_rebuild_file_inode_tree(struct super_block *sb,
 			BUG();
 		}
 
+		/* A snapshot mount stops at the pages of later epochs */
+		if (nova_snapshot_log_end(sb, curr_p))
+			break;
+
 		addr = (void *)nova_get_block(sb, curr_p);
 		type = nova_get_entry_type(addr);
 		switch (type) {
@@ -2192,7 +2640,12 @@ int nova_rebuild_file_inode_tree(struct super_block *sb,
 		}
 
 		entry = (struct nova_file_write_entry *)addr;
-		if (entry->num_pages != entry->invalid_pages) {
+		if (nova_entry_hole(entry)) {
+			/* The punched blocks are already freed */
+			nova_delete_file_tree(sb, sih, entry->pgoff,
+				entry->pgoff + entry->num_pages - 1,
+				false, false);
+		} else if (entry->num_pages != entry->invalid_pages) {
 			/*
 			 * The overlaped blocks are already freed.
 			 * Don't double free them, just re-assign the pointers.
@@ -2206,6 +2659,7 @@ int nova_rebuild_file_inode_tree(struct super_block *sb,
 		curr_p += sizeof(struct nova_file_write_entry);
 	}
 
+	nova_snapshot_rebuild_tree(sb, sih);
 	sih->i_size = le64_to_cpu(pi->i_size);
 	sih->i_mode = le16_to_cpu(pi->i_mode);
 	nova_flush_buffer(pi, sizeof(struct nova_inode), 0);
@@ -18,6 +18,7 @@
 #include <linux/sched.h>
 #include <linux/compat.h>
 #include <linux/mount.h>
+#include <linux/file.h>
 #include "nova.h"
 
 long nova_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
@@ -134,6 +135,130 @@ setversion_out:
 		nova_print_free_lists(sb);
 		return 0;
 	}
+	case NOVA_GET_ALLOC_POLICY:
+		return put_user(pi->i_alloc_policy, (int __user *)arg);
+	case NOVA_SET_ALLOC_POLICY: {
+		unsigned int policy;
+
+		if (!inode_owner_or_capable(inode))
+			return -EPERM;
+		if (get_user(policy, (int __user *)arg))
+			return -EFAULT;
+		if (policy != NOVA_ALLOC_LOCAL &&
+				policy != NOVA_ALLOC_INTERLEAVE)
+			return -EINVAL;
+		ret = mnt_want_write_file(filp);
+		if (ret)
+			return ret;
+
+		/* Only steers future allocations; placed pages stay put */
+		mutex_lock(&inode->i_mutex);
+		nova_memunlock_inode(sb, pi);
+		pi->i_alloc_policy = policy;
+		nova_memlock_inode(sb, pi);
+		nova_flush_buffer(&pi->i_alloc_policy, 1, 1);
+		mutex_unlock(&inode->i_mutex);
+		mnt_drop_write_file(filp);
+		return 0;
+	}
+	case NOVA_GET_LOG_STATS: {
+		struct nova_log_stats stats;
+
+		mutex_lock(&inode->i_mutex);
+		ret = nova_get_log_stats(sb, inode, &stats);
+		mutex_unlock(&inode->i_mutex);
+		if (ret)
+			return ret;
+		if (copy_to_user((void __user *)arg, &stats, sizeof(stats)))
+			return -EFAULT;
+		return 0;
+	}
+	case NOVA_DEFRAG: {
+		struct nova_defrag defrag;
+
+		if (!S_ISREG(inode->i_mode))
+			return -EINVAL;
+		if (!(filp->f_mode & FMODE_WRITE))
+			return -EBADF;
+		if (copy_from_user(&defrag, (void __user *)arg,
+					sizeof(defrag)))
+			return -EFAULT;
+		ret = mnt_want_write_file(filp);
+		if (ret)
+			return ret;
+
+		mutex_lock(&inode->i_mutex);
+		ret = nova_defrag_file(sb, inode, &defrag);
+		mutex_unlock(&inode->i_mutex);
+		mnt_drop_write_file(filp);
+
+		if (copy_to_user((void __user *)arg, &defrag, sizeof(defrag)))
+			return -EFAULT;
+		return ret;
+	}
+	case NOVA_CLONE_RANGE: {
+		struct nova_clone_range clone;
+		struct fd src;
+
+		if (!(filp->f_mode & FMODE_WRITE))
+			return -EBADF;
+		if (IS_APPEND(inode) || IS_IMMUTABLE(inode))
+			return -EPERM;
+		if (copy_from_user(&clone, (void __user *)arg, sizeof(clone)))
+			return -EFAULT;
+
+		src = fdget(clone.src_fd);
+		if (!src.file)
+			return -EBADF;
+		ret = -EBADF;
+		if (src.file->f_mode & FMODE_READ) {
+			ret = mnt_want_write_file(filp);
+			if (ret == 0) {
+				ret = nova_clone_file_range(src.file,
+						clone.src_offset, filp,
+						clone.dest_offset,
+						clone.src_length);
+				mnt_drop_write_file(filp);
+			}
+		}
+		fdput(src);
+		return ret;
+	}
+	case NOVA_NAMEI_BATCH: {
+		return nova_namei_batch(filp,
+				(struct nova_namei_batch __user *)arg);
+	}
+	case NOVA_CREATE_SNAPSHOT: {
+		u64 epoch;
+
+		if (!capable(CAP_SYS_ADMIN))
+			return -EPERM;
+		/* Freezes the fs, so it must not hold write access */
+		ret = nova_create_snapshot(sb, &epoch);
+		if (ret)
+			return ret;
+		if (put_user(epoch, (__u64 __user *)arg))
+			return -EFAULT;
+		return 0;
+	}
+	case NOVA_LIST_SNAPSHOTS: {
+		return nova_list_snapshots(sb,
+				(struct nova_snapshot_list __user *)arg);
+	}
+	case NOVA_DELETE_SNAPSHOT: {
+		u64 epoch;
+
+		if (!capable(CAP_SYS_ADMIN))
+			return -EPERM;
+		if (get_user(epoch, (__u64 __user *)arg))
+			return -EFAULT;
+		ret = mnt_want_write_file(filp);
+		if (ret)
+			return ret;
+		ret = nova_delete_snapshot(sb, epoch);
+		mnt_drop_write_file(filp);
+		return ret;
+	}
 	default:
 		return -ENOTTY;
 	}
@@ -47,21 +47,41 @@ static u64 next_lite_journal(u64 curr_p)
 	return curr_p + size;
 }
 
-static void nova_recover_lite_journal_entry(struct super_block *sb,
+static u64 nova_read_journal_value(void *addr, u8 type)
+{
+	switch (type) {
+		case 1:
+			return *(u8 *)addr;
+		case 2:
+			return *(u16 *)addr;
+		case 4:
+			return *(u32 *)addr;
+		case 8:
+			return *(u64 *)addr;
+		default:
+			nova_dbg("%s: unknown data type %u\n",
+					__func__, type);
+			return 0;
+	}
+}
+
+static void nova_write_journal_value(struct super_block *sb,
 	u64 addr, u64 value, u8 type)
 {
+	void *block = nova_get_block(sb, addr & NOVA_JOURNAL_ADDR_MASK);
+
 	switch (type) {
 		case 1:
-			*(u8 *)nova_get_block(sb, addr) = (u8)value;
+			*(u8 *)block = (u8)value;
 			break;
 		case 2:
-			*(u16 *)nova_get_block(sb, addr) = (u16)value;
+			*(u16 *)block = (u16)value;
 			break;
 		case 4:
-			*(u32 *)nova_get_block(sb, addr) = (u32)value;
+			*(u32 *)block = (u32)value;
 			break;
 		case 8:
-			*(u64 *)nova_get_block(sb, addr) = (u64)value;
+			*(u64 *)block = (u64)value;
 			break;
 		default:
 			nova_dbg("%s: unknown data type %u\n",
@@ -69,7 +89,7 @@ static void nova_recover_lite_journal_entry(struct super_block *sb,
 			break;
 	}
 
-	nova_flush_buffer((void *)nova_get_block(sb, addr), CACHELINE_SIZE, 0);
+	nova_flush_buffer(block, CACHELINE_SIZE, 0);
 }
 
 void nova_print_lite_transaction(struct nova_lite_journal_entry *entry)
@@ -81,53 +101,158 @@ void nova_print_lite_transaction(struct nova_lite_journal_entry *entry)
 				i, entry->addrs[i], entry->values[i]);
 }
 
-u64 nova_create_lite_transaction(struct super_block *sb,
-	struct nova_lite_journal_entry *dram_entry1,
-	struct nova_lite_journal_entry *dram_entry2,
-	int entries, int cpu)
+void nova_init_transaction(struct nova_transaction *txn)
+{
+	INIT_LIST_HEAD(&txn->list);
+	txn->nr_updates = 0;
+	txn->committed = 0;
+}
+
+/* Record that *addr becomes value when txn commits */
+void nova_txn_add(struct super_block *sb, struct nova_transaction *txn,
+	void *addr, u64 value, u8 size)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	int i = txn->nr_updates;
+
+	BUG_ON(i >= NOVA_TXN_MAX_UPDATES);
+
+	txn->addrs[i] = (u64)nova_get_addr_off(sbi, addr);
+	txn->addrs[i] |= (u64)size << 56;
+	txn->old_values[i] = nova_read_journal_value(addr, size);
+	txn->new_values[i] = value;
+	txn->nr_updates++;
+}
+
+/* Move queued transactions that fit in one group commit to group */
+static int nova_take_journal_group(struct nova_sb_info *sbi,
+	struct list_head *group)
+{
+	struct nova_transaction *txn, *next;
+	int updates = 0;
+
+	spin_lock(&sbi->journal_queue_lock);
+	list_for_each_entry_safe(txn, next, &sbi->journal_queue, list) {
+		if (updates + txn->nr_updates > NOVA_GROUP_MAX_ENTRIES * 4)
+			break;
+		updates += txn->nr_updates;
+		list_move_tail(&txn->list, group);
+	}
+	spin_unlock(&sbi->journal_queue_lock);
+
+	return updates;
+}
+
+/*
+ * Commit a group of transactions with one journal record: write the old
+ * values of every update, apply all new values, then move the head.
+ * That is three fences for the whole group instead of three per
+ * transaction. Caller holds the journal lock of cpu.
+ */
+static void nova_group_commit(struct super_block *sb,
+	struct list_head *group, int cpu)
 {
 	struct ptr_pair *pair;
-	struct nova_lite_journal_entry *entry;
+	struct nova_lite_journal_entry entry;
+	struct nova_transaction *txn, *next;
 	size_t size = sizeof(struct nova_lite_journal_entry);
-	u64 new_tail, temp;;
+	u64 curr;
+	int i, slot = 0;
+	timing_t commit_time;
+
+	NOVA_START_TIMING(group_commit_t, commit_time);
 
 	pair = nova_get_journal_pointers(sb, cpu);
 	if (!pair || pair->journal_head == 0 ||
 			pair->journal_head != pair->journal_tail)
 		BUG();
 
-	temp = pair->journal_head;
-	entry = (struct nova_lite_journal_entry *)nova_get_block(sb,
-							temp);
+	curr = pair->journal_head;
+	memset(&entry, 0, size);
+	list_for_each_entry(txn, group, list) {
+		for (i = 0; i < txn->nr_updates; i++) {
+			entry.addrs[slot] = txn->addrs[i];
+			entry.values[slot] = txn->old_values[i];
+			if (++slot < 4)
+				continue;
+
+			memcpy_to_pmem_nocache(nova_get_block(sb, curr),
+						&entry, size);
+			NOVA_WA_ADD(wa_journal, size);
+			curr = next_lite_journal(curr);
+			memset(&entry, 0, size);
+			slot = 0;
+		}
+		NOVA_STATS_ADD(group_commit_trans, 1);
+	}
 
-//	nova_print_lite_transaction(dram_entry1);
-	memcpy_to_pmem_nocache(entry, dram_entry1, size);
+	if (slot) {
+		memcpy_to_pmem_nocache(nova_get_block(sb, curr), &entry, size);
+		NOVA_WA_ADD(wa_journal, size);
+		curr = next_lite_journal(curr);
+	}
 
-	if (entries == 2) {
-		temp = next_lite_journal(temp);
-		entry = (struct nova_lite_journal_entry *)nova_get_block(sb,
-							temp);
-//		nova_print_lite_transaction(dram_entry2);
-		memcpy_to_pmem_nocache(entry, dram_entry2, size);
+	pair->journal_tail = curr;
+	nova_flush_buffer(&pair->journal_head, CACHELINE_SIZE, 1);
+
+	/* The protected updates are charged to the journal as well */
+	list_for_each_entry(txn, group, list) {
+		for (i = 0; i < txn->nr_updates; i++) {
+			nova_write_journal_value(sb, txn->addrs[i],
+					txn->new_values[i],
+					txn->addrs[i] >> 56);
+			NOVA_WA_ADD(wa_journal, txn->addrs[i] >> 56);
+		}
 	}
+	PERSISTENT_BARRIER();
 
-	new_tail = next_lite_journal(temp);
-	pair->journal_tail = new_tail;
+	pair->journal_head = curr;
 	nova_flush_buffer(&pair->journal_head, CACHELINE_SIZE, 1);
 
-	return new_tail;
+	/* Owners may return as soon as committed is set */
+	list_for_each_entry_safe(txn, next, group, list) {
+		list_del(&txn->list);
+		smp_store_release(&txn->committed, 1);
+	}
+
+	NOVA_END_TIMING(group_commit_t, commit_time);
 }
 
-void nova_commit_lite_transaction(struct super_block *sb, u64 tail, int cpu)
+void nova_commit_transaction(struct super_block *sb,
+	struct nova_transaction *txn)
 {
-	struct ptr_pair *pair;
-
-	pair = nova_get_journal_pointers(sb, cpu);
-	if (!pair || pair->journal_tail != tail)
-		BUG();
-
-	pair->journal_head = tail;
-	nova_flush_buffer(&pair->journal_head, CACHELINE_SIZE, 1);
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	LIST_HEAD(group);
+	u64 trace_start;
+	int groups = 0;
+	int cpu;
+
+	if (txn->nr_updates == 0)
+		return;
+
+	trace_start = NOVA_TRACE_START(nova_commit_exit);
+	/* Stay on this CPU; only CPUs folded onto its journal share the lock */
+	cpu = get_cpu() % sbi->cpus;
+	trace_nova_commit_enter(sb, cpu, txn->nr_updates);
+	spin_lock(&sbi->journal_queue_lock);
+	list_add_tail(&txn->list, &sbi->journal_queue);
+	spin_unlock(&sbi->journal_queue_lock);
+
+	/*
+	 * Lead a group commit of everything queued so far. Another CPU may
+	 * have taken our transaction into its group; then wait for it.
+	 */
+	while (!smp_load_acquire(&txn->committed)) {
+		spin_lock(&sbi->journal_locks[cpu]);
+		if (nova_take_journal_group(sbi, &group)) {
+			nova_group_commit(sb, &group, cpu);
+			groups++;
+		}
+		spin_unlock(&sbi->journal_locks[cpu]);
+		cpu_relax();
+	}
+	trace_nova_commit_exit(sb, cpu, groups, trace_start);
+	put_cpu();
 }
 
 static void nova_undo_lite_journal_entry(struct super_block *sb,
@@ -136,32 +261,34 @@ static void nova_undo_lite_journal_entry(struct super_block *sb,
 	int i;
 	u8 type;
 
-	for (i = 0; i < 4; i++) {
+	/* Reverse order so the oldest value of an address wins */
+	for (i = 3; i >= 0; i--) {
 		type = entry->addrs[i] >> 56;
 		if (entry->addrs[i] && type) {
 			nova_dbg("%s: recover entry %d\n", __func__, i);
-			nova_recover_lite_journal_entry(sb, entry->addrs[i],
+			nova_write_journal_value(sb, entry->addrs[i],
 					entry->values[i], type);
 		}
 	}
 }
 
+/* Roll back the uncommitted group between head and tail, newest first */
 static int nova_recover_lite_journal(struct super_block *sb,
-	struct ptr_pair *pair, int recover)
+	struct ptr_pair *pair, int entries)
 {
 	struct nova_lite_journal_entry *entry;
-	u64 temp;
-
-	entry = (struct nova_lite_journal_entry *)nova_get_block(sb,
-							pair->journal_head);
-	nova_undo_lite_journal_entry(sb, entry);
+	u64 page = pair->journal_head & PAGE_MASK;
+	u64 first = pair->journal_head & ~PAGE_MASK;
+	size_t size = sizeof(struct nova_lite_journal_entry);
+	int per_page = PAGE_SIZE / size;
+	int i;
 
-	if (recover == 2) {
-		temp = next_lite_journal(pair->journal_head);
+	for (i = entries - 1; i >= 0; i--) {
 		entry = (struct nova_lite_journal_entry *)nova_get_block(sb,
-							temp);
+			page + ((first / size + i) % per_page) * size);
 		nova_undo_lite_journal_entry(sb, entry);
 	}
+	PERSISTENT_BARRIER();
 
 	pair->journal_tail = pair->journal_head;
 	nova_flush_buffer(&pair->journal_head, CACHELINE_SIZE, 1);
@@ -173,6 +300,7 @@ int nova_lite_journal_soft_init(struct super_block *sb)
 {
 	struct nova_sb_info *sbi = NOVA_SB(sb);
 	struct ptr_pair *pair;
+	int entries;
 	int i;
 	u64 temp;
 
@@ -184,21 +312,25 @@ int nova_lite_journal_soft_init(struct super_block *sb)
 	for (i = 0; i < sbi->cpus; i++)
 		spin_lock_init(&sbi->journal_locks[i]);
 
+	spin_lock_init(&sbi->journal_queue_lock);
+	INIT_LIST_HEAD(&sbi->journal_queue);
+
 	for (i = 0; i < sbi->cpus; i++) {
 		pair = nova_get_journal_pointers(sb, i);
 		if (pair->journal_head == pair->journal_tail)
 			continue;
 
-		/* We only allow up to two uncommited entries */
-		temp = next_lite_journal(pair->journal_head);
-		if (pair->journal_tail == temp) {
-			nova_recover_lite_journal(sb, pair, 1);
-			continue;
+		/* A group commit spans at most NOVA_GROUP_MAX_ENTRIES */
+		temp = pair->journal_head;
+		for (entries = 1; entries <= NOVA_GROUP_MAX_ENTRIES;
+							entries++) {
+			temp = next_lite_journal(temp);
+			if (temp == pair->journal_tail)
+				break;
 		}
 
-		temp = next_lite_journal(temp);
-		if (pair->journal_tail == temp) {
-			nova_recover_lite_journal(sb, pair, 2);
+		if (entries <= NOVA_GROUP_MAX_ENTRIES) {
+			nova_recover_lite_journal(sb, pair, entries);
 			continue;
 		}
 
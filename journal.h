@@ -30,11 +30,34 @@ struct nova_lite_journal_entry {
 	u64 values[4];
 };
 
+#define	NOVA_JOURNAL_ADDR_MASK	((1ULL << 56) - 1)
+
+/*
+ * Updates in one transaction, and journal entries in one group commit.
+ * A lite journal page holds 64 entries and head == tail means empty.
+ */
+#define	NOVA_TXN_MAX_UPDATES	16
+#define	NOVA_GROUP_MAX_ENTRIES	32
+
+/*
+ * A set of in-place metadata updates that become durable atomically.
+ * Transactions queued at the same time are journaled, applied and
+ * committed together by whichever CPU gets to the journal first.
+ */
+struct nova_transaction {
+	struct list_head list;
+	int	nr_updates;
+	int	committed;
+	u64	addrs[NOVA_TXN_MAX_UPDATES];	/* Highest byte is size */
+	u64	old_values[NOVA_TXN_MAX_UPDATES];
+	u64	new_values[NOVA_TXN_MAX_UPDATES];
+};
+
 int nova_lite_journal_soft_init(struct super_block *sb);
 int nova_lite_journal_hard_init(struct super_block *sb);
-u64 nova_create_lite_transaction(struct super_block *sb,
-	struct nova_lite_journal_entry *dram_entry1,
-	struct nova_lite_journal_entry *dram_entry2,
-	int entries, int cpu);
-void nova_commit_lite_transaction(struct super_block *sb, u64 tail, int cpu);
+void nova_init_transaction(struct nova_transaction *txn);
+void nova_txn_add(struct super_block *sb, struct nova_transaction *txn,
+	void *addr, u64 value, u8 size);
+void nova_commit_transaction(struct super_block *sb,
+	struct nova_transaction *txn);
 #endif    /* __NOVA_JOURNAL_H__ */
@@ -16,6 +16,10 @@
  */
 #include <linux/fs.h>
 #include <linux/pagemap.h>
+#include <linux/namei.h>
+#include <linux/mount.h>
+#include <linux/security.h>
+#include <linux/fsnotify.h>
 #include "nova.h"
 
 static ino_t nova_inode_by_name(struct inode *dir, struct qstr *entry,
@@ -69,39 +73,111 @@ static struct dentry *nova_lookup(struct inode *dir, struct dentry *dentry,
 static void nova_lite_transaction_for_new_inode(struct super_block *sb,
 	struct nova_inode *pi, struct nova_inode *pidir, u64 pidir_tail)
 {
-	struct nova_sb_info *sbi = NOVA_SB(sb);
-	struct nova_lite_journal_entry entry;
-	int cpu;
-	u64 journal_tail;
+	struct nova_transaction txn;
 	timing_t trans_time;
 
 	NOVA_START_TIMING(create_trans_t, trans_time);
 
-	/* Commit a lite transaction */
-	memset(&entry, 0, sizeof(struct nova_lite_journal_entry));
-	entry.addrs[0] = (u64)nova_get_addr_off(sbi, &pidir->log_tail);
-	entry.addrs[0] |= (u64)8 << 56;
-	entry.values[0] = pidir->log_tail;
+	nova_init_transaction(&txn);
+	nova_txn_add(sb, &txn, &pidir->log_tail, pidir_tail, 8);
+	nova_txn_add(sb, &txn, &pi->valid, 1, 1);
+	nova_commit_transaction(sb, &txn);
 
-	entry.addrs[1] = (u64)nova_get_addr_off(sbi, &pi->valid);
-	entry.addrs[1] |= (u64)1 << 56;
-	entry.values[1] = pi->valid;
+	NOVA_END_TIMING(create_trans_t, trans_time);
+}
 
-	cpu = smp_processor_id();
-	spin_lock(&sbi->journal_locks[cpu]);
-	journal_tail = nova_create_lite_transaction(sb, &entry, NULL, 1, cpu);
+/*
+ * Batched namespace operations (NOVA_NAMEI_BATCH).
+ *
+ * While a batch runs on a directory, creates and mkdirs in it append their
+ * dentries behind the uncommitted batch tail and only queue the new inode.
+ * Up to NOVA_BATCH_INODES new inodes and the directory tail are then
+ * committed by one lite transaction. The caller holds the directory i_mutex
+ * for the whole batch, so nobody else appends to the directory log.
+ *
+ * Queued dentries stay negative until the commit, so nobody can link the
+ * new inodes or create children under the new directories while they are
+ * still invalid on media. That is why the batch calls nova_create and
+ * nova_mkdir itself instead of going through the VFS: fsnotify is only
+ * told about the new names once the commit has instantiated them.
+ */
+static inline u64 nova_dir_pending_tail(struct inode *dir)
+{
+	struct nova_dir_batch *batch = NOVA_I(dir)->header.batch;
 
-	pidir->log_tail = pidir_tail;
-	nova_flush_buffer(&pidir->log_tail, CACHELINE_SIZE, 0);
-	pi->valid = 1;
-	nova_flush_buffer(&pi->valid, CACHELINE_SIZE, 0);
-	PERSISTENT_BARRIER();
+	return batch ? batch->dir_tail : 0;
+}
 
-	nova_commit_lite_transaction(sb, journal_tail, cpu);
-	spin_unlock(&sbi->journal_locks[cpu]);
+static void nova_commit_dir_batch(struct super_block *sb, struct inode *dir)
+{
+	struct nova_dir_batch *batch = NOVA_I(dir)->header.batch;
+	struct nova_transaction txn;
+	struct nova_inode *pidir;
+	int i;
+	timing_t trans_time;
+
+	if (!batch || batch->dir_tail == 0)
+		return;
+
+	NOVA_START_TIMING(create_trans_t, trans_time);
+	pidir = nova_get_inode(sb, dir);
+
+	nova_init_transaction(&txn);
+	nova_txn_add(sb, &txn, &pidir->log_tail, batch->dir_tail, 8);
+	for (i = 0; i < batch->nr_inodes; i++)
+		nova_txn_add(sb, &txn, &batch->new_inodes[i]->valid, 1, 1);
+	nova_commit_transaction(sb, &txn);
+
+	for (i = 0; i < batch->nr_inodes; i++) {
+		d_instantiate(batch->dentries[i], batch->inodes[i]);
+		unlock_new_inode(batch->inodes[i]);
+		if (S_ISDIR(batch->inodes[i]->i_mode))
+			fsnotify_mkdir(dir, batch->dentries[i]);
+		else
+			fsnotify_create(dir, batch->dentries[i]);
+		dput(batch->dentries[i]);
+	}
+
+	batch->dir_tail = 0;
+	batch->nr_inodes = 0;
 	NOVA_END_TIMING(create_trans_t, trans_time);
 }
 
+static bool nova_dir_batch_pending(struct inode *dir, struct dentry *dentry)
+{
+	struct nova_dir_batch *batch = NOVA_I(dir)->header.batch;
+	int i;
+
+	for (i = 0; i < batch->nr_inodes; i++)
+		if (batch->dentries[i] == dentry)
+			return true;
+
+	return false;
+}
+
+static void nova_commit_new_inode(struct super_block *sb, struct inode *dir,
+	struct dentry *dentry, struct inode *inode, struct nova_inode *pi,
+	struct nova_inode *pidir, u64 pidir_tail)
+{
+	struct nova_dir_batch *batch = NOVA_I(dir)->header.batch;
+	int i;
+
+	if (!batch) {
+		d_instantiate(dentry, inode);
+		unlock_new_inode(inode);
+		nova_lite_transaction_for_new_inode(sb, pi, pidir, pidir_tail);
+		return;
+	}
+
+	i = batch->nr_inodes++;
+	batch->dir_tail = pidir_tail;
+	batch->new_inodes[i] = pi;
+	batch->dentries[i] = dget(dentry);
+	batch->inodes[i] = inode;
+	if (batch->nr_inodes == NOVA_BATCH_INODES)
+		nova_commit_dir_batch(sb, dir);
+}
+
 /* Returns new tail after append */
 /*
  * By the time this is called, we already have created
@@ -124,6 +200,7 @@ static int nova_create(struct inode *dir, struct dentry *dentry, umode_t mode,
 	timing_t create_time;
 
 	NOVA_START_TIMING(create_t, create_time);
+	NOVA_WA_BEGIN(wa_create);
 
 	pidir = nova_get_inode(sb, dir);
 	if (!pidir)
@@ -133,7 +210,8 @@ static int nova_create(struct inode *dir, struct dentry *dentry, umode_t mode,
 	if (ino == 0)
 		goto out_err;
 
-	err = nova_add_dentry(dentry, ino, 0, 0, &tail);
+	err = nova_add_dentry(dentry, ino, mode, 0,
+				nova_dir_pending_tail(dir), &tail);
 	if (err)
 		goto out_err;
 
@@ -144,15 +222,14 @@ static int nova_create(struct inode *dir, struct dentry *dentry, umode_t mode,
 	if (IS_ERR(inode))
 		goto out_err;
 
-	d_instantiate(dentry, inode);
-	unlock_new_inode(inode);
-
 	pi = nova_get_block(sb, pi_addr);
-	nova_lite_transaction_for_new_inode(sb, pi, pidir, tail);
+	nova_commit_new_inode(sb, dir, dentry, inode, pi, pidir, tail);
+	NOVA_WA_END(wa_create);
 	NOVA_END_TIMING(create_t, create_time);
 	return err;
 out_err:
 	nova_err(sb, "%s return %d\n", __func__, err);
+	NOVA_WA_END(wa_create);
 	NOVA_END_TIMING(create_t, create_time);
 	return err;
 }
@@ -170,6 +247,7 @@ static int nova_mknod(struct inode *dir, struct dentry *dentry, umode_t mode,
 	timing_t mknod_time;
 
 	NOVA_START_TIMING(mknod_t, mknod_time);
+	NOVA_WA_BEGIN(wa_create);
 
 	pidir = nova_get_inode(sb, dir);
 	if (!pidir)
@@ -181,7 +259,7 @@ static int nova_mknod(struct inode *dir, struct dentry *dentry, umode_t mode,
 
 	nova_dbgv("%s: %s\n", __func__, dentry->d_name.name);
 	nova_dbgv("%s: inode %llu, dir %lu\n", __func__, ino, dir->i_ino);
-	err = nova_add_dentry(dentry, ino, 0, 0, &tail);
+	err = nova_add_dentry(dentry, ino, mode, 0, 0, &tail);
 	if (err)
 		goto out_err;
 
@@ -195,10 +273,12 @@ static int nova_mknod(struct inode *dir, struct dentry *dentry, umode_t mode,
 
 	pi = nova_get_block(sb, pi_addr);
 	nova_lite_transaction_for_new_inode(sb, pi, pidir, tail);
+	NOVA_WA_END(wa_create);
 	NOVA_END_TIMING(mknod_t, mknod_time);
 	return err;
 out_err:
 	nova_err(sb, "%s return %d\n", __func__, err);
+	NOVA_WA_END(wa_create);
 	NOVA_END_TIMING(mknod_t, mknod_time);
 	return err;
 }
@@ -220,6 +300,7 @@ static int nova_symlink(struct inode *dir, struct dentry *dentry,
 	timing_t symlink_time;
 
 	NOVA_START_TIMING(symlink_t, symlink_time);
+	NOVA_WA_BEGIN(wa_create);
 	if (len + 1 > sb->s_blocksize)
 		goto out;
 
@@ -234,7 +315,7 @@ static int nova_symlink(struct inode *dir, struct dentry *dentry,
 	nova_dbgv("%s: name %s, symname %s\n", __func__,
 				dentry->d_name.name, symname);
 	nova_dbgv("%s: inode %llu, dir %lu\n", __func__, ino, dir->i_ino);
-	err = nova_add_dentry(dentry, ino, 0, 0, &tail);
+	err = nova_add_dentry(dentry, ino, S_IFLNK, 0, 0, &tail);
 	if (err)
 		goto out_fail1;
 
@@ -269,6 +350,7 @@ static int nova_symlink(struct inode *dir, struct dentry *dentry,
 
 	nova_lite_transaction_for_new_inode(sb, pi, pidir, tail);
 out:
+	NOVA_WA_END(wa_create);
 	NOVA_END_TIMING(symlink_t, symlink_time);
 	return err;
 
@@ -283,46 +365,18 @@ static void nova_lite_transaction_for_time_and_link(struct super_block *sb,
 	struct nova_inode *pi, struct nova_inode *pidir, u64 pi_tail,
 	u64 pidir_tail, int invalidate)
 {
-	struct nova_sb_info *sbi = NOVA_SB(sb);
-	struct nova_lite_journal_entry entry;
-	u64 journal_tail;
-	int cpu;
+	struct nova_transaction txn;
 	timing_t trans_time;
 
 	NOVA_START_TIMING(link_trans_t, trans_time);
 
-	/* Commit a lite transaction */
-	memset(&entry, 0, sizeof(struct nova_lite_journal_entry));
-	entry.addrs[0] = (u64)nova_get_addr_off(sbi, &pi->log_tail);
-	entry.addrs[0] |= (u64)8 << 56;
-	entry.values[0] = pi->log_tail;
-
-	entry.addrs[1] = (u64)nova_get_addr_off(sbi, &pidir->log_tail);
-	entry.addrs[1] |= (u64)8 << 56;
-	entry.values[1] = pidir->log_tail;
+	nova_init_transaction(&txn);
+	nova_txn_add(sb, &txn, &pi->log_tail, pi_tail, 8);
+	nova_txn_add(sb, &txn, &pidir->log_tail, pidir_tail, 8);
+	if (invalidate)
+		nova_txn_add(sb, &txn, &pi->valid, 0, 1);
+	nova_commit_transaction(sb, &txn);
 
-	if (invalidate) {
-		entry.addrs[2] = (u64)nova_get_addr_off(sbi, &pi->valid);
-		entry.addrs[2] |= (u64)1 << 56;
-		entry.values[2] = pi->valid;
-	}
-
-	cpu = smp_processor_id();
-	spin_lock(&sbi->journal_locks[cpu]);
-	journal_tail = nova_create_lite_transaction(sb, &entry, NULL, 1, cpu);
-
-	pi->log_tail = pi_tail;
-	nova_flush_buffer(&pi->log_tail, CACHELINE_SIZE, 0);
-	pidir->log_tail = pidir_tail;
-	nova_flush_buffer(&pidir->log_tail, CACHELINE_SIZE, 0);
-	if (invalidate) {
-		pi->valid = 0;
-		nova_flush_buffer(&pi->valid, CACHELINE_SIZE, 0);
-	}
-	PERSISTENT_BARRIER();
-
-	nova_commit_lite_transaction(sb, journal_tail, cpu);
-	spin_unlock(&sbi->journal_locks[cpu]);
 	NOVA_END_TIMING(link_trans_t, trans_time);
 }
 
@@ -353,6 +407,7 @@ int nova_append_link_change_entry(struct super_block *sb,
 	entry->flags = cpu_to_le32(inode->i_flags);
 	entry->generation = cpu_to_le32(inode->i_generation);
 	nova_flush_buffer(entry, size, 0);
+	NOVA_WA_ADD(wa_log, size);
 	*new_tail = curr_p + size;
 	sih->last_link_change = curr_p;
 
@@ -403,7 +458,8 @@ static int nova_link(struct dentry *dest_dentry, struct inode *dir,
 			dentry->d_name.name, dest_dentry->d_name.name);
 	nova_dbgv("%s: inode %lu, dir %lu\n", __func__,
 			inode->i_ino, dir->i_ino);
-	err = nova_add_dentry(dentry, inode->i_ino, 0, 0, &pidir_tail);
+	err = nova_add_dentry(dentry, inode->i_ino, inode->i_mode, 0, 0,
+				&pidir_tail);
 	if (err) {
 		iput(inode);
 		goto out;
@@ -439,6 +495,7 @@ static int nova_unlink(struct inode *dir, struct dentry *dentry)
 	timing_t unlink_time;
 
 	NOVA_START_TIMING(unlink_t, unlink_time);
+	NOVA_WA_BEGIN(wa_unlink);
 
 	pidir = nova_get_inode(sb, dir);
 	if (!pidir)
@@ -447,6 +504,8 @@ static int nova_unlink(struct inode *dir, struct dentry *dentry)
 	nova_dbgv("%s: %s\n", __func__, dentry->d_name.name);
 	nova_dbgv("%s: inode %lu, dir %lu\n", __func__,
 				inode->i_ino, dir->i_ino);
+	/* Unlink touches the victim's log too, so it is never batched */
+	nova_commit_dir_batch(sb, dir);
 	retval = nova_remove_dentry(dentry, 0, 0, &pidir_tail);
 	if (retval)
 		goto out;
@@ -467,10 +526,12 @@ static int nova_unlink(struct inode *dir, struct dentry *dentry)
 	nova_lite_transaction_for_time_and_link(sb, pi, pidir,
 					pi_tail, pidir_tail, invalidate);
 
+	NOVA_WA_END(wa_unlink);
 	NOVA_END_TIMING(unlink_t, unlink_time);
 	return 0;
 out:
 	nova_err(sb, "%s return %d\n", __func__, retval);
+	NOVA_WA_END(wa_unlink);
 	NOVA_END_TIMING(unlink_t, unlink_time);
 	return retval;
 }
@@ -489,6 +550,7 @@ static int nova_mkdir(struct inode *dir, struct dentry *dentry, umode_t mode)
 	timing_t mkdir_time;
 
 	NOVA_START_TIMING(mkdir_t, mkdir_time);
+	NOVA_WA_BEGIN(wa_create);
 	if (dir->i_nlink >= NOVA_LINK_MAX)
 		goto out;
 
@@ -499,7 +561,8 @@ static int nova_mkdir(struct inode *dir, struct dentry *dentry, umode_t mode)
 	nova_dbgv("%s: name %s\n", __func__, dentry->d_name.name);
 	nova_dbgv("%s: inode %llu, dir %lu, link %d\n", __func__,
 				ino, dir->i_ino, dir->i_nlink);
-	err = nova_add_dentry(dentry, ino, 1, 0, &tail);
+	err = nova_add_dentry(dentry, ino, S_IFDIR, 1,
+				nova_dir_pending_tail(dir), &tail);
 	if (err) {
 		nova_dbg("failed to add dir entry\n");
 		goto out_err;
@@ -524,11 +587,10 @@ static int nova_mkdir(struct inode *dir, struct dentry *dentry, umode_t mode)
 	pidir = nova_get_inode(sb, dir);
 	dir->i_blocks = pidir->i_blocks;
 	inc_nlink(dir);
-	d_instantiate(dentry, inode);
-	unlock_new_inode(inode);
 
-	nova_lite_transaction_for_new_inode(sb, pi, pidir, tail);
+	nova_commit_new_inode(sb, dir, dentry, inode, pi, pidir, tail);
 out:
+	NOVA_WA_END(wa_create);
 	NOVA_END_TIMING(mkdir_t, mkdir_time);
 	return err;
 
@@ -594,6 +656,8 @@ static int nova_rmdir(struct inode *dir, struct dentry *dentry)
 	if (!nova_empty_dir(inode))
 		return err;
 
+	NOVA_WA_BEGIN(wa_unlink);
+
 	nova_dbgv("%s: inode %lu, dir %lu, link %d\n", __func__,
 				inode->i_ino, dir->i_ino, dir->i_nlink);
 
@@ -621,11 +685,13 @@ static int nova_rmdir(struct inode *dir, struct dentry *dentry)
 	nova_lite_transaction_for_time_and_link(sb, pi, pidir,
 						pi_tail, pidir_tail, 1);
 
+	NOVA_WA_END(wa_unlink);
 	NOVA_END_TIMING(rmdir_t, rmdir_time);
 	return err;
 
 end_rmdir:
 	nova_err(sb, "%s return %d\n", __func__, err);
+	NOVA_WA_END(wa_unlink);
 	NOVA_END_TIMING(rmdir_t, rmdir_time);
 	return err;
 }
@@ -637,19 +703,15 @@ static int nova_rename(struct inode *old_dir,
 	struct inode *old_inode = old_dentry->d_inode;
 	struct inode *new_inode = new_dentry->d_inode;
 	struct super_block *sb = old_inode->i_sb;
-	struct nova_sb_info *sbi = NOVA_SB(sb);
 	struct nova_inode *old_pi = NULL, *new_pi = NULL;
 	struct nova_inode *new_pidir = NULL, *old_pidir = NULL;
-	struct nova_lite_journal_entry entry, entry1;
+	struct nova_transaction txn;
 	struct nova_dentry *father_entry = NULL;
 	char *head_addr = NULL;
 	u64 old_tail = 0, new_tail = 0, new_pi_tail = 0, old_pi_tail = 0;
 	int err = -ENOENT;
 	int inc_link = 0, dec_link = 0;
-	int entries = 0;
-	int cpu;
 	int change_parent = 0;
-	u64 journal_tail;
 	timing_t rename_time;
 
 	nova_dbgv("%s: rename %s to %s,\n", __func__,
@@ -659,6 +721,7 @@ static int nova_rename(struct inode *old_dir,
 			old_inode->i_ino, old_dir->i_ino, new_dir->i_ino,
 			new_inode ? new_inode->i_ino : 0);
 	NOVA_START_TIMING(rename_t, rename_time);
+	NOVA_WA_BEGIN(wa_rename);
 
 	if (new_inode) {
 		err = -ENOTEMPTY;
@@ -678,6 +741,10 @@ static int nova_rename(struct inode *old_dir,
 			inc_link = 1;
 	}
 
+	nova_commit_dir_batch(sb, old_dir);
+	if (new_dir != old_dir)
+		nova_commit_dir_batch(sb, new_dir);
+
 	new_pidir = nova_get_inode(sb, new_dir);
 	old_pidir = nova_get_inode(sb, old_dir);
 
@@ -710,7 +777,7 @@ static int nova_rename(struct inode *old_dir,
 	}
 
 	/* link into the new directory. */
-	err = nova_add_dentry(new_dentry, old_inode->i_ino,
+	err = nova_add_dentry(new_dentry, old_inode->i_ino, old_inode->i_mode,
 				inc_link, new_tail, &new_tail);
 	if (err)
 		goto out;
@@ -745,89 +812,200 @@ static int nova_rename(struct inode *old_dir,
 			goto out;
 	}
 
-	entries = 1;
-	memset(&entry, 0, sizeof(struct nova_lite_journal_entry));
+	/* One transaction covers every inode and directory involved */
+	nova_init_transaction(&txn);
+	nova_txn_add(sb, &txn, &old_pi->log_tail, old_pi_tail, 8);
+	nova_txn_add(sb, &txn, &old_pidir->log_tail, old_tail, 8);
+
+	if (old_pidir != new_pidir)
+		nova_txn_add(sb, &txn, &new_pidir->log_tail, new_tail, 8);
+
+	if (change_parent && father_entry)
+		nova_txn_add(sb, &txn, &father_entry->ino,
+				cpu_to_le64(new_dir->i_ino), 8);
 
-	entry.addrs[0] = (u64)nova_get_addr_off(sbi, &old_pi->log_tail);
-	entry.addrs[0] |= (u64)8 << 56;
-	entry.values[0] = old_pi->log_tail;
+	if (new_inode) {
+		nova_txn_add(sb, &txn, &new_pi->log_tail, new_pi_tail, 8);
+		if (!new_inode->i_nlink)
+			nova_txn_add(sb, &txn, &new_pi->valid, 0, 1);
+	}
 
-	entry.addrs[1] = (u64)nova_get_addr_off(sbi, &old_pidir->log_tail);
-	entry.addrs[1] |= (u64)8 << 56;
-	entry.values[1] = old_pidir->log_tail;
+	nova_commit_transaction(sb, &txn);
 
-	if (old_dir != new_dir) {
-		entry.addrs[2] = (u64)nova_get_addr_off(sbi,
-						&new_pidir->log_tail);
-		entry.addrs[2] |= (u64)8 << 56;
-		entry.values[2] = new_pidir->log_tail;
+	NOVA_WA_END(wa_rename);
+	NOVA_END_TIMING(rename_t, rename_time);
+	return 0;
+out:
+	nova_err(sb, "%s return %d\n", __func__, err);
+	NOVA_WA_END(wa_rename);
+	NOVA_END_TIMING(rename_t, rename_time);
+	return err;
+}
 
-		if (change_parent && father_entry) {
-			entry.addrs[3] = (u64)nova_get_addr_off(sbi,
-						&father_entry->ino);
-			entry.addrs[3] |= (u64)8 << 56;
-			entry.values[3] = father_entry->ino;
+/* The checks vfs_create and vfs_mkdir do before calling us */
+static int nova_batch_may_create(struct inode *dir, struct dentry *dentry)
+{
+	if (d_really_is_positive(dentry))
+		return -EEXIST;
+	if (IS_DEADDIR(dir))
+		return -ENOENT;
+	audit_inode_child(dir, dentry, AUDIT_TYPE_CHILD_CREATE);
+	return inode_permission(dir, MAY_WRITE | MAY_EXEC);
+}
+
+static int nova_namei_batch_op(struct path *path, struct nova_namei_op *op)
+{
+	struct dentry *parent = path->dentry;
+	struct inode *dir = parent->d_inode;
+	struct dentry *dentry, *new_dentry;
+	size_t len;
+	umode_t mode;
+	int err;
+
+	len = strnlen(op->name, NOVA_NAME_LEN + 1);
+	if (len == 0 || len > NOVA_NAME_LEN)
+		return -EINVAL;
+
+	dentry = lookup_one_len(op->name, parent, len);
+	if (IS_ERR(dentry))
+		return PTR_ERR(dentry);
+
+	/* Unlink and rename, or a name created earlier, need it visible */
+	if ((op->op != NOVA_NAMEI_CREATE && op->op != NOVA_NAMEI_MKDIR) ||
+			nova_dir_batch_pending(dir, dentry))
+		nova_commit_dir_batch(dir->i_sb, dir);
+
+	switch (op->op) {
+	case NOVA_NAMEI_CREATE:
+		mode = op->mode & S_IALLUGO;
+		if (!IS_POSIXACL(dir))
+			mode &= ~current_umask();
+		mode |= S_IFREG;
+		err = security_path_mknod(path, dentry, mode, 0);
+		if (!err)
+			err = nova_batch_may_create(dir, dentry);
+		if (!err)
+			err = security_inode_create(dir, dentry, mode);
+		if (!err)
+			err = nova_create(dir, dentry, mode, true);
+		break;
+	case NOVA_NAMEI_MKDIR:
+		mode = op->mode & (S_IRWXUGO | S_ISVTX);
+		if (!IS_POSIXACL(dir))
+			mode &= ~current_umask();
+		err = security_path_mkdir(path, dentry, mode);
+		if (!err)
+			err = nova_batch_may_create(dir, dentry);
+		if (!err)
+			err = security_inode_mkdir(dir, dentry, mode);
+		if (!err && dir->i_sb->s_max_links &&
+				dir->i_nlink >= dir->i_sb->s_max_links)
+			err = -EMLINK;
+		if (!err)
+			err = nova_mkdir(dir, dentry, mode);
+		break;
+	case NOVA_NAMEI_UNLINK:
+		err = security_path_unlink(path, dentry);
+		if (!err)
+			err = vfs_unlink(dir, dentry, NULL);
+		break;
+	case NOVA_NAMEI_RENAME:
+		len = strnlen(op->new_name, NOVA_NAME_LEN + 1);
+		if (len == 0 || len > NOVA_NAME_LEN) {
+			err = -EINVAL;
+			break;
+		}
+		new_dentry = lookup_one_len(op->new_name, parent, len);
+		if (IS_ERR(new_dentry)) {
+			err = PTR_ERR(new_dentry);
+			break;
 		}
+		if (d_is_negative(dentry))
+			err = -ENOENT;
+		else
+			err = security_path_rename(path, dentry, path,
+						new_dentry, 0);
+		if (!err)
+			err = vfs_rename(dir, dentry, dir, new_dentry,
+						NULL, 0);
+		dput(new_dentry);
+		break;
+	default:
+		err = -EINVAL;
+		break;
 	}
 
-	if (new_inode) {
-		entries++;
-		memset(&entry1, 0, sizeof(struct nova_lite_journal_entry));
-
-		entry1.addrs[0] = (u64)nova_get_addr_off(sbi,
-						&new_pi->log_tail);
-		entry1.addrs[0] |= (u64)8 << 56;
-		entry1.values[0] = new_pi->log_tail;
-
-		if (!new_inode->i_nlink) {
-			entry1.addrs[1] = (u64)nova_get_addr_off(sbi,
-							&new_pi->valid);
-			entry1.addrs[1] |= (u64)1 << 56;
-			entry1.values[1] = new_pi->valid;
-		}
+	dput(dentry);
+	return err;
+}
 
-	}
+/*
+ * Run a vector of create/mkdir/unlink/rename operations on the directory
+ * filp refers to, under one hold of its i_mutex. Each op gets its own
+ * result; the number of ops processed is returned in batch->done.
+ */
+int nova_namei_batch(struct file *filp, struct nova_namei_batch __user *arg)
+{
+	struct inode *dir = file_inode(filp);
+	struct super_block *sb = dir->i_sb;
+	struct nova_inode_info_header *sih = &NOVA_I(dir)->header;
+	struct nova_namei_batch batch_arg;
+	struct nova_namei_op __user *uops;
+	struct nova_namei_op *op;
+	struct nova_dir_batch *batch;
+	u32 i = 0;
+	int ret;
 
-	cpu = smp_processor_id();
-	spin_lock(&sbi->journal_locks[cpu]);
-	journal_tail = nova_create_lite_transaction(sb, &entry, &entry1,
-							entries, cpu);
+	if (!S_ISDIR(dir->i_mode))
+		return -ENOTDIR;
 
-	old_pi->log_tail = old_pi_tail;
-	nova_flush_buffer(&old_pi->log_tail, CACHELINE_SIZE, 0);
-	old_pidir->log_tail = old_tail;
-	nova_flush_buffer(&old_pidir->log_tail, CACHELINE_SIZE, 0);
+	if (copy_from_user(&batch_arg, arg, sizeof(batch_arg)))
+		return -EFAULT;
 
-	if (old_pidir != new_pidir) {
-		new_pidir->log_tail = new_tail;
-		nova_flush_buffer(&new_pidir->log_tail, CACHELINE_SIZE, 0);
-	}
+	if (batch_arg.count > NOVA_NAMEI_BATCH_MAX)
+		return -EINVAL;
 
-	if (change_parent && father_entry) {
-		father_entry->ino = cpu_to_le64(new_dir->i_ino);
-		nova_flush_buffer(father_entry, NOVA_DIR_LOG_REC_LEN(2), 0);
-	}
+	uops = (struct nova_namei_op __user *)(unsigned long)batch_arg.ops;
 
-	if (new_inode) {
-		new_pi->log_tail = new_pi_tail;
-		nova_flush_buffer(&new_pi->log_tail, CACHELINE_SIZE, 0);
-		if (!new_inode->i_nlink) {
-			new_pi->valid = 0;
-			nova_flush_buffer(&new_pi->valid, CACHELINE_SIZE, 0);
-		}
+	op = kmalloc(sizeof(struct nova_namei_op), GFP_KERNEL);
+	batch = kzalloc(sizeof(struct nova_dir_batch), GFP_KERNEL);
+	if (!op || !batch) {
+		ret = -ENOMEM;
+		goto out_free;
 	}
 
-	PERSISTENT_BARRIER();
+	ret = mnt_want_write_file(filp);
+	if (ret)
+		goto out_free;
 
-	nova_commit_lite_transaction(sb, journal_tail, cpu);
-	spin_unlock(&sbi->journal_locks[cpu]);
+	mutex_lock_nested(&dir->i_mutex, I_MUTEX_PARENT);
+	sih->batch = batch;
+	for (i = 0; i < batch_arg.count; i++) {
+		if (copy_from_user(op, &uops[i], sizeof(struct nova_namei_op))) {
+			ret = -EFAULT;
+			break;
+		}
 
-	NOVA_END_TIMING(rename_t, rename_time);
-	return 0;
-out:
-	nova_err(sb, "%s return %d\n", __func__, err);
-	NOVA_END_TIMING(rename_t, rename_time);
-	return err;
+		op->name[NOVA_NAME_LEN] = '\0';
+		op->new_name[NOVA_NAME_LEN] = '\0';
+		op->result = nova_namei_batch_op(&filp->f_path, op);
+		if (put_user(op->result, &uops[i].result)) {
+			ret = -EFAULT;
+			break;
+		}
+	}
+	nova_commit_dir_batch(sb, dir);
+	sih->batch = NULL;
+	mutex_unlock(&dir->i_mutex);
+	mnt_drop_write_file(filp);
+
+	if (put_user(i, &arg->done))
+		ret = -EFAULT;
+
+out_free:
+	kfree(batch);
+	kfree(op);
+	return ret;
 }
 
 struct dentry *nova_get_parent(struct dentry *child)
@@ -41,6 +41,7 @@
 #include "nova_def.h"
 #include "journal.h"
 #include "stats.h"
+#include "nova_trace.h"
 
 #define PAGE_SHIFT_2M 21
 #define PAGE_SHIFT_1G 30
@@ -122,14 +123,122 @@ extern unsigned int nova_dbgmask;
 #define	NOVA_PRINT_LOG_BLOCKNODE	0xBCD00014
 #define	NOVA_PRINT_LOG_PAGES		0xBCD00015
 #define	NOVA_PRINT_FREE_LISTS		0xBCD00018
+#define	NOVA_NAMEI_BATCH		0xBCD00019
+#define	NOVA_GET_ALLOC_POLICY		0xBCD0001A
+#define	NOVA_SET_ALLOC_POLICY		0xBCD0001B
+#define	NOVA_GET_LOG_STATS		0xBCD0001C
+#define	NOVA_DEFRAG			0xBCD0001D
+#define	NOVA_CLONE_RANGE		0xBCD0001E
+#define	NOVA_CREATE_SNAPSHOT		0xBCD0001F
+#define	NOVA_LIST_SNAPSHOTS		0xBCD00020
+#define	NOVA_DELETE_SNAPSHOT		0xBCD00021
+
+/* NOVA_SET_ALLOC_POLICY: where a file's data and log pages are placed */
+#define	NOVA_ALLOC_LOCAL		0	/* Writer's NUMA node */
+#define	NOVA_ALLOC_INTERLEAVE		1	/* Round-robin over nodes */
+
+/* NOVA_NAMEI_BATCH: a vector of namespace ops on one directory */
+#define	NOVA_NAMEI_CREATE		1
+#define	NOVA_NAMEI_UNLINK		2
+#define	NOVA_NAMEI_MKDIR		3
+#define	NOVA_NAMEI_RENAME		4
+#define	NOVA_NAMEI_BATCH_MAX		4096
+
+struct nova_namei_op {
+	__u32	op;
+	__u32	mode;
+	__s32	result;			/* 0 or -errno, set by NOVA */
+	__u32	padding;
+	char	name[NOVA_NAME_LEN + 1];
+	char	new_name[NOVA_NAME_LEN + 1];	/* Rename target */
+};
+
+struct nova_namei_batch {
+	__u64	ops;			/* User address of nova_namei_op[] */
+	__u32	count;
+	__u32	done;			/* Ops processed, set by NOVA */
+};
+
+/*
+ * NOVA_GET_LOG_STATS: log and space summary of one inode. GC counts
+ * start from zero whenever the inode is loaded into DRAM.
+ */
+#define	NOVA_EXTENT_CLASSES		16
+
+struct nova_log_stats {
+	__u64	ino;
+	__u64	log_pages;		/* Pages in the log chain */
+	__u64	live_entries;
+	__u64	dead_entries;
+	__u64	live_bytes;
+	__u64	dead_bytes;
+	__u64	valid_bytes;		/* Live bytes at the last fast GC */
+	__u64	fast_gcs;
+	__u64	thorough_gcs;
+	__u64	gc_freed_pages;
+	__u64	data_blocks;		/* Mapped data blocks */
+	__u64	extents;		/* Physically contiguous runs */
+	__u64	mmap_pages;		/* DRAM shadow pages of mmap */
+	__u32	blk_type;		/* NOVA_BLOCK_TYPE_* of data blocks */
+	__u32	padding;
+	/* extent_sizes[i] counts extents of 2^i to 2^(i+1) - 1 blocks */
+	__u64	extent_sizes[NOVA_EXTENT_CLASSES];
+};
+
+/*
+ * NOVA_DEFRAG: move the data of a file into contiguous blocks, at most
+ * max_blocks per call. Call again from start until it reaches the end
+ * of the file. Files that are mmapped or were written in the last
+ * NOVA_DEFRAG_IDLE seconds fail with EBUSY.
+ */
+#define	NOVA_DEFRAG_MAX_BLOCKS		65536
+#define	NOVA_DEFRAG_IDLE		30
+
+struct nova_defrag {
+	__u64	start;			/* First page, updated by NOVA */
+	__u32	max_blocks;
+	__u32	moved;			/* Blocks moved, set by NOVA */
+};
 
+/*
+ * NOVA_CLONE_RANGE: share the data blocks of src_length bytes of src_fd
+ * from src_offset with the file at dest_offset, like FICLONERANGE. Zero
+ * src_length clones to the end of the source file.
+ */
+struct nova_clone_range {
+	__s64	src_fd;
+	__u64	src_offset;
+	__u64	src_length;
+	__u64	dest_offset;
+};
+
+/*
+ * NOVA_CREATE_SNAPSHOT sets a __u64 to the epoch of the new snapshot,
+ * which NOVA_DELETE_SNAPSHOT takes and mount -o snapshot=<epoch> reads.
+ * NOVA_LIST_SNAPSHOTS fills up to count entries, oldest first, and sets
+ * count to the number of snapshots.
+ */
+struct nova_snapshot_info {
+	__u64	epoch;
+	__u64	timestamp;		/* Seconds since the epoch */
+};
+
+struct nova_snapshot_list {
+	__u64	snapshots;		/* User address of nova_snapshot_info[] */
+	__u32	count;
+	__u32	padding;
+};
 
 #define	READDIR_END			(ULONG_MAX)
 #define	INVALID_CPU			(-1)
 #define	SHARED_CPU			(65536)
 #define FREE_BATCH			(16)
+#define READDIR_BATCH			(64)
+#define INODE_MAGAZINE_SIZE		(64)
+#define INODE_MAGAZINE_REFILL		(32)
 
 extern int measure_timing;
+extern int timing_histogram;
 
 extern unsigned int blk_type_to_shift[NOVA_BLOCK_TYPE_MAX];
 extern unsigned int blk_type_to_size[NOVA_BLOCK_TYPE_MAX];
@@ -171,13 +280,32 @@ struct nova_file_write_entry {
 	__le64	size;
 } __attribute((__packed__));
 
+/*
+ * Flags in the block field of a file write entry, between the entry type
+ * and the block offset.
+ */
+#define	FILE_UNWRITTEN	0x100	/* Preallocated, the pages read as zeros */
+#define	FILE_HOLE	0x200	/* No blocks, the pages are punched out */
+
+static inline bool nova_entry_unwritten(struct nova_file_write_entry *entry)
+{
+	return entry->block & FILE_UNWRITTEN;
+}
+
+static inline bool nova_entry_hole(struct nova_file_write_entry *entry)
+{
+	return entry->block & FILE_HOLE;
+}
+
 struct nova_inode_page_tail {
-	__le64	padding1;
-	__le64	padding2;
+	__le64	epoch;		/* Of the entries in the page, see snapshot.c */
+	__le64	epoch_check;	/* epoch ^ NOVA_EPOCH_MAGIC */
 	__le64	padding3;
 	__le64	next_page;
 } __attribute((__packed__));
 
+#define	NOVA_EPOCH_MAGIC	0x45504f43484e4f56ULL
+
 #define	LAST_ENTRY	4064
 #define	PAGE_TAIL(p)	(((p) & ~INVALID_MASK) + LAST_ENTRY)
 
@@ -235,6 +363,32 @@ struct nova_link_change_entry {
 	__le64	paddings[2];
 } __attribute((__packed__));
 
+/*
+ * Index snapshot: the radix tree of an inode as of log_tail, written to a
+ * chain of log pages on evict. Records never cross a page tail.
+ */
+#define	NOVA_INDEX_MAGIC	0x4e4f5641494e4458ULL	/* "NOVAINDX" */
+
+struct nova_index_header {
+	__le64	magic;
+	__le64	ino;
+	__le64	log_head;
+	__le64	log_tail;		/* Last entry covered ends here */
+	__le64	log_pages;		/* Up to the log_tail page */
+	__le64	last_setattr;
+	__le64	last_link_change;
+	__le64	nr_records;
+	__le32	csum;
+	__le32	padding;
+} __attribute((__packed__));
+
+/* pgoff or name hash, and the log entry it maps to */
+struct nova_index_record {
+	__le64	index;
+	__le64	num;			/* Consecutive indexes, same entry */
+	__le64	entry;
+} __attribute((__packed__));
+
 enum alloc_type {
 	LOG = 1,
 	DATA,
@@ -294,6 +448,35 @@ struct nova_range_node_lowhigh {
 
 #define	RANGENODE_PER_PAGE	254
 
+/* Reference count of shared data blocks, see reflink.c */
+struct nova_refcount_entry {
+	__le64	blocknr;
+	__le32	num;		/* 0 ends the records of a page */
+	__le32	refs;
+};
+
+/* Snapshot table, see snapshot.c */
+enum nova_snapshot_type {
+	SNAPSHOT_CREATE = 1,
+	SNAPSHOT_DELETE,
+	SNAPSHOT_EPOCH,		/* Epochs start after this one */
+	SNAPSHOT_PAGES,		/* Invalidated pages of a write entry */
+	SNAPSHOT_DENTRY,	/* Invalidated dentry */
+	SNAPSHOT_INODE,		/* Unlinked inode kept */
+};
+
+struct nova_snapshot_entry {
+	u8	type;		/* 0 ends the records of a page */
+	u8	paddings[3];
+	__le32	num;		/* Pages */
+	__le64	epoch;		/* Snapshot, or the epoch a record ends */
+	__le64	birth;		/* Epoch a record starts */
+	__le64	ino;
+	__le64	entry;		/* Log entry */
+	__le64	pgoff;		/* Or inode generation */
+	__le64	blocknr;	/* 0 if the pages moved, not freed */
+} __attribute((__packed__));
+
 struct nova_range_node {
 	struct rb_node node;
 	unsigned long range_low;
@@ -314,6 +497,24 @@ struct nova_inode_info_header {
 	unsigned long valid_bytes;	/* For thorough GC */
 	u64 last_setattr;		/* Last setattr entry */
 	u64 last_link_change;		/* Last link change entry */
+	u64 dir_version;		/* Bumped on every dir tree change */
+	struct nova_dir_batch *batch;	/* Running NOVA_NAMEI_BATCH */
+	unsigned long fast_gcs;		/* For NOVA_GET_LOG_STATS */
+	unsigned long thorough_gcs;
+	unsigned long gc_freed_pages;
+	int snapshot_dead;		/* Being freed, no snapshot sees it */
+};
+
+/* One transaction: the dir log tail plus the new inodes' valid bits */
+#define	NOVA_BATCH_INODES		(NOVA_TXN_MAX_UPDATES - 1)
+
+struct nova_dir_batch {
+	u64 dir_tail;			/* Uncommitted dir log tail */
+	int nr_inodes;
+	struct nova_inode *new_inodes[NOVA_BATCH_INODES];
+	/* Kept negative until the commit makes the new inodes valid */
+	struct dentry *dentries[NOVA_BATCH_INODES];
+	struct inode *inodes[NOVA_BATCH_INODES];
 };
 
 struct nova_inode_info {
@@ -356,10 +557,61 @@ struct free_list {
 	unsigned long	alloc_data_pages;
 	unsigned long	freed_log_pages;
 	unsigned long	freed_data_pages;
+	unsigned long	alloc_local_pages;
+	unsigned long	alloc_remote_pages;
+
+	int		nid;		/* NUMA node backing this range */
+
+	/* Blocks from here up were free at the last persisted bump */
+	unsigned long	alloc_hwm;
+	/* Background recovery: blocks below are not in the list yet */
+	unsigned long	bg_limit;
 
 	u64		padding[8];	/* Cache line break */
 };
 
+/*
+ * Free lists grouped by the NUMA node that backs their block range.
+ * Lists of node n are node_lists[first .. first + nr_lists - 1].
+ * A node without NVMM allocates from its nearest node, 'fallback'.
+ */
+struct nova_numa_node {
+	int		first;
+	int		nr_lists;
+	int		fallback;
+};
+
+/*
+ * Allocator redo log, see checkpoint.c. There is one per free list, the
+ * shared list after the per-CPU ones, and one per inode map. Each is a
+ * ring of NOVA_REDO_PAGES pages indexed by lsn.
+ */
+struct nova_redo_entry {
+	__le64	lsn;
+	__le64	type_low;	/* Type in the top byte */
+	__le64	range_high;
+	__le64	csum;
+};
+
+#define	NOVA_REDO_PAGES		32
+#define	NOVA_REDO_PER_PAGE	(PAGE_SIZE / sizeof(struct nova_redo_entry))
+#define	NOVA_REDO_ENTRIES	(NOVA_REDO_PAGES * NOVA_REDO_PER_PAGE)
+
+enum nova_redo_type {
+	NOVA_REDO_ALLOC_BLOCKS = 1,
+	NOVA_REDO_FREE_BLOCKS,
+	NOVA_REDO_ALLOC_INODE,
+	NOVA_REDO_FREE_INODE,
+};
+
+struct nova_redo_log {
+	spinlock_t	lock;
+	u64		next_lsn;
+	u64		retain_lsn;	/* Oldest lsn a checkpoint needs */
+	int		overflowed;
+	u64		pages[NOVA_REDO_PAGES];
+};
+
 /*
  * The first block contains super blocks and reserved inodes;
  * The second block contains pointers to journal pages.
@@ -367,11 +619,36 @@ struct free_list {
  */
 #define	RESERVED_BLOCKS	3
 
+/*
+ * Block 0 holds the super block and reserved inodes. It is followed by the
+ * journal pointer table and then the inode table pointer table, each of
+ * which takes one cacheline per CPU over as many 4K pages as needed. Up to
+ * 64 CPUs this is the original layout: blocks 1 and 2.
+ */
+#define	NOVA_PTRS_PER_PAGE	(PAGE_SIZE / CACHELINE_SIZE)
+/* Saved inode lists carry the cpuid in 16 bits */
+#define	NOVA_MAX_CPUS		(65535)
+
+static inline unsigned long nova_cpu_table_pages(int cpus)
+{
+	return DIV_ROUND_UP(cpus, NOVA_PTRS_PER_PAGE);
+}
+
 struct inode_map {
 	struct mutex inode_table_mutex;
 	struct rb_root	inode_inuse_tree;
 	unsigned long	num_range_node_inode;
 	struct nova_range_node *first_inode_range;
+	/* Superpage index -> inode table block, mirrors the NVMM chain */
+	struct radix_tree_root	inode_table_tree;
+	unsigned long	num_table_blocks;
+	/* In-use ranges found by the background crawl, see bbuild.c */
+	struct rb_root	bg_inuse_tree;
+	unsigned long	bg_limit;	/* Table slots at mount */
+	/* Free inode numbers reserved for this map, see inode.c */
+	spinlock_t	magazine_lock;
+	int		magazine_count;
+	unsigned long	magazine[INODE_MAGAZINE_SIZE];
 	int allocated;
 	int freed;
 };
@@ -412,6 +689,7 @@ struct nova_sb_info {
 	/* inode tracking */
 	unsigned long	s_inodes_used_count;
 	unsigned long	reserved_blocks;
+	unsigned long	cpu_table_pages;	/* 4K pages per pointer table */
 
 	struct mutex 	s_lock;	/* protects the SB's buffer-head */
 
@@ -423,18 +701,69 @@ struct nova_sb_info {
 	/* Per-CPU journal lock */
 	spinlock_t *journal_locks;
 
+	/* Transactions waiting for a group commit */
+	spinlock_t	journal_queue_lock;
+	struct list_head journal_queue;
+
 	/* Per-CPU inode map */
 	struct inode_map	*inode_maps;
 
-	/* Decide new inode map id */
-	unsigned long map_id;
-
 	/* Per-CPU free block list */
 	struct free_list *free_lists;
 
 	/* Shared free block list */
 	unsigned long per_list_blocks;
 	struct free_list shared_free_list;
+
+	/* NUMA placement, NULL if the node layout is unknown */
+	struct nova_numa_node *numa_nodes;
+	int		*node_lists;
+	int		*interleave_lists;
+	atomic_t	interleave_cursor;
+
+	/* Allocator checkpoints, redo_logs is NULL when they are off */
+	unsigned int	ckpt_interval;		/* Seconds */
+	struct nova_redo_log *redo_logs;
+	struct task_struct *ckpt_thread;
+	wait_queue_head_t ckpt_wait;
+	int		ckpt_requested;
+	spinlock_t	ckpt_lock;
+	int		ckpt_valid;
+	u64		ckpt_head;		/* Log of the last checkpoint */
+	u64		ckpt_seq;
+	u32		ckpt_gen;
+
+	/* Failure recovery, see bbuild.c */
+	struct nova_recovery *recovery;
+
+	/* Background recovery, see bbuild.c */
+	int		bg_recovery;
+	spinlock_t	bg_lock;
+	struct rb_root	bg_deferred_tree;	/* Frees held back */
+	struct radix_tree_root bg_pinned;	/* ino -> pinned inode */
+	unsigned long	*bg_claimed;		/* Ino each crawler is on */
+	wait_queue_head_t bg_wait;
+	struct task_struct *bg_thread;
+	struct completion bg_done;
+
+	/* Shared data blocks, see reflink.c */
+	struct mutex	refcount_mutex;
+	struct rb_root	refcount_tree;
+	unsigned long	refcount_nodes;
+	unsigned long	refcount_log_pages;
+
+	/* Snapshots, see snapshot.c */
+	struct mutex	snapshot_mutex;
+	struct list_head snapshot_list;		/* Oldest first */
+	struct rb_root	snapshot_tree;		/* What they still see */
+	unsigned long	snapshot_count;
+	unsigned long	snapshot_records;
+	unsigned long	snapshot_log_pages;
+	u64		s_epoch;		/* Of new log pages */
+	u64		snapshot_latest;	/* 0 if there is none */
+	u64		mount_snapshot;		/* 0 unless -o snapshot= */
+
+	struct dentry	*debugfs_dir;		/* nova/<device> */
 };
 
 static inline struct nova_sb_info *NOVA_SB(struct super_block *sb)
@@ -517,6 +846,7 @@ struct ptr_pair *nova_get_journal_pointers(struct super_block *sb, int cpu)
 
 struct inode_table {
 	__le64 log_head;
+	__le64 alloc_hwm;	/* Of this CPU's free list, 0 if unknown */
 };
 
 static inline
@@ -528,7 +858,8 @@ struct inode_table *nova_get_inode_table(struct super_block *sb, int cpu)
 		return NULL;
 
 	return (struct inode_table *)((char *)nova_get_block(sb,
-		NOVA_DEF_BLOCK_SIZE_4K * 2) + cpu * CACHELINE_SIZE);
+		NOVA_DEF_BLOCK_SIZE_4K * (1 + sbi->cpu_table_pages)) +
+		cpu * CACHELINE_SIZE);
 }
 
 // BKDR String Hash Function
@@ -679,6 +1010,10 @@ static inline u64 nova_find_nvmm_block(struct super_block *sb,
 			return 0;
 	}
 
+	/* Nothing to copy from */
+	if (nova_entry_unwritten(entry))
+		return 0;
+
 	nvmm = get_nvmm(sb, &si->header, entry, blocknr);
 	return nvmm << PAGE_SHIFT;
 }
@@ -794,6 +1129,51 @@ static inline u64 next_log_page(struct super_block *sb, u64 curr_p)
 	return ((struct nova_inode_page_tail *)page_tail)->next_page;
 }
 
+/* Tag a log page with the epoch its entries are written in */
+static inline void nova_set_page_epoch(struct super_block *sb,
+	struct nova_inode_page_tail *page_tail)
+{
+	u64 epoch = NOVA_SB(sb)->s_epoch;
+
+	page_tail->epoch = cpu_to_le64(epoch);
+	page_tail->epoch_check = cpu_to_le64(epoch ^ NOVA_EPOCH_MAGIC);
+}
+
+/* Epoch of the log page of curr_p, 0 if it was never tagged */
+static inline u64 nova_log_page_epoch(struct super_block *sb, u64 curr_p)
+{
+	struct nova_inode_page_tail *page_tail;
+	u64 epoch;
+
+	page_tail = (struct nova_inode_page_tail *)nova_get_block(sb,
+							PAGE_TAIL(curr_p));
+	epoch = le64_to_cpu(page_tail->epoch);
+	if ((epoch ^ NOVA_EPOCH_MAGIC) != le64_to_cpu(page_tail->epoch_check))
+		return 0;
+
+	return epoch;
+}
+
+/*
+ * Whether a snapshot may read the log page of curr_p. Snapshots are only
+ * taken with the fs frozen and a stale value after a delete is only too
+ * high, so writers need no lock to read snapshot_latest.
+ */
+static inline bool nova_log_page_frozen(struct super_block *sb, u64 curr_p)
+{
+	u64 latest = READ_ONCE(NOVA_SB(sb)->snapshot_latest);
+
+	return latest && nova_log_page_epoch(sb, curr_p) <= latest;
+}
+
+/* Whether a snapshot mount stops replaying a log at curr_p */
+static inline bool nova_snapshot_log_end(struct super_block *sb, u64 curr_p)
+{
+	u64 epoch = NOVA_SB(sb)->mount_snapshot;
+
+	return epoch && nova_log_page_epoch(sb, curr_p) > epoch;
+}
+
 #define	CACHE_ALIGN(p)	((p) & ~(CACHELINE_SIZE - 1))
 
 static inline bool is_last_entry(u64 curr_p, size_t size)
@@ -848,6 +1228,12 @@ inline void nova_free_blocknode(struct super_block *sb,
 	struct nova_range_node *bnode);
 inline void nova_free_inode_node(struct super_block *sb,
 	struct nova_range_node *bnode);
+int nova_alloc_range_nodes(struct super_block *sb,
+	struct nova_range_node **nodes, unsigned long num);
+void nova_free_range_nodes(struct nova_range_node **nodes,
+	unsigned long num);
+void nova_build_range_tree(struct rb_root *tree,
+	struct nova_range_node **nodes, unsigned long num);
 extern void nova_init_blockmap(struct super_block *sb, int recovery);
 extern int nova_free_data_blocks(struct super_block *sb, struct nova_inode *pi,
 	unsigned long blocknr, int num);
@@ -859,6 +1245,11 @@ extern int nova_new_data_blocks(struct super_block *sb, struct nova_inode *pi,
 extern int nova_new_log_blocks(struct super_block *sb, struct nova_inode *pi,
 	unsigned long *blocknr, unsigned int num, int zero);
 extern unsigned long nova_count_free_blocks(struct super_block *sb);
+int nova_redo_block_range(struct super_block *sb, unsigned long low,
+	unsigned long high, int alloc);
+void nova_reset_alloc_hwm(struct super_block *sb, bool valid);
+int nova_free_recovered_blocks(struct super_block *sb, unsigned long low,
+	unsigned long high);
 inline int nova_search_inodetree(struct nova_sb_info *sbi,
 	unsigned long ino, struct nova_range_node **ret_node);
 inline int nova_insert_blocktree(struct nova_sb_info *sbi,
@@ -874,12 +1265,37 @@ int nova_find_free_slot(struct nova_sb_info *sbi,
 inline void set_bm(unsigned long bit, struct scan_bitmap *bm,
 	enum bm_type type);
 int nova_rebuild_inode(struct super_block *sb, struct nova_inode_info *si,
-	u64 pi_addr);
+	struct nova_inode *pi, u64 pi_addr);
 void nova_save_blocknode_mappings_to_log(struct super_block *sb);
 void nova_save_inode_list_to_log(struct super_block *sb);
+bool nova_clean_shutdown(struct super_block *sb);
+void nova_destroy_range_trees(struct super_block *sb);
+void nova_drop_saved_lists(struct super_block *sb);
 void nova_init_header(struct super_block *sb,
 	struct nova_inode_info_header *sih, u16 i_mode);
+int nova_insert_blocknode_map(struct super_block *sb,
+	int cpuid, unsigned long low, unsigned long high);
+int nova_failure_insert_inodetree(struct super_block *sb,
+	unsigned long ino_low, unsigned long ino_high);
 int nova_recovery(struct super_block *sb);
+int nova_bg_pin_inode(struct inode *inode);
+void nova_wait_bg_recovery(struct super_block *sb);
+
+/* checkpoint.c */
+void nova_redo_log_blocks(struct super_block *sb, int cpuid, int type,
+	unsigned long low, unsigned long high);
+void nova_redo_log_inode(struct super_block *sb, int type, unsigned long ino);
+void nova_invalidate_checkpoint(struct super_block *sb);
+int nova_start_checkpointer(struct super_block *sb);
+void nova_stop_checkpointer(struct super_block *sb);
+int nova_recover_from_checkpoint(struct super_block *sb);
+
+/* index.c */
+u64 nova_get_index_head(struct super_block *sb, struct nova_inode *pi);
+void nova_drop_index(struct super_block *sb, struct nova_inode *pi);
+int nova_save_index(struct super_block *sb, struct inode *inode);
+int nova_load_index(struct super_block *sb, struct nova_inode *pi,
+	struct nova_inode_info_header *sih, u64 *curr_p);
 
 /*
  * Inodes and files operations
@@ -899,12 +1315,14 @@ ssize_t nova_dax_file_read(struct file *filp, char __user *buf, size_t len,
 ssize_t nova_dax_file_write(struct file *filp, const char __user *buf,
 		size_t len, loff_t *ppos);
 int nova_dax_file_mmap(struct file *file, struct vm_area_struct *vma);
+int nova_defrag_file(struct super_block *sb, struct inode *inode,
+	struct nova_defrag *defrag);
 
 /* dir.c */
 extern const struct file_operations nova_dir_operations;
 int nova_append_dir_init_entries(struct super_block *sb,
 	struct nova_inode *pi, u64 self_ino, u64 parent_ino);
-extern int nova_add_dentry(struct dentry *dentry, u64 ino,
+extern int nova_add_dentry(struct dentry *dentry, u64 ino, umode_t mode,
 	int inc_link, u64 tail, u64 *new_tail);
 extern int nova_remove_dentry(struct dentry *dentry, int dec_link, u64 tail,
 	u64 *new_tail);
@@ -918,16 +1336,67 @@ struct nova_dentry *nova_find_dentry(struct super_block *sb,
 int nova_rebuild_dir_inode_tree(struct super_block *sb,
 	struct nova_inode *pi, u64 pi_addr,
 	struct nova_inode_info_header *sih);
+inline int nova_replay_add_dentry(struct super_block *sb,
+	struct nova_inode_info_header *sih, struct nova_dentry *entry);
 
 /* file.c */
 extern const struct inode_operations nova_file_inode_operations;
 extern const struct file_operations nova_dax_file_operations;
 int nova_fsync(struct file *file, loff_t start, loff_t end, int datasync);
+u64 nova_append_range_entry(struct super_block *sb,
+	struct nova_inode *pi, struct inode *inode, unsigned long pgoff,
+	unsigned long num, u64 block, loff_t size, u64 tail);
+bool nova_range_mapped(struct nova_inode_info_header *sih,
+	unsigned long pgoff, unsigned long last);
+void nova_fallocate_abort(struct super_block *sb,
+	struct nova_inode *pi, u64 begin, u64 tail);
+int nova_fallocate_commit(struct super_block *sb,
+	struct nova_inode *pi, struct inode *inode, u64 begin, u64 tail,
+	unsigned long blocks, loff_t new_size);
+
+/* reflink.c */
+bool nova_refcount_shared(struct super_block *sb);
+int nova_refcount_get(struct super_block *sb, unsigned long blocknr,
+	unsigned long num);
+int nova_refcount_put(struct super_block *sb, unsigned long blocknr,
+	unsigned long num, unsigned long *run);
+bool nova_block_shared(struct super_block *sb, unsigned long blocknr);
+int nova_refcount_init(struct super_block *sb);
+void nova_save_refcount_log(struct super_block *sb);
+void nova_refcount_exit(struct super_block *sb);
+int nova_clone_file_range(struct file *src_file, loff_t off,
+	struct file *dst_file, loff_t destoff, u64 len);
+
+/* snapshot.c */
+int nova_snapshot_load(struct super_block *sb);
+int nova_snapshot_init(struct super_block *sb);
+void nova_save_snapshot_log(struct super_block *sb);
+void nova_snapshot_exit(struct super_block *sb);
+void nova_snapshot_mark_blocks(struct super_block *sb,
+	struct scan_bitmap *bm);
+int nova_create_snapshot(struct super_block *sb, u64 *epoch);
+int nova_delete_snapshot(struct super_block *sb, u64 epoch);
+int nova_list_snapshots(struct super_block *sb,
+	struct nova_snapshot_list __user *arg);
+bool nova_snapshot_keep_pages(struct super_block *sb,
+	struct nova_inode_info_header *sih,
+	struct nova_file_write_entry *entry, unsigned long pgoff,
+	unsigned long num, unsigned long blocknr);
+void nova_snapshot_keep_dentry(struct super_block *sb,
+	struct nova_inode_info_header *sih, struct nova_dentry *entry);
+bool nova_snapshot_keep_inode(struct super_block *sb, struct inode *inode);
+void nova_snapshot_rebuild_tree(struct super_block *sb,
+	struct nova_inode_info_header *sih);
 
 /* inode.c */
 extern const struct address_space_operations nova_aops_dax;
 int nova_init_inode_inuse_list(struct super_block *sb);
 extern int nova_init_inode_table(struct super_block *sb);
+int nova_build_inode_table_index(struct super_block *sb);
+void nova_delete_inode_table_index(struct super_block *sb);
+void nova_drain_inode_magazines(struct super_block *sb);
+unsigned long nova_count_magazine_inodes(struct super_block *sb);
+int nova_redo_free_inode(struct super_block *sb, unsigned long ino);
 unsigned long nova_get_last_blocknr(struct super_block *sb,
 	struct nova_inode_info_header *sih);
 int nova_get_inode_address(struct super_block *sb, u64 ino,
@@ -948,6 +1417,11 @@ extern unsigned long nova_find_region(struct inode *inode, loff_t *offset,
 void nova_apply_setattr_entry(struct super_block *sb, struct nova_inode *pi,
 	struct nova_inode_info_header *sih,
 	struct nova_setattr_logentry *entry);
+u64 nova_append_setattr_entry(struct super_block *sb,
+	struct nova_inode *pi, struct inode *inode, struct iattr *attr,
+	u64 tail);
+int nova_free_contiguous_log_blocks(struct super_block *sb,
+	struct nova_inode *pi, u64 head);
 void nova_free_inode_log(struct super_block *sb, struct nova_inode *pi);
 int nova_allocate_inode_log_pages(struct super_block *sb,
 	struct nova_inode *pi, unsigned long num_pages,
@@ -958,6 +1432,8 @@ int nova_delete_file_tree(struct super_block *sb,
 u64 nova_get_append_head(struct super_block *sb, struct nova_inode *pi,
 	struct nova_inode_info_header *sih, u64 tail, size_t size,
 	int *extended);
+int nova_get_log_stats(struct super_block *sb, struct inode *inode,
+	struct nova_log_stats *stats);
 u64 nova_append_file_write_entry(struct super_block *sb, struct nova_inode *pi,
 	struct inode *inode, struct nova_file_write_entry *data, u64 tail);
 int nova_rebuild_file_inode_tree(struct super_block *sb,
@@ -988,6 +1464,7 @@ int nova_append_link_change_entry(struct super_block *sb,
 	struct nova_inode *pi, struct inode *inode, u64 tail, u64 *new_tail);
 void nova_apply_link_change_entry(struct nova_inode *pi,
 	struct nova_link_change_entry *entry);
+int nova_namei_batch(struct file *filp, struct nova_namei_batch __user *arg);
 
 /* super.c */
 extern struct super_block *nova_read_super(struct super_block *sb, void *data,
@@ -1005,6 +1482,12 @@ extern const struct inode_operations nova_symlink_inode_operations;
 /* nova_stats.c */
 void nova_print_timing_stats(struct super_block *sb);
 void nova_clear_stats(void);
+void nova_debugfs_add_sb(struct super_block *sb);
+void nova_debugfs_remove_sb(struct super_block *sb);
+void nova_debugfs_init(void);
+void nova_debugfs_exit(void);
+int nova_stats_init(void);
+void nova_stats_exit(void);
 void nova_print_inode_log(struct super_block *sb, struct inode *inode);
 void nova_print_inode_log_pages(struct super_block *sb, struct inode *inode);
 void nova_print_free_lists(struct super_block *sb);
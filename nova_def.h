@@ -22,6 +22,8 @@
 
 #include <linux/types.h>
 #include <linux/magic.h>
+#include <linux/kernel.h>
+#include <linux/percpu.h>
 
 #define	NOVA_SUPER_MAGIC	0x4E4F5641	/* NOVA */
 
@@ -43,6 +45,9 @@
 #define NOVA_MOUNT_HUGEIOREMAP 0x000100        /* Huge mappings with ioremap */
 #define NOVA_MOUNT_FORMAT      0x000200        /* was FS formatted on mount? */
 #define NOVA_MOUNT_MOUNTING    0x000400        /* FS currently being mounted */
+#define NOVA_MOUNT_INTERLEAVE  0x000800        /* Interleave pages over nodes */
+#define NOVA_MOUNT_BGRECOVERY  0x001000        /* Crawl after mount returns */
+#define NOVA_MOUNT_INDEX       0x002000        /* Snapshot inode indexes */
 
 /*
  * Maximal count of links to a file
@@ -101,7 +106,8 @@ struct nova_inode {
 	__le32	i_uid;		/* Owner Uid */
 	__le32	i_gid;		/* Group Id */
 	__le32	i_generation;	/* File version (for NFS) */
-	__le32	padding;
+	u8	i_alloc_policy;	/* NUMA placement of data and log pages */
+	u8	i_padding[3];
 	__le64	nova_ino;	/* nova inode number */
 
 	__le64	log_head;	/* Log head pointer */
@@ -111,6 +117,9 @@ struct nova_inode {
 		__le32 rdev;	/* major/minor # */
 	} dev;			/* device inode */
 
+	__le32	i_epoch;	/* Created in, see snapshot.c */
+	__le64	i_index;	/* Index snapshot of the log, 0 if none */
+
 	/* Leave 8 bytes for inode table tail pointer */
 } __attribute((__packed__));
 
@@ -135,7 +144,7 @@ struct nova_super_block {
 	__le16		s_sum;              /* checksum of this sb */
 	__le16		s_padding16;
 	__le32		s_magic;            /* magic signature */
-	__le32		s_padding32;
+	__le32		s_cpus;		    /* CPUs at format, 0 on old images */
 	__le32		s_blocksize;        /* blocksize in bytes */
 	__le64		s_size;             /* total size of fs in bytes */
 	char		s_volume_name[16];  /* volume name */
@@ -163,6 +172,9 @@ struct nova_super_block {
 #define NOVA_INODELIST_INO	(4)
 #define NOVA_LITEJOURNAL_INO	(5)
 #define NOVA_INODELIST1_INO	(6)
+#define NOVA_CHECKPOINT_INO	(7)	/* Allocator checkpoint */
+#define NOVA_REFCOUNT_INO	(8)	/* Shared block counts */
+#define NOVA_SNAPSHOT_INO	(9)	/* Snapshot table */
 
 #define	NOVA_ROOT_INO_START	(NOVA_SB_SIZE * 2)
 
@@ -191,7 +203,20 @@ static inline bool arch_has_clwb(void)
 
 extern int support_clwb;
 extern int support_pcommit;
-extern unsigned long barriers;
+
+/*
+ * Fences and flushed cachelines, charged to the operation class that
+ * runs on this CPU (enum wa_class in stats.h).
+ */
+#define NOVA_WA_CLASSES		8
+
+struct nova_persist_cost {
+	unsigned long	fences[NOVA_WA_CLASSES];
+	unsigned long	flushes[NOVA_WA_CLASSES];
+};
+
+DECLARE_PER_CPU(int, nova_wa_class);
+DECLARE_PER_CPU(struct nova_persist_cost, nova_persist_cost);
 
 #define _mm_clflush(addr)\
 	asm volatile("clflush %0" : "+m" (*(volatile char *)(addr)))
@@ -210,7 +235,7 @@ static inline void PERSISTENT_MARK(void)
 
 static inline void PERSISTENT_BARRIER(void)
 {
-	barriers++;
+	this_cpu_inc(nova_persist_cost.fences[this_cpu_read(nova_wa_class)]);
 	asm volatile ("sfence\n" : : );
 	if (support_pcommit) {
 		_mm_pcommit();
@@ -229,6 +254,8 @@ static inline void nova_flush_buffer(void *buf, uint32_t len, bool fence)
 		for (i = 0; i < len; i += CACHELINE_SIZE)
 			_mm_clflush(buf + i);
 	}
+	this_cpu_add(nova_persist_cost.flushes[this_cpu_read(nova_wa_class)],
+			DIV_ROUND_UP(len, CACHELINE_SIZE));
 	/* Do a fence only if asked. We often don't need to do a fence
 	 * immediately after clflush because even if we get context switched
 	 * between clflush and subsequent fence, the context switch operation
@@ -0,0 +1,334 @@
+/*
+ * NOVA File System tracepoints
+ *
+ * Copyright 2015-2016 Regents of the University of California,
+ * UCSD Non-Volatile Systems Lab, Andiry Xu <jix024@cs.ucsd.edu>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM nova
+
+#if !defined(_NOVA_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _NOVA_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/ktime.h>
+
+/*
+ * Every operation has an _enter and an _exit event. Exit events carry
+ * the latency in ns since the matching NOVA_TRACE_START(), which only
+ * reads the clock while the exit event is enabled.
+ */
+#define NOVA_TRACE_START(exit_event) \
+	(trace_##exit_event##_enabled() ? ktime_get_ns() : 0)
+
+#define NOVA_TRACE_LATENCY(start) \
+	((start) ? ktime_get_ns() - (start) : 0)
+
+/* File I/O: write, read, fault and fsync */
+DECLARE_EVENT_CLASS(nova_io_enter,
+	TP_PROTO(struct inode *inode, loff_t pos, size_t len),
+	TP_ARGS(inode, pos, len),
+
+	TP_STRUCT__entry(
+		__field(dev_t,		dev)
+		__field(unsigned long,	ino)
+		__field(loff_t,		pos)
+		__field(size_t,		len)
+	),
+
+	TP_fast_assign(
+		__entry->dev	= inode->i_sb->s_dev;
+		__entry->ino	= inode->i_ino;
+		__entry->pos	= pos;
+		__entry->len	= len;
+	),
+
+	TP_printk("dev %d,%d ino %lu pos %lld len %zu",
+		MAJOR(__entry->dev), MINOR(__entry->dev),
+		__entry->ino, __entry->pos, __entry->len)
+);
+
+DECLARE_EVENT_CLASS(nova_io_exit,
+	TP_PROTO(struct inode *inode, loff_t pos, long ret,
+		unsigned long blocks, u64 start),
+	TP_ARGS(inode, pos, ret, blocks, start),
+
+	TP_STRUCT__entry(
+		__field(dev_t,		dev)
+		__field(unsigned long,	ino)
+		__field(loff_t,		pos)
+		__field(long,		ret)
+		__field(unsigned long,	blocks)
+		__field(u64,		latency)
+	),
+
+	TP_fast_assign(
+		__entry->dev	= inode->i_sb->s_dev;
+		__entry->ino	= inode->i_ino;
+		__entry->pos	= pos;
+		__entry->ret	= ret;
+		__entry->blocks	= blocks;
+		__entry->latency = NOVA_TRACE_LATENCY(start);
+	),
+
+	TP_printk("dev %d,%d ino %lu pos %lld ret %ld blocks %lu "
+		"latency %llu ns",
+		MAJOR(__entry->dev), MINOR(__entry->dev),
+		__entry->ino, __entry->pos, __entry->ret,
+		__entry->blocks, __entry->latency)
+);
+
+DEFINE_EVENT(nova_io_enter, nova_write_enter,
+	TP_PROTO(struct inode *inode, loff_t pos, size_t len),
+	TP_ARGS(inode, pos, len)
+);
+
+DEFINE_EVENT(nova_io_exit, nova_write_exit,
+	TP_PROTO(struct inode *inode, loff_t pos, long ret,
+		unsigned long blocks, u64 start),
+	TP_ARGS(inode, pos, ret, blocks, start)
+);
+
+DEFINE_EVENT(nova_io_enter, nova_read_enter,
+	TP_PROTO(struct inode *inode, loff_t pos, size_t len),
+	TP_ARGS(inode, pos, len)
+);
+
+DEFINE_EVENT(nova_io_exit, nova_read_exit,
+	TP_PROTO(struct inode *inode, loff_t pos, long ret,
+		unsigned long blocks, u64 start),
+	TP_ARGS(inode, pos, ret, blocks, start)
+);
+
+DEFINE_EVENT(nova_io_enter, nova_fault_enter,
+	TP_PROTO(struct inode *inode, loff_t pos, size_t len),
+	TP_ARGS(inode, pos, len)
+);
+
+DEFINE_EVENT(nova_io_exit, nova_fault_exit,
+	TP_PROTO(struct inode *inode, loff_t pos, long ret,
+		unsigned long blocks, u64 start),
+	TP_ARGS(inode, pos, ret, blocks, start)
+);
+
+DEFINE_EVENT(nova_io_enter, nova_fsync_enter,
+	TP_PROTO(struct inode *inode, loff_t pos, size_t len),
+	TP_ARGS(inode, pos, len)
+);
+
+DEFINE_EVENT(nova_io_exit, nova_fsync_exit,
+	TP_PROTO(struct inode *inode, loff_t pos, long ret,
+		unsigned long blocks, u64 start),
+	TP_ARGS(inode, pos, ret, blocks, start)
+);
+
+/* Block allocator */
+DECLARE_EVENT_CLASS(nova_blocks_enter,
+	TP_PROTO(struct super_block *sb, unsigned long blocknr,
+		int num, unsigned short btype),
+	TP_ARGS(sb, blocknr, num, btype),
+
+	TP_STRUCT__entry(
+		__field(dev_t,		dev)
+		__field(unsigned long,	blocknr)
+		__field(int,		num)
+		__field(unsigned short,	btype)
+	),
+
+	TP_fast_assign(
+		__entry->dev	= sb->s_dev;
+		__entry->blocknr = blocknr;
+		__entry->num	= num;
+		__entry->btype	= btype;
+	),
+
+	TP_printk("dev %d,%d blocknr %lu num %d btype %u",
+		MAJOR(__entry->dev), MINOR(__entry->dev),
+		__entry->blocknr, __entry->num, __entry->btype)
+);
+
+DECLARE_EVENT_CLASS(nova_blocks_exit,
+	TP_PROTO(struct super_block *sb, unsigned long blocknr,
+		int ret, u64 start),
+	TP_ARGS(sb, blocknr, ret, start),
+
+	TP_STRUCT__entry(
+		__field(dev_t,		dev)
+		__field(unsigned long,	blocknr)
+		__field(int,		ret)
+		__field(u64,		latency)
+	),
+
+	TP_fast_assign(
+		__entry->dev	= sb->s_dev;
+		__entry->blocknr = blocknr;
+		__entry->ret	= ret;
+		__entry->latency = NOVA_TRACE_LATENCY(start);
+	),
+
+	TP_printk("dev %d,%d blocknr %lu ret %d latency %llu ns",
+		MAJOR(__entry->dev), MINOR(__entry->dev),
+		__entry->blocknr, __entry->ret, __entry->latency)
+);
+
+DEFINE_EVENT(nova_blocks_enter, nova_new_blocks_enter,
+	TP_PROTO(struct super_block *sb, unsigned long blocknr,
+		int num, unsigned short btype),
+	TP_ARGS(sb, blocknr, num, btype)
+);
+
+DEFINE_EVENT(nova_blocks_exit, nova_new_blocks_exit,
+	TP_PROTO(struct super_block *sb, unsigned long blocknr,
+		int ret, u64 start),
+	TP_ARGS(sb, blocknr, ret, start)
+);
+
+DEFINE_EVENT(nova_blocks_enter, nova_free_blocks_enter,
+	TP_PROTO(struct super_block *sb, unsigned long blocknr,
+		int num, unsigned short btype),
+	TP_ARGS(sb, blocknr, num, btype)
+);
+
+DEFINE_EVENT(nova_blocks_exit, nova_free_blocks_exit,
+	TP_PROTO(struct super_block *sb, unsigned long blocknr,
+		int ret, u64 start),
+	TP_ARGS(sb, blocknr, ret, start)
+);
+
+/* Log garbage collection */
+DECLARE_EVENT_CLASS(nova_gc_enter,
+	TP_PROTO(struct super_block *sb, u64 ino, unsigned long log_pages),
+	TP_ARGS(sb, ino, log_pages),
+
+	TP_STRUCT__entry(
+		__field(dev_t,		dev)
+		__field(u64,		ino)
+		__field(unsigned long,	log_pages)
+	),
+
+	TP_fast_assign(
+		__entry->dev	= sb->s_dev;
+		__entry->ino	= ino;
+		__entry->log_pages = log_pages;
+	),
+
+	TP_printk("dev %d,%d ino %llu log pages %lu",
+		MAJOR(__entry->dev), MINOR(__entry->dev),
+		__entry->ino, __entry->log_pages)
+);
+
+DECLARE_EVENT_CLASS(nova_gc_exit,
+	TP_PROTO(struct super_block *sb, u64 ino, unsigned long checked,
+		unsigned long freed, u64 start),
+	TP_ARGS(sb, ino, checked, freed, start),
+
+	TP_STRUCT__entry(
+		__field(dev_t,		dev)
+		__field(u64,		ino)
+		__field(unsigned long,	checked)
+		__field(unsigned long,	freed)
+		__field(u64,		latency)
+	),
+
+	TP_fast_assign(
+		__entry->dev	= sb->s_dev;
+		__entry->ino	= ino;
+		__entry->checked = checked;
+		__entry->freed	= freed;
+		__entry->latency = NOVA_TRACE_LATENCY(start);
+	),
+
+	TP_printk("dev %d,%d ino %llu checked %lu freed %lu latency %llu ns",
+		MAJOR(__entry->dev), MINOR(__entry->dev),
+		__entry->ino, __entry->checked, __entry->freed,
+		__entry->latency)
+);
+
+DEFINE_EVENT(nova_gc_enter, nova_fast_gc_enter,
+	TP_PROTO(struct super_block *sb, u64 ino, unsigned long log_pages),
+	TP_ARGS(sb, ino, log_pages)
+);
+
+DEFINE_EVENT(nova_gc_exit, nova_fast_gc_exit,
+	TP_PROTO(struct super_block *sb, u64 ino, unsigned long checked,
+		unsigned long freed, u64 start),
+	TP_ARGS(sb, ino, checked, freed, start)
+);
+
+DEFINE_EVENT(nova_gc_enter, nova_thorough_gc_enter,
+	TP_PROTO(struct super_block *sb, u64 ino, unsigned long log_pages),
+	TP_ARGS(sb, ino, log_pages)
+);
+
+DEFINE_EVENT(nova_gc_exit, nova_thorough_gc_exit,
+	TP_PROTO(struct super_block *sb, u64 ino, unsigned long checked,
+		unsigned long freed, u64 start),
+	TP_ARGS(sb, ino, checked, freed, start)
+);
+
+/* Lite journal transactions */
+TRACE_EVENT(nova_commit_enter,
+	TP_PROTO(struct super_block *sb, int cpu, int updates),
+	TP_ARGS(sb, cpu, updates),
+
+	TP_STRUCT__entry(
+		__field(dev_t,	dev)
+		__field(int,	cpu)
+		__field(int,	updates)
+	),
+
+	TP_fast_assign(
+		__entry->dev	= sb->s_dev;
+		__entry->cpu	= cpu;
+		__entry->updates = updates;
+	),
+
+	TP_printk("dev %d,%d cpu %d updates %d",
+		MAJOR(__entry->dev), MINOR(__entry->dev),
+		__entry->cpu, __entry->updates)
+);
+
+TRACE_EVENT(nova_commit_exit,
+	TP_PROTO(struct super_block *sb, int cpu, int groups, u64 start),
+	TP_ARGS(sb, cpu, groups, start),
+
+	TP_STRUCT__entry(
+		__field(dev_t,	dev)
+		__field(int,	cpu)
+		__field(int,	groups)
+		__field(u64,	latency)
+	),
+
+	TP_fast_assign(
+		__entry->dev	= sb->s_dev;
+		__entry->cpu	= cpu;
+		__entry->groups	= groups;
+		__entry->latency = NOVA_TRACE_LATENCY(start);
+	),
+
+	TP_printk("dev %d,%d cpu %d group commits %d latency %llu ns",
+		MAJOR(__entry->dev), MINOR(__entry->dev),
+		__entry->cpu, __entry->groups, __entry->latency)
+);
+
+#endif /* _NOVA_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE nova_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,738 @@
+/*
+ * NOVA shared data blocks
+ *
+ * Copyright 2015-2016 Regents of the University of California,
+ * UCSD Non-Volatile Systems Lab, Andiry Xu <jix024@cs.ucsd.edu>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * FICLONE, FICLONERANGE, copy_file_range and NOVA_CLONE_RANGE append
+ * write entries to the target that point at the blocks of the source;
+ * no data is copied. NOVA never writes data in place, so the next write
+ * to either file goes to new blocks and unshares the page.
+ *
+ * Blocks with more than one reference are kept in refcount_tree with
+ * their count. nova_free_data_blocks drops a reference to such a block
+ * instead of freeing it, and frees it with the last one.
+ *
+ * Every change to the tree appends a nova_refcount_entry, which sets the
+ * count of a range, to the log of NOVA_REFCOUNT_INO. Every mount replays
+ * the log, whatever the recovery path, and compacts it into a snapshot
+ * of the tree; so does umount, and the append path once the log grows.
+ * A clone commits the new counts before the entries of the target, a
+ * free after the entry that dropped the reference, so after a crash a
+ * count can be too high but never too low: a block may leak, a live
+ * block is never freed.
+ */
+
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include "nova.h"
+
+#define	NOVA_REFCOUNT_PER_PAGE	\
+	(LAST_ENTRY / sizeof(struct nova_refcount_entry))
+
+/* Compact a log longer than this and twice its snapshot */
+#define	NOVA_REFCOUNT_COMPACT_PAGES	64
+
+/* Pages cloned per commit */
+#define	NOVA_CLONE_BATCH		4096
+
+struct nova_refcount_node {
+	struct rb_node	node;
+	unsigned long	blocknr;
+	unsigned long	num;
+	unsigned int	refs;
+};
+
+/* The first node that ends after blocknr */
+static struct nova_refcount_node *nova_refcount_search(
+	struct nova_sb_info *sbi, unsigned long blocknr)
+{
+	struct rb_node *temp = sbi->refcount_tree.rb_node;
+	struct nova_refcount_node *curr, *found = NULL;
+
+	while (temp) {
+		curr = container_of(temp, struct nova_refcount_node, node);
+		if (blocknr < curr->blocknr + curr->num) {
+			found = curr;
+			if (blocknr >= curr->blocknr)
+				break;
+			temp = temp->rb_left;
+		} else {
+			temp = temp->rb_right;
+		}
+	}
+
+	return found;
+}
+
+static struct nova_refcount_node *nova_refcount_insert(
+	struct nova_sb_info *sbi, unsigned long blocknr, unsigned long num,
+	unsigned int refs)
+{
+	struct rb_node **temp = &sbi->refcount_tree.rb_node;
+	struct rb_node *parent = NULL;
+	struct nova_refcount_node *curr, *new_node;
+
+	new_node = kmalloc(sizeof(struct nova_refcount_node), GFP_NOFS);
+	if (!new_node)
+		return NULL;
+
+	new_node->blocknr = blocknr;
+	new_node->num = num;
+	new_node->refs = refs;
+
+	while (*temp) {
+		curr = container_of(*temp, struct nova_refcount_node, node);
+		parent = *temp;
+		if (blocknr < curr->blocknr)
+			temp = &((*temp)->rb_left);
+		else
+			temp = &((*temp)->rb_right);
+	}
+
+	rb_link_node(&new_node->node, parent, temp);
+	rb_insert_color(&new_node->node, &sbi->refcount_tree);
+	WRITE_ONCE(sbi->refcount_nodes, sbi->refcount_nodes + 1);
+
+	return new_node;
+}
+
+static void nova_refcount_erase(struct nova_sb_info *sbi,
+	struct nova_refcount_node *node)
+{
+	rb_erase(&node->node, &sbi->refcount_tree);
+	WRITE_ONCE(sbi->refcount_nodes, sbi->refcount_nodes - 1);
+	kfree(node);
+}
+
+/* Split node at blocknr, returns the upper part */
+static struct nova_refcount_node *nova_refcount_split(
+	struct nova_sb_info *sbi, struct nova_refcount_node *node,
+	unsigned long blocknr)
+{
+	struct nova_refcount_node *upper;
+
+	upper = nova_refcount_insert(sbi, blocknr,
+			node->blocknr + node->num - blocknr, node->refs);
+	if (upper)
+		node->num = blocknr - node->blocknr;
+
+	return upper;
+}
+
+/*
+ * Split the node covering blocknr so that it starts there and ends at or
+ * before end. Returns that node, NULL if out of memory.
+ */
+static struct nova_refcount_node *nova_refcount_isolate(
+	struct nova_sb_info *sbi, struct nova_refcount_node *node,
+	unsigned long blocknr, unsigned long end)
+{
+	if (node->blocknr < blocknr) {
+		node = nova_refcount_split(sbi, node, blocknr);
+		if (!node)
+			return NULL;
+	}
+
+	if (node->blocknr + node->num > end &&
+			!nova_refcount_split(sbi, node, end))
+		return NULL;
+
+	return node;
+}
+
+/* Replay a record: the blocks in [blocknr, blocknr + num) have refs */
+static int nova_refcount_set(struct nova_sb_info *sbi, unsigned long blocknr,
+	unsigned long num, unsigned int refs)
+{
+	struct nova_refcount_node *node;
+	unsigned long end = blocknr + num;
+
+	while ((node = nova_refcount_search(sbi, blocknr)) &&
+			node->blocknr < end) {
+		node = nova_refcount_isolate(sbi, node,
+				max(node->blocknr, blocknr), end);
+		if (!node)
+			return -ENOMEM;
+		nova_refcount_erase(sbi, node);
+	}
+
+	if (refs > 1 && !nova_refcount_insert(sbi, blocknr, num, refs))
+		return -ENOMEM;
+
+	return 0;
+}
+
+static u64 nova_refcount_write(struct super_block *sb, u64 tail,
+	unsigned long blocknr, unsigned long num, unsigned int refs)
+{
+	struct nova_refcount_entry *entry;
+	size_t size = sizeof(struct nova_refcount_entry);
+
+	if (is_last_entry(tail, size))
+		tail = next_log_page(sb, tail);
+
+	entry = (struct nova_refcount_entry *)nova_get_block(sb, tail);
+	entry->blocknr = cpu_to_le64(blocknr);
+	entry->num = cpu_to_le32(num);
+	entry->refs = cpu_to_le32(refs);
+	nova_flush_buffer(entry, size, 0);
+
+	return tail + size;
+}
+
+/* Append a record after tail, the caller commits it */
+static u64 nova_refcount_append(struct super_block *sb, struct nova_inode *pi,
+	u64 tail, unsigned long blocknr, unsigned long num, unsigned int refs)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	size_t size = sizeof(struct nova_refcount_entry);
+	int extended = 0;
+
+	tail = nova_get_append_head(sb, pi, NULL, tail, size, &extended);
+	if (tail == 0)
+		return 0;
+
+	if (extended)
+		sbi->refcount_log_pages++;
+
+	return nova_refcount_write(sb, tail, blocknr, num, refs);
+}
+
+/*
+ * Write the tree to new log pages and move the log there. The new pages
+ * are linked after the old tail before the tail moves to them, so the
+ * log replays to the same counts at every step.
+ */
+static int nova_refcount_compact(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_inode *pi = nova_get_inode_by_ino(sb, NOVA_REFCOUNT_INO);
+	struct nova_inode_log_page *last_page = NULL;
+	struct nova_refcount_node *curr;
+	struct rb_node *temp;
+	size_t size = sizeof(struct nova_refcount_entry);
+	unsigned long num_pages;
+	u64 new_head = 0, old_head, old_tail, tail;
+	int allocated;
+
+	num_pages = DIV_ROUND_UP(sbi->refcount_nodes, NOVA_REFCOUNT_PER_PAGE);
+	if (num_pages == 0)
+		num_pages = 1;
+
+	allocated = nova_allocate_inode_log_pages(sb, pi, num_pages,
+						&new_head);
+	if (allocated != num_pages) {
+		nova_dbg("Error saving shared block counts: %d\n", allocated);
+		return -ENOSPC;
+	}
+
+	tail = new_head;
+	for (temp = rb_first(&sbi->refcount_tree); temp; temp = rb_next(temp)) {
+		curr = container_of(temp, struct nova_refcount_node, node);
+		tail = nova_refcount_write(sb, tail, curr->blocknr, curr->num,
+						curr->refs);
+	}
+
+	old_head = pi->log_head;
+	old_tail = pi->log_tail;
+	if (old_head) {
+		/* An empty record sends replay on to the next page */
+		if (!is_last_entry(old_tail, size))
+			nova_refcount_write(sb, old_tail, 0, 0, 0);
+		last_page = (struct nova_inode_log_page *)
+				nova_get_block(sb, BLOCK_OFF(old_tail));
+		last_page->page_tail.next_page = new_head;
+		nova_flush_buffer(&last_page->page_tail,
+				sizeof(struct nova_inode_page_tail), 0);
+	}
+
+	nova_update_tail(pi, tail);
+	pi->log_head = new_head;
+	nova_flush_buffer(&pi->log_head, CACHELINE_SIZE, 1);
+
+	if (old_head) {
+		last_page->page_tail.next_page = 0;
+		nova_flush_buffer(&last_page->page_tail,
+				sizeof(struct nova_inode_page_tail), 1);
+		nova_free_contiguous_log_blocks(sb, pi, old_head);
+	}
+
+	sbi->refcount_log_pages = num_pages;
+	return 0;
+}
+
+static void nova_refcount_maybe_compact(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	unsigned long snapshot;
+
+	snapshot = DIV_ROUND_UP(sbi->refcount_nodes, NOVA_REFCOUNT_PER_PAGE);
+	if (sbi->refcount_log_pages > NOVA_REFCOUNT_COMPACT_PAGES &&
+			sbi->refcount_log_pages > 2 * snapshot)
+		nova_refcount_compact(sb);
+}
+
+/* Committed tail of the log, which is created on first use */
+static u64 nova_refcount_tail(struct super_block *sb, struct nova_inode *pi)
+{
+	if (pi->log_head == 0 && nova_refcount_compact(sb))
+		return 0;
+
+	return pi->log_tail;
+}
+
+/* Take back the increments of a get that could not be logged */
+static void nova_refcount_undo(struct nova_sb_info *sbi,
+	unsigned long blocknr, unsigned long end)
+{
+	struct nova_refcount_node *node;
+
+	while ((node = nova_refcount_search(sbi, blocknr)) &&
+			node->blocknr < end) {
+		blocknr = node->blocknr + node->num;
+		if (--node->refs < 2)
+			nova_refcount_erase(sbi, node);
+	}
+}
+
+/*
+ * Whether any block is shared, without refcount_mutex, for the free path.
+ *
+ * Blocks only gain their first extra reference in nova_refcount_get,
+ * which a clone calls under the source's i_mutex while the source still
+ * maps them; refcount_nodes is raised under refcount_mutex before that.
+ * Every path that frees blocks a live file maps holds that file's
+ * i_mutex too, and eviction runs after the last open file is gone, so no
+ * clone can be using it as a source. The i_mutex release and acquire
+ * order the count against the free: a zero read here means the blocks
+ * being freed have no other reference, and none can be added to them.
+ * Blocks that are shared keep a node until their last reference is
+ * dropped, so the count is not zero while they are.
+ */
+bool nova_refcount_shared(struct super_block *sb)
+{
+	return READ_ONCE(NOVA_SB(sb)->refcount_nodes) != 0;
+}
+
+/*
+ * Add a reference to each block in [blocknr, blocknr + num), which the
+ * caller is about to share. The counts are persistent on return.
+ */
+int nova_refcount_get(struct super_block *sb, unsigned long blocknr,
+	unsigned long num)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_inode *pi = nova_get_inode_by_ino(sb, NOVA_REFCOUNT_INO);
+	struct nova_refcount_node *node;
+	unsigned long curr = blocknr, done = blocknr;
+	unsigned long end = blocknr + num;
+	u64 tail;
+	int ret = 0;
+
+	mutex_lock(&sbi->refcount_mutex);
+	tail = nova_refcount_tail(sb, pi);
+	if (tail == 0) {
+		ret = -ENOSPC;
+		goto out;
+	}
+
+	while (curr < end) {
+		node = nova_refcount_search(sbi, curr);
+		if (node && node->blocknr <= curr) {
+			node = nova_refcount_isolate(sbi, node, curr, end);
+			if (node)
+				node->refs++;
+		} else {
+			node = nova_refcount_insert(sbi, curr,
+					(node ? min(node->blocknr, end) : end) -
+					curr, 2);
+		}
+		if (!node) {
+			ret = -ENOMEM;
+			break;
+		}
+
+		curr = done = node->blocknr + node->num;
+		tail = nova_refcount_append(sb, pi, tail, node->blocknr,
+						node->num, node->refs);
+		if (tail == 0) {
+			ret = -ENOSPC;
+			break;
+		}
+	}
+
+	if (ret) {
+		nova_refcount_undo(sbi, blocknr, done);
+		goto out;
+	}
+
+	nova_update_tail(pi, tail);
+	nova_refcount_maybe_compact(sb);
+out:
+	mutex_unlock(&sbi->refcount_mutex);
+	return ret;
+}
+
+/*
+ * Drop a reference to the blocks at the start of [blocknr, blocknr + num)
+ * and set *run to how many. Returns 1 if they were shared, so the caller
+ * must not free them, 0 if they were not.
+ */
+int nova_refcount_put(struct super_block *sb, unsigned long blocknr,
+	unsigned long num, unsigned long *run)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_inode *pi = nova_get_inode_by_ino(sb, NOVA_REFCOUNT_INO);
+	struct nova_refcount_node *node;
+	unsigned long end = blocknr + num;
+	u64 tail;
+	int ret = 0;
+
+	mutex_lock(&sbi->refcount_mutex);
+	node = nova_refcount_search(sbi, blocknr);
+	if (!node || node->blocknr >= end) {
+		*run = num;
+		goto out;
+	}
+
+	if (node->blocknr > blocknr) {
+		*run = node->blocknr - blocknr;
+		goto out;
+	}
+
+	*run = min(node->blocknr + node->num, end) - blocknr;
+	node = nova_refcount_isolate(sbi, node, blocknr, end);
+	if (!node) {
+		/* Leak the blocks rather than free them shared */
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	/* Unlogged, the count is only too high after a crash */
+	tail = nova_refcount_tail(sb, pi);
+	node->refs--;
+	if (tail) {
+		tail = nova_refcount_append(sb, pi, tail, node->blocknr,
+						node->num, node->refs);
+		if (tail)
+			nova_update_tail(pi, tail);
+	}
+
+	if (node->refs < 2)
+		nova_refcount_erase(sbi, node);
+
+	nova_refcount_maybe_compact(sb);
+	ret = 1;
+out:
+	mutex_unlock(&sbi->refcount_mutex);
+	return ret;
+}
+
+/* Whether a data block has more than one reference */
+bool nova_block_shared(struct super_block *sb, unsigned long blocknr)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_refcount_node *node;
+	bool shared;
+
+	if (RB_EMPTY_ROOT(&sbi->refcount_tree))
+		return false;
+
+	mutex_lock(&sbi->refcount_mutex);
+	node = nova_refcount_search(sbi, blocknr);
+	shared = node && node->blocknr <= blocknr;
+	mutex_unlock(&sbi->refcount_mutex);
+
+	return shared;
+}
+
+/* Load the counts at mount. A failure must fail the mount. */
+int nova_refcount_init(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_inode *pi = nova_get_inode_by_ino(sb, NOVA_REFCOUNT_INO);
+	struct nova_refcount_entry *entry;
+	size_t size = sizeof(struct nova_refcount_entry);
+	unsigned long records = 0;
+	u64 curr_p = pi->log_head;
+	int ret = 0;
+
+	mutex_lock(&sbi->refcount_mutex);
+	sbi->refcount_log_pages = curr_p ? 1 : 0;
+	while (curr_p && curr_p != pi->log_tail) {
+		if (is_last_entry(curr_p, size)) {
+			curr_p = next_log_page(sb, curr_p);
+			sbi->refcount_log_pages++;
+			continue;
+		}
+
+		entry = (struct nova_refcount_entry *)nova_get_block(sb,
+								curr_p);
+		if (entry->num == 0) {
+			curr_p = BLOCK_OFF(curr_p) + LAST_ENTRY;
+			continue;
+		}
+
+		ret = nova_refcount_set(sbi, le64_to_cpu(entry->blocknr),
+				le32_to_cpu(entry->num),
+				le32_to_cpu(entry->refs));
+		if (ret)
+			break;
+		records++;
+		curr_p += size;
+	}
+
+	if (ret == 0 && !(sb->s_flags & MS_RDONLY) &&
+			nova_refcount_compact(sb))
+		nova_dbg("%s: compaction failed\n", __func__);
+	mutex_unlock(&sbi->refcount_mutex);
+
+	if (ret)
+		nova_refcount_exit(sb);
+
+	nova_dbgv("%s: %lu records, %lu shared ranges\n", __func__,
+			records, sbi->refcount_nodes);
+	return ret;
+}
+
+/* Compact the log at umount, so the next mount replays a snapshot */
+void nova_save_refcount_log(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	unsigned long snapshot;
+
+	if (sb->s_flags & MS_RDONLY)
+		return;
+
+	mutex_lock(&sbi->refcount_mutex);
+	snapshot = DIV_ROUND_UP(sbi->refcount_nodes, NOVA_REFCOUNT_PER_PAGE);
+	if (sbi->refcount_log_pages > max(snapshot, 1UL))
+		nova_refcount_compact(sb);
+	mutex_unlock(&sbi->refcount_mutex);
+}
+
+void nova_refcount_exit(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct rb_node *temp;
+
+	/* Also reached by mounts that failed before the mutex was set up */
+	if (RB_EMPTY_ROOT(&sbi->refcount_tree))
+		return;
+
+	mutex_lock(&sbi->refcount_mutex);
+	while ((temp = rb_first(&sbi->refcount_tree)))
+		nova_refcount_erase(sbi, container_of(temp,
+					struct nova_refcount_node, node));
+	mutex_unlock(&sbi->refcount_mutex);
+}
+
+/*
+ * Pages from pgoff, at most max, that are all holes or all map
+ * contiguous blocks of the same kind.
+ */
+static unsigned long nova_clone_run(struct super_block *sb,
+	struct nova_inode_info_header *sih,
+	struct nova_file_write_entry *entry, unsigned long pgoff,
+	unsigned long max)
+{
+	struct nova_file_write_entry *next;
+	unsigned long nvmm = 0;
+	unsigned long run;
+
+	if (entry)
+		nvmm = get_nvmm(sb, sih, entry, pgoff);
+
+	for (run = 1; run < max; run++) {
+		next = radix_tree_lookup(&sih->tree, pgoff + run);
+		if (!entry || !next) {
+			if (entry || next)
+				break;
+			continue;
+		}
+
+		if (get_nvmm(sb, sih, next, pgoff + run) != nvmm + run ||
+				nova_entry_unwritten(next) !=
+				nova_entry_unwritten(entry))
+			break;
+	}
+
+	return run;
+}
+
+/*
+ * Map num pages of dst from dpgoff to the blocks of src from spgoff,
+ * committing one batch at a time. Source holes punch the target.
+ */
+static int nova_clone_pages(struct super_block *sb, struct inode *src,
+	struct inode *dst, unsigned long spgoff, unsigned long dpgoff,
+	unsigned long num, loff_t new_size)
+{
+	struct nova_inode_info_header *ssih = &NOVA_I(src)->header;
+	struct nova_inode_info_header *dsih = &NOVA_I(dst)->header;
+	struct nova_inode *pi = nova_get_inode(sb, dst);
+	struct nova_file_write_entry *entry;
+	unsigned long i, n, run, nvmm = 0;
+	unsigned long blocks;
+	u64 begin, tail, block, curr_entry;
+	struct iattr attr;
+	bool sized = false;
+	int ret = 0;
+
+	dst->i_ctime = dst->i_mtime = CURRENT_TIME_SEC;
+
+	while (num) {
+		n = min_t(unsigned long, num, NOVA_CLONE_BATCH);
+		begin = 0;
+		tail = pi->log_tail;
+		blocks = 0;
+
+		for (i = 0; i < n; i += run) {
+			entry = radix_tree_lookup(&ssih->tree, spgoff + i);
+			run = nova_clone_run(sb, ssih, entry, spgoff + i,
+						n - i);
+			if (entry) {
+				nvmm = get_nvmm(sb, ssih, entry, spgoff + i);
+				ret = nova_refcount_get(sb, nvmm, run);
+				if (ret)
+					goto fail;
+				block = ((u64)nvmm << PAGE_SHIFT) |
+					(entry->block & FILE_UNWRITTEN);
+			} else if (nova_range_mapped(dsih, dpgoff + i,
+						dpgoff + i + run - 1)) {
+				block = FILE_HOLE;
+			} else {
+				continue;
+			}
+
+			curr_entry = nova_append_range_entry(sb, pi, dst,
+					dpgoff + i, run, block, new_size, tail);
+			if (curr_entry == 0) {
+				/* Drop the reference just taken */
+				if (entry)
+					nova_free_data_blocks(sb, pi, nvmm, run);
+				ret = -ENOSPC;
+				goto fail;
+			}
+
+			if (begin == 0)
+				begin = curr_entry;
+			tail = curr_entry + sizeof(struct nova_file_write_entry);
+			if (entry)
+				blocks += run;
+		}
+
+		if (begin)
+			sized = true;
+		ret = nova_fallocate_commit(sb, pi, dst, begin, tail, blocks,
+						new_size);
+		if (ret)
+			return ret;
+
+		spgoff += n;
+		dpgoff += n;
+		num -= n;
+		cond_resched();
+	}
+
+	/* No entry records the new size */
+	if (!sized && new_size != dst->i_size) {
+		attr.ia_valid = ATTR_SIZE | ATTR_MTIME | ATTR_CTIME;
+		attr.ia_size = new_size;
+		tail = nova_append_setattr_entry(sb, pi, dst, &attr,
+							pi->log_tail);
+		ret = nova_fallocate_commit(sb, pi, dst, 0, tail, 0, new_size);
+	}
+
+	return ret;
+fail:
+	nova_fallocate_abort(sb, pi, begin, tail);
+	return ret;
+}
+
+/*
+ * Share [off, off + len) of src_file with dst_file at destoff. Offsets
+ * must be block aligned, and so must len unless the range ends at the
+ * source EOF and reaches the target EOF. Zero len clones to EOF.
+ */
+int nova_clone_file_range(struct file *src_file, loff_t off,
+	struct file *dst_file, loff_t destoff, u64 len)
+{
+	struct inode *src = file_inode(src_file);
+	struct inode *dst = file_inode(dst_file);
+	struct super_block *sb = dst->i_sb;
+	unsigned long mask = sb->s_blocksize - 1;
+	unsigned int bits = sb->s_blocksize_bits;
+	loff_t end, new_size;
+	int ret;
+	timing_t clone_time;
+
+	if (src->i_sb != sb)
+		return -EXDEV;
+	if (!S_ISREG(src->i_mode) || !S_ISREG(dst->i_mode))
+		return -EINVAL;
+	if (off < 0 || destoff < 0 || ((off | destoff) & mask))
+		return -EINVAL;
+
+	NOVA_START_TIMING(clone_t, clone_time);
+	if (src == dst)
+		mutex_lock(&src->i_mutex);
+	else
+		lock_two_nondirectories(src, dst);
+
+	ret = -EINVAL;
+	if (len == 0 && off < src->i_size)
+		len = src->i_size - off;
+	if (len > (u64)(LLONG_MAX - off))
+		goto out;
+	end = off + len;
+	if (end > src->i_size)
+		goto out;
+	if ((len & mask) &&
+			(end != src->i_size || destoff + len < dst->i_size))
+		goto out;
+	if (src == dst && destoff < end && off < destoff + len)
+		goto out;
+
+	ret = 0;
+	if (len == 0)
+		goto out;
+
+	/* mmap pages may hold data the blocks do not */
+	ret = -EBUSY;
+	if (mapping_mapped(src->i_mapping) || NOVA_I(src)->header.mmap_pages ||
+			mapping_mapped(dst->i_mapping) ||
+			NOVA_I(dst)->header.mmap_pages)
+		goto out;
+
+	new_size = max_t(loff_t, dst->i_size, destoff + len);
+	ret = inode_newsize_ok(dst, new_size);
+	if (ret)
+		goto out;
+
+	ret = nova_clone_pages(sb, src, dst, off >> bits, destoff >> bits,
+				(len + mask) >> bits, new_size);
+out:
+	if (src == dst)
+		mutex_unlock(&src->i_mutex);
+	else
+		unlock_two_nondirectories(src, dst);
+	NOVA_END_TIMING(clone_t, clone_time);
+	return ret;
+}
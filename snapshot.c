@@ -0,0 +1,964 @@
+/*
+ * NOVA snapshots
+ *
+ * Copyright 2015-2016 Regents of the University of California,
+ * UCSD Non-Volatile Systems Lab, Andiry Xu <jix024@cs.ucsd.edu>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * A snapshot is an epoch. Every log page is tagged with the epoch of its
+ * entries, and NOVA_CREATE_SNAPSHOT freezes the fs, commits the current
+ * epoch as a snapshot and starts the next one. An append to a log page
+ * of a snapshot moves to a new page instead, so the snapshot of an inode
+ * is the prefix of its log made of pages up to that epoch, and log GC
+ * leaves those pages alone while the snapshot lives.
+ *
+ * Replaying the prefix ignores what was invalidated later, which is not
+ * in the log: pages overwritten, truncated or moved and dentries removed
+ * after the snapshot. Those invalidations of entries a snapshot sees
+ * append a record instead of freeing the blocks, and an unlinked inode a
+ * snapshot sees is kept as a record rather than freed. A record lives
+ * from the epoch of the entry (birth) to the epoch it was made in
+ * (death), and is needed while a snapshot S has birth <= S < death.
+ *
+ * Records and snapshots are logged by NOVA_SNAPSHOT_INO the way
+ * reflink.c logs block counts. Deleting a snapshot frees the blocks and
+ * inodes of the records nothing needs any more. A record is committed
+ * after the entry that invalidated the pages, so a crash in between could
+ * lose it; recovery marks every block of an entry a snapshot sees
+ * instead, which may leak a block but never frees one a snapshot reads.
+ *
+ * mount -o snapshot=<epoch> replays each log up to the epoch, then the
+ * records alive at that epoch, read-only. The live fs can not be mounted
+ * at the same time.
+ */
+
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include "nova.h"
+
+#define	NOVA_SNAPSHOT_PER_PAGE	\
+	(LAST_ENTRY / sizeof(struct nova_snapshot_entry))
+
+/* Compact a log longer than this and twice its snapshot */
+#define	NOVA_SNAPSHOT_COMPACT_PAGES	64
+
+struct nova_snapshot {
+	struct list_head list;
+	u64		epoch;
+	u64		time;
+};
+
+struct nova_snapshot_record {
+	struct rb_node	node;
+	u8		type;
+	unsigned long	ino;
+	u64		entry;		/* 0 for SNAPSHOT_INODE */
+	unsigned long	pgoff;		/* Or inode generation */
+	unsigned long	num;
+	unsigned long	blocknr;
+	u64		birth;
+	u64		death;
+};
+
+/* Whether a snapshot S has birth <= S < death */
+static bool nova_snapshot_live(struct nova_sb_info *sbi, u64 birth,
+	u64 death)
+{
+	struct nova_snapshot *snapshot;
+
+	list_for_each_entry(snapshot, &sbi->snapshot_list, list) {
+		if (snapshot->epoch >= death)
+			break;
+		if (snapshot->epoch >= birth)
+			return true;
+	}
+
+	return false;
+}
+
+static struct nova_snapshot *nova_snapshot_find(struct nova_sb_info *sbi,
+	u64 epoch)
+{
+	struct nova_snapshot *snapshot;
+
+	list_for_each_entry(snapshot, &sbi->snapshot_list, list) {
+		if (snapshot->epoch == epoch)
+			return snapshot;
+	}
+
+	return NULL;
+}
+
+static int nova_snapshot_add(struct nova_sb_info *sbi, u64 epoch, u64 time)
+{
+	struct nova_snapshot *snapshot;
+
+	snapshot = kmalloc(sizeof(struct nova_snapshot), GFP_NOFS);
+	if (!snapshot)
+		return -ENOMEM;
+
+	/* Epochs only grow, the list stays sorted */
+	snapshot->epoch = epoch;
+	snapshot->time = time;
+	list_add_tail(&snapshot->list, &sbi->snapshot_list);
+	sbi->snapshot_count++;
+	WRITE_ONCE(sbi->snapshot_latest, epoch);
+
+	return 0;
+}
+
+static void nova_snapshot_remove(struct nova_sb_info *sbi,
+	struct nova_snapshot *snapshot)
+{
+	list_del(&snapshot->list);
+	kfree(snapshot);
+	sbi->snapshot_count--;
+
+	if (list_empty(&sbi->snapshot_list))
+		WRITE_ONCE(sbi->snapshot_latest, 0);
+	else
+		WRITE_ONCE(sbi->snapshot_latest, list_last_entry(
+			&sbi->snapshot_list, struct nova_snapshot, list)->epoch);
+}
+
+/* Records are ordered by ino, entry, then pgoff */
+static int nova_snapshot_cmp(struct nova_snapshot_record *rec,
+	unsigned long ino, u64 entry, unsigned long pgoff)
+{
+	if (ino != rec->ino)
+		return ino < rec->ino ? -1 : 1;
+	if (entry != rec->entry)
+		return entry < rec->entry ? -1 : 1;
+	if (pgoff != rec->pgoff)
+		return pgoff < rec->pgoff ? -1 : 1;
+
+	return 0;
+}
+
+/* The first record at or after the key */
+static struct nova_snapshot_record *nova_snapshot_search(
+	struct nova_sb_info *sbi, unsigned long ino, u64 entry,
+	unsigned long pgoff)
+{
+	struct rb_node *temp = sbi->snapshot_tree.rb_node;
+	struct nova_snapshot_record *curr, *found = NULL;
+	int cmp;
+
+	while (temp) {
+		curr = container_of(temp, struct nova_snapshot_record, node);
+		cmp = nova_snapshot_cmp(curr, ino, entry, pgoff);
+		if (cmp <= 0) {
+			found = curr;
+			if (cmp == 0)
+				break;
+			temp = temp->rb_left;
+		} else {
+			temp = temp->rb_right;
+		}
+	}
+
+	return found;
+}
+
+static struct nova_snapshot_record *nova_snapshot_lookup(
+	struct nova_sb_info *sbi, unsigned long ino, u64 entry,
+	unsigned long pgoff)
+{
+	struct nova_snapshot_record *rec;
+
+	rec = nova_snapshot_search(sbi, ino, entry, pgoff);
+	if (rec && nova_snapshot_cmp(rec, ino, entry, pgoff))
+		return NULL;
+
+	return rec;
+}
+
+static struct nova_snapshot_record *nova_snapshot_next(
+	struct nova_snapshot_record *rec)
+{
+	struct rb_node *temp = rb_next(&rec->node);
+
+	return temp ? container_of(temp, struct nova_snapshot_record, node) :
+			NULL;
+}
+
+/* The last record before the key */
+static struct nova_snapshot_record *nova_snapshot_prev(
+	struct nova_sb_info *sbi, unsigned long ino, u64 entry,
+	unsigned long pgoff)
+{
+	struct nova_snapshot_record *rec;
+	struct rb_node *temp;
+
+	rec = nova_snapshot_search(sbi, ino, entry, pgoff);
+	temp = rec ? rb_prev(&rec->node) : rb_last(&sbi->snapshot_tree);
+
+	return temp ? container_of(temp, struct nova_snapshot_record, node) :
+			NULL;
+}
+
+/* Insert a record, or update the one with the same key */
+static struct nova_snapshot_record *nova_snapshot_insert(
+	struct nova_sb_info *sbi, u8 type, unsigned long ino, u64 entry,
+	unsigned long pgoff, unsigned long num, unsigned long blocknr,
+	u64 birth, u64 death)
+{
+	struct rb_node **temp = &sbi->snapshot_tree.rb_node;
+	struct rb_node *parent = NULL;
+	struct nova_snapshot_record *curr, *rec = NULL;
+	int cmp;
+
+	while (*temp) {
+		curr = container_of(*temp, struct nova_snapshot_record, node);
+		parent = *temp;
+		cmp = nova_snapshot_cmp(curr, ino, entry, pgoff);
+		if (cmp == 0) {
+			rec = curr;
+			break;
+		}
+		if (cmp < 0)
+			temp = &((*temp)->rb_left);
+		else
+			temp = &((*temp)->rb_right);
+	}
+
+	if (!rec) {
+		rec = kmalloc(sizeof(struct nova_snapshot_record), GFP_NOFS);
+		if (!rec)
+			return NULL;
+
+		rec->ino = ino;
+		rec->entry = entry;
+		rec->pgoff = pgoff;
+		rb_link_node(&rec->node, parent, temp);
+		rb_insert_color(&rec->node, &sbi->snapshot_tree);
+		sbi->snapshot_records++;
+	}
+
+	rec->type = type;
+	rec->num = num;
+	rec->blocknr = blocknr;
+	rec->birth = birth;
+	rec->death = death;
+
+	return rec;
+}
+
+static void nova_snapshot_erase(struct nova_sb_info *sbi,
+	struct nova_snapshot_record *rec)
+{
+	rb_erase(&rec->node, &sbi->snapshot_tree);
+	sbi->snapshot_records--;
+	kfree(rec);
+}
+
+static void nova_snapshot_fill(struct nova_snapshot_entry *record, u8 type,
+	u64 epoch, u64 time)
+{
+	memset(record, 0, sizeof(struct nova_snapshot_entry));
+	record->type = type;
+	record->epoch = cpu_to_le64(epoch);
+	record->pgoff = cpu_to_le64(time);
+}
+
+static void nova_snapshot_fill_record(struct nova_snapshot_entry *record,
+	struct nova_snapshot_record *rec)
+{
+	nova_snapshot_fill(record, rec->type, rec->death, rec->pgoff);
+	record->num = cpu_to_le32(rec->num);
+	record->birth = cpu_to_le64(rec->birth);
+	record->ino = cpu_to_le64(rec->ino);
+	record->entry = cpu_to_le64(rec->entry);
+	record->blocknr = cpu_to_le64(rec->blocknr);
+}
+
+static u64 nova_snapshot_write(struct super_block *sb, u64 tail,
+	struct nova_snapshot_entry *record)
+{
+	struct nova_snapshot_entry *entry;
+	size_t size = sizeof(struct nova_snapshot_entry);
+
+	if (is_last_entry(tail, size))
+		tail = next_log_page(sb, tail);
+
+	entry = (struct nova_snapshot_entry *)nova_get_block(sb, tail);
+	memcpy(entry, record, size);
+	nova_flush_buffer(entry, size, 0);
+
+	return tail + size;
+}
+
+/*
+ * Write the snapshots and records to new log pages and move the log
+ * there, the same way nova_refcount_compact does.
+ */
+static int nova_snapshot_compact(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_inode *pi = nova_get_inode_by_ino(sb, NOVA_SNAPSHOT_INO);
+	struct nova_inode_log_page *last_page = NULL;
+	struct nova_snapshot_entry record;
+	struct nova_snapshot *snapshot;
+	struct nova_snapshot_record *rec;
+	struct rb_node *temp;
+	size_t size = sizeof(struct nova_snapshot_entry);
+	unsigned long num_pages;
+	u64 new_head = 0, old_head, old_tail, tail;
+	int allocated;
+
+	num_pages = DIV_ROUND_UP(1 + sbi->snapshot_count +
+			sbi->snapshot_records, NOVA_SNAPSHOT_PER_PAGE);
+
+	allocated = nova_allocate_inode_log_pages(sb, pi, num_pages,
+						&new_head);
+	if (allocated != num_pages) {
+		nova_dbg("Error saving snapshots: %d\n", allocated);
+		return -ENOSPC;
+	}
+
+	nova_snapshot_fill(&record, SNAPSHOT_EPOCH, sbi->s_epoch, 0);
+	tail = nova_snapshot_write(sb, new_head, &record);
+	list_for_each_entry(snapshot, &sbi->snapshot_list, list) {
+		nova_snapshot_fill(&record, SNAPSHOT_CREATE, snapshot->epoch,
+					snapshot->time);
+		tail = nova_snapshot_write(sb, tail, &record);
+	}
+
+	for (temp = rb_first(&sbi->snapshot_tree); temp; temp = rb_next(temp)) {
+		rec = container_of(temp, struct nova_snapshot_record, node);
+		nova_snapshot_fill_record(&record, rec);
+		tail = nova_snapshot_write(sb, tail, &record);
+	}
+
+	old_head = pi->log_head;
+	old_tail = pi->log_tail;
+	if (old_head) {
+		/* An empty record sends replay on to the next page */
+		if (!is_last_entry(old_tail, size)) {
+			memset(&record, 0, size);
+			nova_snapshot_write(sb, old_tail, &record);
+		}
+		last_page = (struct nova_inode_log_page *)
+				nova_get_block(sb, BLOCK_OFF(old_tail));
+		last_page->page_tail.next_page = new_head;
+		nova_flush_buffer(&last_page->page_tail,
+				sizeof(struct nova_inode_page_tail), 0);
+	}
+
+	nova_update_tail(pi, tail);
+	pi->log_head = new_head;
+	nova_flush_buffer(&pi->log_head, CACHELINE_SIZE, 1);
+
+	if (old_head) {
+		last_page->page_tail.next_page = 0;
+		nova_flush_buffer(&last_page->page_tail,
+				sizeof(struct nova_inode_page_tail), 1);
+		nova_free_contiguous_log_blocks(sb, pi, old_head);
+	}
+
+	sbi->snapshot_log_pages = num_pages;
+	return 0;
+}
+
+static void nova_snapshot_maybe_compact(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	unsigned long snapshot;
+
+	snapshot = DIV_ROUND_UP(1 + sbi->snapshot_count +
+			sbi->snapshot_records, NOVA_SNAPSHOT_PER_PAGE);
+	if (sbi->snapshot_log_pages > NOVA_SNAPSHOT_COMPACT_PAGES &&
+			sbi->snapshot_log_pages > 2 * snapshot)
+		nova_snapshot_compact(sb);
+}
+
+/*
+ * Append a record to the log, which is created on first use, and commit.
+ * The caller updates the DRAM state first if it compacts after.
+ */
+static int nova_snapshot_log(struct super_block *sb,
+	struct nova_snapshot_entry *record)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_inode *pi = nova_get_inode_by_ino(sb, NOVA_SNAPSHOT_INO);
+	size_t size = sizeof(struct nova_snapshot_entry);
+	int extended = 0;
+	u64 tail;
+
+	if (pi->log_head == 0 && nova_snapshot_compact(sb))
+		return -ENOSPC;
+
+	tail = nova_get_append_head(sb, pi, NULL, pi->log_tail, size,
+					&extended);
+	if (tail == 0)
+		return -ENOSPC;
+
+	if (extended)
+		sbi->snapshot_log_pages++;
+
+	tail = nova_snapshot_write(sb, tail, record);
+	nova_update_tail(pi, tail);
+
+	return 0;
+}
+
+static int nova_snapshot_log_record(struct super_block *sb,
+	struct nova_snapshot_record *rec)
+{
+	struct nova_snapshot_entry record;
+	int ret;
+
+	nova_snapshot_fill_record(&record, rec);
+	ret = nova_snapshot_log(sb, &record);
+	if (ret == 0)
+		nova_snapshot_maybe_compact(sb);
+
+	return ret;
+}
+
+static bool nova_snapshot_record_needed(struct nova_sb_info *sbi,
+	struct nova_snapshot_record *rec)
+{
+	return nova_snapshot_live(sbi, rec->birth, rec->death);
+}
+
+/*
+ * Drop the page and dentry records nothing needs. Blocks are only freed
+ * on a delete, records left in the log after one were freed already.
+ */
+static void nova_snapshot_release(struct super_block *sb, bool free)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_inode *pi = nova_get_inode_by_ino(sb, NOVA_SNAPSHOT_INO);
+	struct nova_snapshot_record *rec, *next;
+	struct rb_node *temp = rb_first(&sbi->snapshot_tree);
+
+	rec = temp ? container_of(temp, struct nova_snapshot_record, node) :
+			NULL;
+	for (; rec; rec = next) {
+		next = nova_snapshot_next(rec);
+		if (rec->type == SNAPSHOT_INODE ||
+				nova_snapshot_record_needed(sbi, rec))
+			continue;
+
+		if (free && rec->blocknr)
+			nova_free_data_blocks(sb, pi, rec->blocknr, rec->num);
+		nova_snapshot_erase(sbi, rec);
+	}
+}
+
+/* Finish the eviction of an unlinked inode */
+static void nova_snapshot_evict_inode(struct super_block *sb,
+	unsigned long ino, u32 generation)
+{
+	struct inode *inode;
+
+	inode = nova_iget(sb, ino);
+	if (IS_ERR(inode)) {
+		nova_dbg("%s: inode %lu: error %ld\n", __func__, ino,
+				PTR_ERR(inode));
+		return;
+	}
+
+	if (inode->i_nlink || inode->i_generation != generation)
+		nova_dbg("%s: inode %lu was reused\n", __func__, ino);
+
+	/* The last reference of an unlinked inode frees it */
+	iput(inode);
+}
+
+/* Free the unlinked inodes no snapshot sees any more */
+static void nova_snapshot_evict_dead(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_snapshot_record *rec;
+	unsigned long ino;
+	u32 generation;
+
+	mutex_lock(&sbi->snapshot_mutex);
+	rec = nova_snapshot_search(sbi, 0, 0, 0);
+	while (1) {
+		while (rec && (rec->type != SNAPSHOT_INODE ||
+				nova_snapshot_record_needed(sbi, rec)))
+			rec = nova_snapshot_next(rec);
+		if (!rec)
+			break;
+
+		ino = rec->ino;
+		generation = rec->pgoff;
+		mutex_unlock(&sbi->snapshot_mutex);
+
+		/* Its eviction finds the record and drops it */
+		nova_snapshot_evict_inode(sb, ino, generation);
+
+		mutex_lock(&sbi->snapshot_mutex);
+		rec = nova_snapshot_lookup(sbi, ino, 0, generation);
+		if (rec)
+			nova_snapshot_erase(sbi, rec);
+		rec = nova_snapshot_search(sbi, ino, 0, generation + 1);
+	}
+	mutex_unlock(&sbi->snapshot_mutex);
+}
+
+/*
+ * Replay the log at mount, before recovery so it can mark what the
+ * snapshots hold on to. A failure must fail the mount.
+ */
+int nova_snapshot_load(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_inode *pi = nova_get_inode_by_ino(sb, NOVA_SNAPSHOT_INO);
+	struct nova_snapshot_entry *entry;
+	struct nova_snapshot *snapshot;
+	size_t size = sizeof(struct nova_snapshot_entry);
+	unsigned long records = 0;
+	u64 curr_p = pi->log_head;
+	u64 epoch;
+	int ret = 0;
+
+	mutex_lock(&sbi->snapshot_mutex);
+	sbi->s_epoch = 1;
+	sbi->snapshot_log_pages = curr_p ? 1 : 0;
+	while (curr_p && curr_p != pi->log_tail) {
+		if (is_last_entry(curr_p, size)) {
+			curr_p = next_log_page(sb, curr_p);
+			sbi->snapshot_log_pages++;
+			continue;
+		}
+
+		entry = (struct nova_snapshot_entry *)nova_get_block(sb,
+								curr_p);
+		epoch = le64_to_cpu(entry->epoch);
+		switch (entry->type) {
+		case 0:
+			curr_p = BLOCK_OFF(curr_p) + LAST_ENTRY;
+			continue;
+		case SNAPSHOT_CREATE:
+			ret = nova_snapshot_add(sbi, epoch,
+					le64_to_cpu(entry->pgoff));
+			epoch++;
+			break;
+		case SNAPSHOT_DELETE:
+			snapshot = nova_snapshot_find(sbi, epoch);
+			if (snapshot)
+				nova_snapshot_remove(sbi, snapshot);
+			break;
+		case SNAPSHOT_EPOCH:
+			break;
+		default:
+			if (!nova_snapshot_insert(sbi, entry->type,
+					le64_to_cpu(entry->ino),
+					le64_to_cpu(entry->entry),
+					le64_to_cpu(entry->pgoff),
+					le32_to_cpu(entry->num),
+					le64_to_cpu(entry->blocknr),
+					le64_to_cpu(entry->birth), epoch))
+				ret = -ENOMEM;
+			break;
+		}
+
+		if (ret)
+			break;
+		sbi->s_epoch = max(sbi->s_epoch, epoch);
+		records++;
+		curr_p += size;
+	}
+
+	if (ret == 0 && sbi->mount_snapshot &&
+			!nova_snapshot_find(sbi, sbi->mount_snapshot)) {
+		nova_err(sb, "No snapshot %llu\n", sbi->mount_snapshot);
+		ret = -EINVAL;
+	}
+	mutex_unlock(&sbi->snapshot_mutex);
+
+	if (ret)
+		nova_snapshot_exit(sb);
+
+	nova_dbgv("%s: %lu records, %lu snapshots, epoch %llu\n", __func__,
+			records, sbi->snapshot_count, sbi->s_epoch);
+	return ret;
+}
+
+/* Finish what a crash or a read-only mount left over, after recovery */
+int nova_snapshot_init(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_inode *pi = nova_get_inode_by_ino(sb, NOVA_SNAPSHOT_INO);
+
+	if (sb->s_flags & MS_RDONLY)
+		return 0;
+
+	mutex_lock(&sbi->snapshot_mutex);
+	nova_snapshot_release(sb, false);
+	if (pi->log_head && nova_snapshot_compact(sb))
+		nova_dbg("%s: compaction failed\n", __func__);
+	mutex_unlock(&sbi->snapshot_mutex);
+
+	nova_snapshot_evict_dead(sb);
+	return 0;
+}
+
+/*
+ * Mark the snapshot log and the blocks the snapshots hold on to, for
+ * failure recovery.
+ */
+void nova_snapshot_mark_blocks(struct super_block *sb, struct scan_bitmap *bm)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_inode *pi = nova_get_inode_by_ino(sb, NOVA_SNAPSHOT_INO);
+	struct nova_snapshot_record *rec;
+	struct rb_node *temp;
+	unsigned long i;
+	u64 curr_p;
+
+	mutex_lock(&sbi->snapshot_mutex);
+	for (curr_p = pi->log_head; curr_p; curr_p = next_log_page(sb, curr_p))
+		set_bm(curr_p >> PAGE_SHIFT, bm, BM_4K);
+
+	for (temp = rb_first(&sbi->snapshot_tree); temp; temp = rb_next(temp)) {
+		rec = container_of(temp, struct nova_snapshot_record, node);
+		if (!rec->blocknr || !nova_snapshot_record_needed(sbi, rec))
+			continue;
+		for (i = 0; i < rec->num; i++)
+			set_bm(rec->blocknr + i, bm, BM_4K);
+	}
+	mutex_unlock(&sbi->snapshot_mutex);
+}
+
+/*
+ * Freeze the fs so that every transaction is either in the snapshot or
+ * after it, then start a new epoch. Writers only wait for the record.
+ */
+int nova_create_snapshot(struct super_block *sb, u64 *epoch)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_snapshot_entry record;
+	timing_t create_time;
+	u64 time = get_seconds();
+	int ret;
+
+	if (sb->s_flags & MS_RDONLY)
+		return -EROFS;
+
+	NOVA_START_TIMING(create_snapshot_t, create_time);
+	ret = freeze_super(sb);
+	if (ret)
+		goto out;
+
+	mutex_lock(&sbi->snapshot_mutex);
+	nova_snapshot_fill(&record, SNAPSHOT_CREATE, sbi->s_epoch, time);
+	ret = nova_snapshot_log(sb, &record);
+	if (ret == 0)
+		ret = nova_snapshot_add(sbi, sbi->s_epoch, time);
+	if (ret == 0) {
+		*epoch = sbi->s_epoch;
+		sbi->s_epoch++;
+		nova_snapshot_maybe_compact(sb);
+	}
+	mutex_unlock(&sbi->snapshot_mutex);
+
+	thaw_super(sb);
+out:
+	NOVA_END_TIMING(create_snapshot_t, create_time);
+	return ret;
+}
+
+int nova_delete_snapshot(struct super_block *sb, u64 epoch)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_snapshot_entry record;
+	struct nova_snapshot *snapshot;
+	timing_t delete_time;
+	int ret;
+
+	if (sb->s_flags & MS_RDONLY)
+		return -EROFS;
+
+	NOVA_START_TIMING(delete_snapshot_t, delete_time);
+	mutex_lock(&sbi->snapshot_mutex);
+	snapshot = nova_snapshot_find(sbi, epoch);
+	if (!snapshot) {
+		ret = -ENOENT;
+		goto out;
+	}
+
+	/* Committed first, recovery then frees what the snapshot held */
+	nova_snapshot_fill(&record, SNAPSHOT_DELETE, epoch, 0);
+	ret = nova_snapshot_log(sb, &record);
+	if (ret)
+		goto out;
+
+	nova_snapshot_remove(sbi, snapshot);
+	nova_snapshot_release(sb, true);
+	nova_snapshot_maybe_compact(sb);
+out:
+	mutex_unlock(&sbi->snapshot_mutex);
+
+	if (ret == 0)
+		nova_snapshot_evict_dead(sb);
+	NOVA_END_TIMING(delete_snapshot_t, delete_time);
+	return ret;
+}
+
+int nova_list_snapshots(struct super_block *sb,
+	struct nova_snapshot_list __user *arg)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_snapshot_list list;
+	struct nova_snapshot_info *info;
+	struct nova_snapshot *snapshot;
+	unsigned long count = 0, max;
+	int ret = 0;
+
+	if (copy_from_user(&list, arg, sizeof(list)))
+		return -EFAULT;
+
+	/* Copied out after the mutex is dropped */
+	max = min_t(unsigned long, list.count, READ_ONCE(sbi->snapshot_count));
+	info = kcalloc(max, sizeof(struct nova_snapshot_info), GFP_KERNEL);
+	if (!info)
+		return -ENOMEM;
+
+	mutex_lock(&sbi->snapshot_mutex);
+	list_for_each_entry(snapshot, &sbi->snapshot_list, list) {
+		if (count < max) {
+			info[count].epoch = snapshot->epoch;
+			info[count].timestamp = snapshot->time;
+		}
+		count++;
+	}
+	mutex_unlock(&sbi->snapshot_mutex);
+
+	if (copy_to_user((void __user *)(unsigned long)list.snapshots, info,
+			min(count, max) * sizeof(struct nova_snapshot_info)))
+		ret = -EFAULT;
+	else if (put_user(count, &arg->count))
+		ret = -EFAULT;
+
+	kfree(info);
+	return ret;
+}
+
+/*
+ * The pages [pgoff, pgoff + num) of entry were invalidated. Returns true
+ * if a snapshot still maps them; a record then owns blocknr, if any, and
+ * the caller must not free the blocks.
+ */
+bool nova_snapshot_keep_pages(struct super_block *sb,
+	struct nova_inode_info_header *sih,
+	struct nova_file_write_entry *entry, unsigned long pgoff,
+	unsigned long num, unsigned long blocknr)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_snapshot_record *rec;
+	u64 entry_p, birth;
+	int ret;
+
+	if (likely(!READ_ONCE(sbi->snapshot_latest)) || sih->snapshot_dead)
+		return false;
+
+	entry_p = nova_get_addr_off(sbi, entry);
+	mutex_lock(&sbi->snapshot_mutex);
+	birth = nova_log_page_epoch(sb, entry_p);
+	if (!nova_snapshot_live(sbi, birth, sbi->s_epoch)) {
+		mutex_unlock(&sbi->snapshot_mutex);
+		return false;
+	}
+
+	/* Extend the record of the pages just before, if contiguous */
+	rec = nova_snapshot_prev(sbi, sih->ino, entry_p, pgoff);
+	if (rec && rec->ino == sih->ino && rec->entry == entry_p &&
+			rec->death == sbi->s_epoch &&
+			rec->pgoff + rec->num == pgoff &&
+			(blocknr ? rec->blocknr &&
+			 rec->blocknr + rec->num == blocknr : !rec->blocknr))
+		rec->num += num;
+	else
+		rec = nova_snapshot_insert(sbi, SNAPSHOT_PAGES, sih->ino,
+				entry_p, pgoff, num, blocknr, birth,
+				sbi->s_epoch);
+
+	ret = rec ? nova_snapshot_log_record(sb, rec) : -ENOMEM;
+	mutex_unlock(&sbi->snapshot_mutex);
+
+	/* Leak the blocks rather than free them under a snapshot */
+	if (ret)
+		nova_err(sb, "%s: inode %lu pgoff %lu: error %d\n",
+				__func__, sih->ino, pgoff, ret);
+	return true;
+}
+
+/* The dentry entry was invalidated */
+void nova_snapshot_keep_dentry(struct super_block *sb,
+	struct nova_inode_info_header *sih, struct nova_dentry *entry)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_snapshot_record *rec;
+	u64 entry_p, birth;
+	int ret = 0;
+
+	if (likely(!READ_ONCE(sbi->snapshot_latest)))
+		return;
+
+	entry_p = nova_get_addr_off(sbi, entry);
+	mutex_lock(&sbi->snapshot_mutex);
+	birth = nova_log_page_epoch(sb, entry_p);
+	if (nova_snapshot_live(sbi, birth, sbi->s_epoch)) {
+		rec = nova_snapshot_insert(sbi, SNAPSHOT_DENTRY, sih->ino,
+				entry_p, 0, 0, 0, birth, sbi->s_epoch);
+		ret = rec ? nova_snapshot_log_record(sb, rec) : -ENOMEM;
+	}
+	mutex_unlock(&sbi->snapshot_mutex);
+
+	if (ret)
+		nova_err(sb, "%s: dir %lu: error %d\n", __func__,
+				sih->ino, ret);
+}
+
+/*
+ * An unlinked inode is being evicted. Returns true if a snapshot still
+ * sees it, then it stays until the last such snapshot is deleted.
+ */
+bool nova_snapshot_keep_inode(struct super_block *sb, struct inode *inode)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_inode *pi = nova_get_inode(sb, inode);
+	struct nova_snapshot_record *rec;
+	u64 birth, death;
+	bool keep;
+	int ret = 0;
+
+	/* A snapshot mount reads the inodes of the live fs */
+	if (sbi->mount_snapshot)
+		return true;
+
+	if (likely(!READ_ONCE(sbi->snapshot_latest)) &&
+			RB_EMPTY_ROOT(&sbi->snapshot_tree))
+		return false;
+
+	mutex_lock(&sbi->snapshot_mutex);
+	rec = nova_snapshot_lookup(sbi, inode->i_ino, 0,
+					inode->i_generation);
+	if (rec) {
+		birth = rec->birth;
+		death = rec->death;
+	} else {
+		birth = le32_to_cpu(pi->i_epoch);
+		death = sbi->s_epoch;
+	}
+
+	keep = nova_snapshot_live(sbi, birth, death);
+	if (keep && !rec) {
+		rec = nova_snapshot_insert(sbi, SNAPSHOT_INODE, inode->i_ino,
+				0, inode->i_generation, 0, 0, birth, death);
+		ret = rec ? nova_snapshot_log_record(sb, rec) : -ENOMEM;
+	} else if (!keep && rec) {
+		nova_snapshot_erase(sbi, rec);
+	}
+	mutex_unlock(&sbi->snapshot_mutex);
+
+	/* Unrecorded, the inode leaks */
+	if (ret)
+		nova_err(sb, "%s: inode %lu: error %d\n", __func__,
+				inode->i_ino, ret);
+	return keep;
+}
+
+/*
+ * Add back what was invalidated after the snapshot of a snapshot mount,
+ * once the log of the inode is replayed.
+ */
+void nova_snapshot_rebuild_tree(struct super_block *sb,
+	struct nova_inode_info_header *sih)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_snapshot_record *rec;
+	u64 epoch = sbi->mount_snapshot;
+	void *entry;
+	void **pentry;
+	unsigned long pgoff;
+
+	if (!epoch)
+		return;
+
+	mutex_lock(&sbi->snapshot_mutex);
+	for (rec = nova_snapshot_search(sbi, sih->ino, 0, 0);
+			rec && rec->ino == sih->ino;
+			rec = nova_snapshot_next(rec)) {
+		if (rec->birth > epoch || rec->death <= epoch)
+			continue;
+
+		entry = nova_get_block(sb, rec->entry);
+		switch (rec->type) {
+		case SNAPSHOT_PAGES:
+			for (pgoff = rec->pgoff; pgoff < rec->pgoff + rec->num;
+					pgoff++) {
+				pentry = radix_tree_lookup_slot(&sih->tree,
+								pgoff);
+				if (pentry)
+					radix_tree_replace_slot(pentry, entry);
+				else if (radix_tree_insert(&sih->tree, pgoff,
+								entry))
+					break;
+			}
+			break;
+		case SNAPSHOT_DENTRY:
+			nova_replay_add_dentry(sb, sih, entry);
+			break;
+		default:
+			break;
+		}
+	}
+	mutex_unlock(&sbi->snapshot_mutex);
+}
+
+/* Compact the log at umount, so the next mount replays a snapshot */
+void nova_save_snapshot_log(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_inode *pi = nova_get_inode_by_ino(sb, NOVA_SNAPSHOT_INO);
+	unsigned long snapshot;
+
+	if ((sb->s_flags & MS_RDONLY) || pi->log_head == 0)
+		return;
+
+	mutex_lock(&sbi->snapshot_mutex);
+	snapshot = DIV_ROUND_UP(1 + sbi->snapshot_count +
+			sbi->snapshot_records, NOVA_SNAPSHOT_PER_PAGE);
+	if (sbi->snapshot_log_pages > snapshot)
+		nova_snapshot_compact(sb);
+	mutex_unlock(&sbi->snapshot_mutex);
+}
+
+void nova_snapshot_exit(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_snapshot *snapshot, *next;
+	struct rb_node *temp;
+
+	/* Also reached by mounts that failed before the list was set up */
+	if (!sbi->snapshot_list.next)
+		return;
+
+	mutex_lock(&sbi->snapshot_mutex);
+	list_for_each_entry_safe(snapshot, next, &sbi->snapshot_list, list)
+		nova_snapshot_remove(sbi, snapshot);
+	while ((temp = rb_first(&sbi->snapshot_tree)))
+		nova_snapshot_erase(sbi, container_of(temp,
+					struct nova_snapshot_record, node));
+	mutex_unlock(&sbi->snapshot_mutex);
+}
@@ -18,6 +18,8 @@
  * 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 #include "nova.h"
 
 const char *Timingstring[TIMING_NUM] = 
@@ -45,6 +47,8 @@ const char *Timingstring[TIMING_NUM] =
 	"dax_read",
 	"cow_write",
 	"copy_to_nvmm",
+	"fallocate",
+	"clone",
 
 	"memcpy_read_nvmm",
 	"memcpy_write_nvmm",
@@ -58,6 +62,7 @@ const char *Timingstring[TIMING_NUM] =
 
 	"transaction_new_inode",
 	"transaction_link_change",
+	"group_commit",
 	"update_tail",
 
 	"append_dir_entry",
@@ -83,148 +88,784 @@ const char *Timingstring[TIMING_NUM] =
 
 	"rebuild_dir",
 	"rebuild_file",
+	"checkpoint",
+	"save_index",
+	"load_index",
+	"defrag",
+	"create_snapshot",
+	"delete_snapshot",
 };
 
-unsigned long long Timingstats[TIMING_NUM];
-u64 Countstats[TIMING_NUM];
-unsigned long alloc_steps;
-unsigned long free_steps;
-unsigned long write_breaks;
-unsigned long long read_bytes;
-unsigned long long cow_write_bytes;
-unsigned long long fsync_bytes;
-unsigned long long fast_checked_pages;
-unsigned long long thorough_checked_pages;
-unsigned long fast_gc_pages;
-unsigned long thorough_gc_pages;
-unsigned long fsync_pages;
-unsigned long barriers;
-
-void nova_print_alloc_stats(struct super_block *sb)
+const char *Statsstring[STATS_NUM] =
+{
+	"alloc_steps",
+	"free_steps",
+	"write_breaks",
+	"read_bytes",
+	"cow_write_bytes",
+	"fsync_bytes",
+	"fast_checked_pages",
+	"thorough_checked_pages",
+	"fast_gc_pages",
+	"thorough_gc_pages",
+	"fsync_pages",
+	"group_commit_trans",
+	"redo_entries",
+};
+
+const char *WAclassstring[WA_CLASS_NUM] =
+{
+	"other",
+	"write",
+	"msync",
+	"create",
+	"unlink",
+	"rename",
+	"setattr",
+	"fallocate",
+};
+
+const char *WAkindstring[WA_KIND_NUM] =
+{
+	"ops",
+	"user",
+	"data",
+	"log",
+	"gc",
+	"journal",
+	"zero",
+};
+
+/* Too big for the static per-CPU area of a module */
+struct nova_stats __percpu *nova_stats;
+DEFINE_PER_CPU(int, nova_wa_class);
+DEFINE_PER_CPU(struct nova_persist_cost, nova_persist_cost);
+
+/* Sums at the last reset, protected by stats_lock */
+static struct nova_stats stats_base;
+static u64 barriers_base;
+static DEFINE_SPINLOCK(stats_lock);
+
+static struct dentry *nova_debugfs_root;
+
+static void nova_sum_stats(struct nova_stats *sum, u64 *barriers)
+{
+	struct nova_persist_cost *cost;
+	struct nova_stats *stats;
+	int cpu, i, j;
+
+	memset(sum, 0, sizeof(struct nova_stats));
+	*barriers = 0;
+
+	for_each_possible_cpu(cpu) {
+		stats = per_cpu_ptr(nova_stats, cpu);
+		for (i = 0; i < TIMING_NUM; i++) {
+			sum->timing[i] += stats->timing[i];
+			sum->count[i] += stats->count[i];
+			for (j = 0; j < NOVA_HIST_BUCKETS; j++)
+				sum->hist[i][j] += stats->hist[i][j];
+		}
+		for (i = 0; i < STATS_NUM; i++)
+			sum->counter[i] += stats->counter[i];
+
+		cost = per_cpu_ptr(&nova_persist_cost, cpu);
+		for (i = 0; i < WA_CLASS_NUM; i++) {
+			for (j = 0; j < WA_KIND_NUM; j++)
+				sum->wa[i][j] += stats->wa[i][j];
+			sum->wa_flushes[i] += cost->flushes[i];
+			sum->wa_fences[i] += cost->fences[i];
+			*barriers += cost->fences[i];
+		}
+	}
+}
+
+/* Counters since the last reset */
+static void nova_get_stats(struct nova_stats *stats, u64 *barriers)
+{
+	int i, j;
+
+	nova_sum_stats(stats, barriers);
+
+	spin_lock(&stats_lock);
+	for (i = 0; i < TIMING_NUM; i++) {
+		stats->timing[i] -= stats_base.timing[i];
+		stats->count[i] -= stats_base.count[i];
+		for (j = 0; j < NOVA_HIST_BUCKETS; j++)
+			stats->hist[i][j] -= stats_base.hist[i][j];
+	}
+	for (i = 0; i < STATS_NUM; i++)
+		stats->counter[i] -= stats_base.counter[i];
+	for (i = 0; i < WA_CLASS_NUM; i++) {
+		for (j = 0; j < WA_KIND_NUM; j++)
+			stats->wa[i][j] -= stats_base.wa[i][j];
+		stats->wa_flushes[i] -= stats_base.wa_flushes[i];
+		stats->wa_fences[i] -= stats_base.wa_fences[i];
+	}
+	*barriers -= barriers_base;
+	spin_unlock(&stats_lock);
+}
+
+struct nova_alloc_stats {
+	unsigned long alloc_log_count;
+	unsigned long alloc_log_pages;
+	unsigned long alloc_data_count;
+	unsigned long alloc_data_pages;
+	unsigned long free_log_count;
+	unsigned long freed_log_pages;
+	unsigned long free_data_count;
+	unsigned long freed_data_pages;
+	unsigned long alloc_local_pages;
+	unsigned long alloc_remote_pages;
+};
+
+static void nova_get_alloc_stats(struct super_block *sb,
+	struct nova_alloc_stats *as)
 {
 	struct nova_sb_info *sbi = NOVA_SB(sb);
 	struct free_list *free_list;
-	unsigned long alloc_log_count = 0;
-	unsigned long alloc_log_pages = 0;
-	unsigned long alloc_data_count = 0;
-	unsigned long alloc_data_pages = 0;
-	unsigned long free_log_count = 0;
-	unsigned long freed_log_pages = 0;
-	unsigned long free_data_count = 0;
-	unsigned long freed_data_pages = 0;
 	int i;
 
-	printk("=========== NOVA allocation stats ===========\n");
-	printk("Alloc %llu, alloc steps %lu, average %llu\n",
-		Countstats[new_data_blocks_t], alloc_steps,
-		Countstats[new_data_blocks_t] ?
-			alloc_steps / Countstats[new_data_blocks_t] : 0);
-	printk("Free %llu, free steps %lu, average %llu\n",
-		Countstats[free_data_t], free_steps,
-		Countstats[free_data_t] ?
-			free_steps / Countstats[free_data_t] : 0);
-	printk("Fast GC %llu, check pages %llu, free pages %lu, average %llu\n",
-		Countstats[fast_gc_t], fast_checked_pages,
-		fast_gc_pages, Countstats[fast_gc_t] ?
-			fast_gc_pages / Countstats[fast_gc_t] : 0);
-	printk("Thorough GC %llu, checked pages %llu, free pages %lu, "
-		"average %llu\n", Countstats[thorough_gc_t],
-		thorough_checked_pages, thorough_gc_pages,
-		Countstats[thorough_gc_t] ?
-			thorough_gc_pages / Countstats[thorough_gc_t] : 0);
-
+	memset(as, 0, sizeof(struct nova_alloc_stats));
 	for (i = 0; i < sbi->cpus; i++) {
 		free_list = nova_get_free_list(sb, i);
 
-		alloc_log_count += free_list->alloc_log_count;
-		alloc_log_pages += free_list->alloc_log_pages;
-		alloc_data_count += free_list->alloc_data_count;
-		alloc_data_pages += free_list->alloc_data_pages;
-		free_log_count += free_list->free_log_count;
-		freed_log_pages += free_list->freed_log_pages;
-		free_data_count += free_list->free_data_count;
-		freed_data_pages += free_list->freed_data_pages;
+		as->alloc_log_count += free_list->alloc_log_count;
+		as->alloc_log_pages += free_list->alloc_log_pages;
+		as->alloc_data_count += free_list->alloc_data_count;
+		as->alloc_data_pages += free_list->alloc_data_pages;
+		as->free_log_count += free_list->free_log_count;
+		as->freed_log_pages += free_list->freed_log_pages;
+		as->free_data_count += free_list->free_data_count;
+		as->freed_data_pages += free_list->freed_data_pages;
+		as->alloc_local_pages += free_list->alloc_local_pages;
+		as->alloc_remote_pages += free_list->alloc_remote_pages;
 	}
+}
+
+static void nova_print_alloc_stats(struct super_block *sb,
+	struct nova_stats *stats, u64 barriers)
+{
+	struct nova_alloc_stats as;
+	u64 *count = stats->count;
+	u64 *counter = stats->counter;
+
+	printk("=========== NOVA allocation stats ===========\n");
+	printk("Alloc %llu, alloc steps %llu, average %llu\n",
+		count[new_data_blocks_t], counter[alloc_steps],
+		count[new_data_blocks_t] ?
+			counter[alloc_steps] / count[new_data_blocks_t] : 0);
+	printk("Free %llu, free steps %llu, average %llu\n",
+		count[free_data_t], counter[free_steps],
+		count[free_data_t] ?
+			counter[free_steps] / count[free_data_t] : 0);
+	printk("Fast GC %llu, check pages %llu, free pages %llu, "
+		"average %llu\n", count[fast_gc_t],
+		counter[fast_checked_pages], counter[fast_gc_pages],
+		count[fast_gc_t] ?
+			counter[fast_gc_pages] / count[fast_gc_t] : 0);
+	printk("Thorough GC %llu, checked pages %llu, free pages %llu, "
+		"average %llu\n", count[thorough_gc_t],
+		counter[thorough_checked_pages], counter[thorough_gc_pages],
+		count[thorough_gc_t] ?
+			counter[thorough_gc_pages] / count[thorough_gc_t] : 0);
 
+	nova_get_alloc_stats(sb, &as);
 	printk("alloc log count %lu, allocated log pages %lu, "
 		"alloc data count %lu, allocated data pages %lu, "
 		"free log count %lu, freed log pages %lu, "
 		"free data count %lu, freed data pages %lu\n",
-		alloc_log_count, alloc_log_pages,
-		alloc_data_count, alloc_data_pages,
-		free_log_count, freed_log_pages,
-		free_data_count, freed_data_pages);
+		as.alloc_log_count, as.alloc_log_pages,
+		as.alloc_data_count, as.alloc_data_pages,
+		as.free_log_count, as.freed_log_pages,
+		as.free_data_count, as.freed_data_pages);
 
-	printk("Persistent barriers %lu\n", barriers);
+	printk("NUMA local pages %lu, remote pages %lu\n",
+		as.alloc_local_pages, as.alloc_remote_pages);
+
+	printk("Group commit %llu, transactions %llu, average %llu\n",
+		count[group_commit_t], counter[group_commit_trans],
+		count[group_commit_t] ?
+			counter[group_commit_trans] / count[group_commit_t] : 0);
+
+	printk("Checkpoints %llu, redo log entries %llu\n",
+		count[checkpoint_t], counter[redo_entries]);
+
+	printk("Persistent barriers %llu\n", barriers);
 }
 
-void nova_print_IO_stats(struct super_block *sb)
+static void nova_print_IO_stats(struct super_block *sb,
+	struct nova_stats *stats)
 {
+	u64 *count = stats->count;
+	u64 *counter = stats->counter;
+
 	printk("=========== NOVA I/O stats ===========\n");
 	printk("Read %llu, bytes %llu, average %llu\n",
-		Countstats[dax_read_t], read_bytes,
-		Countstats[dax_read_t] ?
-			read_bytes / Countstats[dax_read_t] : 0);
+		count[dax_read_t], counter[read_bytes],
+		count[dax_read_t] ?
+			counter[read_bytes] / count[dax_read_t] : 0);
 	printk("COW write %llu, bytes %llu, average %llu, "
-		"write breaks %lu, average %llu\n",
-		Countstats[cow_write_t], cow_write_bytes,
-		Countstats[cow_write_t] ?
-			cow_write_bytes / Countstats[cow_write_t] : 0,
-		write_breaks, Countstats[cow_write_t] ?
-			write_breaks / Countstats[cow_write_t] : 0);
+		"write breaks %llu, average %llu\n",
+		count[cow_write_t], counter[cow_write_bytes],
+		count[cow_write_t] ?
+			counter[cow_write_bytes] / count[cow_write_t] : 0,
+		counter[write_breaks], count[cow_write_t] ?
+			counter[write_breaks] / count[cow_write_t] : 0);
 	printk("Copy to NVMM %llu, bytes %llu, average %llu\n",
-		Countstats[copy_to_nvmm_t], fsync_bytes,
-		Countstats[copy_to_nvmm_t] ?
-			fsync_bytes / Countstats[copy_to_nvmm_t] : 0);
-	printk("Fsync %lu pages\n", fsync_pages);
+		count[copy_to_nvmm_t], counter[fsync_bytes],
+		count[copy_to_nvmm_t] ?
+			counter[fsync_bytes] / count[copy_to_nvmm_t] : 0);
+	printk("Fsync %llu pages\n", counter[fsync_pages]);
+}
+
+static u64 nova_wa_media_bytes(struct nova_stats *stats, int class)
+{
+	u64 *wa = stats->wa[class];
+
+	return wa[wa_data] + wa[wa_log] + wa[wa_gc] + wa[wa_journal] +
+		wa[wa_zero];
+}
+
+/* Media bytes per user byte, in hundredths */
+static u64 nova_wa_ratio(struct nova_stats *stats, int class)
+{
+	u64 user = stats->wa[class][wa_user];
+
+	return user ? nova_wa_media_bytes(stats, class) * 100 / user : 0;
+}
+
+static void nova_print_wa_stats(struct nova_stats *stats)
+{
+	u64 *wa, media, ratio;
+	int i;
+
+	printk("=========== NOVA write amplification ===========\n");
+	for (i = 0; i < WA_CLASS_NUM; i++) {
+		wa = stats->wa[i];
+		media = nova_wa_media_bytes(stats, i);
+		ratio = nova_wa_ratio(stats, i);
+		printk("%s: ops %llu, user bytes %llu, media bytes %llu "
+			"(data %llu, log %llu, GC %llu, journal %llu, "
+			"zero %llu), flushes %llu, fences %llu, "
+			"amplification %llu.%02llu\n", WAclassstring[i],
+			wa[wa_ops], wa[wa_user], media, wa[wa_data],
+			wa[wa_log], wa[wa_gc], wa[wa_journal], wa[wa_zero],
+			stats->wa_flushes[i], stats->wa_fences[i],
+			ratio / 100, ratio % 100);
+	}
+}
+
+static u64 nova_hist_samples(u64 *hist)
+{
+	u64 samples = 0;
+	int i;
+
+	for (i = 0; i < NOVA_HIST_BUCKETS; i++)
+		samples += hist[i];
+
+	return samples;
+}
+
+/*
+ * Upper bound in ns of the bucket holding the given percentile,
+ * in units of 0.01%. Accurate to a factor of two.
+ */
+static u64 nova_hist_percentile(u64 *hist, u64 samples,
+	unsigned int pct100)
+{
+	u64 target, seen = 0;
+	int i;
+
+	target = (samples * pct100 + 9999) / 10000;
+	for (i = 0; i < NOVA_HIST_BUCKETS - 1; i++) {
+		seen += hist[i];
+		if (seen >= target)
+			break;
+	}
+
+	return 1ULL << i;
 }
 
 void nova_print_timing_stats(struct super_block *sb)
 {
+	struct nova_stats *stats;
+	u64 barriers, samples;
 	int i;
 
+	stats = vmalloc(sizeof(struct nova_stats));
+	if (!stats)
+		return;
+
+	nova_get_stats(stats, &barriers);
+
 	printk("======== NOVA kernel timing stats ========\n");
 	for (i = 0; i < TIMING_NUM; i++) {
-		if (measure_timing || Timingstats[i]) {
+		samples = nova_hist_samples(stats->hist[i]);
+		if (samples) {
+			printk("%s: count %llu, timing %llu, average %llu, "
+				"p99 < %llu, p99.9 < %llu\n",
+				Timingstring[i],
+				stats->count[i],
+				stats->timing[i],
+				stats->count[i] ?
+				stats->timing[i] / stats->count[i] : 0,
+				nova_hist_percentile(stats->hist[i],
+						samples, 9900),
+				nova_hist_percentile(stats->hist[i],
+						samples, 9990));
+		} else if (measure_timing || stats->timing[i]) {
 			printk("%s: count %llu, timing %llu, average %llu\n",
 				Timingstring[i],
-				Countstats[i],
-				Timingstats[i],
-				Countstats[i] ?
-				Timingstats[i] / Countstats[i] : 0);
+				stats->count[i],
+				stats->timing[i],
+				stats->count[i] ?
+				stats->timing[i] / stats->count[i] : 0);
 		} else {
 			printk("%s: count %llu\n",
 				Timingstring[i],
-				Countstats[i]);
+				stats->count[i]);
 		}
 	}
 
-	nova_print_alloc_stats(sb);
-	nova_print_IO_stats(sb);
+	nova_print_alloc_stats(sb, stats, barriers);
+	nova_print_IO_stats(sb, stats);
+	nova_print_wa_stats(stats);
+	vfree(stats);
 }
 
+/*
+ * The per-CPU copies are never written here. Taking all sums as the
+ * new baseline in one step means readers see every counter reset
+ * together.
+ */
 void nova_clear_stats(void)
 {
-	int i;
+	struct nova_stats *sum;
+	u64 barriers;
+
+	sum = vmalloc(sizeof(struct nova_stats));
+	if (!sum)
+		return;
 
 	printk("======== Clear NOVA kernel timing stats ========\n");
+	nova_sum_stats(sum, &barriers);
+
+	spin_lock(&stats_lock);
+	memcpy(&stats_base, sum, sizeof(struct nova_stats));
+	barriers_base = barriers;
+	spin_unlock(&stats_lock);
+
+	vfree(sum);
+}
+
+/*
+ * debugfs: timing and event counters are kept for the whole module, so
+ * nova/stats has them once, one "name value" pair per line, and
+ * nova/reset clears them on any write. nova/latency and nova/histogram
+ * have one line per timed category, nova/amplification one line per
+ * operation class. nova/<device>/alloc has the allocation counters of
+ * that mount in the stats format and free_space one line per free
+ * list.
+ */
+static int nova_stats_show(struct seq_file *seq, void *v)
+{
+	struct nova_stats *stats;
+	u64 barriers;
+	int i;
+
+	stats = vmalloc(sizeof(struct nova_stats));
+	if (!stats)
+		return -ENOMEM;
+
+	nova_get_stats(stats, &barriers);
+
+	for (i = 0; i < TIMING_NUM; i++) {
+		seq_printf(seq, "%s_count %llu\n", Timingstring[i],
+				stats->count[i]);
+		seq_printf(seq, "%s_ns %llu\n", Timingstring[i],
+				stats->timing[i]);
+	}
+	for (i = 0; i < STATS_NUM; i++)
+		seq_printf(seq, "%s %llu\n", Statsstring[i],
+				stats->counter[i]);
+	seq_printf(seq, "barriers %llu\n", barriers);
+
+	vfree(stats);
+	return 0;
+}
+
+static int nova_alloc_show(struct seq_file *seq, void *v)
+{
+	struct super_block *sb = seq->private;
+	struct nova_alloc_stats as;
+
+	nova_get_alloc_stats(sb, &as);
+	seq_printf(seq, "alloc_log_count %lu\n", as.alloc_log_count);
+	seq_printf(seq, "alloc_log_pages %lu\n", as.alloc_log_pages);
+	seq_printf(seq, "alloc_data_count %lu\n", as.alloc_data_count);
+	seq_printf(seq, "alloc_data_pages %lu\n", as.alloc_data_pages);
+	seq_printf(seq, "free_log_count %lu\n", as.free_log_count);
+	seq_printf(seq, "freed_log_pages %lu\n", as.freed_log_pages);
+	seq_printf(seq, "free_data_count %lu\n", as.free_data_count);
+	seq_printf(seq, "freed_data_pages %lu\n", as.freed_data_pages);
+	seq_printf(seq, "alloc_local_pages %lu\n", as.alloc_local_pages);
+	seq_printf(seq, "alloc_remote_pages %lu\n", as.alloc_remote_pages);
+
+	return 0;
+}
+
+static int nova_latency_show(struct seq_file *seq, void *v)
+{
+	struct nova_stats *stats;
+	u64 barriers, samples;
+	u64 *hist;
+	int i;
+
+	stats = vmalloc(sizeof(struct nova_stats));
+	if (!stats)
+		return -ENOMEM;
+
+	nova_get_stats(stats, &barriers);
+
+	seq_puts(seq, "# name samples p50_ns p90_ns p99_ns p999_ns\n");
 	for (i = 0; i < TIMING_NUM; i++) {
-		Countstats[i] = 0;
-		Timingstats[i] = 0;
+		hist = stats->hist[i];
+		samples = nova_hist_samples(hist);
+		if (samples == 0)
+			continue;
+		seq_printf(seq, "%s %llu %llu %llu %llu %llu\n",
+				Timingstring[i], samples,
+				nova_hist_percentile(hist, samples, 5000),
+				nova_hist_percentile(hist, samples, 9000),
+				nova_hist_percentile(hist, samples, 9900),
+				nova_hist_percentile(hist, samples, 9990));
 	}
 
-	alloc_steps = 0;
-	free_steps = 0;
-	write_breaks = 0;
-	read_bytes = 0;
-	cow_write_bytes = 0;
-	fsync_bytes = 0;
-	fast_checked_pages = 0;
-	thorough_checked_pages = 0;
-	fast_gc_pages = 0;
-	thorough_gc_pages = 0;
-	fsync_pages = 0;
-	barriers = 0;
+	vfree(stats);
+	return 0;
+}
+
+static int nova_histogram_show(struct seq_file *seq, void *v)
+{
+	struct nova_stats *stats;
+	u64 barriers;
+	int i, j;
+
+	stats = vmalloc(sizeof(struct nova_stats));
+	if (!stats)
+		return -ENOMEM;
+
+	nova_get_stats(stats, &barriers);
+
+	seq_printf(seq, "# name, then %d bucket counts, bucket b < 2^b ns\n",
+			NOVA_HIST_BUCKETS);
+	for (i = 0; i < TIMING_NUM; i++) {
+		if (nova_hist_samples(stats->hist[i]) == 0)
+			continue;
+		seq_puts(seq, Timingstring[i]);
+		for (j = 0; j < NOVA_HIST_BUCKETS; j++)
+			seq_printf(seq, " %llu", stats->hist[i][j]);
+		seq_putc(seq, '\n');
+	}
+
+	vfree(stats);
+	return 0;
+}
+
+/*
+ * Classes that write no user data, like create, report 0 amplification;
+ * use media bytes over ops for those.
+ */
+static int nova_amplification_show(struct seq_file *seq, void *v)
+{
+	struct nova_stats *stats;
+	u64 barriers, ratio;
+	int i, j;
+
+	stats = vmalloc(sizeof(struct nova_stats));
+	if (!stats)
+		return -ENOMEM;
+
+	nova_get_stats(stats, &barriers);
+
+	seq_puts(seq, "# class");
+	for (j = 0; j < WA_KIND_NUM; j++)
+		seq_printf(seq, " %s", WAkindstring[j]);
+	seq_puts(seq, " flushes fences media amplification\n");
+	for (i = 0; i < WA_CLASS_NUM; i++) {
+		seq_puts(seq, WAclassstring[i]);
+		for (j = 0; j < WA_KIND_NUM; j++)
+			seq_printf(seq, " %llu", stats->wa[i][j]);
+		ratio = nova_wa_ratio(stats, i);
+		seq_printf(seq, " %llu %llu %llu %llu.%02llu\n",
+				stats->wa_flushes[i], stats->wa_fences[i],
+				nova_wa_media_bytes(stats, i),
+				ratio / 100, ratio % 100);
+	}
+
+	vfree(stats);
+	return 0;
+}
+
+/*
+ * Free space fragmentation. Range sizes go in log2 buckets of 4K blocks,
+ * the last one is 1G and up. Each free list is walked a batch of ranges
+ * per lock hold, so allocations only ever wait for one batch.
+ */
+#define NOVA_FRAG_BUCKETS	19
+#define NOVA_FRAG_BATCH		256
+#define NOVA_2M_BLOCKS		512
+
+struct nova_frag_stats {
+	unsigned long	free_blocks;
+	unsigned long	ranges;
+	unsigned long	largest;
+	unsigned long	aligned_2m;	/* Free, 2M-aligned 2M chunks */
+	unsigned long	hist[NOVA_FRAG_BUCKETS];
+};
+
+/* First range starting above key */
+static struct nova_range_node *nova_frag_next_range(struct rb_root *tree,
+	unsigned long key)
+{
+	struct rb_node *temp = tree->rb_node;
+	struct nova_range_node *curr, *next = NULL;
+
+	while (temp) {
+		curr = container_of(temp, struct nova_range_node, node);
+		if (curr->range_low > key) {
+			next = curr;
+			temp = temp->rb_left;
+		} else {
+			temp = temp->rb_right;
+		}
+	}
+
+	return next;
+}
+
+static void nova_frag_add_range(struct nova_frag_stats *fs,
+	unsigned long low, unsigned long high)
+{
+	unsigned long blocks = high - low + 1;
+	unsigned long aligned = ALIGN(low, NOVA_2M_BLOCKS);
+	int bucket = fls_long(blocks) - 1;
+
+	if (bucket >= NOVA_FRAG_BUCKETS)
+		bucket = NOVA_FRAG_BUCKETS - 1;
+
+	fs->free_blocks += blocks;
+	fs->ranges++;
+	fs->hist[bucket]++;
+	if (blocks > fs->largest)
+		fs->largest = blocks;
+	if (high + 1 >= aligned + NOVA_2M_BLOCKS)
+		fs->aligned_2m += (high + 1 - aligned) / NOVA_2M_BLOCKS;
+}
+
+static void nova_get_frag_stats(struct free_list *free_list,
+	struct nova_frag_stats *fs)
+{
+	struct nova_range_node *curr;
+	struct rb_node *temp;
+	unsigned long key = 0;
+	int count, first = 1;
+
+	memset(fs, 0, sizeof(struct nova_frag_stats));
+
+	do {
+		spin_lock(&free_list->s_lock);
+		if (first) {
+			temp = rb_first(&free_list->block_free_tree);
+			curr = temp ? container_of(temp,
+					struct nova_range_node, node) : NULL;
+			first = 0;
+		} else {
+			curr = nova_frag_next_range(
+					&free_list->block_free_tree, key);
+		}
+
+		for (count = 0; curr && count < NOVA_FRAG_BATCH; count++) {
+			nova_frag_add_range(fs, curr->range_low,
+						curr->range_high);
+			key = curr->range_high;
+			temp = rb_next(&curr->node);
+			curr = temp ? container_of(temp,
+					struct nova_range_node, node) : NULL;
+		}
+		spin_unlock(&free_list->s_lock);
+		cond_resched();
+	} while (curr);
+}
+
+/*
+ * Share of free blocks that cannot serve an aligned 2M allocation, in
+ * thousandths: 0 when all free space is in 2M chunks, 1000 when none is.
+ */
+static unsigned long nova_frag_index(struct nova_frag_stats *fs)
+{
+	if (fs->free_blocks == 0)
+		return 0;
+
+	return 1000 - fs->aligned_2m * NOVA_2M_BLOCKS * 1000 /
+			fs->free_blocks;
+}
+
+static void nova_show_frag_stats(struct seq_file *seq, const char *name,
+	struct nova_frag_stats *fs)
+{
+	int i;
+
+	seq_printf(seq, "%s %lu %lu %lu %lu %lu", name, fs->free_blocks,
+			fs->ranges, fs->largest, fs->aligned_2m,
+			nova_frag_index(fs));
+	for (i = 0; i < NOVA_FRAG_BUCKETS; i++)
+		seq_printf(seq, " %lu", fs->hist[i]);
+	seq_putc(seq, '\n');
+}
+
+/*
+ * One line per free list and a total. The lists are sampled one after
+ * another and may change in between, so the total is approximate
+ * under load.
+ */
+static int nova_free_space_show(struct seq_file *seq, void *v)
+{
+	struct super_block *sb = seq->private;
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_frag_stats fs, total;
+	char name[16];
+	int i, j;
+
+	memset(&total, 0, sizeof(struct nova_frag_stats));
+	seq_puts(seq, "# list free_blocks ranges largest aligned_2m "
+			"frag_index hist_4K..hist_1G\n");
+
+	for (i = 0; i <= sbi->cpus; i++) {
+		if (i < sbi->cpus) {
+			nova_get_frag_stats(nova_get_free_list(sb, i), &fs);
+			snprintf(name, sizeof(name), "cpu%d", i);
+		} else {
+			nova_get_frag_stats(nova_get_free_list(sb,
+						SHARED_CPU), &fs);
+			snprintf(name, sizeof(name), "shared");
+		}
+		nova_show_frag_stats(seq, name, &fs);
+
+		total.free_blocks += fs.free_blocks;
+		total.ranges += fs.ranges;
+		total.aligned_2m += fs.aligned_2m;
+		if (fs.largest > total.largest)
+			total.largest = fs.largest;
+		for (j = 0; j < NOVA_FRAG_BUCKETS; j++)
+			total.hist[j] += fs.hist[j];
+	}
+
+	nova_show_frag_stats(seq, "total", &total);
+	return 0;
+}
+
+#define NOVA_DEBUGFS_SHOW_FOPS(name)					\
+static int nova_##name##_open(struct inode *inode, struct file *file)	\
+{									\
+	return single_open(file, nova_##name##_show, inode->i_private);	\
+}									\
+									\
+static const struct file_operations nova_##name##_fops = {		\
+	.owner		= THIS_MODULE,					\
+	.open		= nova_##name##_open,				\
+	.read		= seq_read,					\
+	.llseek		= seq_lseek,					\
+	.release	= single_release,				\
+};
+
+NOVA_DEBUGFS_SHOW_FOPS(stats)
+NOVA_DEBUGFS_SHOW_FOPS(alloc)
+NOVA_DEBUGFS_SHOW_FOPS(latency)
+NOVA_DEBUGFS_SHOW_FOPS(histogram)
+NOVA_DEBUGFS_SHOW_FOPS(amplification)
+NOVA_DEBUGFS_SHOW_FOPS(free_space)
+
+static ssize_t nova_reset_write(struct file *file, const char __user *buf,
+	size_t len, loff_t *ppos)
+{
+	nova_clear_stats();
+	return len;
+}
+
+static const struct file_operations nova_reset_fops = {
+	.owner		= THIS_MODULE,
+	.open		= simple_open,
+	.write		= nova_reset_write,
+	.llseek		= noop_llseek,
+};
+
+void nova_debugfs_add_sb(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+
+	if (IS_ERR_OR_NULL(nova_debugfs_root))
+		return;
+
+	sbi->debugfs_dir = debugfs_create_dir(sb->s_id, nova_debugfs_root);
+	if (IS_ERR_OR_NULL(sbi->debugfs_dir)) {
+		sbi->debugfs_dir = NULL;
+		return;
+	}
+
+	debugfs_create_file("alloc", S_IRUSR, sbi->debugfs_dir, sb,
+				&nova_alloc_fops);
+	debugfs_create_file("free_space", S_IRUSR, sbi->debugfs_dir, sb,
+				&nova_free_space_fops);
+}
+
+void nova_debugfs_remove_sb(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+
+	debugfs_remove_recursive(sbi->debugfs_dir);
+	sbi->debugfs_dir = NULL;
+}
+
+void nova_debugfs_init(void)
+{
+	BUILD_BUG_ON(WA_CLASS_NUM > NOVA_WA_CLASSES);
+	nova_debugfs_root = debugfs_create_dir("nova", NULL);
+	if (IS_ERR_OR_NULL(nova_debugfs_root))
+		return;
+
+	debugfs_create_file("stats", S_IRUSR, nova_debugfs_root, NULL,
+				&nova_stats_fops);
+	debugfs_create_file("latency", S_IRUSR, nova_debugfs_root, NULL,
+				&nova_latency_fops);
+	debugfs_create_file("histogram", S_IRUSR, nova_debugfs_root, NULL,
+				&nova_histogram_fops);
+	debugfs_create_file("amplification", S_IRUSR, nova_debugfs_root,
+				NULL, &nova_amplification_fops);
+	debugfs_create_file("reset", S_IWUSR, nova_debugfs_root, NULL,
+				&nova_reset_fops);
+}
+
+void nova_debugfs_exit(void)
+{
+	debugfs_remove_recursive(nova_debugfs_root);
+	nova_debugfs_root = NULL;
+}
+
+int nova_stats_init(void)
+{
+	BUILD_BUG_ON(sizeof(struct nova_stats) > PCPU_MIN_UNIT_SIZE);
+	nova_stats = alloc_percpu(struct nova_stats);
+	if (!nova_stats)
+		return -ENOMEM;
+
+	return 0;
+}
+
+void nova_stats_exit(void)
+{
+	free_percpu(nova_stats);
+	nova_stats = NULL;
 }
 
 static inline void nova_print_file_write_entry(struct super_block *sb,
@@ -450,6 +1091,11 @@ void nova_print_free_lists(struct super_block *sb)
 			free_list->freed_log_pages,
 			free_list->free_data_count,
 			free_list->freed_data_pages);
+
+		nova_dbg("Free list %d: node %d, local pages %lu, "
+			"remote pages %lu\n", i, free_list->nid,
+			free_list->alloc_local_pages,
+			free_list->alloc_remote_pages);
 	}
 
 	i = SHARED_CPU;
@@ -46,6 +46,8 @@ enum timing_category {
 	dax_read_t,
 	cow_write_t,
 	copy_to_nvmm_t,
+	fallocate_t,
+	clone_t,
 
 	/* Memory operations */
 	memcpy_r_nvmm_t,
@@ -62,6 +64,7 @@ enum timing_category {
 	/* Transaction */
 	create_trans_t,
 	link_trans_t,
+	group_commit_t,
 	update_tail_t,
 
 	/* Logging */
@@ -89,40 +92,143 @@ enum timing_category {
 
 	rebuild_dir_t,
 	rebuild_file_t,
+	checkpoint_t,
+	save_index_t,
+	load_index_t,
+	defrag_t,
+	create_snapshot_t,
+	delete_snapshot_t,
 
 	/* Sentinel */
 	TIMING_NUM,
 };
 
+/* Event counters, summed with the timing stats */
+enum stats_category {
+	alloc_steps,
+	free_steps,
+	write_breaks,
+	read_bytes,
+	cow_write_bytes,
+	fsync_bytes,
+	fast_checked_pages,
+	thorough_checked_pages,
+	fast_gc_pages,
+	thorough_gc_pages,
+	fsync_pages,
+	group_commit_trans,
+	redo_entries,
+
+	/* Sentinel */
+	STATS_NUM,
+};
+
+/*
+ * Write amplification: NVMM bytes written by each class of operation.
+ * The class is set per CPU for the duration of the operation, so an
+ * operation that sleeps may be charged for work done meanwhile by
+ * another task on that CPU. Everything outside these classes, such as
+ * background checkpoints, is charged to wa_other.
+ */
+enum wa_class {
+	wa_other,
+	wa_write,
+	wa_msync,
+	wa_create,
+	wa_unlink,
+	wa_rename,
+	wa_setattr,
+	wa_fallocate,
+
+	/* Sentinel */
+	WA_CLASS_NUM,
+};
+
+enum wa_kind {
+	wa_ops,		/* Operations, not bytes */
+	wa_user,	/* Bytes the user asked to write or persist */
+	wa_data,
+	wa_log,
+	wa_gc,
+	wa_journal,
+	wa_zero,
+
+	/* Sentinel */
+	WA_KIND_NUM,
+};
+
+/*
+ * Latency histograms: bucket b counts samples below 2^b ns and at least
+ * 2^(b-1) ns. The last bucket also takes everything slower.
+ */
+#define NOVA_HIST_BUCKETS	40
+
+/*
+ * Each CPU updates its own copy without locks or atomics; readers sum
+ * them. Reset saves the sums as a baseline instead of zeroing copies
+ * other CPUs may be updating.
+ */
+struct nova_stats {
+	u64	timing[TIMING_NUM];
+	u64	count[TIMING_NUM];
+	u64	counter[STATS_NUM];
+	u64	hist[TIMING_NUM][NOVA_HIST_BUCKETS];
+	u64	wa[WA_CLASS_NUM][WA_KIND_NUM];
+	/* Filled in from nova_persist_cost when summing */
+	u64	wa_flushes[WA_CLASS_NUM];
+	u64	wa_fences[WA_CLASS_NUM];
+} ____cacheline_aligned_in_smp;
+
+extern struct nova_stats __percpu *nova_stats;
+
 extern const char *Timingstring[TIMING_NUM];
-extern unsigned long long Timingstats[TIMING_NUM];
-extern u64 Countstats[TIMING_NUM];
-extern unsigned long long read_bytes;
-extern unsigned long long cow_write_bytes;
-extern unsigned long long fsync_bytes;
-extern unsigned long long fast_checked_pages;
-extern unsigned long long thorough_checked_pages;
-extern unsigned long fast_gc_pages;
-extern unsigned long thorough_gc_pages;
-extern unsigned long fsync_pages;
+extern const char *Statsstring[STATS_NUM];
+extern const char *WAclassstring[WA_CLASS_NUM];
+extern const char *WAkindstring[WA_KIND_NUM];
 
 typedef struct timespec timing_t;
 
+#define NOVA_ADD_TIMING(name, ns) \
+	this_cpu_add(nova_stats->timing[name], ns)
+
+#define NOVA_STATS_ADD(name, value) \
+	this_cpu_add(nova_stats->counter[name], value)
+
+static inline int nova_hist_bucket(u64 ns)
+{
+	int bucket = fls64(ns);
+
+	return bucket < NOVA_HIST_BUCKETS ? bucket : NOVA_HIST_BUCKETS - 1;
+}
+
+#define NOVA_ADD_HIST(name, ns) \
+	this_cpu_inc(nova_stats->hist[name][nova_hist_bucket(ns)])
+
+#define NOVA_WA_BEGIN(class) \
+	{this_cpu_write(nova_wa_class, class); \
+	this_cpu_inc(nova_stats->wa[class][wa_ops]);}
+
+/* Only if this CPU is still on class, we may have migrated */
+#define NOVA_WA_END(class) \
+	this_cpu_cmpxchg(nova_wa_class, class, wa_other)
+
+#define NOVA_WA_ADD(kind, bytes) \
+	this_cpu_add(nova_stats->wa[this_cpu_read(nova_wa_class)][kind], bytes)
+
 #define NOVA_START_TIMING(name, start) \
 	{if (measure_timing) getrawmonotonic(&start);}
 
 #define NOVA_END_TIMING(name, start) \
 	{if (measure_timing) { \
 		timing_t end; \
+		u64 __ns; \
 		getrawmonotonic(&end); \
-		Timingstats[name] += \
-			(end.tv_sec - start.tv_sec) * 1000000000 + \
+		__ns = (end.tv_sec - start.tv_sec) * 1000000000 + \
 			(end.tv_nsec - start.tv_nsec); \
+		NOVA_ADD_TIMING(name, __ns); \
+		if (timing_histogram) \
+			NOVA_ADD_HIST(name, __ns); \
 	} \
-	Countstats[name]++; \
+	this_cpu_inc(nova_stats->count[name]); \
 	}
 
-extern unsigned long alloc_steps;
-extern unsigned long free_steps;
-extern unsigned long write_breaks;
-
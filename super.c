@@ -39,13 +39,21 @@
 #include <linux/list.h>
 #include "nova.h"
 
+#define CREATE_TRACE_POINTS
+#include "nova_trace.h"
+
 int measure_timing = 0;
+int timing_histogram = 0;
 int support_clwb = 0;
 int support_pcommit = 0;
 
 module_param(measure_timing, int, S_IRUGO);
 MODULE_PARM_DESC(measure_timing, "Timing measurement");
 
+module_param(timing_histogram, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(timing_histogram,
+		"Latency histograms, needs measure_timing");
+
 static struct super_operations nova_sops;
 static const struct export_operations nova_export_ops;
 static struct kmem_cache *nova_inode_cachep;
@@ -142,7 +150,8 @@ enum {
 	Opt_bpi, Opt_init, Opt_mode, Opt_uid,
 	Opt_gid, Opt_blocksize, Opt_wprotect,
 	Opt_err_cont, Opt_err_panic, Opt_err_ro,
-	Opt_dbgmask, Opt_err
+	Opt_dbgmask, Opt_interleave, Opt_checkpoint, Opt_bgrecovery,
+	Opt_index, Opt_snapshot, Opt_err
 };
 
 static const match_table_t tokens = {
@@ -156,6 +165,11 @@ static const match_table_t tokens = {
 	{ Opt_err_panic,     "errors=panic"	  },
 	{ Opt_err_ro,	     "errors=remount-ro"  },
 	{ Opt_dbgmask,	     "dbgmask=%u"	  },
+	{ Opt_interleave,    "interleave"	  },
+	{ Opt_checkpoint,    "checkpoint=%u"	  },
+	{ Opt_bgrecovery,    "bgrecovery"	  },
+	{ Opt_index,	     "index"		  },
+	{ Opt_snapshot,	     "snapshot=%u"	  },
 	{ Opt_err,	     NULL		  },
 };
 
@@ -232,6 +246,31 @@ static int nova_parse_options(char *options, struct nova_sb_info *sbi,
 				goto bad_val;
 			nova_dbgmask = option;
 			break;
+		case Opt_interleave:
+			set_opt(sbi->s_mount_opt, INTERLEAVE);
+			break;
+		case Opt_checkpoint:
+			if (remount)
+				goto bad_opt;
+			if (match_int(&args[0], &option) || option < 0)
+				goto bad_val;
+			sbi->ckpt_interval = option;
+			break;
+		case Opt_bgrecovery:
+			if (remount)
+				goto bad_opt;
+			set_opt(sbi->s_mount_opt, BGRECOVERY);
+			break;
+		case Opt_index:
+			set_opt(sbi->s_mount_opt, INDEX);
+			break;
+		case Opt_snapshot:
+			if (remount)
+				goto bad_opt;
+			if (match_int(&args[0], &option) || option <= 0)
+				goto bad_val;
+			sbi->mount_snapshot = option;
+			break;
 		default: {
 			goto bad_opt;
 		}
@@ -324,6 +363,7 @@ static struct nova_inode *nova_init(struct super_block *sb,
 	super->s_size = cpu_to_le64(size);
 	super->s_blocksize = cpu_to_le32(blocksize);
 	super->s_magic = cpu_to_le32(NOVA_SUPER_MAGIC);
+	super->s_cpus = cpu_to_le32(sbi->cpus);
 
 	nova_init_blockmap(sb, 0);
 
@@ -338,6 +378,8 @@ static struct nova_inode *nova_init(struct super_block *sb,
 	if (nova_init_inode_table(sb) < 0)
 		return ERR_PTR(-EINVAL);
 
+	nova_reset_alloc_hwm(sb, true);
+
 	pi = nova_get_inode_by_ino(sb, NOVA_BLOCKNODE_INO);
 	pi->nova_ino = NOVA_BLOCKNODE_INO;
 	nova_flush_buffer(pi, CACHELINE_SIZE, 1);
@@ -368,6 +410,7 @@ static struct nova_inode *nova_init(struct super_block *sb,
 	root_i->i_atime = root_i->i_mtime = root_i->i_ctime =
 		cpu_to_le32(get_seconds());
 	root_i->nova_ino = NOVA_ROOT_INO;
+	root_i->i_index = 0;
 	root_i->valid = 1;
 	/* nova_sync_inode(root_i); */
 	nova_memlock_inode(sb, root_i);
@@ -382,13 +425,41 @@ static struct nova_inode *nova_init(struct super_block *sb,
 	return root_i;
 }
 
+static inline void nova_set_cpus(struct nova_sb_info *sbi, int cpus)
+{
+	sbi->cpus = cpus;
+	sbi->cpu_table_pages = nova_cpu_table_pages(sbi->cpus);
+	/* Super block, then journal and inode table pointer pages */
+	sbi->reserved_blocks = RESERVED_BLOCKS - 2 + 2 * sbi->cpu_table_pages;
+}
+
 static inline void set_default_opts(struct nova_sb_info *sbi)
 {
 	set_opt(sbi->s_mount_opt, HUGEIOREMAP);
 	set_opt(sbi->s_mount_opt, ERRORS_CONT);
-	sbi->reserved_blocks = RESERVED_BLOCKS;
-	sbi->cpus = num_online_cpus();
-	sbi->map_id = 0;
+	nova_set_cpus(sbi, num_online_cpus());
+}
+
+/*
+ * Per-CPU journals, inode tables and free lists are laid out for the CPU
+ * count at format time, and inode numbers map to tables by ino % cpus.
+ * Keep that layout on any machine: with fewer CPUs online some tables
+ * just have no CPU of their own, with more CPUs the extra ones fold onto
+ * the existing tables by cpu % cpus.
+ */
+static void nova_use_format_cpus(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_super_block *super = nova_get_super(sb);
+	unsigned int cpus = le32_to_cpu(super->s_cpus);
+
+	/* Images formatted before s_cpus was recorded, or not NOVA */
+	if (cpus == 0 || cpus > NOVA_MAX_CPUS || cpus == sbi->cpus)
+		return;
+
+	nova_info("NOVA: image formatted for %u cpus, %d online\n",
+			cpus, sbi->cpus);
+	nova_set_cpus(sbi, cpus);
 }
 
 static void nova_root_check(struct super_block *sb, struct nova_inode *root_pi)
@@ -483,10 +554,9 @@ static int nova_fill_super(struct super_block *sb, void *data, int silent)
 
 	set_default_opts(sbi);
 
-	/* Currently the log page supports 64 journal pointer pairs */
-	if (sbi->cpus > 64) {
-		nova_err(sb, "NOVA needs more log pointer pages "
-				"to support more than 64 cpus.\n");
+	if (sbi->cpus > NOVA_MAX_CPUS) {
+		nova_err(sb, "NOVA supports at most %d cpus.\n",
+				NOVA_MAX_CPUS);
 		goto out;
 	}
 
@@ -499,6 +569,16 @@ static int nova_fill_super(struct super_block *sb, void *data, int silent)
 	/* Init with default values */
 	sbi->shared_free_list.block_free_tree = RB_ROOT;
 	spin_lock_init(&sbi->shared_free_list.s_lock);
+	spin_lock_init(&sbi->ckpt_lock);
+	init_waitqueue_head(&sbi->ckpt_wait);
+	spin_lock_init(&sbi->bg_lock);
+	init_waitqueue_head(&sbi->bg_wait);
+	mutex_init(&sbi->refcount_mutex);
+	sbi->refcount_tree = RB_ROOT;
+	mutex_init(&sbi->snapshot_mutex);
+	INIT_LIST_HEAD(&sbi->snapshot_list);
+	sbi->snapshot_tree = RB_ROOT;
+	sbi->s_epoch = 1;
 	sbi->mode = (S_IRUGO | S_IXUGO | S_IWUSR);
 	sbi->uid = current_fsuid();
 	sbi->gid = current_fsgid();
@@ -506,6 +586,27 @@ static int nova_fill_super(struct super_block *sb, void *data, int silent)
 	clear_opt(sbi->s_mount_opt, PROTECT);
 	set_opt(sbi->s_mount_opt, HUGEIOREMAP);
 
+	mutex_init(&sbi->s_lock);
+
+	sbi->zeroed_page = kzalloc(PAGE_SIZE, GFP_KERNEL);
+	if (!sbi->zeroed_page) {
+		retval = -ENOMEM;
+		goto out;
+	}
+
+	if (nova_parse_options(data, sbi, 0))
+		goto out;
+
+	/* Snapshots are read-only */
+	if (sbi->mount_snapshot) {
+		if (sbi->s_mount_opt & NOVA_MOUNT_FORMAT)
+			goto out;
+		sb->s_flags |= MS_RDONLY;
+	}
+
+	if ((sbi->s_mount_opt & NOVA_MOUNT_FORMAT) == 0)
+		nova_use_format_cpus(sb);
+
 	sbi->inode_maps = kzalloc(sbi->cpus * sizeof(struct inode_map),
 					GFP_KERNEL);
 	if (!sbi->inode_maps) {
@@ -517,19 +618,10 @@ static int nova_fill_super(struct super_block *sb, void *data, int silent)
 		inode_map = &sbi->inode_maps[i];
 		mutex_init(&inode_map->inode_table_mutex);
 		inode_map->inode_inuse_tree = RB_ROOT;
+		INIT_RADIX_TREE(&inode_map->inode_table_tree, GFP_KERNEL);
+		spin_lock_init(&inode_map->magazine_lock);
 	}
 
-	mutex_init(&sbi->s_lock);
-
-	sbi->zeroed_page = kzalloc(PAGE_SIZE, GFP_KERNEL);
-	if (!sbi->zeroed_page) {
-		retval = -ENOMEM;
-		goto out;
-	}
-
-	if (nova_parse_options(data, sbi, 0))
-		goto out;
-
 	set_opt(sbi->s_mount_opt, MOUNTING);
 
 	if (nova_alloc_block_free_lists(sb)) {
@@ -557,12 +649,38 @@ static int nova_fill_super(struct super_block *sb, void *data, int silent)
 		goto out;
 	}
 
+	/*
+	 * Images formatted before s_cpus was recorded only have single page
+	 * pointer tables, and must be mounted with the CPU count they were
+	 * formatted with.
+	 */
+	if (le32_to_cpu(super->s_cpus) == 0 &&
+			sbi->cpus > NOVA_PTRS_PER_PAGE) {
+		nova_err(sb, "Image formatted without multi-page cpu tables "
+			"supports at most %lu cpus, %d online.\n",
+			NOVA_PTRS_PER_PAGE, sbi->cpus);
+		goto out;
+	}
+
+	/* Recovery would have to write to the image */
+	if (sbi->mount_snapshot && !nova_clean_shutdown(sb)) {
+		nova_err(sb, "Snapshot mount needs a cleanly unmounted "
+				"image.\n");
+		goto out;
+	}
+
 	if (nova_lite_journal_soft_init(sb)) {
 		retval = -EINVAL;
 		printk(KERN_ERR "Lite journal initialization failed\n");
 		goto out;
 	}
 
+	if (nova_build_inode_table_index(sb)) {
+		retval = -ENOMEM;
+		printk(KERN_ERR "Inode table index build failed\n");
+		goto out;
+	}
+
 	blocksize = le32_to_cpu(super->s_blocksize);
 	nova_set_blocksize(sb, blocksize);
 
@@ -584,11 +702,28 @@ setup_sb:
 	sb->s_xattr = NULL;
 	sb->s_flags |= MS_NOSEC;
 
+	/* Recovery keeps what the snapshots hold on to */
+	if ((sbi->s_mount_opt & NOVA_MOUNT_FORMAT) == 0) {
+		retval = nova_snapshot_load(sb);
+		if (retval) {
+			printk(KERN_ERR "Load snapshots failed\n");
+			goto out;
+		}
+	}
+
 	/* If the FS was not formatted on this mount, scan the meta-data after
 	 * truncate list has been processed */
 	if ((sbi->s_mount_opt & NOVA_MOUNT_FORMAT) == 0)
 		nova_recovery(sb);
 
+	retval = nova_refcount_init(sb);
+	if (retval) {
+		printk(KERN_ERR "Load shared block counts failed\n");
+		goto out;
+	}
+
+	nova_snapshot_init(sb);
+
 	root_i = nova_iget(sb, NOVA_ROOT_INO);
 	if (IS_ERR(root_i)) {
 		retval = PTR_ERR(root_i);
@@ -617,20 +752,34 @@ setup_sb:
 		PERSISTENT_BARRIER();
 	}
 
+	/* Background recovery starts it when it is done */
+	if (sbi->ckpt_interval && !(sb->s_flags & MS_RDONLY) &&
+			!sbi->bg_thread) {
+		retval = nova_start_checkpointer(sb);
+		if (retval)
+			nova_err(sb, "Start checkpointer failed %d, "
+					"checkpoints disabled\n", retval);
+	}
+
 	clear_opt(sbi->s_mount_opt, MOUNTING);
+	nova_debugfs_add_sb(sb);
 	retval = 0;
 
 	NOVA_END_TIMING(mount_t, mount_time);
 	return retval;
 out:
+	nova_wait_bg_recovery(sb);
+	nova_refcount_exit(sb);
+	nova_snapshot_exit(sb);
+
 	if (sbi->zeroed_page) {
 		kfree(sbi->zeroed_page);
 		sbi->zeroed_page = NULL;
 	}
 
 	if (sbi->free_lists) {
-		kfree(sbi->free_lists);
-		sbi->free_lists = NULL;
+		nova_destroy_range_trees(sb);
+		nova_delete_free_lists(sb);
 	}
 
 	if (sbi->journal_locks) {
@@ -639,11 +788,13 @@ out:
 	}
 
 	if (sbi->inode_maps) {
+		nova_delete_inode_table_index(sb);
 		kfree(sbi->inode_maps);
 		sbi->inode_maps = NULL;
 	}
 
 	kfree(sbi);
+	sb->s_fs_info = NULL;
 	return retval;
 }
 
@@ -658,7 +809,8 @@ int nova_statfs(struct dentry *d, struct kstatfs *buf)
 	buf->f_blocks = sbi->num_blocks;
 	buf->f_bfree = buf->f_bavail = nova_count_free_blocks(sb);
 	buf->f_files = LONG_MAX;
-	buf->f_ffree = LONG_MAX - sbi->s_inodes_used_count;
+	buf->f_ffree = LONG_MAX - (sbi->s_inodes_used_count -
+					nova_count_magazine_inodes(sb));
 	buf->f_namelen = NOVA_NAME_LEN;
 	nova_dbg_verbose("nova_stats: total 4k free blocks 0x%llx\n",
 		buf->f_bfree);
@@ -693,10 +845,30 @@ static int nova_show_options(struct seq_file *seq, struct dentry *root)
 		seq_puts(seq, ",wprotect");
 	if (test_opt(root->d_sb, DAX))
 		seq_puts(seq, ",dax");
+	if (test_opt(root->d_sb, INTERLEAVE))
+		seq_puts(seq, ",interleave");
+	if (sbi->ckpt_interval)
+		seq_printf(seq, ",checkpoint=%u", sbi->ckpt_interval);
+	if (test_opt(root->d_sb, BGRECOVERY))
+		seq_puts(seq, ",bgrecovery");
+	if (test_opt(root->d_sb, INDEX))
+		seq_puts(seq, ",index");
+	if (sbi->mount_snapshot)
+		seq_printf(seq, ",snapshot=%llu", sbi->mount_snapshot);
 
 	return 0;
 }
 
+/* Save the in-DRAM allocator state, so the next mount skips recovery */
+static void nova_save_logs(struct super_block *sb)
+{
+	nova_save_refcount_log(sb);
+	nova_save_snapshot_log(sb);
+	nova_save_inode_list_to_log(sb);
+	/* Save everything before blocknode mapping! */
+	nova_save_blocknode_mappings_to_log(sb);
+}
+
 int nova_remount(struct super_block *sb, int *mntflags, char *data)
 {
 	unsigned long old_sb_flags;
@@ -713,6 +885,9 @@ int nova_remount(struct super_block *sb, int *mntflags, char *data)
 	if (nova_parse_options(data, sbi, 1))
 		goto restore_opt;
 
+	if (sbi->mount_snapshot && !(*mntflags & MS_RDONLY))
+		goto restore_opt;
+
 	sb->s_flags = (sb->s_flags & ~MS_POSIXACL) |
 		      ((sbi->s_mount_opt & NOVA_MOUNT_POSIX_ACL) ? MS_POSIXACL : 0);
 
@@ -732,6 +907,19 @@ int nova_remount(struct super_block *sb, int *mntflags, char *data)
 		PERSISTENT_BARRIER();
 	}
 
+	if ((*mntflags & MS_RDONLY) && !(sb->s_flags & MS_RDONLY)) {
+		/* Unmount will not write to a read-only mount, save now */
+		nova_wait_bg_recovery(sb);
+		nova_stop_checkpointer(sb);
+		nova_save_logs(sb);
+	} else if (!(*mntflags & MS_RDONLY) && (sb->s_flags & MS_RDONLY)) {
+		/* The saved lists go stale with the first write */
+		nova_drop_saved_lists(sb);
+		if (sbi->ckpt_interval && nova_start_checkpointer(sb))
+			nova_err(sb, "Start checkpointer failed, "
+					"checkpoints disabled\n");
+	}
+
 	mutex_unlock(&sbi->s_lock);
 	ret = 0;
 	return ret;
@@ -751,14 +939,20 @@ static void nova_put_super(struct super_block *sb)
 
 	/* It's unmount time, so unmap the nova memory */
 //	nova_print_free_lists(sb);
+	nova_debugfs_remove_sb(sb);
+	nova_stop_checkpointer(sb);
 	if (sbi->virt_addr) {
-		nova_save_inode_list_to_log(sb);
-		/* Save everything before blocknode mapping! */
-		nova_save_blocknode_mappings_to_log(sb);
+		/* Read-only mounts leave the image as they found it */
+		if (!sbi->mount_snapshot && !(sb->s_flags & MS_RDONLY))
+			nova_save_logs(sb);
 		sbi->virt_addr = NULL;
 	}
 
+	nova_refcount_exit(sb);
+	nova_snapshot_exit(sb);
+	nova_destroy_range_trees(sb);
 	nova_delete_free_lists(sb);
+	nova_delete_inode_table_index(sb);
 
 	kfree(sbi->zeroed_page);
 	sb->s_fs_info = NULL;
@@ -803,6 +997,22 @@ struct nova_range_node *nova_alloc_range_node(struct super_block *sb)
 	return p;
 }
 
+/* All num nodes or none, for loading a saved tree */
+int nova_alloc_range_nodes(struct super_block *sb,
+	struct nova_range_node **nodes, unsigned long num)
+{
+	if (!kmem_cache_alloc_bulk(nova_range_node_cachep, GFP_NOFS, num,
+						(void **)nodes))
+		return -ENOMEM;
+	return 0;
+}
+
+void nova_free_range_nodes(struct nova_range_node **nodes,
+	unsigned long num)
+{
+	kmem_cache_free_bulk(nova_range_node_cachep, num, (void **)nodes);
+}
+
 inline struct nova_range_node *nova_alloc_blocknode(struct super_block *sb)
 {
 	return nova_alloc_range_node(sb);
@@ -904,6 +1114,14 @@ static struct super_operations nova_sops = {
 	.show_options	= nova_show_options,
 };
 
+/* Pinned inodes must be released before the inodes are evicted */
+static void nova_kill_sb(struct super_block *sb)
+{
+	if (sb->s_fs_info)
+		nova_wait_bg_recovery(sb);
+	kill_block_super(sb);
+}
+
 static struct dentry *nova_mount(struct file_system_type *fs_type,
 				  int flags, const char *dev_name, void *data)
 {
@@ -914,7 +1132,7 @@ static struct file_system_type nova_fs_type = {
 	.owner		= THIS_MODULE,
 	.name		= "NOVA",
 	.mount		= nova_mount,
-	.kill_sb	= kill_block_super,
+	.kill_sb	= nova_kill_sb,
 };
 
 static struct inode *nova_nfs_get_inode(struct super_block *sb,
@@ -968,6 +1186,10 @@ static int __init init_nova_fs(void)
 	int rc = 0;
 	timing_t init_time;
 
+	rc = nova_stats_init();
+	if (rc)
+		return rc;
+
 	NOVA_START_TIMING(init_t, init_time);
 	nova_dbg("%s: %d cpus online\n", __func__, num_online_cpus());
 	if (arch_has_pcommit())
@@ -992,7 +1214,7 @@ static int __init init_nova_fs(void)
 
 	rc = init_rangenode_cache();
 	if (rc)
-		return rc;
+		goto out0;
 
 	rc = init_inodecache();
 	if (rc)
@@ -1002,6 +1224,7 @@ static int __init init_nova_fs(void)
 	if (rc)
 		goto out2;
 
+	nova_debugfs_init();
 	NOVA_END_TIMING(init_t, init_time);
 	return 0;
 
@@ -1009,14 +1232,18 @@ out2:
 	destroy_inodecache();
 out1:
 	destroy_rangenode_cache();
+out0:
+	nova_stats_exit();
 	return rc;
 }
 
 static void __exit exit_nova_fs(void)
 {
 	unregister_filesystem(&nova_fs_type);
+	nova_debugfs_exit();
 	destroy_inodecache();
 	destroy_rangenode_cache();
+	nova_stats_exit();
 }
 
 MODULE_AUTHOR("Andiry Xu <jix024@cs.ucsd.edu>");
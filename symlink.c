@@ -40,6 +40,7 @@ int nova_block_symlink(struct super_block *sb, struct nova_inode *pi,
 
 	nova_memunlock_block(sb, blockp);
 	memcpy_to_pmem_nocache(blockp, symname, len);
+	NOVA_WA_ADD(wa_data, len);
 	blockp[len] = '\0';
 	nova_memlock_block(sb, blockp);
 